@@ -73,6 +73,8 @@ __private_extern__ void ntfs_do_postponed_release(ntfs_volume *vol);
 
 #endif /* KERNEL */
 
+#include <sys/ioccom.h>
+
 #include "ntfs_endian.h"
 #include "ntfs_types.h"
 
@@ -166,4 +168,48 @@ typedef struct {
 	// TODO: Add NTFS specific mount options here.
 } __attribute__((__packed__)) ntfs_mount_options_1_0;
 
+/*
+ * Runlist statistics returned by the NTFS_IOC_RL_STATS ioctl() on a regular
+ * file, describing the runlist of its unnamed $DATA attribute (or of the named
+ * attribute if the ioctl() is issued on a named stream).
+ *
+ * @elements and @rl_bytes describe the in-memory runlist: the number of
+ * runlist elements (including the terminator) and the number of bytes of
+ * memory used by the runlist and its associated structures.  When the runlist
+ * is currently packed, @packed is set and @rl_bytes is the size of the packed
+ * runlist.
+ *
+ * @runs is the number of runs of allocated clusters and @fragments is the
+ * number of physically discontiguous extents these form, i.e. adjacent runs
+ * which continue on disk count as one fragment.  @largest_run and
+ * @smallest_run are the sizes of the largest and smallest fragments in
+ * clusters.  @holes is the number of sparse runs.
+ *
+ * @mapped_extents and @unmapped_extents are the number of contiguous ranges of
+ * the runlist that are mapped and not mapped into memory, respectively, and
+ * @unmapped_clusters is the number of clusters that are not mapped.  The
+ * statistics only cover the mapped parts of the runlist.
+ *
+ * @attr_extents is the number of attribute extents, i.e. attribute records,
+ * the attribute is stored in.
+ */
+typedef struct ntfs_rl_stats {
+	u64 elements;
+	u64 runs;
+	u64 fragments;
+	u64 holes;
+	u64 mapped_extents;
+	u64 unmapped_extents;
+	u64 unmapped_clusters;
+	u64 largest_run;
+	u64 smallest_run;
+	u64 rl_bytes;
+	u32 cluster_size;
+	u32 attr_extents;
+	u32 packed;
+	u32 reserved;
+} ntfs_rl_stats;
+
+#define NTFS_IOC_RL_STATS	_IOR('N', 1, ntfs_rl_stats)
+
 #endif /* !_OSX_NTFS_H */
@@ -175,6 +175,344 @@ err:
 	return err;
 }
 
+/**
+ * ntfs_attr_pack_runlist - replace the runlist of an ntfs inode by a packed copy
+ * @ni:		ntfs inode whose runlist to pack
+ *
+ * If the runlist of the ntfs inode @ni is large, replace it with a packed copy
+ * (see the description of ntfs_rl_packed in ntfs_runlist.h) which takes a
+ * fraction of the memory.  ntfs_attr_vcn_to_lcn_nolock(), i.e. the i/o paths,
+ * use the packed copy directly and everything else which needs the runlist
+ * maps it again using ntfs_map_runlist_nolock() which expands the packed copy
+ * rather than decompressing the mapping pairs array again.
+ *
+ * This is called when the last reference to the vnode is dropped so that the
+ * runlists of inodes sitting unused in the vnode cache take up less memory.
+ *
+ * Only the unnamed $DATA attribute of regular user files which are neither
+ * compressed nor encrypted is packed.
+ *
+ * Locking: - Caller must hold an iocount reference on the inode.
+ *	    - The runlist must not be locked.
+ */
+void ntfs_attr_pack_runlist(ntfs_inode *ni)
+{
+	ntfs_rl_packed *packed;
+	errno_t err;
+
+	if (NInoAttr(ni) || !S_ISREG(ni->mode) || !NInoNonResident(ni) ||
+			NInoCompressed(ni) || NInoEncrypted(ni) ||
+			ni->mft_no < FILE_first_user ||
+			ni->rl.elements < NTFS_RL_PACK_MIN_ELEMENTS)
+		return;
+	lck_rw_lock_exclusive(&ni->rl.lock);
+	if (ni->rl.elements < NTFS_RL_PACK_MIN_ELEMENTS) {
+		lck_rw_unlock_exclusive(&ni->rl.lock);
+		return;
+	}
+	err = ntfs_rl_pack(&ni->rl, &packed);
+	if (err) {
+		lck_rw_unlock_exclusive(&ni->rl.lock);
+		ntfs_debug("Failed to pack runlist of mft_no 0x%llx (error "
+				"%d).", (unsigned long long)ni->mft_no, err);
+		return;
+	}
+	if (ni->rl_packed)
+		ntfs_rl_packed_free(ni->rl_packed);
+	ni->rl_packed = packed;
+	IODeleteData(ni->rl.rl, ntfs_rl_element, ni->rl.alloc_count);
+	ni->rl.rl = NULL;
+	ni->rl.alloc_count = ni->rl.elements = 0;
+	lck_rw_unlock_exclusive(&ni->rl.lock);
+	ntfs_debug("Packed runlist of mft_no 0x%llx.",
+			(unsigned long long)ni->mft_no);
+}
+
+/**
+ * ntfs_attr_unpack_runlist_nolock - expand the packed runlist of an ntfs inode
+ * @ni:		ntfs inode whose packed runlist to expand
+ *
+ * Expand the packed copy of the runlist of the ntfs inode @ni created by
+ * ntfs_attr_pack_runlist() into the runlist if the runlist is not mapped and
+ * free the packed copy.
+ *
+ * If expanding the packed copy fails the runlist is left unmapped which is
+ * fine as the caller can then map it from the mapping pairs array instead.
+ *
+ * Locking: The runlist must be locked for writing.
+ */
+static void ntfs_attr_unpack_runlist_nolock(ntfs_inode *ni)
+{
+	ntfs_rl_packed *packed = ni->rl_packed;
+
+	ni->rl_packed = NULL;
+	if (!ni->rl.elements && ntfs_rl_unpack(packed, &ni->rl))
+		ntfs_debug("Failed to expand packed runlist, mapping it "
+				"from the mapping pairs array instead.");
+	ntfs_rl_packed_free(packed);
+}
+
+/**
+ * ntfs_attr_get_rl_stats - gather runlist statistics of an ntfs inode
+ * @ni:		ntfs inode whose runlist statistics to gather
+ * @stats:	destination in which to return the statistics
+ *
+ * Fill @stats with statistics about the runlist of the ntfs inode @ni (see the
+ * description of ntfs_rl_stats in ntfs.h) for the NTFS_IOC_RL_STATS ioctl().
+ *
+ * Only the parts of the runlist which are currently mapped are described, no
+ * attribute extents are mapped to gather the statistics.  If the runlist is
+ * packed, the packed copy is expanded into a temporary runlist which is freed
+ * again afterwards so the packed state of the inode is not affected.
+ *
+ * Return 0 on success and errno on error.
+ *
+ * Locking: The caller must hold the inode lock of @ni (and of its base inode
+ *	    if @ni is an attribute inode).
+ */
+errno_t ntfs_attr_get_rl_stats(ntfs_inode *ni, ntfs_rl_stats *stats)
+{
+	ntfs_inode *base_ni;
+	MFT_RECORD *m;
+	ATTR_LIST_ENTRY *al_entry;
+	u8 *al_end;
+	errno_t err;
+
+	bzero(stats, sizeof(*stats));
+	stats->cluster_size = ni->vol->cluster_size;
+	stats->attr_extents = 1;
+	base_ni = ni;
+	if (NInoAttr(ni))
+		base_ni = ni->base_ni;
+	if (NInoAttrList(base_ni) && NInoNonResident(ni)) {
+		err = ntfs_mft_record_map(base_ni, &m);
+		if (err)
+			return err;
+		stats->attr_extents = 0;
+		al_entry = (ATTR_LIST_ENTRY*)base_ni->attr_list;
+		al_end = base_ni->attr_list + base_ni->attr_list_size;
+		for (; (u8*)al_entry < al_end && al_entry->length;
+				al_entry = (ATTR_LIST_ENTRY*)((u8*)al_entry +
+				le16_to_cpu(al_entry->length))) {
+			if (al_entry->type == ni->type &&
+					al_entry->name_length == ni->name_len &&
+					!memcmp((u8*)al_entry +
+					al_entry->name_offset, ni->name,
+					ni->name_len * sizeof(ntfschar)))
+				stats->attr_extents++;
+		}
+		ntfs_mft_record_unmap(base_ni);
+	}
+	if (!NInoNonResident(ni))
+		return 0;
+	err = 0;
+	lck_rw_lock_shared(&ni->rl.lock);
+	if (!ni->rl.elements && ni->rl_packed) {
+		ntfs_runlist runlist;
+
+		runlist.rl = NULL;
+		runlist.alloc_count = runlist.elements = 0;
+		err = ntfs_rl_unpack(ni->rl_packed, &runlist);
+		if (!err) {
+			ntfs_rl_get_stats(&runlist, stats);
+			IODeleteData(runlist.rl, ntfs_rl_element,
+					runlist.alloc_count);
+			stats->rl_bytes = ni->rl_packed->size;
+			stats->packed = 1;
+		}
+	} else {
+		ntfs_rl_get_stats(&ni->rl, stats);
+		if (!ni->rl.elements && ni->allocated_size) {
+			stats->unmapped_extents = 1;
+			stats->unmapped_clusters = ni->allocated_size >>
+					ni->vol->cluster_size_shift;
+		}
+	}
+	if (ni->rl_extents)
+		stats->rl_bytes += sizeof(ntfs_rl_extents);
+	if (ni->rl_cache)
+		stats->rl_bytes += sizeof(ntfs_rl_cache);
+	lck_rw_unlock_shared(&ni->rl.lock);
+	return err;
+}
+
+/**
+ * ntfs_attr_seek_hole_data - find the next hole or data region of an attribute
+ * @ni:		ntfs inode of the attribute to search
+ * @ofs:	byte offset at which to start searching (in) and result (out)
+ * @hole:	if true search for a hole and if false search for data
+ *
+ * Starting at the byte offset *@ofs into the attribute described by the ntfs
+ * inode @ni, search for the first byte which is in a hole if @hole is true or
+ * which is in a data region if @hole is false and return its offset in *@ofs.
+ * This implements the SEEK_HOLE and SEEK_DATA whences of lseek(2).
+ *
+ * The layout is determined from the runlist alone, thus no data is read.
+ * Sparse runs are holes and so is everything from the initialized size to the
+ * data size as it reads back as zeroes.  For compressed attributes, only
+ * compression blocks which are entirely sparse are holes.  There is always an
+ * implicit hole at the end of the attribute, thus when searching for a hole
+ * the data size is returned if no other hole is found.
+ *
+ * Return 0 on success and errno on error.  ENXIO is returned if *@ofs is at
+ * or beyond the data size or if searching for data and there is no data
+ * beyond *@ofs.
+ *
+ * Locking: - Caller must hold @ni->lock on the inode.
+ *	    - The runlist @ni must be unlocked as it is taken for reading.
+ */
+errno_t ntfs_attr_seek_hole_data(ntfs_inode *ni, s64 *ofs, const BOOL hole)
+{
+	VCN vcn, end_vcn;
+	LCN lcn;
+	s64 pos, clusters, data_size, init_size, cb_clusters;
+	ntfs_volume *vol = ni->vol;
+	errno_t err;
+
+	ntfs_debug("Entering for mft_no 0x%llx, ofs 0x%llx, %s.",
+			(unsigned long long)ni->mft_no,
+			(unsigned long long)*ofs, hole ? "hole" : "data");
+	pos = *ofs;
+	if (pos < 0)
+		return EINVAL;
+	lck_spin_lock(&ni->size_lock);
+	data_size = ni->data_size;
+	init_size = ni->initialized_size;
+	lck_spin_unlock(&ni->size_lock);
+	if (pos >= data_size)
+		return ENXIO;
+	if (init_size > data_size)
+		init_size = data_size;
+	err = 0;
+	/*
+	 * Resident attributes and attributes which are neither sparse nor
+	 * compressed have no holes below the initialized size.
+	 */
+	if (!NInoNonResident(ni) || (!NInoSparse(ni) && !NInoCompressed(ni))) {
+		if (!hole && pos < init_size)
+			goto done;
+		goto uninitialized;
+	}
+	cb_clusters = 1;
+	if (NInoCompressed(ni))
+		cb_clusters = ni->compression_block_clusters;
+	lck_rw_lock_shared(&ni->rl.lock);
+	while (pos < init_size) {
+		vcn = (pos >> vol->cluster_size_shift) & ~(cb_clusters - 1);
+		lcn = ntfs_attr_vcn_to_lcn_nolock(ni, vcn, FALSE, &clusters);
+		if (lcn < LCN_HOLE) {
+			/* The rest of the attribute is not allocated. */
+			if (lcn == LCN_ENOENT) {
+				pos = init_size;
+				break;
+			}
+			ntfs_error(vol->mp, "Failed to convert vcn 0x%llx of "
+					"mft_no 0x%llx to lcn (error %lld).",
+					(unsigned long long)vcn,
+					(unsigned long long)ni->mft_no,
+					(long long)lcn);
+			err = lcn == LCN_ENOMEM ? ENOMEM : EIO;
+			break;
+		}
+		/*
+		 * For compressed attributes @vcn is the start of a compression
+		 * block whose real clusters are always at its start thus the
+		 * compression block is a hole if its first cluster is sparse.
+		 * Whole compression blocks starting at @vcn are of the same
+		 * kind as long as the run is at least a compression block in
+		 * size and if it is shorter, the compression block is data.
+		 */
+		if (clusters > cb_clusters)
+			clusters &= ~(cb_clusters - 1);
+		else
+			clusters = cb_clusters;
+		end_vcn = vcn + clusters;
+		if ((lcn == LCN_HOLE) == hole)
+			break;
+		pos = end_vcn << vol->cluster_size_shift;
+	}
+	lck_rw_unlock_shared(&ni->rl.lock);
+	if (err)
+		return err;
+	if (pos < init_size) {
+		*ofs = pos;
+		goto done;
+	}
+uninitialized:
+	/*
+	 * Everything from the initialized size to the data size reads back as
+	 * zeroes and is thus a hole, followed by the implicit hole at the end
+	 * of the attribute.
+	 */
+	if (!hole)
+		return ENXIO;
+	if (*ofs < init_size)
+		*ofs = init_size;
+done:
+	ntfs_debug("Done (ofs 0x%llx).", (unsigned long long)*ofs);
+	return 0;
+}
+
+/**
+ * ntfs_attr_unmap_runlist_extent_nolock - unmap the least recently used extent
+ * @ni:		ntfs inode whose runlist to unmap an attribute extent of
+ *
+ * If the runlist of the ntfs inode @ni is large and the maximum number of
+ * tracked attribute extents are mapped, unmap the least recently used one of
+ * them so that mapping another one does not grow the runlist any further.
+ *
+ * The vcn range of the attribute extent is verified against the attribute
+ * record before unmapping it as the runlist may have been modified and the
+ * attribute extents rearranged since it was mapped.
+ *
+ * Locking: - The runlist must be locked for writing.
+ *	    - The base mft record of @ni must not be mapped.
+ *	    - The caller must not hold any pointers into the runlist.
+ */
+static void ntfs_attr_unmap_runlist_extent_nolock(ntfs_inode *ni)
+{
+	VCN start_vcn, end_vcn;
+	ntfs_inode *base_ni;
+	MFT_RECORD *m;
+	ntfs_attr_search_ctx *ctx;
+	ATTR_RECORD *a;
+	errno_t err;
+
+	if (!ni->rl_extents || ni->rl.elements < NTFS_RL_EVICT_MIN_ELEMENTS ||
+			!ntfs_rl_extents_evict(ni->rl_extents, &start_vcn,
+			&end_vcn))
+		return;
+	base_ni = ni;
+	if (NInoAttr(ni))
+		base_ni = ni->base_ni;
+	if (ntfs_mft_record_map(base_ni, &m))
+		return;
+	ctx = ntfs_attr_search_ctx_get(base_ni, m);
+	if (!ctx)
+		goto unm;
+	err = ntfs_attr_lookup(ni->type, ni->name, ni->name_len, start_vcn,
+			NULL, 0, ctx);
+	if (!err) {
+		a = ctx->a;
+		if (a->non_resident &&
+				sle64_to_cpu(a->lowest_vcn) == start_vcn &&
+				sle64_to_cpu(a->highest_vcn) + 1 == end_vcn)
+			err = ntfs_rl_unmap_nolock(&ni->rl, start_vcn,
+					end_vcn);
+		else
+			err = EINVAL;
+	}
+	if (err)
+		ntfs_debug("Not unmapping vcns 0x%llx-0x%llx of mft_no "
+				"0x%llx (error %d).",
+				(unsigned long long)start_vcn,
+				(unsigned long long)end_vcn - 1,
+				(unsigned long long)ni->mft_no, err);
+	ntfs_attr_search_ctx_put(ctx);
+unm:
+	ntfs_mft_record_unmap(base_ni);
+}
+
 /**
  * ntfs_map_runlist_nolock - map (a part of) a runlist of an ntfs inode
  * @ni:		ntfs inode for which to map (part of) a runlist
@@ -239,6 +577,17 @@ errno_t ntfs_map_runlist_nolock(ntfs_inode *ni, VCN vcn,
 	ntfs_debug("Entering for mft_no 0x%llx, vcn 0x%llx.",
 			(unsigned long long)ni->mft_no,
 			(unsigned long long)vcn);
+	/*
+	 * If the runlist has been packed, expand the packed copy.  If that
+	 * mapped @vcn we do not need to go to the mft record at all.
+	 */
+	if (ni->rl_packed) {
+		ntfs_attr_unpack_runlist_nolock(ni);
+		if (ni->rl.elements && ntfs_rl_vcn_to_lcn(
+				ntfs_rl_lookup_nolock(&ni->rl, vcn), vcn,
+				NULL) != LCN_RL_NOT_MAPPED)
+			goto done;
+	}
 	base_ni = ni;
 	if (NInoAttr(ni))
 		base_ni = ni->base_ni;
@@ -315,6 +664,18 @@ errno_t ntfs_map_runlist_nolock(ntfs_inode *ni, VCN vcn,
 		goto err;
 	}
 	err = ntfs_mapping_pairs_decompress(ni->vol, a, &ni->rl);
+	/*
+	 * Track the mapped attribute extents of large runlists of user files
+	 * so the least recently used ones can be unmapped again.
+	 */
+	if (!err && ni->mft_no >= FILE_first_user &&
+			ni->rl.elements >= NTFS_RL_EVICT_MIN_ELEMENTS / 2) {
+		if (!ni->rl_extents)
+			ni->rl_extents = IOMallocType(ntfs_rl_extents);
+		if (ni->rl_extents)
+			ntfs_rl_extents_add(ni->rl_extents,
+					sle64_to_cpu(a->lowest_vcn), end_vcn);
+	}
 err:
 	if (ctx_is_temporary) {
 		if (ctx)
@@ -455,17 +816,32 @@ retry_remap:
 		if (!ni->allocated_size) {
 			lck_spin_unlock(&ni->size_lock);
 			lcn = LCN_ENOENT;
-			goto lcn_enoent;
+			goto done;
 		}
 		lck_spin_unlock(&ni->size_lock);
+		/*
+		 * If the runlist has been packed, look up @vcn in the packed
+		 * copy without expanding it.  Note we may get here after
+		 * retaking the lock for writing in which case we need to
+		 * switch it back to shared on the way out.
+		 */
+		if (ni->rl_packed && !is_retry) {
+			lcn = ntfs_rl_packed_vcn_to_lcn(ni->rl_packed, vcn,
+					clusters);
+			if (lcn >= LCN_HOLE || lcn == LCN_ENOENT)
+				goto done;
+		}
 		if (!is_retry)
 			goto try_to_map;
 		lcn = LCN_EIO;
-		goto lcn_eio;
+		goto done;
 	}
 	/* Convert vcn to lcn.  If that fails map the runlist and retry once. */
-	lcn = ntfs_rl_vcn_to_lcn(ni->rl.rl, vcn, clusters);
+	lcn = ntfs_rl_vcn_to_lcn(ntfs_rl_lookup_nolock(&ni->rl, vcn), vcn,
+			clusters);
 	if (lcn >= LCN_HOLE) {
+		if (ni->rl_extents)
+			ntfs_rl_extents_touch(ni->rl_extents, vcn);
 		if (need_lock_switch)
 			lck_rw_lock_exclusive_to_shared(&ni->rl.lock);
 		ntfs_debug("Done (lcn 0x%llx, clusters 0x%llx).",
@@ -492,6 +868,14 @@ try_to_map:
 				goto retry_remap;
 			}
 		}
+		/*
+		 * If the caller only had the runlist locked for reading, it
+		 * cannot hold any pointers into the runlist thus we can unmap
+		 * the least recently used attribute extent of a large runlist
+		 * so the runlist does not keep growing.
+		 */
+		if (!write_locked)
+			ntfs_attr_unmap_runlist_extent_nolock(ni);
 		err = ntfs_map_runlist_nolock(ni, vcn, NULL);
 		if (!err) {
 			is_retry = TRUE;
@@ -508,13 +892,15 @@ try_to_map:
 			lcn = LCN_EIO;
 		}
 	}
-lcn_eio:
+done:
 	if (need_lock_switch)
 		lck_rw_lock_exclusive_to_shared(&ni->rl.lock);
-	if (lcn == LCN_ENOENT) {
-lcn_enoent:
+	if (lcn >= LCN_HOLE)
+		ntfs_debug("Done (packed, lcn 0x%llx).",
+				(unsigned long long)lcn);
+	else if (lcn == LCN_ENOENT)
 		ntfs_debug("Done (LCN_ENOENT).");
-	} else
+	else
 		ntfs_error(ni->vol->mp, "Failed (error %lld).", (long long)lcn);
 	return lcn;
 }
@@ -606,7 +992,7 @@ retry_remap:
 		err = EIO;
 		goto err;
 	}
-	rl = ni->rl.rl;
+	rl = ntfs_rl_lookup_nolock(&ni->rl, vcn);
 	if (vcn >= rl[0].vcn) {
 		while (rl->length) {
 			if (vcn < rl[1].vcn) {
@@ -1981,6 +2367,8 @@ restart_compressed_size_add:
 			goto sparse_done;
 		}
 		/* Ensure this runlist fragment is mapped. */
+		if (ni->rl_packed)
+			ntfs_attr_unpack_runlist_nolock(ni);
 		if (ni->allocated_size && (!ni->rl.elements ||
 				ni->rl.rl->lcn == LCN_RL_NOT_MAPPED)) {
 			err = ntfs_mapping_pairs_decompress(vol, a, &ni->rl);
@@ -2197,6 +2585,8 @@ attr_is_only_one:
 		goto sparse_done;
 	}
 	/* Ensure this runlist fragment is mapped. */
+	if (ni->rl_packed)
+		ntfs_attr_unpack_runlist_nolock(ni);
 	if (ni->allocated_size && (!ni->rl.elements ||
 			ni->rl.rl->lcn == LCN_RL_NOT_MAPPED)) {
 		err = ntfs_mapping_pairs_decompress(vol, a, &ni->rl);
@@ -2959,22 +3349,30 @@ errno_t ntfs_attr_make_non_resident(ntfs_inode *ni)
 		return err;
 	}
 	/*
-	 * FIXME: Compressed and encrypted attributes are not supported when
-	 * writing and we should never have gotten here for them.
+	 * FIXME: Encrypted attributes are not supported when writing and we
+	 * should never have gotten here for them.
 	 */
-	if (NInoCompressed(ni))
-		panic("%s(): NInoCompressed(ni)\n", __FUNCTION__);
 	if (NInoEncrypted(ni))
 		panic("%s(): NInoEncrypted(ni)\n", __FUNCTION__);
 	/*
 	 * The size needs to be aligned to a cluster boundary for allocation
 	 * purposes.
+	 *
+	 * Compressed attributes are allocated in whole compression blocks.
+	 * The compression block starts out uncompressed, i.e. fully
+	 * allocated, and is compressed when the page is written out.
 	 */
 	lck_spin_lock(&ni->size_lock);
 	data_size = ni->data_size;
 	lck_spin_unlock(&ni->size_lock);
-	new_size = (data_size + vol->cluster_size_mask) &
-			~vol->cluster_size_mask;
+	if (NInoCompressed(ni)) {
+		const s64 cb_mask = (1LL << (NTFS_COMPRESSION_UNIT +
+				vol->cluster_size_shift)) - 1;
+
+		new_size = (data_size + cb_mask) & ~cb_mask;
+	} else
+		new_size = (data_size + vol->cluster_size_mask) &
+				~vol->cluster_size_mask;
 	lck_rw_lock_exclusive(&ni->rl.lock);
 	if (ni->rl.elements)
 		panic("%s(): ni->rl.elements\n", __FUNCTION__);
@@ -4516,39 +4914,38 @@ err:
  * Switch the non-sparse, base attribute described by @ni and @ctx belonging to
  * the base ntfs inode @base_ni to be sparse.
  *
- * Return 0 on success and errno on error.
+ * Return 0 on success and errno on error.  ENOSPC is returned if the
+ * attribute record is the only one in its mft record and there is not enough
+ * space in the mft record to add the compressed size to it.
  *
  * Note that the attribute may be moved to be able to extend it when adding the
  * compressed size.  Thus any cached values of @ctx->ni, @ctx->m, and @ctx->a
  * are invalid after this function returns.
  */
 static errno_t ntfs_attr_sparse_set(ntfs_inode *base_ni, ntfs_inode *ni,
-		ntfs_attr_search_ctx *ctx __attribute__((unused)))
+		ntfs_attr_search_ctx *ctx)
 {
-#if 0
-	VCN highest_vcn, stop_vcn;
 	ntfs_volume *vol;
 	MFT_RECORD *base_m, *m;
 	ATTR_RECORD *a;
+	unsigned mp_ofs;
+	errno_t err;
+#if 0
+	VCN highest_vcn, stop_vcn;
 	ntfs_rl_element *rl;
 	ntfs_inode *eni;
 	ATTR_LIST_ENTRY *al_entry;
-	unsigned name_size, mp_ofs, mp_size, al_entry_len, new_al_size;
-	unsigned new_al_alloc;
-	errno_t err;
-	BOOL rewrite;
+	unsigned name_size, mp_size, al_entry_len, new_al_size, new_al_alloc;
+	BOOL rewrite = FALSE;
 #endif
 
 	ntfs_debug("Entering for mft_no 0x%llx, type 0x%x, name_len 0x%x.",
 			(unsigned long long)base_ni->mft_no,
 			(unsigned)le32_to_cpu(ni->type), ni->name_len);
-	return ENOTSUP;
-#if 0
 	vol = base_ni->vol;
 	base_m = base_ni->m;
 	m = ctx->m;
 	a = ctx->a;
-	rewrite = FALSE;
 	/*
 	 * We should only be called for non-sparse, non-resident, $DATA
 	 * attributes.
@@ -4676,11 +5073,21 @@ retry_attr_rec_resize:
 	}
 	/*
 	 * This is the only attribute in the mft record thus there is nothing
-	 * to gain by moving it to another extent mft record.  So to generate
-	 * space, we allocate a new extent mft record, create a new extent
-	 * attribute record in it and use it to catch the overflow mapping
-	 * pairs array data generated by the fact that we have added the
-	 * compressed size to the base extent.
+	 * to gain by moving it to another extent mft record.  Making space
+	 * requires splitting the mapping pairs array into a new attribute
+	 * extent but the code below to do that cannot yet roll back on error
+	 * thus it is disabled and we return ENOSPC instead.  Callers fall back
+	 * to zeroing instead of deallocating in this case.
+	 */
+	ntfs_debug("Not enough space in the mft record to add the compressed "
+			"size.");
+	return ENOSPC;
+#if 0
+	/*
+	 * To generate space, we allocate a new extent mft record, create a new
+	 * extent attribute record in it and use it to catch the overflow
+	 * mapping pairs array data generated by the fact that we have added
+	 * the compressed size to the base extent.
 	 *
 	 * TODO: We could instead iterate over all existing extent attribute
 	 * records and rewrite the entire mapping pairs array but this could
@@ -4722,6 +5129,7 @@ retry_attr_rec_resize:
 	/* Update the mapping pairs offset to its new location. */
 	mp_ofs = (offsetof(ATTR_RECORD, compressed_size) +
 			sizeof(a->compressed_size) + name_size + 7) & ~7;
+#endif
 set_compressed_size:
 	a->mapping_pairs_offset = cpu_to_le16(mp_ofs);
 	/*
@@ -4759,6 +5167,7 @@ is_compressed:
 		ni->file_attributes |= FILE_ATTR_SPARSE_FILE;
 		NInoSetDirtyFileAttributes(ni);
 	}
+#if 0
 	/* If we do not need to rewrite the mapping pairs array we are done. */
 	if (!rewrite)
 		goto done;
@@ -5048,6 +5457,8 @@ undo1:
 	panic("%s(): TODO!\n", __FUNCTION__);
 	return err;
 #endif
+	ntfs_debug("Done.");
+	return 0;
 }
 
 /**
@@ -5148,723 +5559,909 @@ static void ntfs_attr_sparse_clear(ntfs_inode *base_ni, ntfs_inode *ni,
 }
 
 /**
- * ntfs_attr_instantiate_holes - instantiate the holes in an attribute region
- * @ni:		ntfs inode of the attribute whose holes to instantiate
- * @start:	start offset in bytes at which to begin instantiating holes
- * @end:	end offset in bytes at which to stop instantiating holes
- * @new_end:	return the offset at which we stopped instantiating holes
- * @atomic:	if true must complete the entire exension or abort
- *
- * Scan the runlist (mapping any unmapped fragments as needed) starting at byte
- * offset @start into the attribute described by the ntfs inode @ni and
- * finishing at byte offset @end and instantiate any sparse regions located
- * between @start and @end with real clusters.
- *
- * Any clusters that are inside the initialized size are zeroed.
- *
- * If @atomic is true the whole instantiation must be complete so abort on
- * errors.  If @atomic is false partial instantiations are acceptable (but we
- * still return an error if the instantiation is partial).  In any case we set
- * *@new_end to the end of the instantiated range.  Thus the caller has to
- * always check *@new_end.  If *@new_end is equal to @end then the whole
- * instantiation was complete.  If *@new_end is less than @end the
- * instantiation was partial.
+ * ntfs_attr_extent_get - look up the attribute extent containing a vcn
+ * @ni:		ntfs inode of the non-resident attribute
+ * @vcn:	vcn whose attribute extent to look up
+ * @ctx:	return the search context describing the attribute extent
  *
- * Note if @new_end is NULL, then @atomic is set to true as there is no way to
- * communicate to the caller that the hole instantiation was partial.
+ * Map the runlist fragment of the attribute described by the ntfs inode @ni
+ * which contains the vcn @vcn, map the base mft record of @ni, and look up the
+ * attribute extent containing @vcn, returning a search context describing it
+ * in *@ctx.  The caller must release it with ntfs_attr_extent_put().
  *
  * Return 0 on success and errno on error.
  *
- * Locking: - Caller must hold @ni->lock on the inode for writing.
- *	    - The runlist @ni must be unlocked as it is taken for writing.
+ * Locking: - Caller must hold the runlist lock of @ni for writing.
+ *	    - The base mft record of @ni must not be mapped.
  */
-errno_t ntfs_attr_instantiate_holes(ntfs_inode *ni, s64 start, s64 end,
-		s64 *new_end __attribute__((unused)),
-		BOOL atomic __attribute__((unused)))
+static errno_t ntfs_attr_extent_get(ntfs_inode *ni, const VCN vcn,
+		ntfs_attr_search_ctx **ctx)
 {
-#if 0
-	VCN vcn, end_vcn;
-	s64 allocated_size, initialized_size, compressed_size, len;
-	ntfs_inode *base_ni;
 	ntfs_volume *vol = ni->vol;
+	ntfs_inode *base_ni;
+	MFT_RECORD *base_m;
 	ntfs_rl_element *rl;
-	MFT_RECORD *base_m, *m;
-	ntfs_attr_search_ctx *ctx;
-	ATTR_RECORD *a;
-	errno_t err, err2;
-	BOOL write_locked;
-	ntfs_runlist runlist;
-#else
-	ntfs_volume *vol = ni->vol;
 	errno_t err;
-#endif
 
-	err = 0;
-	/* We should never be called for non-sparse attributes. */
-	if (!NInoSparse(ni))
-		panic("%s(): !NInoSparse(ni)\n", __FUNCTION__);
-	/* We should never be called for resident attributes. */
-	if (!NInoNonResident(ni))
-		panic("%s(): !NInoNonResident(ni)\n", __FUNCTION__);
-	/* We should only be called for $DATA attributes. */
-	if (ni->type != AT_DATA)
-		panic("%s(): ni->type != AT_DATA\n", __FUNCTION__);
-	/* Sanity check @start and @end. */
-	if (start >= end)
-		panic("%s(): start >= end\n", __FUNCTION__);
-	if (start & vol->cluster_size_mask || end & vol->cluster_size_mask)
-		panic("%s(): start & vol->cluster_size_mask || "
-				"end & vol->cluster_size_mask\n", __FUNCTION__);
-	err = ENOTSUP;
-	return err;
-#if 0
 	base_ni = ni;
 	if (NInoAttr(ni))
 		base_ni = ni->base_ni;
-	if (!new_end)
-		atomic = TRUE;
-	lck_rw_lock_shared(&ni->rl.lock);
-	write_locked = FALSE;
-	/*
-	 * We have to round down @start to the nearest page boundary and we
-	 * have to round up @end to the nearest page boundary for the cases
-	 * where the cluster size is smaller than the page size.  It makes no
-	 * sense to instantiate only part of a page as a later pageout of the
-	 * dirty page would cause any sparse clusters inside the page to be
-	 * instantiated so we might as well do it now whilst we are
-	 * instantiating things.
-	 */
-	vcn = (start & ~PAGE_MASK_64) >> vol->cluster_size_shift;
-	end_vcn = ((end + PAGE_MASK) & ~PAGE_MASK_64) >>
-			vol->cluster_size_shift;
-	/* Cache the sizes for the attribute so we take the size lock once. */
-	lck_spin_lock(&ni->size_lock);
-	allocated_size = ni->allocated_size;
-	initialized_size = ni->initialized_size;
-	compressed_size = ni->compressed_size;
-	lck_spin_unlock(&ni->size_lock);
-	/*
-	 * We have to make sure that we stay within the existing allocated
-	 * size when instantiating holes as it would corrupt the attribute if
-	 * we were to extend the runlist beyond the allocated size.  And our
-	 * rounding up of @end above could have caused us to go above the
-	 * allocated size so fix this up now.
-	 */
-	if (end_vcn > allocated_size >> vol->cluster_size_shift)
-		end_vcn = allocated_size >> vol->cluster_size_shift;
-retry_remap:
-	rl = ni->rl.rl;
-	if (!ni->rl.elements || vcn < rl->vcn || !rl->length) {
-map_vcn:
-		if (!write_locked) {
-			write_locked = TRUE;
-			if (!lck_rw_lock_shared_to_exclusive(&ni->rl.lock)) {
-				lck_rw_lock_exclusive(&ni->rl.lock);
-				goto retry_remap;
-			}
-		}
-		/* Need to map the runlist fragment containing @vcn. */
-		err = ntfs_map_runlist_nolock(ni, vcn, NULL);
-		if (err) {
-			ntfs_error(vol->mp, "Failed to map runlist fragment "
-					"(error %d).", err);
-			if (err == EINVAL)
-				err = EIO;
-			goto err;
-		}
-		rl = ni->rl.rl;
-		if (!ni->rl.elements || vcn < rl->vcn || !rl->length)
-			panic("%s(): !ni->rl.elements || vcn < rl[0].vcn || "
-					"!rl->length\n", __FUNCTION__);
+	err = ntfs_attr_find_vcn_nolock(ni, vcn, &rl, NULL);
+	if (err) {
+		ntfs_error(vol->mp, "Failed to map runlist fragment (error "
+				"%d).", err);
+		if (err != ENOMEM)
+			err = EIO;
+		return err;
 	}
-	do {
-		VCN lowest_vcn, highest_vcn, stop_vcn;
-		ntfs_rl_element *rl2;
-		unsigned mp_size, mp_ofs;
+	err = ntfs_mft_record_map(base_ni, &base_m);
+	if (err)
+		return err;
+	*ctx = ntfs_attr_search_ctx_get(base_ni, base_m);
+	if (!*ctx) {
+		ntfs_mft_record_unmap(base_ni);
+		return ENOMEM;
+	}
+	err = ntfs_attr_lookup(ni->type, ni->name, ni->name_len, vcn, NULL, 0,
+			*ctx);
+	if (err) {
+		ntfs_attr_search_ctx_put(*ctx);
+		ntfs_mft_record_unmap(base_ni);
+		if (err == ENOENT)
+			err = EIO;
+	}
+	return err;
+}
 
-		/* Seek to the runlist element containing @vcn. */
-		while (rl->length && vcn >= rl[1].vcn)
-			rl++;
-		/*
-		 * Seek to the first sparse run or to the end of the region we
-		 * are interested in.
-		 */
-		while (rl->length && rl->lcn >= 0 && vcn < end_vcn) {
-			rl++;
-			vcn = rl->vcn;
-		}
-		/*
-		 * If there are no sparse runs (left) in the region of interest
-		 * we are done.
-		 */
-		if (vcn >= end_vcn) {
-			vcn = end_vcn;
-			break;
+/**
+ * ntfs_attr_extent_put - release an attribute extent
+ * @ni:		ntfs inode of the attribute
+ * @ctx:	search context returned by ntfs_attr_extent_get()
+ */
+static void ntfs_attr_extent_put(ntfs_inode *ni, ntfs_attr_search_ctx *ctx)
+{
+	ntfs_attr_search_ctx_put(ctx);
+	ntfs_mft_record_unmap(NInoAttr(ni) ? ni->base_ni : ni);
+}
+
+/**
+ * ntfs_attr_rl_copy - make a copy of the runlist of an attribute
+ * @ni:		ntfs inode of the attribute
+ * @runlist:	runlist to set up as a copy of the runlist of @ni
+ *
+ * Return 0 on success and ENOMEM if not enough memory is available.
+ *
+ * Locking: Caller must hold the runlist lock of @ni.
+ */
+static errno_t ntfs_attr_rl_copy(ntfs_inode *ni, ntfs_runlist *runlist)
+{
+	runlist->alloc_count = ni->rl.alloc_count;
+	runlist->rl = IONewData(ntfs_rl_element, runlist->alloc_count);
+	if (!runlist->rl)
+		return ENOMEM;
+	memcpy(runlist->rl, ni->rl.rl, ni->rl.elements * sizeof(*runlist->rl));
+	runlist->elements = ni->rl.elements;
+	runlist->hint = 0;
+	runlist->gen = 0;
+	return 0;
+}
+
+/**
+ * ntfs_attr_extent_rl_commit - switch an attribute extent to a modified runlist
+ * @ni:		ntfs inode of the non-resident attribute
+ * @ctx:	search context describing the attribute extent
+ * @runlist:	modified copy of the runlist of @ni
+ * @free_vcn:	first vcn of the clusters to free
+ * @free_len:	number of clusters to free (may be zero)
+ * @delta:	change in the number of real clusters of the attribute
+ *
+ * Rebuild the mapping pairs array of the attribute extent described by @ctx
+ * from @runlist, which is a copy of the runlist of @ni that has been modified
+ * inside the attribute extent only.  Then free the real clusters the runlist
+ * of @ni describes between @free_vcn and @free_vcn + @free_len, replace the
+ * runlist of @ni with @runlist, and add @delta clusters to the compressed size
+ * both in the ntfs inode and in the first attribute extent.
+ *
+ * Return 0 on success and errno on error.  If the mapping pairs array does not
+ * fit in the mft record ENOSPC is returned, nothing has been modified, and the
+ * caller still owns @runlist.  Otherwise the runlist of @ni has been replaced
+ * even if an error is returned because the compressed size could not be
+ * updated.  The caller can tell the two apart by checking whether @ni->rl.rl
+ * is @runlist->rl.
+ *
+ * Locking: - Caller must hold the runlist lock of @ni for writing.
+ *	    - The base mft record of @ni must be mapped via @ctx.
+ */
+static errno_t ntfs_attr_extent_rl_commit(ntfs_inode *ni,
+		ntfs_attr_search_ctx *ctx, ntfs_runlist *runlist,
+		const VCN free_vcn, const s64 free_len, const s64 delta)
+{
+	VCN lowest_vcn, highest_vcn;
+	s64 compressed_size;
+	ntfs_volume *vol = ni->vol;
+	ATTR_RECORD *a = ctx->a;
+	ntfs_rl_element *rl;
+	unsigned mp_size, mp_ofs;
+	errno_t err, err2;
+
+	lowest_vcn = sle64_to_cpu(a->lowest_vcn);
+	highest_vcn = sle64_to_cpu(a->highest_vcn);
+	rl = ntfs_rl_find_vcn_nolock(ntfs_rl_lookup_nolock(runlist,
+			lowest_vcn), lowest_vcn);
+	err = ntfs_get_size_for_mapping_pairs(vol, rl, lowest_vcn,
+			highest_vcn, &mp_size);
+	if (err) {
+		ntfs_error(vol->mp, "Failed to get size for mapping pairs "
+				"array (error %d).", err);
+		return EIO;
+	}
+	mp_ofs = le16_to_cpu(a->mapping_pairs_offset);
+	err = ntfs_attr_record_resize(ctx->m, a, mp_ofs + mp_size);
+	if (err) {
+		ntfs_debug("Not enough space in the mft record for the "
+				"mapping pairs array.");
+		return err;
+	}
+	/*
+	 * This cannot fail as we have already checked the size we need to
+	 * build the mapping pairs array.
+	 */
+	err = ntfs_mapping_pairs_build(vol, (s8*)a + mp_ofs,
+			le32_to_cpu(a->length) - mp_ofs, rl, lowest_vcn,
+			highest_vcn, NULL);
+	if (err)
+		panic("%s(): err\n", __FUNCTION__);
+	NInoSetMrecNeedsDirtying(ctx->ni);
+	/*
+	 * Free the clusters that are no longer part of the attribute.  They
+	 * are still described by the old runlist.
+	 */
+	if (free_len) {
+		err2 = ntfs_cluster_free_from_rl(vol, ni->rl.rl, free_vcn,
+				free_len, NULL);
+		if (err2) {
+			ntfs_error(vol->mp, "Failed to release cluster(s) "
+					"(error %d).  Run chkdsk to recover "
+					"the lost space.", err2);
+			NVolSetErrors(vol);
 		}
-		/*
-		 * If this run is not mapped map it now and start again as the
-		 * runlist will have been updated.
-		 */
-		if (rl->lcn == LCN_RL_NOT_MAPPED)
-			goto map_vcn;
-		/* If this run is not valid abort with an error. */
-		if (!rl->length || rl->lcn < LCN_HOLE) {
-			ntfs_error(vol->mp, "Runlist is corrupt.  Unmount and "
-					"run chkdsk.");
+	}
+	/*
+	 * Switch to the new runlist, invalidating any cached translations of
+	 * the old one first.
+	 */
+	ni->rl.gen++;
+	__sync_synchronize();
+	IODeleteData(ni->rl.rl, ntfs_rl_element, ni->rl.alloc_count);
+	ni->rl.rl = runlist->rl;
+	ni->rl.elements = runlist->elements;
+	ni->rl.alloc_count = runlist->alloc_count;
+	ni->rl.hint = 0;
+	/*
+	 * Update the compressed size which is only stored in the first
+	 * attribute extent.
+	 */
+	if (lowest_vcn) {
+		ntfs_attr_search_ctx_reinit(ctx);
+		err = ntfs_attr_lookup(ni->type, ni->name, ni->name_len, 0,
+				NULL, 0, ctx);
+		if (err) {
+			ntfs_error(vol->mp, "Failed to look up first "
+					"attribute extent of mft_no 0x%llx to "
+					"update the compressed size (error "
+					"%d).  Run chkdsk.",
+					(unsigned long long)ni->mft_no, err);
 			NVolSetErrors(vol);
-			err = EIO;
-			goto err;
+			if (err == ENOENT)
+				err = EIO;
 		}
-		/*
-		 * This run is sparse thus we need to instantiate it for which
-		 * we need to hold the runlist lock for writing.
-		 */
-		if (!write_locked) {
-			write_locked = TRUE;
-			if (!lck_rw_lock_shared_to_exclusive(&ni->rl.lock)) {
-				lck_rw_lock_exclusive(&ni->rl.lock);
-				goto retry_remap;
-			}
+		a = ctx->a;
+	}
+	lck_spin_lock(&ni->size_lock);
+	ni->compressed_size += delta << vol->cluster_size_shift;
+	compressed_size = ni->compressed_size;
+	lck_spin_unlock(&ni->size_lock);
+	if (!err) {
+		a->compressed_size = cpu_to_sle64(compressed_size);
+		NInoSetMrecNeedsDirtying(ctx->ni);
+	}
+	/*
+	 * The compressed size is what is stored as the allocated size in the
+	 * directory index entries.
+	 */
+	if (!NInoAttr(ni))
+		NInoSetDirtySizes(ni);
+	return err;
+}
+
+/**
+ * ntfs_attr_cb_resize - change the number of real clusters in a compression block
+ * @ni:			ntfs inode of the compressed attribute
+ * @vcn:		first vcn of the compression block
+ * @nr_clusters:	number of real clusters the compression block is to have
+ * @nr_real:		return the number of real clusters in the compression block
+ *
+ * Reallocate the compression block starting at vcn @vcn of the compressed
+ * attribute described by the ntfs inode @ni so that its first @nr_clusters
+ * clusters are backed by real clusters and the remainder of the compression
+ * block is sparse.  If the compression block currently has more real clusters
+ * the excess ones are freed and if it has fewer, new clusters are allocated,
+ * preferably directly following the existing ones.
+ *
+ * The changes are made to a copy of the runlist from which the mapping pairs
+ * array of the attribute extent containing the compression block is rebuilt
+ * before the copy replaces the runlist of @ni thus on error nothing has been
+ * modified.  The compressed size is updated both in the ntfs inode and in the
+ * attribute record.
+ *
+ * On return *@nr_real is set to the number of real clusters in the compression
+ * block, i.e. to @nr_clusters on success and to the unchanged number of real
+ * clusters on error, so the caller can decide whether the compression block can
+ * be written anyway.
+ *
+ * Return 0 on success and errno on error.  The following error codes are
+ * defined:
+ *	ENOSPC	- Not enough free clusters on the volume or not enough space in
+ *		  the mft record for the mapping pairs array.
+ *	ENOTSUP	- The compression block spans more than one attribute extent.
+ *	ENOMEM	- Not enough memory to copy the runlist.
+ *	EIO	- The runlist is corrupt or an i/o error occured.
+ *
+ * Locking: - Caller must hold @ni->lock on the inode and must hold the lock of
+ *	      the raw inode of @ni for writing so that the compression block
+ *	      cannot be accessed concurrently.
+ *	    - The runlist @ni must be unlocked as it is taken for writing.
+ *	    - The base mft record of @ni must not be mapped.
+ */
+errno_t ntfs_attr_cb_resize(ntfs_inode *ni, const VCN vcn,
+		const s64 nr_clusters, s64 *nr_real)
+{
+	VCN end_vcn;
+	LCN lcn;
+	s64 cur;
+	ntfs_volume *vol = ni->vol;
+	ntfs_attr_search_ctx *ctx;
+	ntfs_rl_element *rl;
+	errno_t err, err2;
+	ntfs_runlist runlist, alloc_runlist;
+
+	ntfs_debug("Entering for mft_no 0x%llx, vcn 0x%llx, nr_clusters "
+			"0x%llx.", (unsigned long long)ni->mft_no,
+			(unsigned long long)vcn,
+			(unsigned long long)nr_clusters);
+	if (!NInoCompressed(ni) || !NInoNonResident(ni) || NInoRaw(ni) ||
+			ni->type != AT_DATA)
+		panic("%s(): Called for incorrect inode type.\n", __FUNCTION__);
+	end_vcn = vcn + ni->compression_block_clusters;
+	if (vcn & (ni->compression_block_clusters - 1) || nr_clusters < 0 ||
+			nr_clusters > ni->compression_block_clusters)
+		panic("%s(): Invalid vcn 0x%llx or nr_clusters 0x%llx.\n",
+				__FUNCTION__, (unsigned long long)vcn,
+				(unsigned long long)nr_clusters);
+	*nr_real = 0;
+	lck_rw_lock_exclusive(&ni->rl.lock);
+	err = ntfs_attr_extent_get(ni, vcn, &ctx);
+	if (err)
+		goto unl_err;
+	/*
+	 * The extent containing @vcn is mapped thus so is the whole
+	 * compression block if it does not extend into the next extent.
+	 */
+	cur = ntfs_rl_get_nr_real_clusters(&ni->rl, vcn,
+			ni->compression_block_clusters);
+	*nr_real = cur;
+	if (cur == nr_clusters) {
+		ntfs_attr_extent_put(ni, ctx);
+		lck_rw_unlock_exclusive(&ni->rl.lock);
+		ntfs_debug("Done (nothing to do).");
+		return 0;
+	}
+	if (end_vcn - 1 > sle64_to_cpu(ctx->a->highest_vcn)) {
+		ntfs_debug("Compression block spans attribute extents.");
+		err = ENOTSUP;
+		goto put_err;
+	}
+	/*
+	 * The real clusters of a compression block are always at its start
+	 * with the sparse clusters following them.
+	 */
+	if (ntfs_rl_get_nr_real_clusters(&ni->rl, vcn, cur) != cur) {
+		ntfs_error(vol->mp, "Compression block at vcn 0x%llx of mft_no "
+				"0x%llx has sparse clusters followed by real "
+				"clusters.  Run chkdsk.",
+				(unsigned long long)vcn,
+				(unsigned long long)ni->mft_no);
+		NVolSetErrors(vol);
+		err = EIO;
+		goto put_err;
+	}
+	/* Work on a copy of the runlist so we can back out on error. */
+	err = ntfs_attr_rl_copy(ni, &runlist);
+	if (err)
+		goto put_err;
+	if (nr_clusters < cur) {
+		err = ntfs_rl_punch_nolock(vol, &runlist, vcn + nr_clusters,
+				cur - nr_clusters);
+		if (err) {
+			ntfs_error(vol->mp, "Failed to punch hole into runlist "
+					"(error %d).", err);
+			if (err != ENOMEM)
+				err = EIO;
+			goto free_err;
 		}
-		/*
-		 * Make sure that we do not instantiate past @end_vcn as would
-		 * otherwise happen when the hole goes past @end_vcn.
-		 */
-		len = rl[1].vcn - vcn;
-		if (rl[1].vcn > end_vcn)
-			len = end_vcn - vcn;
-// TODO: HERE:
-		/*
-		 * If the entire run lies outside the initialized size we do
-		 * not need to do anything other than instantiating the hole
-		 * with real clusters.
-		 *
-		 * If part of the run (or the whole run) lies inside the
-		 * initialized size we need to zero the clusters in memory and
-		 * mark the pages dirty so they get written out later in
-		 * addition to instantiating the hole with real clusters.
-		 *
-		 * The need for zeroing causes two potential problems.  The
-		 * first problem is that if the run being instantiated is very
-		 * large we could run out of memory due to us holding both the
-		 * inode lock and the runlist lock for writing so all the dirty
-		 * pages we create/release back to the VM cannot be paged out
-		 * until we release the locks and the second problem is that if
-		 * the cluster size is less than the page size we can encounter
-		 * partially sparse pages and if they are not already cached by
-		 * the VM we have to page them in.  But to do so we have to not
-		 * hold the runlist lock for writing.  We have two ways out of
-		 * this situation.  Either we have to drop and re-acquire the
-		 * runlist lock around paging in such pages (with restarting
-		 * everything each time because we had dropped the lock) or we
-		 * have to read the non-sparse clusters in by hand using an
-		 * enhanced ntfs_rl_read() or even by calling buf_meta_bread()
-		 * directly.
-		 *
-		 * FIXME: We ignore the first problem for now until the code is
-		 * working and we can test it.  The solution is probably to
-		 * break the work into chunks of a fixed size and the allocate
-		 * only enough clusters to complete the current chunk then
-		 * merge that with the runlist, dirty all corresponding pages,
-		 * then drop the locks to allow the pages to be written if
-		 * needed and then take the locks again and start again with
-		 * the next chunk.  This does have one nasty side effect and
-		 * that is that whilst the locks are dropped a concurrent
-		 * process could do nasty things to the inode including
-		 * truncate our carefully allocated pages by shrinking the file
-		 * so a lot of sanity checking after re-taking the locks will
-		 * be needed.  Alternatively perhaps we need to hold the inode
-		 * lock shared throughout this function so dropping the
-		 * runlist lock would be sufficient.  We do not actually need
-		 * the inode lock for writing in this function as we do not
-		 * modify any of the inode sizes and the runlist lock will
-		 * protect us sufficiently from everything.
-		 *
-		 * FIXME: We also ignore the second problem for now and abort
-		 * if it bites us, again until the code is working and we can
-		 * test it.
-		 */
-		/*
-		 * Seek back to the last real LCN so we can try and extend the
-		 * hole at that LCN so the instantiated clusters are at least
-		 * in close proximity to the other data in the attribute.
-		 */
-		rl2 = rl;
-		while (rl2->lcn < 0 && rl2 > ni->rl.rl)
-			rl2--;
-		runlist.rl = NULL;
-		runlist.alloc = runlist.elements = 0;
-		err = ntfs_cluster_alloc(vol, vcn, len,
-				(rl2->lcn >= 0) ? rl2->lcn + rl2->length : -1,
-				DATA_ZONE, FALSE, &runlist);
+	} else {
+		/* Try to continue the existing clusters on disk. */
+		lcn = -1;
+		if (cur) {
+			rl = ntfs_rl_find_vcn_nolock(ntfs_rl_lookup_nolock(
+					&runlist, vcn + cur - 1),
+					vcn + cur - 1);
+			lcn = rl->lcn + (vcn + cur - rl->vcn);
+		}
+		alloc_runlist.rl = NULL;
+		alloc_runlist.alloc_count = alloc_runlist.elements = 0;
+		err = ntfs_cluster_alloc(vol, vcn + cur, nr_clusters - cur,
+				lcn, DATA_ZONE, FALSE, &alloc_runlist);
 		if (err) {
 			if (err != ENOSPC)
 				ntfs_error(vol->mp, "Failed to allocate "
 						"clusters (error %d).", err);
-			goto err;
-		}
-// TODO: HERE:
-		/*
-		 * If the instantiated hole starts before the initialized size
-		 * we need to zero it.
-		 *
-		 * FIXME: For now we do it in the most stupid way possible and
-		 * that is to synchronously write zeroes to disk via the device
-		 * hosting the volume.  That way we get around our issues and
-		 * problems with the UBC and small/large cluster sizes.  This
-		 * way if there is dirty data in the UBC it will still get
-		 * written on top of the zeroing we are now doing.  Ordering is
-		 * guaranteed as no-one knows about the allocated clusters yet
-		 * as we have not merged the runlists yet.
-		 *
-		 * FIXME: TODO: It may be worth restricting ntfs_rl_set() to
-		 * only operate up to the initialized size as it could
-		 * otherwise do a lot of unneeded extra work.
-		 */
-		if (vcn << vol->cluster_size_shift < initialized_size) {
-			ntfs_debug("Zeroing instantiated hole inside the "
-					"initialized size.");
-			if (!runlist.elements || !runlist.alloc)
-				panic("%s(): !runlist.elements || "
-						"!runlist.alloc\n",
-						__FUNCTION__);
-			err = ntfs_rl_set(vol, runlist.rl, 0);
-			if (err) {
-				ntfs_error(vol->mp, "Failed to zero newly "
-						"allocated space (error %d).",
-						err);
-				goto undo_alloc;
-			}
+			if (err != ENOMEM && err != ENOSPC)
+				err = EIO;
+			goto free_err;
 		}
-		err = ntfs_rl_merge(&ni->rl, &runlist);
+		err = ntfs_rl_merge(&runlist, &alloc_runlist);
 		if (err) {
 			ntfs_error(vol->mp, "Failed to merge runlists (error "
 					"%d).", err);
-			goto undo_alloc;
-		}
-		/*
-		 * The runlist may have been reallocated so @rl needs to be
-		 * reset back to the beginning.
-		 */
-		rl = ni->rl.rl;
-		/*
-		 * Need to update the mapping pairs array of the attribute.  We
-		 * cannot postpone this till the end (which would be much more
-		 * efficient) because we could run out of space on the volume
-		 * when trying to update the mapping pairs array and then we
-		 * would not be able to roll back to the previous state because
-		 * we would not know which bits of the runlist are new and
-		 * which are old.  Doing it now means that if we get an error
-		 * we still know the starting and ending VCNs of the run we
-		 * instantiated so we can punch the clusters out again thus
-		 * restoring the original hole.
-		 */
-		err = ntfs_mft_record_map(base_ni, &base_m);
-		if (err) {
-			ntfs_error(vol->mp, "Failed to map mft_no 0x%llx "
-					"(error %d).",
-					(unsigned long long)base_ni->mft_no,
-					err);
-			goto undo_merge;
+			err2 = ntfs_cluster_free_from_rl(vol, alloc_runlist.rl,
+					0, -1, NULL);
+			if (err2) {
+				ntfs_error(vol->mp, "Failed to release "
+						"allocated cluster(s) in error "
+						"code path (error %d).  Run "
+						"chkdsk to recover the lost "
+						"space.", err2);
+				NVolSetErrors(vol);
+			}
+			IODeleteData(alloc_runlist.rl, ntfs_rl_element,
+					alloc_runlist.alloc_count);
+			if (err != ENOMEM)
+				err = EIO;
+			goto free_err;
 		}
-		ctx = ntfs_attr_search_ctx_get(base_ni, base_m);
-		if (!ctx) {
-			ntfs_error(vol->mp, "Failed to allocate attribute "
-					"search context.");
-			err = ENOMEM;
-			goto unm_err;
+	}
+	err = ntfs_attr_extent_rl_commit(ni, ctx, &runlist, vcn + nr_clusters,
+			nr_clusters < cur ? cur - nr_clusters : 0,
+			nr_clusters - cur);
+	if (ni->rl.rl != runlist.rl)
+		goto undo_alloc;
+	*nr_real = nr_clusters;
+	ntfs_attr_extent_put(ni, ctx);
+	lck_rw_unlock_exclusive(&ni->rl.lock);
+	ntfs_debug("Done (compression block now has 0x%llx real clusters).",
+			(unsigned long long)nr_clusters);
+	return err;
+undo_alloc:
+	if (nr_clusters > cur) {
+		err2 = ntfs_cluster_free_from_rl(vol, runlist.rl, vcn + cur,
+				nr_clusters - cur, NULL);
+		if (err2) {
+			ntfs_error(vol->mp, "Failed to release allocated "
+					"cluster(s) in error code path (error "
+					"%d).  Run chkdsk to recover the lost "
+					"space.", err2);
+			NVolSetErrors(vol);
 		}
-		/*
-		 * Get the base attribute record so we can update the
-		 * compressed size or so we can switch the attribute to not be
-		 * sparse any more if we just filled the last hole.
-		 */
-		err = ntfs_attr_lookup(ni->type, ni->name, ni->name_len, 0,
-				NULL, 0, ctx);
+	}
+free_err:
+	IODeleteData(runlist.rl, ntfs_rl_element, runlist.alloc_count);
+put_err:
+	ntfs_attr_extent_put(ni, ctx);
+unl_err:
+	lck_rw_unlock_exclusive(&ni->rl.lock);
+	ntfs_debug("Failed (error %d).", err);
+	return err;
+}
+
+/**
+ * ntfs_attr_extent_hole_fill - instantiate a hole within an attribute extent
+ * @ni:		ntfs inode of the sparse attribute
+ * @vcn:	first vcn of the hole to instantiate
+ * @len:	maximum number of clusters to instantiate (in) and number of
+ *		clusters instantiated (out)
+ * @zero:	if true, zero the allocated clusters on disk
+ *
+ * Allocate real clusters for the sparse run of the attribute described by the
+ * ntfs inode @ni starting at vcn @vcn.  At most *@len clusters are allocated
+ * and the allocation stops at the end of the sparse run and at the end of the
+ * attribute extent containing @vcn.  On success *@len is set to the number of
+ * clusters that were allocated.
+ *
+ * The clusters are allocated directly after the preceding run if possible so
+ * the attribute stays as contiguous as possible.  If @zero is true, the
+ * allocated clusters are zeroed on disk before they are merged into the
+ * runlist so that nobody can see their old contents.
+ *
+ * The changes are made to a copy of the runlist as in ntfs_attr_cb_resize()
+ * thus on error nothing has been modified.
+ *
+ * Return 0 on success and errno on error.
+ *
+ * Locking: - Caller must hold the runlist lock of @ni for writing.
+ *	    - The base mft record of @ni must not be mapped.
+ */
+static errno_t ntfs_attr_extent_hole_fill(ntfs_inode *ni, const VCN vcn,
+		s64 *len, const BOOL zero)
+{
+	VCN end_vcn;
+	LCN lcn;
+	ntfs_volume *vol = ni->vol;
+	ntfs_attr_search_ctx *ctx;
+	ntfs_rl_element *rl;
+	errno_t err, err2;
+	ntfs_runlist runlist, alloc_runlist;
+
+	err = ntfs_attr_extent_get(ni, vcn, &ctx);
+	if (err)
+		return err;
+	rl = ntfs_rl_find_vcn_nolock(ntfs_rl_lookup_nolock(&ni->rl, vcn),
+			vcn);
+	if (!rl || rl->lcn != LCN_HOLE)
+		panic("%s(): vcn 0x%llx is not sparse.\n", __FUNCTION__,
+				(unsigned long long)vcn);
+	end_vcn = vcn + *len;
+	if (end_vcn > rl[1].vcn)
+		end_vcn = rl[1].vcn;
+	if (end_vcn > sle64_to_cpu(ctx->a->highest_vcn) + 1)
+		end_vcn = sle64_to_cpu(ctx->a->highest_vcn) + 1;
+	/* Try to continue the preceding run on disk. */
+	lcn = -1;
+	if (rl > ni->rl.rl && (rl - 1)->lcn >= 0)
+		lcn = (rl - 1)->lcn + (rl - 1)->length;
+	err = ntfs_attr_rl_copy(ni, &runlist);
+	if (err)
+		goto put;
+	alloc_runlist.rl = NULL;
+	alloc_runlist.alloc_count = alloc_runlist.elements = 0;
+	err = ntfs_cluster_alloc(vol, vcn, end_vcn - vcn, lcn, DATA_ZONE,
+			FALSE, &alloc_runlist);
+	if (err) {
+		if (err != ENOSPC)
+			ntfs_error(vol->mp, "Failed to allocate clusters "
+					"(error %d).", err);
+		if (err != ENOMEM && err != ENOSPC)
+			err = EIO;
+		goto free;
+	}
+	if (zero) {
+		err = ntfs_rl_set(vol, alloc_runlist.rl, 0);
 		if (err) {
-			ntfs_error(vol->mp, "Failed to lookup base attribute "
-					"extent in mft_no 0x%llx (error %d).",
-					(unsigned long long)base_ni->mft_no,
-					err);
-			goto put_err;
+			ntfs_error(vol->mp, "Failed to zero newly allocated "
+					"clusters (error %d).", err);
+			goto free_alloc;
 		}
-		m = ctx->m;
-		a = ctx->a;
-		/*
-		 * We added @len clusters thus the compressed size grows by
-		 * that many clusters whilst the allocated size does not change
-		 * as we have not extended the attribute.
-		 */
-		compressed_size += len << vol->cluster_size_shift;
-		/*
-		 * Determine whether the attribute is still sparse by comparing
-		 * the new compressed size to the allocated size.  If the two
-		 * have now become the same the attribute is no longer sparse.
-		 */
-		if (compressed_size >= allocated_size) {
-			if (compressed_size != allocated_size)
-				panic("%s(): compressed_size != "
-						"allocated_size\n",
-						__FUNCTION__);
-			/* Switch the attribute to not be sparse any more. */
-			ntfs_attr_sparse_clear(base_ni, ni, ctx);
-		}
-		/*
-		 * If the attribute is (still) sparse or compressed, need to
-		 * update the compressed size.
-		 */
-		if (NInoSparse(ni) || NInoCompressed(ni)) {
-			lck_spin_lock(&ni->size_lock);
-			ni->compressed_size = compressed_size;
-			a->compressed_size = cpu_to_sle64(compressed_size);
-			lck_spin_unlock(&ni->size_lock);
-		}
-		/*
-		 * If this is the unnamed $DATA attribute also need to update
-		 * the sizes in the directory entries pointing to this inode.
-		 */
-		if (ni == base_ni)
-			NInoSetDirtySizes(ni);
-		/*
-		 * If the VCN we started allocating at is not in the base
-		 * attribute record get the attribute record containing it so
-		 * we can update the mapping pairs array.
-		 */
-		if (vcn > sle64_to_cpu(a->highest_vcn)) {
-			/* Ensure the modified mft record is written out. */
-			NInoSetMrecNeedsDirtying(ctx->ni);
-			err = ntfs_attr_lookup(ni->type, ni->name, ni->name_len,
-					vcn, NULL, 0, ctx);
-			if (err) {
-				ntfs_error(vol->mp, "Failed to lookup "
-						"attribute extent in mft_no "
-						"0x%llx (error %d).",
-						(unsigned long long)
-						base_ni->mft_no, err);
-				a = NULL;
-				goto undo_sparse;
-			}
-			a = ctx->a;
-		}
-		/*
-		 * Get the size for the new mapping pairs array for this
-		 * attribute extent.
-		 */
-		lowest_vcn = sle64_to_cpu(a->lowest_vcn);
-		/*
-		 * Get the runlist element containing the lowest vcn.
-		 *
-		 * This cannot fail as we know the runlist is ok and the
-		 * runlist fragment containing the lowest vcn is mapped.
-		 */
-		rl2 = ntfs_rl_find_vcn_nolock(rl, lowest_vcn);
-		if (!rl2)
-			panic("%s(): Memory corruption detected.\n",
-					__FUNCTION__);
-		err = ntfs_get_size_for_mapping_pairs(vol, rl2, lowest_vcn,
-				highest_vcn, &mp_size);
-		if (err) {
-			ntfs_error(vol->mp, "Failed to get size for mapping "
-					"pairs array (error %d).", err);
-			goto undo_sparse;
+	}
+	err = ntfs_rl_merge(&runlist, &alloc_runlist);
+	if (err) {
+		ntfs_error(vol->mp, "Failed to merge runlists (error %d).",
+				err);
+		goto free_alloc;
+	}
+	err = ntfs_attr_extent_rl_commit(ni, ctx, &runlist, 0, 0,
+			end_vcn - vcn);
+	if (ni->rl.rl != runlist.rl) {
+		err2 = ntfs_cluster_free_from_rl(vol, runlist.rl, vcn,
+				end_vcn - vcn, NULL);
+		if (err2) {
+			ntfs_error(vol->mp, "Failed to release allocated "
+					"cluster(s) in error code path (error "
+					"%d).  Run chkdsk to recover the lost "
+					"space.", err2);
+			NVolSetErrors(vol);
 		}
-		mp_ofs = le16_to_cpu(a->mapping_pairs_offset);
-retry_attr_rec_resize:
-		/*
-		 * Extend the attribute record to fit the bigger mapping pairs
-		 * array.
-		 */
-		err = ntfs_attr_record_resize(m, a, mp_size + mp_ofs);
-		if (!err)
-			goto build_mpa;
-		if (err != ENOSPC)
-			panic("%s(): err != ENOSPC\n", __FUNCTION__);
-		/*
-		 * There is not enough space in the mft record.
-		 *
-		 * We need to add an attribute list attribute if it is not
-		 * already present.
-		 */
-		if (!NInoAttrList(base_ni)) {
-			err = ntfs_attr_list_add(base_ni, base_m, ctx);
-			if (err || ctx->is_error) {
-				if (!err)
-					err = ctx->error;
-				ntfs_error(vol->mp, "Failed to %s mft_no "
-						"0x%llx (error %d).",
-						ctx->is_error ?
-						"remap extent mft record of" :
-						"add attribute list attribute "
-						"to", (unsigned long long)
-						base_ni->mft_no, err);
-				goto undo1;
-			}
-			/*
-			 * The attribute location will have changed so update
-			 * it from the search context.
-			 */
-			m = ctx->m;
-			a = ctx->a;
-			/*
-			 * Retry the original attribute record resize as we may
-			 * now have enough space to create the needed mapping 
-			 * pairs array in the moved attribute record.
-			 *
-			 * This can for example happen when the attribute was
-			 * moved out to an extent mft record which has much
-			 * more free space than the base mft record had.
-			 */
-			goto retry_attr_rec_resize;
+		goto free;
+	}
+	*len = end_vcn - vcn;
+	ntfs_attr_extent_put(ni, ctx);
+	return err;
+free_alloc:
+	err2 = ntfs_cluster_free_from_rl(vol, alloc_runlist.rl, 0, -1, NULL);
+	if (err2) {
+		ntfs_error(vol->mp, "Failed to release allocated cluster(s) "
+				"in error code path (error %d).  Run chkdsk "
+				"to recover the lost space.", err2);
+		NVolSetErrors(vol);
+	}
+	IODeleteData(alloc_runlist.rl, ntfs_rl_element,
+			alloc_runlist.alloc_count);
+	if (err != ENOMEM)
+		err = EIO;
+free:
+	IODeleteData(runlist.rl, ntfs_rl_element, runlist.alloc_count);
+put:
+	ntfs_attr_extent_put(ni, ctx);
+	return err;
+}
+
+/**
+ * ntfs_attr_instantiate_holes - instantiate the holes in an attribute region
+ * @ni:		ntfs inode of the attribute whose holes to instantiate
+ * @start:	start offset in bytes at which to begin instantiating holes
+ * @end:	end offset in bytes at which to stop instantiating holes
+ * @new_end:	return the offset at which we stopped instantiating holes
+ * @atomic:	if true must complete the entire exension or abort
+ *
+ * Scan the runlist (mapping any unmapped fragments as needed) starting at byte
+ * offset @start into the attribute described by the ntfs inode @ni and
+ * finishing at byte offset @end and instantiate any sparse regions located
+ * between @start and @end with real clusters.
+ *
+ * @start is rounded down and @end is rounded up to page boundaries as it makes
+ * no sense to instantiate only part of a page given a later pageout of the
+ * dirty page would instantiate the remainder of the page anyway.  If the
+ * attribute has a compression unit they are rounded to compression block
+ * boundaries instead so that whole compression units are allocated as Windows
+ * does.  @end is never rounded beyond the allocated size.  Sparse regions
+ * outside the rounded range are left alone, thus a write into a large hole
+ * only allocates the clusters it touches.
+ *
+ * Any clusters that are inside the initialized size are zeroed.
+ *
+ * If @atomic is true the whole instantiation must be complete so abort on
+ * errors.  If @atomic is false partial instantiations are acceptable (but we
+ * still return an error if the instantiation is partial).  In any case we set
+ * *@new_end to the end of the instantiated range.  Thus the caller has to
+ * always check *@new_end.  If *@new_end is equal to @end then the whole
+ * instantiation was complete.  If *@new_end is less than @end the
+ * instantiation was partial.
+ *
+ * Note there is nothing to roll back when aborting as the holes are filled
+ * one at a time and each instantiated hole reads back as zeroes just as it did
+ * before it was instantiated.
+ *
+ * Note if @new_end is NULL, then @atomic is set to true as there is no way to
+ * communicate to the caller that the hole instantiation was partial.
+ *
+ * Return 0 on success and errno on error.
+ *
+ * Locking: - Caller must hold @ni->lock on the inode for writing.
+ *	    - The runlist @ni must be unlocked as it is taken for writing.
+ */
+errno_t ntfs_attr_instantiate_holes(ntfs_inode *ni, s64 start, s64 end,
+		s64 *new_end, BOOL atomic)
+{
+	VCN vcn, end_vcn;
+	s64 len, allocated_size, initialized_size, mask;
+	ntfs_volume *vol = ni->vol;
+	ntfs_rl_element *rl;
+	errno_t err;
+
+	/* We should never be called for non-sparse attributes. */
+	if (!NInoSparse(ni))
+		panic("%s(): !NInoSparse(ni)\n", __FUNCTION__);
+	/* We should never be called for resident attributes. */
+	if (!NInoNonResident(ni))
+		panic("%s(): !NInoNonResident(ni)\n", __FUNCTION__);
+	/* We should only be called for $DATA attributes. */
+	if (ni->type != AT_DATA)
+		panic("%s(): ni->type != AT_DATA\n", __FUNCTION__);
+	/* Sanity check @start and @end. */
+	if (start >= end)
+		panic("%s(): start >= end\n", __FUNCTION__);
+	if (start & vol->cluster_size_mask || end & vol->cluster_size_mask)
+		panic("%s(): start & vol->cluster_size_mask || "
+				"end & vol->cluster_size_mask\n", __FUNCTION__);
+	ntfs_debug("Entering for mft_no 0x%llx, start 0x%llx, end 0x%llx.",
+			(unsigned long long)ni->mft_no,
+			(unsigned long long)start, (unsigned long long)end);
+	if (!new_end)
+		atomic = TRUE;
+	mask = PAGE_MASK_64;
+	if (ni->compression_block_size > PAGE_SIZE)
+		mask = ni->compression_block_size - 1;
+	lck_spin_lock(&ni->size_lock);
+	allocated_size = ni->allocated_size;
+	initialized_size = ni->initialized_size;
+	lck_spin_unlock(&ni->size_lock);
+	vcn = (start & ~mask) >> vol->cluster_size_shift;
+	end_vcn = ((end + mask) & ~mask) >> vol->cluster_size_shift;
+	/*
+	 * We have to make sure that we stay within the existing allocated
+	 * size when instantiating holes as it would corrupt the attribute if
+	 * we were to extend the runlist beyond the allocated size.
+	 */
+	if (end_vcn > allocated_size >> vol->cluster_size_shift)
+		end_vcn = allocated_size >> vol->cluster_size_shift;
+	err = 0;
+	lck_rw_lock_exclusive(&ni->rl.lock);
+	while (vcn < end_vcn) {
+		err = ntfs_attr_find_vcn_nolock(ni, vcn, &rl, NULL);
+		if (err) {
+			ntfs_error(vol->mp, "Failed to map runlist fragment "
+					"(error %d).", err);
+			if (err != ENOMEM)
+				err = EIO;
+			break;
 		}
-		/*
-		 * If this is not the only attribute record in the mft record
-		 * then move it out to a new extent mft record which will allow
-		 * the attribute record to grow larger thus reducing the total
-		 * number of extent attribute records needed to a minimum.
-		 */
-		if (!ntfs_attr_record_is_only_one(m, a)) {
-			lck_rw_lock_shared(&base_ni->attr_list_rl.lock);
-			err = ntfs_attr_record_move(ctx);
-			lck_rw_unlock_shared(&base_ni->attr_list_rl.lock);
-			if (err) {
-				ntfs_error(vol->mp, "Failed to move attribute "
-						"extent from mft record "
-						"0x%llx to an extent mft "
-						"record (error %d).",
-						(unsigned long long)
-						ctx->ni->mft_no, err);
-				/*
-				 * We could try to remove the attribute list
-				 * attribute if we added it above but this
-				 * would probably require attributes to be
-				 * moved back into the base mft record from
-				 * extent mft records so is a lot of work and
-				 * given we are in an error code path and given
-				 * that it is ok to just leave the inode with
-				 * an attribute list attribute we do not bother
-				 * and just bail out.
-				 */
-				goto undo1;
-			}
-			/*
-			 * The attribute location will have changed so update
-			 * it from the search context.
-			 */
-			m = ctx->m;
-			a = ctx->a;
-			/*
-			 * Retry the original attribute record resize as we may
-			 * now have enough space to create the mapping pairs
-			 * array in the moved attribute record.
-			 */
-			goto retry_attr_rec_resize;
+		/* Skip runs which are already allocated. */
+		if (rl->lcn >= 0) {
+			vcn = rl[1].vcn;
+			continue;
 		}
-		max_size = (le32_to_cpu(m->bytes_allocated) -
-				le32_to_cpu(m->bytes_in_use)) & ~7;
-		max_size += le32_to_cpu(a->length) - mp_ofs;
-		err = ntfs_attr_record_resize(m, a, max_size + mp_ofs);
-		/*
-		 * We worked out the exact size we can extend to so the resize
-		 * cannot fail.
-		 */
-		if (err)
-			panic("%s(): err (ntfs_attr_record_resize())\n",
-					__FUNCTION__);
-build_mpa:
-// TODO: HERE...
-		mp_rebuilt = TRUE;
-		/*
-		 * Generate the mapping pairs array directly into the attribute
-		 * record.
-		 *
-		 * This cannot fail as we have already checked the size we need
-		 * to build the mapping pairs array.
-		 */
-		err = ntfs_mapping_pairs_build(vol, (s8*)a + mp_ofs,
-				le32_to_cpu(a->length) - mp_ofs, rl2,
-				lowest_vcn, highest_vcn, &stop_vcn);
-		if (err && err != ENOSPC) {
-			ntfs_error(vol->mp, "Cannot fill hole of mft_no "
-					"0x%llx, attribute type 0x%x, because "
-					"building the mapping pairs array "
-					"failed (error %d).",
-					(unsigned long long)ni->mft_no,
-					(unsigned)le32_to_cpu(ni->type), err);
+		if (rl->lcn != LCN_HOLE || !rl->length) {
+			ntfs_error(vol->mp, "Runlist is corrupt.  Unmount and "
+					"run chkdsk.");
+			NVolSetErrors(vol);
 			err = EIO;
-			/*
-			 * Need to set @a->highest_vcn to enable correct error
-			 * recovery.
-			 */
-// TODO: HERE...
-			if (!is_first)
-				a->highest_vcn = cpu_to_sle64(sle64_to_cpu(
-						a->lowest_vcn) - 1);
-			goto undo;
+			break;
 		}
-		/* Update the highest_vcn. */
-		a->highest_vcn = cpu_to_sle64(stop_vcn - 1);
-		/* Ensure the modified mft record is written out. */
-		NInoSetMrecNeedsDirtying(ctx->ni);
-		/*
-		 * If the mapping pairs build succeeded, i.e. the current
-		 * attribute extent contains the whole runlist fragment, we are
-		 * done and can proceed to the next run.
-		 */
-		if (!err)
-			goto next_run;
-		/*
-		 * Partial mapping pairs update.  This means we need to create
-		 * one or me new attribute extents to hold the remainder of the
-		 * mapping pairs.
-		 *
-		 * Get the size of the remaining mapping pairs array.
-		 */
-		rl2 = ntfs_rl_find_vcn_nolock(rl2, stop_vcn);
-		if (!rl2)
-			panic("%s(): !rl2 (stop_vcn)\n", __FUNCTION__);
-		if (!rl2->length)
-			panic("%s(): !rl2->length (stop_vcn)\n", __FUNCTION__);
-		if (rl2->lcn < LCN_HOLE)
-			panic("%s(): rl2->lcn < LCN_HOLE (stop_vcn)\n",
-					__FUNCTION__);
-		err = ntfs_get_size_for_mapping_pairs(vol, rl2, stop_vcn,
-				highest_vcn, &mp_size);
+		len = end_vcn - vcn;
+		err = ntfs_attr_extent_hole_fill(ni, vcn, &len,
+				(vcn << vol->cluster_size_shift) <
+				initialized_size);
 		if (err) {
-			ntfs_error(vol->mp, "Cannot complete filling of hole "
-					"of mft_no 0x%llx, attribute type "
-					"0x%x, because determining the size "
-					"for the mapping pairs failed (error "
-					"%d).", (unsigned long long)ni->mft_no,
-					(unsigned)le32_to_cpu(ni->type), err);
-			err = EIO;
-// TODO: HERE...
-			goto undo;
-		}
-		/* We only release extent mft records. */
-		if (ctx->ni != base_ni)
-			ntfs_extent_mft_record_unmap(ctx->ni);
-// TODO: I AM HERE...  Need to allocate an extent mft record, add an extent
-// attribute record to it filling it with remaining mapping pairs array fragment
-// and creating an attribute list attribute entry for it.  Then if still not
-// reached highest_vcn, need to repeat the process again.
-next_run:
-		ntfs_attr_search_ctx_put(ctx);
-		ntfs_mft_record_unmap(base_ni);
-		/*
-		 * If the attribute is no longer sparse there are no more holes
-		 * to instantiate thus we are done with the whole region of
-		 * interest.
-		 */
-		if (!NInoSparse(ni)) {
-			vcn = end_vcn;
+			if (err != ENOSPC)
+				ntfs_error(vol->mp, "Failed to instantiate "
+						"hole at vcn 0x%llx of mft_no "
+						"0x%llx (error %d).",
+						(unsigned long long)vcn,
+						(unsigned long long)ni->mft_no,
+						err);
 			break;
 		}
-		/*
-		 * We allocated @len clusters starting at @vcn.  Thus the next
-		 * VCN we need to look at is at @vcn + @len.
-		 */
 		vcn += len;
-	} while (vcn < end_vcn);
-	if (vcn > end_vcn)
-		panic("%s(): vcn > end_vcn\n", __FUNCTION__);
-	ntfs_debug("Done, new_end 0x%llx.",
-			(unsigned long long)vcn << vol->cluster_size_shift);
-err:
-	if (new_end)
+	}
+	lck_rw_unlock_exclusive(&ni->rl.lock);
+	if (new_end) {
 		*new_end = vcn << vol->cluster_size_shift;
-	if (write_locked)
-		lck_rw_unlock_exclusive(&ni->rl.lock);
+		if (!err || *new_end > end)
+			*new_end = end;
+	}
+	if (err && atomic)
+		ntfs_debug("Failed (error %d).", err);
 	else
-		lck_rw_unlock_shared(&ni->rl.lock);
+		ntfs_debug("Done.");
 	return err;
-undo_alloc:
-	err2 = ntfs_cluster_free_from_rl(vol, runlist.rl, 0, -1, NULL);
-	if (err2) {
-		ntfs_error(vol->mp, "Failed to release allocated cluster(s) "
-				"in error code path (error %d).  Run chkdsk "
-				"to recover the lost space.", err2);
-		NVolSetErrors(vol);
+}
+
+/**
+ * ntfs_attr_extent_punch - deallocate clusters within an attribute extent
+ * @ni:		ntfs inode of the sparse attribute
+ * @vcn:	first vcn to deallocate
+ * @len:	maximum number of clusters to deallocate (in) and number of
+ *		clusters processed (out)
+ *
+ * Make the clusters of the attribute described by the ntfs inode @ni starting
+ * at vcn @vcn sparse and free the real clusters among them.  At most *@len
+ * clusters are processed and processing stops at the end of the attribute
+ * extent containing @vcn.  On success *@len is set to the number of clusters
+ * that were processed.
+ *
+ * The changes are made to a copy of the runlist as in ntfs_attr_cb_resize()
+ * thus on error nothing has been modified.
+ *
+ * Return 0 on success and errno on error.
+ *
+ * Locking: - Caller must hold the runlist lock of @ni for writing.
+ *	    - The base mft record of @ni must not be mapped.
+ */
+static errno_t ntfs_attr_extent_punch(ntfs_inode *ni, const VCN vcn,
+		s64 *len)
+{
+	VCN end_vcn;
+	s64 nr_real;
+	ntfs_volume *vol = ni->vol;
+	ntfs_attr_search_ctx *ctx;
+	errno_t err;
+	ntfs_runlist runlist;
+
+	err = ntfs_attr_extent_get(ni, vcn, &ctx);
+	if (err)
+		return err;
+	end_vcn = vcn + *len;
+	if (end_vcn > sle64_to_cpu(ctx->a->highest_vcn) + 1)
+		end_vcn = sle64_to_cpu(ctx->a->highest_vcn) + 1;
+	nr_real = ntfs_rl_get_nr_real_clusters(&ni->rl, vcn, end_vcn - vcn);
+	if (!nr_real)
+		goto done;
+	err = ntfs_attr_rl_copy(ni, &runlist);
+	if (err)
+		goto put;
+	err = ntfs_rl_punch_nolock(vol, &runlist, vcn, end_vcn - vcn);
+	if (err) {
+		ntfs_error(vol->mp, "Failed to punch hole into runlist (error "
+				"%d).", err);
+		if (err != ENOMEM)
+			err = EIO;
+		goto free;
 	}
-	IOFreeData(runlist.rl, runlist.alloc);
-	goto err;
-undo_sparse:
+	err = ntfs_attr_extent_rl_commit(ni, ctx, &runlist, vcn,
+			end_vcn - vcn, -nr_real);
+	if (ni->rl.rl != runlist.rl)
+		goto free;
+done:
+	*len = end_vcn - vcn;
+	ntfs_attr_extent_put(ni, ctx);
+	return err;
+free:
+	IODeleteData(runlist.rl, ntfs_rl_element, runlist.alloc_count);
+put:
+	ntfs_attr_extent_put(ni, ctx);
+	return err;
+}
+
+/**
+ * ntfs_attr_punch_hole - deallocate a region of an attribute
+ * @ni:		ntfs inode of the attribute in which to punch a hole
+ * @start:	start offset in bytes of the region to deallocate
+ * @end:	end offset in bytes of the region to deallocate
+ *
+ * Deallocate the byte range @start to @end of the attribute described by the
+ * ntfs inode @ni so that it reads back as zeroes, freeing the clusters backing
+ * it.  The region is clipped to the data size.  This is the NTFS equivalent of
+ * F_PUNCHHOLE.
+ *
+ * Only the part of the region which covers whole pages, clusters, and, if the
+ * attribute has a compression unit, compression blocks is deallocated.  The
+ * remainder at either end of the region is zeroed via the page cache using
+ * ntfs_attr_set() instead.  The pages of the deallocated part are invalidated
+ * in the page cache, discarding any dirty data they contain.
+ *
+ * If the attribute is not sparse it is switched to be sparse first, before
+ * the page cache is touched.  If that is not possible because the volume is
+ * older than NTFS 3.0, because the attribute may not be sparse, because the
+ * attribute is resident, or because there is no space in the mft record, the
+ * whole region is zeroed instead.  Likewise, if the mapping pairs array of an
+ * attribute extent cannot hold the new hole, the remainder of the region is
+ * zeroed instead of deallocated.  Compressed and encrypted attributes are not
+ * supported.
+ *
+ * Return 0 on success and errno on error.
+ *
+ * Locking: - Caller must hold an iocount reference on the vnode of @ni.
+ *	    - Caller must hold @ni->lock on the inode for writing.
+ *	    - The runlist @ni must be unlocked as it is taken for writing.
+ */
+errno_t ntfs_attr_punch_hole(ntfs_inode *ni, s64 start, s64 end)
+{
+	VCN vcn, end_vcn;
+	s64 len, data_size, hole_start, hole_end, align;
+	ntfs_volume *vol = ni->vol;
+	ntfs_inode *base_ni;
+	MFT_RECORD *base_m;
+	ntfs_attr_search_ctx *ctx;
+	errno_t err;
+
+	ntfs_debug("Entering for mft_no 0x%llx, start 0x%llx, end 0x%llx.",
+			(unsigned long long)ni->mft_no,
+			(unsigned long long)start, (unsigned long long)end);
+	if (ni->type != AT_DATA || NInoCompressed(ni) || NInoEncrypted(ni))
+		return ENOTSUP;
+	lck_spin_lock(&ni->size_lock);
+	data_size = ni->data_size;
+	lck_spin_unlock(&ni->size_lock);
+	if (start < 0)
+		start = 0;
+	if (end > data_size)
+		end = data_size;
+	if (start >= end) {
+		ntfs_debug("Done (nothing to do).");
+		return 0;
+	}
+	/* Determine the region which can be deallocated. */
+	align = PAGE_SIZE;
+	if (vol->cluster_size > align)
+		align = vol->cluster_size;
+	if (ni->compression_block_size > align)
+		align = ni->compression_block_size;
+	hole_start = (start + align - 1) & ~(align - 1);
+	hole_end = end & ~(align - 1);
+	if (!NInoNonResident(ni) || hole_start >= hole_end ||
+			(!NInoSparse(ni) && (vol->major_ver < 3 ||
+			NInoSparseDisabled(ni)))) {
+		ntfs_debug("Zeroing region instead of deallocating it.");
+		return ntfs_attr_set(ni, start, end - start, 0);
+	}
+	/* Zero the partial regions at either end. */
+	if (start < hole_start) {
+		err = ntfs_attr_set(ni, start, hole_start - start, 0);
+		if (err)
+			return err;
+	}
+	if (hole_end < end) {
+		err = ntfs_attr_set(ni, hole_end, end - hole_end, 0);
+		if (err)
+			return err;
+	}
+	base_ni = ni;
+	if (NInoAttr(ni))
+		base_ni = ni->base_ni;
 	/*
-	 * If looking up an attribute extent failed or we are not in the base
-	 * attribute record need to look up the base attribute record.
+	 * Switch the attribute to be sparse before touching the page cache so
+	 * that if this is not possible we can still fall back to zeroing the
+	 * region without having lost any cached data.
 	 */
-	if (!a || a->lowest_vcn) {
-		ntfs_attr_search_ctx_reinit(ctx);
-		err2 = ntfs_attr_lookup(ni->type, ni->name, ni->name_len, 0,
+	if (!NInoSparse(ni)) {
+		lck_rw_lock_exclusive(&ni->rl.lock);
+		err = ntfs_mft_record_map(base_ni, &base_m);
+		if (err)
+			goto unl_err;
+		ctx = ntfs_attr_search_ctx_get(base_ni, base_m);
+		if (!ctx) {
+			ntfs_mft_record_unmap(base_ni);
+			err = ENOMEM;
+			goto unl_err;
+		}
+		err = ntfs_attr_lookup(ni->type, ni->name, ni->name_len, 0,
 				NULL, 0, ctx);
-		if (err2) {
-			ntfs_error(vol->mp, "Failed to re-lookup base "
-					"attribute record in error code path "
-					"(error %d).  Leaving inconsistent "
-					"metadata.  Unmount and run chkdsk.",
-					err2);
-			NVolSetErrors(vol);
-			goto put_err;
+		if (!err) {
+			err = ntfs_attr_sparse_set(base_ni, ni, ctx);
+			if (!err)
+				NInoSetMrecNeedsDirtying(ctx->ni);
+		} else if (err == ENOENT)
+			err = EIO;
+		ntfs_attr_search_ctx_put(ctx);
+		ntfs_mft_record_unmap(base_ni);
+		lck_rw_unlock_exclusive(&ni->rl.lock);
+		if (err == ENOSPC) {
+			ntfs_debug("Cannot make mft_no 0x%llx sparse, zeroing "
+					"region instead of deallocating it.",
+					(unsigned long long)ni->mft_no);
+			return ntfs_attr_set(ni, hole_start,
+					hole_end - hole_start, 0);
+		}
+		if (err) {
+			ntfs_error(vol->mp, "Failed to set mft_no 0x%llx to be "
+					"sparse (error %d).",
+					(unsigned long long)ni->mft_no, err);
+			return err;
 		}
-		a = ctx->a;
 	}
 	/*
-	 * If we caused the attribute to no longer be sparse we need to make it
-	 * sparse again.
+	 * Throw away the cached pages of the region so they are not written
+	 * back into the region once it has been deallocated.  This must
+	 * happen before taking the runlist lock as a concurrent pagein holding
+	 * a page busy may be waiting for it.
 	 */
-	if (!NInoSparse(ni)) {
-		err2 = ntfs_attr_sparse_set(base_ni, ni, ctx);
-		if (err2) {
-			ntfs_error(vol->mp, "Failed to re-set the attribute "
-					"to be sparse in error code path "
-					"(error %d).  Leaving inconsistent "
-					"metadata.  Unmount and run chkdsk.",
-					err2);
-			NVolSetErrors(vol);
-			goto put_err;
-		}
-		/*
-		 * The attribute may have been moved to make space for the
-		 * compressed size so @a is now invalid.
-		 */
-		a = ctx->a;
-	}
-	/* Restore the compressed size to the old value. */
-	compressed_size -= len << vol->cluster_size_shift;
-	lck_spin_lock(&ni->size_lock);
-	ni->compressed_size = compressed_size;
-	a->compressed_size = cpu_to_sle64(compressed_size);
-	lck_spin_unlock(&ni->size_lock);
-	/* Ensure the modified mft record is written out. */
-	NInoSetMrecNeedsDirtying(ctx->ni);
-	if (ni == base_ni)
-		NInoSetDirtySizes(ni);
-put_err:
-	ntfs_attr_search_ctx_put(ctx);
-unm_err:
-	ntfs_mft_record_unmap(base_ni);
-undo_merge:
-	/* Free the clusters we allocated. */
-	err2 = ntfs_cluster_free_from_rl(vol, rl, vcn, len, NULL);
-	if (err2) {
-		ntfs_error(vol->mp, "Failed to release allocated cluster(s) "
-				"in error code path (error %d).  Unmount and "
-				"run chkdsk to recover the lost space.", err2);
-		NVolSetErrors(vol);
+	(void)ubc_msync(ni->vn, hole_start, hole_end, NULL, UBC_INVALIDATE);
+	lck_rw_lock_exclusive(&ni->rl.lock);
+	vcn = hole_start >> vol->cluster_size_shift;
+	end_vcn = hole_end >> vol->cluster_size_shift;
+	while (vcn < end_vcn) {
+		len = end_vcn - vcn;
+		err = ntfs_attr_extent_punch(ni, vcn, &len);
+		if (err)
+			goto punch_err;
+		vcn += len;
 	}
-	/* Punch the original hole back into the runlist. */
-	err2 = ntfs_rl_punch_nolock(vol, &ni->rl, vcn, len);
-	if (err2) {
-		ntfs_error(vol->mp, "Failed to restore hole in error code "
-				"path in error code path (error %d).  Leaving "
-				"inconsistent metadata.  Unmount and run "
-				"chkdsk.", err2);
-		NVolSetErrors(vol);
+	lck_rw_unlock_exclusive(&ni->rl.lock);
+	ntfs_debug("Done.");
+	return 0;
+punch_err:
+	lck_rw_unlock_exclusive(&ni->rl.lock);
+	/*
+	 * The cached pages of the remainder of the region are gone thus zero
+	 * it so it does not read back the stale data on disk.  If the new
+	 * mapping pairs array did not fit this is not an error, the remainder
+	 * is simply zeroed instead of deallocated.
+	 */
+	hole_start = vcn << vol->cluster_size_shift;
+	if (err == ENOSPC || err == ENOTSUP) {
+		ntfs_debug("Cannot deallocate vcn 0x%llx of mft_no 0x%llx "
+				"(error %d), zeroing remainder of region "
+				"instead.", (unsigned long long)vcn,
+				(unsigned long long)ni->mft_no, err);
+		return ntfs_attr_set(ni, hole_start, hole_end - hole_start, 0);
 	}
-	goto err;
-undo1:
-	panic("%s(): TODO\n", __FUNCTION__);
+	ntfs_error(vol->mp, "Failed to deallocate vcn 0x%llx of mft_no "
+			"0x%llx (error %d).", (unsigned long long)vcn,
+			(unsigned long long)ni->mft_no, err);
+	(void)ntfs_attr_set(ni, hole_start, hole_end - hole_start, 0);
+	return err;
+unl_err:
+	lck_rw_unlock_exclusive(&ni->rl.lock);
 	return err;
-#endif
 }
 
 /**
@@ -5948,7 +6545,8 @@ errno_t ntfs_attr_extend_allocation(ntfs_inode *ni, s64 new_alloc_size,
 		ntfs_index_context *ictx, s64 *dst_alloc_size,
 		const BOOL atomic __attribute__((unused)))
 {
-	VCN vcn, lowest_vcn, stop_vcn;
+	VCN vcn, lowest_vcn, stop_vcn, mp_vcn;
+	LCN mp_lcn;
 	s64 start, ll, old_alloc_size, alloc_size, alloc_start, alloc_end;
 	s64 nr_allocated, nr_freed;
 	ntfs_volume *vol = ni->vol;
@@ -5957,7 +6555,8 @@ errno_t ntfs_attr_extend_allocation(ntfs_inode *ni, s64 new_alloc_size,
 	ATTR_RECORD *a;
 	ntfs_attr_search_ctx *actx;
 	ntfs_rl_element *rl;
-	unsigned attr_len, arec_size, name_size, mp_size, mp_ofs, max_size;
+	unsigned attr_len, arec_size, name_size, mp_size, mp_ofs, mp_skip;
+	unsigned max_size;
 	unsigned al_entry_len, new_al_alloc;
 	errno_t err, err2;
 	BOOL is_sparse, is_first, mp_rebuilt, al_entry_added;
@@ -5989,13 +6588,19 @@ errno_t ntfs_attr_extend_allocation(ntfs_inode *ni, s64 new_alloc_size,
 retry_extend:
 	/*
 	 * For non-resident attributes, @start and @new_size need to be aligned
-	 * to cluster boundaries for allocation purposes.
+	 * to cluster boundaries for allocation purposes.  For compressed
+	 * attributes they need to be aligned to compression block boundaries
+	 * instead as the allocated size is always a multiple of the
+	 * compression block size.
 	 */
 	if (NInoNonResident(ni)) {
+		s64 mask = vol->cluster_size_mask;
+
+		if (NInoCompressed(ni) && ni->compression_block_size)
+			mask = ni->compression_block_size - 1;
 		if (start > 0)
-			start &= ~(s64)vol->cluster_size_mask;
-		new_alloc_size = (new_alloc_size + vol->cluster_size - 1) &
-				~(s64)vol->cluster_size_mask;
+			start &= ~mask;
+		new_alloc_size = (new_alloc_size + mask) & ~mask;
 	}
 	if (new_data_size >= 0 && new_data_size > new_alloc_size)
 		panic("%s(): new_data_size >= 0 && new_data_size > "
@@ -6267,6 +6872,8 @@ do_non_resident_extend:
 	 * going to allocate up to the new allocated size.
 	 */
 	alloc_start = alloc_size;
+	if (ni->rl_packed)
+		ntfs_attr_unpack_runlist_nolock(ni);
 	rl = NULL;
 	if (ni->rl.elements) {
 		/* Seek to the end of the runlist. */
@@ -6340,8 +6947,11 @@ do_non_resident_extend:
 	 */
 	if (ni->rl.elements + 2 > ni->rl.alloc_count) {
 		ntfs_rl_element *rl2;
+		unsigned alloc_count;
 
-		rl2 = IONewData(ntfs_rl_element, ni->rl.alloc_count + NTFS_ALLOC_BLOCK / sizeof(ntfs_rl_element));
+		alloc_count = ntfs_rl_alloc_count(ni->rl.alloc_count,
+				ni->rl.elements + 2);
+		rl2 = IONewData(ntfs_rl_element, alloc_count);
 		if (!rl2) {
 			err = ENOMEM;
 			goto err_out;
@@ -6354,7 +6964,7 @@ do_non_resident_extend:
 		if (ni->rl.alloc_count)
 			IODeleteData(ni->rl.rl, ntfs_rl_element, ni->rl.alloc_count);
 		ni->rl.rl = rl2;
-		ni->rl.alloc_count += NTFS_ALLOC_BLOCK / sizeof (ntfs_rl_element);
+		ni->rl.alloc_count = alloc_count;
 	}
 	if (ni->rl.elements) {
 		/* Sanity check that this is the end element. */
@@ -6492,8 +7102,39 @@ skip_real_alloc:
 		panic("%s(): rl->lcn < LCN_HOLE\n", __FUNCTION__);
 	mp_rebuilt = FALSE;
 	attr_len = le32_to_cpu(a->length);
+	/*
+	 * The mapping pairs up to the run containing the last cluster of the
+	 * old allocation are unchanged so we only need to rewrite the mapping
+	 * pairs array from that run onwards.  This makes extending a file
+	 * with many runs cost the same as extending a file with few runs.
+	 *
+	 * If the attribute extent does not end at the old allocated size or
+	 * no mapping pair starts at that run, e.g. because the runlist has
+	 * been merged differently to how the mapping pairs were written, fall
+	 * back to rewriting the whole mapping pairs array of the extent.
+	 */
+	mp_vcn = lowest_vcn;
+	mp_lcn = 0;
+	mp_skip = 0;
+	if ((alloc_size >> vol->cluster_size_shift) > lowest_vcn &&
+			sle64_to_cpu(a->highest_vcn) + 1 ==
+			alloc_size >> vol->cluster_size_shift) {
+		ntfs_rl_element *tail_rl;
+
+		tail_rl = ntfs_rl_lookup_nolock(&ni->rl,
+				(alloc_size >> vol->cluster_size_shift) - 1);
+		if (tail_rl->length && tail_rl->vcn > lowest_vcn &&
+				!ntfs_mapping_pairs_find(a, tail_rl->vcn,
+				&mp_skip, &mp_lcn)) {
+			rl = tail_rl;
+			mp_vcn = tail_rl->vcn;
+		} else {
+			mp_lcn = 0;
+			mp_skip = 0;
+		}
+	}
 	/* Get the size for the new mapping pairs array for this extent. */
-	err = ntfs_get_size_for_mapping_pairs(vol, rl, lowest_vcn, -1,
+	err = ntfs_get_size_for_mapping_pairs_ext(vol, rl, mp_vcn, -1, mp_lcn,
 			&mp_size);
 	if (err) {
 		if (start < 0 || start >= alloc_size)
@@ -6506,6 +7147,7 @@ skip_real_alloc:
 		err = EIO;
 		goto undo_alloc;
 	}
+	mp_size += mp_skip;
 	mp_ofs = le16_to_cpu(a->mapping_pairs_offset);
 retry_attr_rec_resize:
 	/* Extend the attribute record to fit the bigger mapping pairs array. */
@@ -6850,10 +7492,13 @@ start_new_attr:
 		}
 build_mpa:
 		mp_rebuilt = TRUE;
-		/* Generate the mapping pairs directly into the attribute. */
-		err = ntfs_mapping_pairs_build(vol, (s8*)a + mp_ofs,
-				le32_to_cpu(a->length) - mp_ofs, rl,
-				lowest_vcn, -1, &stop_vcn);
+		/*
+		 * Generate the mapping pairs directly into the attribute,
+		 * leaving the unchanged mapping pairs, if any, in place.
+		 */
+		err = ntfs_mapping_pairs_build_ext(vol, (s8*)a + mp_ofs +
+				mp_skip, le32_to_cpu(a->length) - mp_ofs -
+				mp_skip, rl, mp_vcn, -1, mp_lcn, &stop_vcn);
 		if (err && err != ENOSPC) {
 			if (start < 0 || start >= alloc_size)
 				ntfs_error(vol->mp, "Cannot extend allocation "
@@ -6967,6 +7612,10 @@ skip_mpa_build:
 		 * of space available.
 		 */
 		lowest_vcn = stop_vcn;
+		/* The new extent starts with a fresh mapping pairs array. */
+		mp_vcn = lowest_vcn;
+		mp_lcn = 0;
+		mp_skip = 0;
 		/*
 		 * Calculate the offset into the new attribute at which the
 		 * mapping pairs array begins.  The mapping pairs array is
@@ -7320,9 +7969,10 @@ update_sizes:
 	}
 	/*
 	 * If we created a hole and the attribute is not marked as sparse, mark
-	 * it as sparse now.
+	 * it as sparse now.  Compressed attributes can contain holes without
+	 * being sparse.
 	 */
-	if (is_sparse && !NInoSparse(ni)) {
+	if (is_sparse && !NInoSparse(ni) && !NInoCompressed(ni)) {
 		err = ntfs_attr_sparse_set(base_ni, ni, actx);
 		if (err) {
 			ntfs_error(vol->mp, "Failed to set the attribute to "
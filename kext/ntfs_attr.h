@@ -58,6 +58,13 @@ __attribute__((visibility("hidden"))) extern ntfschar AT_UNNAMED[1];
 
 __private_extern__ errno_t ntfs_attr_map_runlist(ntfs_inode *ni);
 
+__private_extern__ void ntfs_attr_pack_runlist(ntfs_inode *ni);
+
+__private_extern__ errno_t ntfs_attr_get_rl_stats(ntfs_inode *ni,
+		ntfs_rl_stats *stats);
+__private_extern__ errno_t ntfs_attr_seek_hole_data(ntfs_inode *ni,
+		s64 *ofs, const BOOL hole);
+
 __private_extern__ errno_t ntfs_map_runlist_nolock(ntfs_inode *ni, VCN vcn,
 		ntfs_attr_search_ctx *ctx);
 
@@ -222,9 +229,15 @@ __private_extern__ errno_t ntfs_attr_set_initialized_size(ntfs_inode *ni,
 __private_extern__ errno_t ntfs_attr_extend_initialized(ntfs_inode *ni,
 		const s64 new_init_size);
 
+__private_extern__ errno_t ntfs_attr_cb_resize(ntfs_inode *ni, const VCN vcn,
+		const s64 nr_clusters, s64 *nr_real);
+
 __private_extern__ errno_t ntfs_attr_instantiate_holes(ntfs_inode *ni,
 		s64 start, s64 end, s64 *new_end, BOOL atomic);
 
+__private_extern__ errno_t ntfs_attr_punch_hole(ntfs_inode *ni, s64 start,
+		s64 end);
+
 __private_extern__ errno_t ntfs_attr_extend_allocation(ntfs_inode *ni,
 		s64 new_alloc_size, const s64 new_data_size,
 		const s64 data_start, ntfs_index_context *ictx,
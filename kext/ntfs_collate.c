@@ -122,11 +122,29 @@ static int ntfs_collate_filename(ntfs_volume *vol,
 	return rc;
 }
 
+/**
+ * ntfs_collate_u32 - collate two little endian 32-bit values
+ */
+static inline int ntfs_collate_u32(const le32 l1, const le32 l2)
+{
+	const u32 u1 = le32_to_cpu(l1);
+	const u32 u2 = le32_to_cpu(l2);
+
+	if (u1 > u2)
+		return 1;
+	if (u1 < u2)
+		return -1;
+	return 0;
+}
+
 /**
  * ntfs_collate_ntofs_ulongs - le32 by le32 collation
  *
- * Used for COLLATION_NTOFS_ULONG, COLLATION_NTOFS_ULONGS, and
- * COLLATION_NTOFS_SECURITY_HASH.
+ * Used for COLLATION_NTOFS_ULONGS and as the fallback for keys of unexpected
+ * length for COLLATION_NTOFS_ULONG and COLLATION_NTOFS_SECURITY_HASH.
+ *
+ * Keys which are a GUID, i.e. the keys of the $O index of $ObjId, are compared
+ * without a loop.
  */
 static int ntfs_collate_ntofs_ulongs(ntfs_volume *vol __attribute__((unused)),
 		const void *data1, const int data1_len,
@@ -141,21 +159,21 @@ static int ntfs_collate_ntofs_ulongs(ntfs_volume *vol __attribute__((unused)),
 		panic("%s(): data1_len & (sizeof(u32) - 1)\n", __FUNCTION__);
 	if (data2_len & (sizeof(u32) - 1))
 		panic("%s(): data2_len & (sizeof(u32) - 1)\n", __FUNCTION__);
+	if (data1_len == sizeof(GUID) && data2_len == sizeof(GUID)) {
+		if (!(rc = ntfs_collate_u32(p1[0], p2[0])) &&
+				!(rc = ntfs_collate_u32(p1[1], p2[1])) &&
+				!(rc = ntfs_collate_u32(p1[2], p2[2])))
+			rc = ntfs_collate_u32(p1[3], p2[3]);
+		goto out;
+	}
 	min_len = data1_len;
 	if (min_len > data2_len)
 		min_len = data2_len;
 	min_len >>= 2;
 	for (i = 0; i < min_len; i++) {
-		const u32 u1 = le32_to_cpu(p1[i]);
-		const u32 u2 = le32_to_cpu(p2[i]);
-		if (u1 > u2) {
-			rc = 1;
+		rc = ntfs_collate_u32(p1[i], p2[i]);
+		if (rc)
 			goto out;
-		}
-		if (u1 < u2) {
-			rc = -1;
-			goto out;
-		}
 	}
 	rc = 1;
 	if (data1_len < data2_len)
@@ -167,8 +185,45 @@ out:
 	return rc;
 }
 
-typedef int (*ntfs_collate_func_t)(ntfs_volume *, const void *, const int,
-		const void *, const int);
+/**
+ * ntfs_collate_ntofs_ulong - single le32 collation
+ *
+ * Used for COLLATION_NTOFS_ULONG, i.e. the $SII index of $Secure which is keyed
+ * by the security id and the $Q index of $Quota which is keyed by the owner id.
+ */
+static int ntfs_collate_ntofs_ulong(ntfs_volume *vol,
+		const void *data1, const int data1_len,
+		const void *data2, const int data2_len)
+{
+	if (data1_len != sizeof(le32) || data2_len != sizeof(le32))
+		return ntfs_collate_ntofs_ulongs(vol, data1, data1_len, data2,
+				data2_len);
+	return ntfs_collate_u32(*(const le32*)data1, *(const le32*)data2);
+}
+
+/**
+ * ntfs_collate_ntofs_security_hash - security hash and id collation
+ *
+ * Used for COLLATION_NTOFS_SECURITY_HASH, i.e. the $SDH index of $Secure which
+ * is keyed by the hash of the security descriptor followed by the security id.
+ */
+static int ntfs_collate_ntofs_security_hash(ntfs_volume *vol,
+		const void *data1, const int data1_len,
+		const void *data2, const int data2_len)
+{
+	const SDH_INDEX_KEY *k1 = data1;
+	const SDH_INDEX_KEY *k2 = data2;
+	int rc;
+
+	if (data1_len != sizeof(SDH_INDEX_KEY) ||
+			data2_len != sizeof(SDH_INDEX_KEY))
+		return ntfs_collate_ntofs_ulongs(vol, data1, data1_len, data2,
+				data2_len);
+	rc = ntfs_collate_u32(k1->hash, k2->hash);
+	if (!rc)
+		rc = ntfs_collate_u32(k1->security_id, k2->security_id);
+	return rc;
+}
 
 static ntfs_collate_func_t ntfs_do_collate0x0[3] = {
 	ntfs_collate_binary,		/* COLLATION_BINARY */
@@ -177,12 +232,38 @@ static ntfs_collate_func_t ntfs_do_collate0x0[3] = {
 };
 
 static ntfs_collate_func_t ntfs_do_collate0x1[4] = {
-	ntfs_collate_ntofs_ulongs,	/* COLLATION_NTOFS_ULONG */
+	ntfs_collate_ntofs_ulong,	/* COLLATION_NTOFS_ULONG */
 	ntfs_collate_binary,		/* COLLATION_NTOFS_SID */
-	ntfs_collate_ntofs_ulongs,	/* COLLATION_NTOFS_SECURITY_HASH */
+	ntfs_collate_ntofs_security_hash, /* COLLATION_NTOFS_SECURITY_HASH */
 	ntfs_collate_ntofs_ulongs,	/* COLLATION_NTOFS_ULONGS */
 };
 
+/**
+ * ntfs_collate_func_get - get the collation function for a collation rule
+ * @cr:		collation rule for which to get the collation function
+ *
+ * Return the function implementing the collation rule @cr so that callers
+ * collating many items with the same rule, e.g. an index lookup, can resolve
+ * the rule once and then call the function directly.
+ *
+ * Return NULL if the collation rule @cr is not supported.
+ */
+ntfs_collate_func_t ntfs_collate_func_get(COLLATION_RULE cr)
+{
+	int i;
+
+	/*
+	 * TODO: At the moment we do not support COLLATION_UNICODE_STRING so
+	 * we return NULL for it.
+	 */
+	if (!ntfs_is_collation_rule_supported(cr))
+		return NULL;
+	i = le32_to_cpu(cr);
+	if (i <= 0x02)
+		return ntfs_do_collate0x0[i];
+	return ntfs_do_collate0x1[i - 0x10];
+}
+
 /**
  * ntfs_collate - collate two data items using a specified collation rule
  * @vol:	ntfs volume to which the data items belong
@@ -197,33 +278,21 @@ static ntfs_collate_func_t ntfs_do_collate0x1[4] = {
  * to match, or to collate after @data2.
  *
  * For speed we use the collation rule @cr as an index into two tables of
- * function pointers to call the appropriate collation function.
+ * function pointers to call the appropriate collation function.  Callers
+ * collating many items with the same collation rule should use
+ * ntfs_collate_func_get() instead.
  */
 int ntfs_collate(ntfs_volume *vol, COLLATION_RULE cr,
 		const void *data1, const int data1_len,
 		const void *data2, const int data2_len) {
-	int i;
+	ntfs_collate_func_t collate;
 
-	i = le32_to_cpu(cr);
 	ntfs_debug("Entering (collation rule 0x%x, data1_len 0x%x, data2_len "
-			"0x%x).", i, data1_len, data2_len);
-	/*
-	 * TODO: At the moment we do not support COLLATION_UNICODE_STRING so we
-	 * BUG() for it.
-	 */
-	if (cr == COLLATION_UNICODE_STRING)
-		panic("%s(): cr == COLLATION_UNICODE_STRING\n", __FUNCTION__);
-	if (i < 0)
-		panic("%s(): i < 0\n", __FUNCTION__);
-	if (i <= 0x02)
-		return ntfs_do_collate0x0[i](vol, data1, data1_len,
-				data2, data2_len);
-	if (i < 0x10)
-		panic("%s(): i < 0x10\n", __FUNCTION__);
-	i -= 0x10;
-	if (i <= 3)
-		return ntfs_do_collate0x1[i](vol, data1, data1_len,
-				data2, data2_len);
-	panic("%s(): i > 3\n", __FUNCTION__);
-	return 0;
+			"0x%x).", (unsigned)le32_to_cpu(cr), data1_len,
+			data2_len);
+	collate = ntfs_collate_func_get(cr);
+	if (!collate)
+		panic("%s(): Unsupported collation rule 0x%x.\n",
+				__FUNCTION__, (unsigned)le32_to_cpu(cr));
+	return collate(vol, data1, data1_len, data2, data2_len);
 }
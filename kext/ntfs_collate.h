@@ -58,6 +58,11 @@ static inline BOOL ntfs_is_collation_rule_supported(COLLATION_RULE cr) {
 	return FALSE;
 }
 
+typedef int (*ntfs_collate_func_t)(ntfs_volume *, const void *, const int,
+		const void *, const int);
+
+__private_extern__ ntfs_collate_func_t ntfs_collate_func_get(COLLATION_RULE cr);
+
 __private_extern__ int ntfs_collate(ntfs_volume *vol, COLLATION_RULE cr,
 		const void *data1, const int data1_len,
 		const void *data2, const int data2_len);
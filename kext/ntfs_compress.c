@@ -36,6 +36,7 @@
  */
 
 #include <sys/errno.h>
+#include <sys/param.h>
 #include <sys/ucred.h>
 #include <sys/ubc.h>
 #include <sys/uio.h>
@@ -48,7 +49,10 @@
 
 #include <string.h>
 
+#include <libkern/OSAtomic.h>
+
 #include <kern/debug.h>
+#include <kern/thread_call.h>
 //#include <kern/locks.h>
 #include "al_lock.h"
 
@@ -57,6 +61,7 @@
 #include "ntfs_compress.h"
 #include "ntfs_debug.h"
 #include "ntfs_inode.h"
+#include "ntfs_lznt1.h"
 #include "ntfs_runlist.h"
 #include "ntfs_types.h"
 #include "ntfs_volume.h"
@@ -70,15 +75,25 @@ enum {
 	NTFS_CB_COMPRESSED	= -2,
 	NTFS_CB_UNCOMPRESSED	= -3,
 
-	/* Compression sub-block (sb) constants. */
-	NTFS_SB_SIZE_MASK	= 0x0fff,
-	NTFS_SB_SIZE		= 0x1000,
-	NTFS_SB_IS_COMPRESSED	= 0x8000,
+	/* Maximum number of clusters in a compression block. */
+	NTFS_MAX_CB_CLUSTERS	= 1 << NTFS_COMPRESSION_UNIT,
+
+	/*
+	 * Number of workers decompressing compression blocks in parallel and
+	 * maximum number of compression blocks read and decompressed at once.
+	 */
+	NTFS_DECOMPRESS_WORKERS	= 4,
+	NTFS_DECOMPRESS_MAX_CBS	= 8,
+
+	/*
+	 * Minimum and maximum number of compression blocks read ahead at once
+	 * by ntfs_compressed_ra().
+	 */
+	NTFS_CB_RA_MIN		= 2,
+	NTFS_CB_RA_MAX		= 32,
 
-	/* Token types and access mask. */
-	NTFS_SYMBOL_TOKEN	= 0,
-	NTFS_PHRASE_TOKEN	= 1,
-	NTFS_TOKEN_MASK		= 1,
+	/* Number of decompressed compression blocks kept in the cache. */
+	NTFS_CB_CACHE_ENTRIES	= 16,
 };
 
 /**
@@ -320,13 +335,13 @@ done:
  *	p_shift--;
  * }
  *
- * The above is the conventional algorithm.  As an optimization we actually use
- * a different algorithm as this offers O(1) performance instead of O(n) of the
- * above conventional algorithm.  Our optimized algorithm first calculates
- * log2(current destination position in sb) and then uses that to derive p and
- * l without having to iterate.  We just need an arch-optimized log2() function
- * now to make it really fast as we for now still have a small loop which we
- * need to determine the log2().  See the below code for details.
+ * The above is the conventional algorithm.  As an optimization we do not run
+ * it for each pt.  There are only nine possible combinations of l_mask and
+ * p_shift, indexed by log2(current destination position in sb), so we look
+ * them up in the ntfs_lznt1_split[] table together with the position up to
+ * which each one applies.  ntfs_decompress_sb() only moves on to the next
+ * table entry when the destination position crosses that end thus there is no
+ * log2() to compute at all.  See the below code for details.
  *
  * Note, that as usual in NTFS, the sb header, as well as each pt, are stored
  * in little endian format.
@@ -349,9 +364,6 @@ static inline errno_t ntfs_decompress(ntfs_volume *vol, u8 *dst_start,
 	u8 *dst_end;		/* End of destination buffer. */
 	u8 *dst_sb_start;	/* Start of current sub-block in destination. */
 	u8 *dst_sb_end;		/* End of current sub-block in destination. */
-	/* Variables for tag and token parsing. */
-	u8 tag;			/* Current tag. */
-	unsigned token;		/* Loop counter for the eight tokens in tag. */
 	unsigned skip_sbs;
 	BOOL skip_valid_pages;
 
@@ -462,108 +474,475 @@ next_sb:
 	/* This sb is compressed, decompress it into the destination buffer. */
 	ntfs_debug("Found compressed sub-block.");
 	/* Forward to the first tag in the sub-block. */
-	cb += 2;
-next_tag:
-	if (cb == cb_sb_end) {
-		/* Check if the decompressed sub-block was not full-length. */
-		if (dst < dst_sb_end) {
-			ntfs_debug("Filling incomplete sub-block with "
-					"zeroes.");
-			/* Zero remainder and update destination position. */
-			bzero(dst, dst_sb_end - dst);
-			dst = dst_sb_end;
-		}
-		/* We have finished the current sub-block. */
-		goto next_sb;
-	}
-	/* Check we are still in range. */
-	if (cb > cb_sb_end || dst > dst_sb_end)
+	dst = ntfs_decompress_sb(cb + 2, cb_sb_end, dst_sb_start);
+	if (!dst)
 		goto err;
-	/* Get the next tag and advance to first token. */
-	tag = *cb++;
-	/* Parse the eight tokens described by the tag. */
-	for (token = 0; token < 8; token++, tag >>= 1) {
-		unsigned lg, u, pt, length, max_non_overlap;
-		u8 *dst_back_addr;
-
-		/* Check if we are done / still in range. */
-		if (cb >= cb_sb_end || dst > dst_sb_end)
-			break;
-		/* Determine token type and parse appropriately.*/
-		if ((tag & NTFS_TOKEN_MASK) == NTFS_SYMBOL_TOKEN) {
-			/*
-			 * We have a symbol token, copy the symbol across, and
-			 * advance the source and destination positions.
-			 */
-			*dst++ = *cb++;
-			/* Continue with the next token. */
-			continue;
-		}
-		/*
-		 * We have a phrase token.  Make sure it is not the first tag
-		 * in the sub-block as this is illegal and would confuse the
-		 * code below.
-		 */
-		if (dst == dst_sb_start)
-			goto err;
-		/*
-		 * Determine the number of bytes to go back (p) and the number
-		 * of bytes to copy (l).  We use an optimized algorithm in
-		 * which we first calculate log2(current destination position
-		 * in sb), which allows determination of l and p in O(1) rather
-		 * than O(n).  We just need an arch-optimized log2() function
-		 * now.
-		 */
-		lg = 0;
-		for (u = dst - dst_sb_start - 1; u >= 0x10; u >>= 1)
-			lg++;
-		/* Get the phrase token. */
-		pt = le16_to_cpup((u16*)cb);
-		/*
-		 * Calculate starting position of the byte sequence in the
-		 * destination using the fact that p = (pt >> (12 - lg)) + 1
-		 * and make sure we do not go too far back.
-		 */
-		dst_back_addr = dst - (pt >> (12 - lg)) - 1;
-		if (dst_back_addr < dst_sb_start)
-			goto err;
-		/* Now calculate the length (l) of the byte sequence. */
-		length = (pt & (0xfff >> lg)) + 3;
-		/* Verify destination is in range. */
-		if (dst + length > dst_sb_end)
-			goto err;
-		/* The number of non-overlapping bytes. */
-		max_non_overlap = dst - dst_back_addr;
-		if (length <= max_non_overlap) {
-			/* The byte sequence does not overlap, just copy it. */
-			memcpy(dst, dst_back_addr, length);
-			/* Advance destination pointer. */
-			dst += length;
-		} else {
-			/*
-			 * The byte sequence does overlap, copy non-overlapping
-			 * part and then do a slow byte by byte copy for the
-			 * overlapping part.  Also, advance the destination
-			 * pointer.
-			 */
-			memcpy(dst, dst_back_addr, max_non_overlap);
-			dst += max_non_overlap;
-			dst_back_addr += max_non_overlap;
-			length -= max_non_overlap;
-			while (length--)
-				*dst++ = *dst_back_addr++;
-		}
-		/* Advance source position and continue with the next token. */
-		cb += 2;
+	/* Check if the decompressed sub-block was not full-length. */
+	if (dst < dst_sb_end) {
+		ntfs_debug("Filling incomplete sub-block with zeroes.");
+		/* Zero remainder and update destination position. */
+		bzero(dst, dst_sb_end - dst);
 	}
-	/* No tokens left in the current tag.  Continue with the next tag. */
-	goto next_tag;
+	/* We have finished the current sub-block. */
+	cb = cb_sb_end;
+	dst = dst_sb_end;
+	goto next_sb;
 err:
 	ntfs_error(vol->mp, "Compressed data is corrupt.  Run chkdsk.");
 	NVolSetErrors(vol);
 	return EOVERFLOW;
 }
 
+/**
+ * ntfs_decompress_job - a compression block to be decompressed by a worker
+ * @batch:		the batch of compression blocks this job belongs to
+ * @vol:		ntfs volume the compression block belongs to
+ * @dst:		destination buffer for the decompressed data
+ * @cb:			the compressed data of the compression block
+ * @cb_size:		size of the compression block in bytes
+ * @pl:			page list in which @dst resides (or NULL)
+ * @cur_pg:		index of the page in @pl at which @dst starts
+ * @pages_per_cb:	number of pages per compression block
+ */
+typedef struct ntfs_decompress_batch ntfs_decompress_batch;
+
+typedef struct {
+	ntfs_decompress_batch *batch;
+	ntfs_volume *vol;
+	u8 *dst;
+	u8 *cb;
+	int cb_size;
+	upl_page_info_t *pl;
+	int cur_pg;
+	int pages_per_cb;
+} ntfs_decompress_job;
+
+/**
+ * ntfs_decompress_batch - compression blocks being decompressed in parallel
+ * @lock:	protects @pending and @err
+ * @pending:	number of jobs handed to workers which have not completed yet
+ * @err:	first error returned by a job
+ * @jobs:	the jobs, one for each compression block in the batch
+ */
+struct ntfs_decompress_batch {
+	al_lck_mtx_t lock;
+	unsigned pending;
+	errno_t err;
+	ntfs_decompress_job jobs[NTFS_DECOMPRESS_MAX_CBS];
+};
+
+/*
+ * The pool of workers used by ntfs_decompress_parallel().  Each worker is a
+ * thread call which runs one job at a time.  @busy is a bitmap of the workers
+ * that are currently running a job and is protected by @lock.
+ */
+static struct {
+	al_lck_spin_t lock;
+	unsigned busy;
+	thread_call_t calls[NTFS_DECOMPRESS_WORKERS];
+} ntfs_decompress_pool;
+
+/**
+ * ntfs_decompress_worker_get - get an idle worker from the pool
+ *
+ * Return the index of an idle worker in the pool, which is marked busy, or -1
+ * if all workers are busy.
+ */
+static int ntfs_decompress_worker_get(void)
+{
+	int worker;
+
+	lck_spin_lock(&ntfs_decompress_pool.lock);
+	for (worker = 0; worker < NTFS_DECOMPRESS_WORKERS; worker++) {
+		if (!(ntfs_decompress_pool.busy & (1U << worker))) {
+			ntfs_decompress_pool.busy |= 1U << worker;
+			break;
+		}
+	}
+	lck_spin_unlock(&ntfs_decompress_pool.lock);
+	if (worker >= NTFS_DECOMPRESS_WORKERS)
+		return -1;
+	return worker;
+}
+
+/**
+ * ntfs_decompress_worker - decompress a compression block in a worker
+ * @worker:	index of the worker in the pool
+ * @arg:	the ntfs_decompress_job to run
+ *
+ * Decompress the compression block described by the job @arg, return the
+ * worker to the pool, and record the result in the batch of the job, waking
+ * up ntfs_decompress_parallel() if this was the last job in flight.
+ */
+static void ntfs_decompress_worker(thread_call_param_t worker,
+		thread_call_param_t arg)
+{
+	ntfs_decompress_job *job = arg;
+	ntfs_decompress_batch *batch = job->batch;
+	errno_t err;
+
+	err = ntfs_decompress(job->vol, job->dst, 0, job->cb_size, job->cb,
+			job->cb_size, job->pl, job->cur_pg, job->pages_per_cb);
+	lck_spin_lock(&ntfs_decompress_pool.lock);
+	ntfs_decompress_pool.busy &= ~(1U << (uintptr_t)worker);
+	lck_spin_unlock(&ntfs_decompress_pool.lock);
+	lck_mtx_lock(&batch->lock);
+	if (err && !batch->err)
+		batch->err = err;
+	if (!--batch->pending)
+		wakeup(batch);
+	lck_mtx_unlock(&batch->lock);
+}
+
+/**
+ * ntfs_decompress_pool_init - allocate the decompression workers
+ *
+ * Allocate the thread calls used as the workers of ntfs_decompress_parallel().
+ *
+ * Return 0 on success and ENOMEM if not enough memory is available.
+ */
+errno_t ntfs_decompress_pool_init(void)
+{
+	int worker;
+
+	lck_spin_init(&ntfs_decompress_pool.lock, ntfs_lock_grp,
+			ntfs_lock_attr);
+	ntfs_decompress_pool.busy = 0;
+	for (worker = 0; worker < NTFS_DECOMPRESS_WORKERS; worker++) {
+		ntfs_decompress_pool.calls[worker] =
+				thread_call_allocate_with_priority(
+				ntfs_decompress_worker,
+				(thread_call_param_t)(uintptr_t)worker,
+				THREAD_CALL_PRIORITY_KERNEL);
+		if (!ntfs_decompress_pool.calls[worker]) {
+			ntfs_error(NULL, "Failed to allocate decompression "
+					"worker.");
+			ntfs_decompress_pool_deinit();
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/**
+ * ntfs_decompress_pool_deinit - free the decompression workers
+ *
+ * Wait for any worker that is still finishing up and free the thread calls
+ * allocated by ntfs_decompress_pool_init().
+ */
+void ntfs_decompress_pool_deinit(void)
+{
+	int worker;
+
+	for (worker = 0; worker < NTFS_DECOMPRESS_WORKERS; worker++) {
+		thread_call_t call = ntfs_decompress_pool.calls[worker];
+
+		if (!call)
+			continue;
+		(void)thread_call_cancel_wait(call);
+		(void)thread_call_free(call);
+		ntfs_decompress_pool.calls[worker] = NULL;
+	}
+	lck_spin_destroy(&ntfs_decompress_pool.lock, ntfs_lock_grp);
+}
+
+/**
+ * ntfs_decompress_parallel - decompress several compression blocks in parallel
+ * @vol:		ntfs volume the compression blocks belong to
+ * @batch:		batch structure to use for the decompression
+ * @dst:		destination buffer for the decompressed data
+ * @cbs:		the compressed data of the compression blocks
+ * @cb_size:		size of a compression block in bytes
+ * @nr_cbs:		number of compression blocks to decompress
+ * @pl:			page list in which @dst resides (or NULL)
+ * @cur_pg:		index of the page in @pl at which @dst starts
+ * @pages_per_cb:	number of pages per compression block
+ *
+ * Decompress the @nr_cbs consecutive compression blocks in @cbs, each of which
+ * is @cb_size bytes in size, into the destination buffer @dst skipping any
+ * valid pages if a page list is present (see ntfs_decompress()).
+ *
+ * Each compression block is handed to an idle worker from the pool if there
+ * is one.  The compression blocks for which there is no idle worker are
+ * decompressed by the calling thread which then waits for the workers to
+ * complete.
+ *
+ * Return 0 on success and errno on error.
+ */
+static errno_t ntfs_decompress_parallel(ntfs_volume *vol,
+		ntfs_decompress_batch *batch, u8 *dst, u8 *cbs,
+		const int cb_size, const int nr_cbs, upl_page_info_t *pl,
+		const int cur_pg, const int pages_per_cb)
+{
+	ntfs_decompress_job *job;
+	int i, worker;
+	errno_t err, err2;
+
+	batch->pending = 0;
+	batch->err = 0;
+	for (i = 0; i < nr_cbs; i++) {
+		job = &batch->jobs[i];
+		job->batch = batch;
+		job->vol = vol;
+		job->dst = dst + i * cb_size;
+		job->cb = cbs + i * cb_size;
+		job->cb_size = cb_size;
+		job->pl = pl;
+		job->cur_pg = cur_pg + i * pages_per_cb;
+		job->pages_per_cb = pages_per_cb;
+	}
+	/* Hand the jobs to idle workers, starting with the last one. */
+	for (i = nr_cbs - 1; i > 0; i--) {
+		worker = ntfs_decompress_worker_get();
+		if (worker < 0)
+			break;
+		lck_mtx_lock(&batch->lock);
+		batch->pending++;
+		lck_mtx_unlock(&batch->lock);
+		(void)thread_call_enter1(ntfs_decompress_pool.calls[worker],
+				&batch->jobs[i]);
+	}
+	/* Decompress the remaining compression blocks ourselves. */
+	err = 0;
+	for (; i >= 0; i--) {
+		job = &batch->jobs[i];
+		err2 = ntfs_decompress(vol, job->dst, 0, cb_size, job->cb,
+				cb_size, pl, job->cur_pg, pages_per_cb);
+		if (err2 && !err)
+			err = err2;
+	}
+	/* Wait for the workers to complete. */
+	lck_mtx_lock(&batch->lock);
+	while (batch->pending)
+		(void)msleep(batch, &batch->lock, PRIBIO, __FUNCTION__, 0);
+	if (!err)
+		err = batch->err;
+	lck_mtx_unlock(&batch->lock);
+	return err;
+}
+
+/**
+ * ntfs_cb_cache_entry - a decompressed compression block in the cache
+ * @ni:		non-raw ntfs inode the compression block belongs to or NULL if
+ *		the entry is unused
+ * @ofs:	byte offset of the start of the compression block
+ * @data:	the decompressed data of the compression block
+ * @size:	size of @data in bytes, i.e. the compression block size
+ * @stamp:	value of the cache clock when the entry was last used
+ */
+typedef struct {
+	ntfs_inode *ni;
+	s64 ofs;
+	u8 *data;
+	int size;
+	u64 stamp;
+} ntfs_cb_cache_entry;
+
+/*
+ * The cache of recently decompressed compression blocks used by
+ * ntfs_read_compressed() for reads which only need part of a compression
+ * block, for example because some of its pages are already in the page cache
+ * of the uncompressed inode.  Without the cache such reads would read and
+ * decompress the whole compression block each time.
+ *
+ * The cache is small and is shared by all volumes.  The least recently used
+ * entry is reused when a compression block is inserted.  The entries are
+ * protected by @lock and @clock is incremented each time an entry is used.
+ *
+ * Entries are keyed by the non-raw inode and the offset of the compression
+ * block.  The cached data cannot become stale as ntfs_write_compressed(),
+ * which is the only place where compressed data is written, invalidates the
+ * compression blocks it writes and holds the inode lock for writing which
+ * excludes any concurrent ntfs_read_compressed().  The entries of an inode
+ * are invalidated before the inode is freed.
+ */
+static struct {
+	al_lck_mtx_t lock;
+	u64 clock;
+	ntfs_cb_cache_entry entries[NTFS_CB_CACHE_ENTRIES];
+} ntfs_cb_cache;
+
+ntfs_cb_cache_stats ntfs_cb_cstats;
+
+/**
+ * ntfs_cb_cache_init - initialize the cache of decompressed compression blocks
+ */
+void ntfs_cb_cache_init(void)
+{
+	lck_mtx_init(&ntfs_cb_cache.lock, ntfs_lock_grp, ntfs_lock_attr);
+	ntfs_cb_cache.clock = 0;
+	bzero(ntfs_cb_cache.entries, sizeof(ntfs_cb_cache.entries));
+}
+
+/**
+ * ntfs_cb_cache_deinit - free the cache of decompressed compression blocks
+ *
+ * Free the buffers of all cache entries.  All inodes must have been freed so
+ * no entry is in use.
+ */
+void ntfs_cb_cache_deinit(void)
+{
+	int i;
+
+	for (i = 0; i < NTFS_CB_CACHE_ENTRIES; i++) {
+		ntfs_cb_cache_entry *e = &ntfs_cb_cache.entries[i];
+
+		if (e->data)
+			IOFreeData(e->data, e->size);
+		e->data = NULL;
+	}
+	lck_mtx_destroy(&ntfs_cb_cache.lock, ntfs_lock_grp);
+}
+
+/**
+ * ntfs_cb_copy - copy decompressed data into a destination buffer
+ * @dst:		destination buffer
+ * @src:		decompressed data to copy
+ * @size:		number of bytes to copy
+ * @pl:			page list in which @dst resides (or NULL)
+ * @cur_pg:		index of the page in @pl at which @dst starts
+ * @pages_per_cb:	number of pages per compression block
+ *
+ * Copy @size bytes from @src to @dst skipping any valid pages if a page list
+ * is present, in the same way as ntfs_decompress() does.
+ */
+static void ntfs_cb_copy(u8 *dst, const u8 *src, const int size,
+		upl_page_info_t *pl, int cur_pg, const int pages_per_cb)
+{
+	int ofs;
+
+	if (!pl || pages_per_cb <= 1) {
+		memcpy(dst, src, size);
+		return;
+	}
+	for (ofs = 0; ofs < size; ofs += PAGE_SIZE, cur_pg++) {
+		if (!upl_valid_page(pl, cur_pg))
+			memcpy(dst + ofs, src + ofs, PAGE_SIZE);
+	}
+}
+
+/**
+ * ntfs_cb_cache_lookup - look up a compression block in the cache
+ * @ni:			non-raw ntfs inode the compression block belongs to
+ * @cb_ofs:		byte offset of the start of the compression block
+ * @dst:		destination buffer for the decompressed data
+ * @dst_ofs_in_cb:	offset into the compression block at which @dst starts
+ * @size:		number of bytes to return in @dst
+ * @pl:			page list in which @dst resides (or NULL)
+ * @cur_pg:		index of the page in @pl at which @dst starts
+ * @pages_per_cb:	number of pages per compression block
+ *
+ * Look up the compression block starting at @cb_ofs in the inode @ni in the
+ * cache and if it is present copy @size bytes of it starting at offset
+ * @dst_ofs_in_cb into @dst, skipping any valid pages if a page list is
+ * present.
+ *
+ * Return TRUE if the compression block was found and FALSE otherwise.
+ */
+static BOOL ntfs_cb_cache_lookup(ntfs_inode *ni, const s64 cb_ofs, u8 *dst,
+		const int dst_ofs_in_cb, const int size, upl_page_info_t *pl,
+		const int cur_pg, const int pages_per_cb)
+{
+	int i;
+
+	lck_mtx_lock(&ntfs_cb_cache.lock);
+	for (i = 0; i < NTFS_CB_CACHE_ENTRIES; i++) {
+		ntfs_cb_cache_entry *e = &ntfs_cb_cache.entries[i];
+
+		if (e->ni != ni || e->ofs != cb_ofs)
+			continue;
+		ntfs_cb_copy(dst, e->data + dst_ofs_in_cb, size, pl, cur_pg,
+				pages_per_cb);
+		e->stamp = ++ntfs_cb_cache.clock;
+		lck_mtx_unlock(&ntfs_cb_cache.lock);
+		OSIncrementAtomic64(&ntfs_cb_cstats.hits);
+		return TRUE;
+	}
+	lck_mtx_unlock(&ntfs_cb_cache.lock);
+	OSIncrementAtomic64(&ntfs_cb_cstats.misses);
+	return FALSE;
+}
+
+/**
+ * ntfs_cb_cache_insert - insert a decompressed compression block into the cache
+ * @ni:		non-raw ntfs inode the compression block belongs to
+ * @cb_ofs:	byte offset of the start of the compression block
+ * @data:	pointer to the buffer containing the decompressed data
+ * @size:	size of the compression block in bytes
+ *
+ * Insert the decompressed compression block in the buffer *@data into the
+ * cache, reusing the least recently used entry.  To avoid copying the data the
+ * cache takes over the buffer and *@data is set to the buffer of the reused
+ * entry or to NULL if the entry did not have a buffer of the right size.
+ */
+static void ntfs_cb_cache_insert(ntfs_inode *ni, const s64 cb_ofs, u8 **data,
+		const int size)
+{
+	ntfs_cb_cache_entry *e, *lru;
+	u8 *old;
+	int i;
+
+	lru = NULL;
+	lck_mtx_lock(&ntfs_cb_cache.lock);
+	for (i = 0; i < NTFS_CB_CACHE_ENTRIES; i++) {
+		e = &ntfs_cb_cache.entries[i];
+		/* Someone else may have inserted it in the mean time. */
+		if (e->ni == ni && e->ofs == cb_ofs) {
+			lru = e;
+			break;
+		}
+		if (!e->ni) {
+			if (!lru || lru->ni)
+				lru = e;
+		} else if (!lru || (lru->ni && e->stamp < lru->stamp))
+			lru = e;
+	}
+	e = lru;
+	if (e->ni && (e->ni != ni || e->ofs != cb_ofs))
+		OSIncrementAtomic64(&ntfs_cb_cstats.evictions);
+	old = e->data;
+	if (old && e->size != size) {
+		IOFreeData(old, e->size);
+		old = NULL;
+	}
+	e->ni = ni;
+	e->ofs = cb_ofs;
+	e->data = *data;
+	e->size = size;
+	e->stamp = ++ntfs_cb_cache.clock;
+	lck_mtx_unlock(&ntfs_cb_cache.lock);
+	*data = old;
+	OSIncrementAtomic64(&ntfs_cb_cstats.inserts);
+}
+
+/**
+ * ntfs_cb_cache_invalidate - invalidate cached compression blocks of an inode
+ * @ni:		non-raw ntfs inode whose compression blocks to invalidate
+ * @start:	byte offset of the start of the range to invalidate
+ * @end:	byte offset of the end of the range to invalidate
+ *
+ * Invalidate all cached compression blocks of the inode @ni which overlap the
+ * byte range @start to @end.  To invalidate all compression blocks of the
+ * inode use a @start of zero and an @end of NTFS_MAX_ATTRIBUTE_SIZE.
+ *
+ * The buffers of the invalidated entries are kept for reuse.
+ */
+void ntfs_cb_cache_invalidate(ntfs_inode *ni, const s64 start, const s64 end)
+{
+	int i;
+
+	lck_mtx_lock(&ntfs_cb_cache.lock);
+	for (i = 0; i < NTFS_CB_CACHE_ENTRIES; i++) {
+		ntfs_cb_cache_entry *e = &ntfs_cb_cache.entries[i];
+
+		if (e->ni != ni || e->ofs >= end || e->ofs + e->size <= start)
+			continue;
+		e->ni = NULL;
+		OSIncrementAtomic64(&ntfs_cb_cstats.invalidations);
+	}
+	lck_mtx_unlock(&ntfs_cb_cache.lock);
+}
+
 /**
  * ntfs_read_compressed - read and decompress data from a compressed attribute
  * @ni:			non-raw ntfs inode to which the raw inode belongs
@@ -594,6 +973,13 @@ err:
  * bytes have been decompressed (usually this will be the end of the
  * compression block).
  *
+ * If only part of a compressed compression block is needed, because the read
+ * does not cover the whole compression block or because some of its pages are
+ * valid, the compression block is instead decompressed in full into a separate
+ * buffer and inserted into the cache of decompressed compression blocks so
+ * that subsequent partial reads of the same compression block can be satisfied
+ * from the cache without reading and decompressing it again.
+ *
  * Return 0 on success and errno on error.
  */
 errno_t ntfs_read_compressed(ntfs_inode *ni, ntfs_inode *raw_ni, s64 ofs_start,
@@ -601,10 +987,12 @@ errno_t ntfs_read_compressed(ntfs_inode *ni, ntfs_inode *raw_ni, s64 ofs_start,
 {
 	s64 ofs, init_size, raw_size, size;
 	ntfs_volume *vol = ni->vol;
-	u8 *dst, *cb;
+	u8 *dst, *cb, *cbs, *ucb;
+	ntfs_decompress_batch *batch;
 	uio_t uio;
 	int err, io_count, pages_per_cb, cb_size, cur_pg, cur_pg_ofs, last_pg;
-	int cb_type, zero_end_ofs, dst_ofs_in_cb;
+	int cb_type, zero_end_ofs, dst_ofs_in_cb, nr_cbs;
+	BOOL partial;
 
 	ntfs_debug("Entering for compressed file inode 0x%llx, offset 0x%llx, "
 			"count 0x%x, ioflags 0x%x.",
@@ -612,7 +1000,8 @@ errno_t ntfs_read_compressed(ntfs_inode *ni, ntfs_inode *raw_ni, s64 ofs_start,
 			(unsigned long long)ofs_start, count, ioflags);
 	ofs = ofs_start;
 	dst = dst_start;
-	cb = NULL;
+	cb = cbs = ucb = NULL;
+	batch = NULL;
 	uio = NULL;
 	zero_end_ofs = last_pg = cur_pg_ofs = cur_pg = 0;
 	/*
@@ -822,6 +1211,87 @@ do_next_cb:
 	 * our temporary buffer, allocating it if we have not done so yet.
 	 */
 	ntfs_debug("Found compressed compression block.");
+	/*
+	 * If the request covers the following compression blocks completely
+	 * and they are compressed, too, read them all with a single i/o and
+	 * decompress them in parallel.
+	 */
+	nr_cbs = 1;
+	if (!dst_ofs_in_cb && (!pl || pages_per_cb > 1)) {
+		while (nr_cbs < NTFS_DECOMPRESS_MAX_CBS &&
+				count >= (nr_cbs + 1) * cb_size) {
+			if (ntfs_get_cb_type(raw_ni, ofs + nr_cbs * cb_size) !=
+					NTFS_CB_COMPRESSED)
+				break;
+			nr_cbs++;
+		}
+	}
+	if (nr_cbs > 1 && !batch) {
+		batch = IOMallocType(ntfs_decompress_batch);
+		cbs = IOMallocData(NTFS_DECOMPRESS_MAX_CBS * cb_size);
+		if (!batch || !cbs) {
+			/* Not fatal, just decompress one at a time. */
+			ntfs_debug("Not enough memory to decompress "
+					"compression blocks in parallel.");
+			if (batch) {
+				IOFreeType(batch, ntfs_decompress_batch);
+				batch = NULL;
+			}
+			if (cbs) {
+				IOFreeData(cbs, NTFS_DECOMPRESS_MAX_CBS *
+						cb_size);
+				cbs = NULL;
+			}
+		} else
+			lck_mtx_init(&batch->lock, ntfs_lock_grp,
+					ntfs_lock_attr);
+	}
+	if (nr_cbs > 1 && batch) {
+		ntfs_debug("Decompressing %d compression blocks in parallel.",
+				nr_cbs);
+		io_count = nr_cbs * cb_size;
+		uio_reset(uio, ofs, UIO_SYSSPACE32, UIO_READ);
+		err = uio_addiov(uio, CAST_USER_ADDR_T(cbs), io_count);
+		if (err)
+			panic("%s(): uio_addiov() failed.\n", __FUNCTION__);
+		err = cluster_read(raw_ni->vn, uio, raw_size, ioflags);
+		if (err || uio_resid(uio))
+			goto cl_err;
+		err = ntfs_decompress_parallel(vol, batch, dst, cbs, cb_size,
+				nr_cbs, pl, cur_pg, pages_per_cb);
+		if (err) {
+			ntfs_error(vol->mp, "Failed to decompress data (error "
+					"%d).", err);
+			goto err;
+		}
+		/* pl_next_cb advances the page index by one cb. */
+		if (pl)
+			cur_pg += (nr_cbs - 1) * pages_per_cb;
+		goto pl_next_cb;
+	}
+	/*
+	 * If only part of the compression block is needed, try to get it from
+	 * the cache of decompressed compression blocks.
+	 */
+	partial = (dst_ofs_in_cb || io_count < cb_size);
+	if (!partial && pl && pages_per_cb > 1) {
+		int pg, stop_pg;
+
+		stop_pg = cur_pg + pages_per_cb;
+		if (stop_pg > last_pg)
+			stop_pg = last_pg;
+		for (pg = cur_pg; pg < stop_pg; pg++) {
+			if (upl_valid_page(pl, pg)) {
+				partial = TRUE;
+				break;
+			}
+		}
+	}
+	if (partial && ntfs_cb_cache_lookup(ni, ofs - dst_ofs_in_cb, dst,
+			dst_ofs_in_cb, io_count, pl, cur_pg, pages_per_cb)) {
+		ntfs_debug("Found compression block in cache.");
+		goto pl_next_cb;
+	}
 	if (!cb) {
 		cb = IOMallocData(cb_size);
 		if (!cb) {
@@ -848,6 +1318,30 @@ do_next_cb:
 	err = cluster_read(raw_ni->vn, uio, raw_size, ioflags);
 	if (err || uio_resid(uio))
 		goto cl_err;
+	/*
+	 * If only part of the compression block is needed, decompress all of
+	 * it into a separate buffer, copy the needed part into the destination
+	 * buffer, and insert the compression block into the cache.  If we
+	 * cannot allocate the buffer, just decompress the needed part.
+	 */
+	if (partial) {
+		if (!ucb)
+			ucb = IOMallocData(cb_size);
+		if (ucb) {
+			err = ntfs_decompress(vol, ucb, 0, cb_size, cb, cb_size,
+					NULL, 0, pages_per_cb);
+			if (err) {
+				ntfs_error(vol->mp, "Failed to decompress "
+						"data (error %d).", err);
+				goto err;
+			}
+			ntfs_cb_copy(dst, ucb + dst_ofs_in_cb, io_count, pl,
+					cur_pg, pages_per_cb);
+			ntfs_cb_cache_insert(ni, ofs - dst_ofs_in_cb, &ucb,
+					cb_size);
+			goto pl_next_cb;
+		}
+	}
 	/*
 	 * We now have the compressed data.  Decompress it into the destination
 	 * buffer skipping any valid pages if a page list is present.
@@ -891,6 +1385,13 @@ next_cb:
 		uio_free(uio);
 	if (cb)
 		IOFreeData(cb, cb_size);
+	if (ucb)
+		IOFreeData(ucb, cb_size);
+	if (batch) {
+		lck_mtx_destroy(&batch->lock, ntfs_lock_grp);
+		IOFreeType(batch, ntfs_decompress_batch);
+		IOFreeData(cbs, NTFS_DECOMPRESS_MAX_CBS * cb_size);
+	}
 	ntfs_debug("Done.");
 	return 0;
 cl_err:
@@ -910,6 +1411,844 @@ err:
 		uio_free(uio);
 	if (cb)
 		IOFreeData(cb, cb_size);
+	if (ucb)
+		IOFreeData(ucb, cb_size);
+	if (batch) {
+		lck_mtx_destroy(&batch->lock, ntfs_lock_grp);
+		IOFreeType(batch, ntfs_decompress_batch);
+		IOFreeData(cbs, NTFS_DECOMPRESS_MAX_CBS * cb_size);
+	}
 	ntfs_error(vol->mp, "Failed (error %d).", err);
 	return err;
 }
+
+/**
+ * ntfs_cb_ra_job - an asynchronous read-ahead of a compressed attribute
+ * @vn:		vnode of the compressed attribute to read ahead
+ * @ofs:	byte offset at which to start the read-ahead
+ * @count:	number of bytes to read ahead
+ *
+ * The job holds a usecount reference on @vn which is dropped once the job has
+ * run or has been cancelled by ntfs_cb_ra_cancel().
+ */
+typedef struct _ntfs_cb_ra_job {
+	vnode_t vn;
+	s64 ofs;
+	int count;
+} ntfs_cb_ra_job;
+
+/**
+ * ntfs_cb_ra_read - decompress a range of a compressed attribute into the cache
+ * @ni:		ntfs inode of the compressed attribute to read ahead
+ * @ofs:	byte offset at which to start, aligned to a compression block
+ * @count:	number of bytes to read ahead, a multiple of PAGE_SIZE
+ *
+ * Create and map a page list covering @count bytes starting at offset @ofs of
+ * the compressed attribute @ni, decompress the data into the pages that are
+ * not valid, and release the pages to the vm page cache.  Already valid pages
+ * are left untouched.
+ *
+ * Return 0 on success and errno on error.
+ *
+ * Locking: Caller must hold @ni->lock on the inode.
+ */
+static errno_t ntfs_cb_ra_read(ntfs_inode *ni, const s64 ofs, const int count)
+{
+	ntfs_inode *raw_ni;
+	upl_t upl;
+	upl_page_info_t *pl;
+	u8 *kaddr;
+	kern_return_t kerr;
+	int cur_pg, last_pg, flags;
+	errno_t err;
+
+	err = ntfs_raw_inode_get(ni, LCK_RW_TYPE_SHARED, &raw_ni);
+	if (err) {
+		ntfs_debug("Failed to get raw inode (error %d).", err);
+		return err;
+	}
+	kerr = ubc_create_upl(ni->vn, ofs, count, &upl, &pl, UPL_SET_LITE);
+	if (kerr != KERN_SUCCESS) {
+		ntfs_debug("Failed to get page list (error %d).", (int)kerr);
+		err = EIO;
+		goto err;
+	}
+	kerr = ubc_upl_map(upl, (vm_offset_t*)&kaddr);
+	if (kerr != KERN_SUCCESS) {
+		ntfs_debug("Failed to map page list (error %d).", (int)kerr);
+		err = EIO;
+	} else {
+		err = ntfs_read_compressed(ni, raw_ni, ofs, count, kaddr, pl,
+				0);
+		(void)ubc_upl_unmap(upl);
+	}
+	/*
+	 * Release the valid pages unmodified.  The pages we filled are
+	 * committed clean unless the decompression failed in which case they
+	 * are dumped.
+	 */
+	last_pg = count >> PAGE_SHIFT;
+	for (cur_pg = 0; cur_pg < last_pg; cur_pg++) {
+		if (upl_valid_page(pl, cur_pg) || err) {
+			flags = UPL_ABORT_FREE_ON_EMPTY;
+			if (!upl_valid_page(pl, cur_pg))
+				flags |= UPL_ABORT_DUMP_PAGES;
+			ubc_upl_abort_range(upl, cur_pg << PAGE_SHIFT,
+					PAGE_SIZE, flags);
+		} else
+			ubc_upl_commit_range(upl, cur_pg << PAGE_SHIFT,
+					PAGE_SIZE, UPL_COMMIT_CLEAR_DIRTY |
+					UPL_COMMIT_INACTIVATE |
+					UPL_COMMIT_FREE_ON_EMPTY);
+	}
+err:
+	lck_rw_unlock_shared(&raw_ni->lock);
+	(void)vnode_put(raw_ni->vn);
+	return err;
+}
+
+/**
+ * ntfs_cb_ra_worker - run an asynchronous read-ahead of a compressed attribute
+ * @unused:	unused
+ * @arg:	the ntfs_cb_ra_job describing the read-ahead
+ *
+ * Run the read-ahead described by @arg, mark the read-ahead state of the inode
+ * as idle again, and free the job.  The read-ahead is clipped to the end of
+ * the attribute as it may have been truncated after the job was queued.
+ *
+ * Nothing but the vnode stored in the job is touched until we have an iocount
+ * reference on it.  If that fails the vnode is being reclaimed and the inode
+ * and its read-ahead state may be gone already so we only drop our usecount
+ * reference and free the job.  Once we have the iocount reference the vnode
+ * cannot be reclaimed so the inode and its read-ahead state cannot go away
+ * whilst we use them.
+ *
+ * The usecount reference held on the vnode is dropped last as this may cause
+ * the inode to be reclaimed.
+ */
+static void ntfs_cb_ra_worker(thread_call_param_t unused __unused,
+		thread_call_param_t arg)
+{
+	ntfs_cb_ra_job *job = arg;
+	vnode_t vn = job->vn;
+	ntfs_inode *ni;
+	ntfs_cb_ra *ra;
+	s64 data_size;
+	errno_t err;
+
+	if (vnode_getwithref(vn)) {
+		ntfs_debug("Vnode is being reclaimed, dropping read-ahead.");
+		IOFreeType(job, ntfs_cb_ra_job);
+		vnode_rele(vn);
+		return;
+	}
+	ni = NTFS_I(vn);
+	ra = ni->cb_ra;
+	lck_rw_lock_shared(&ni->lock);
+	if (NInoDeleted(ni))
+		goto unlock;
+	/*
+	 * The attribute may have been truncated since the read-ahead was
+	 * queued thus clip it to the current end of the attribute rounded up
+	 * to the page size and drop it if nothing is left.  Anything beyond the
+	 * initialized size is zeroed by ntfs_read_compressed().
+	 */
+	lck_spin_lock(&ni->size_lock);
+	data_size = ubc_getsize(vn);
+	if (data_size > ni->data_size)
+		data_size = ni->data_size;
+	lck_spin_unlock(&ni->size_lock);
+	data_size = (data_size + PAGE_MASK) & ~PAGE_MASK_64;
+	if (job->ofs >= data_size) {
+		ntfs_debug("Attribute was truncated, dropping read-ahead.");
+		goto unlock;
+	}
+	if (job->count > data_size - job->ofs)
+		job->count = data_size - job->ofs;
+	err = ntfs_cb_ra_read(ni, job->ofs, job->count);
+	if (err)
+		ntfs_debug("Read-ahead of mft_no 0x%llx at offset 0x%llx "
+				"failed (error %d).",
+				(unsigned long long)ni->mft_no,
+				(unsigned long long)job->ofs, err);
+unlock:
+	lck_rw_unlock_shared(&ni->lock);
+	lck_spin_lock(&ra->lock);
+	ra->in_flight = FALSE;
+	lck_spin_unlock(&ra->lock);
+	IOFreeType(job, ntfs_cb_ra_job);
+	vnode_rele(vn);
+	(void)vnode_put(vn);
+}
+
+/**
+ * ntfs_compressed_ra - read ahead in a compressed attribute
+ * @ni:		ntfs inode of the compressed attribute that was read
+ * @ofs:	byte offset at which the read started
+ * @count:	number of bytes that were read
+ *
+ * Called by ntfs_vnop_read_compressed() after each read of the compressed
+ * attribute @ni to detect sequential access and to read ahead.
+ *
+ * A read starting where the previous one ended is sequential.  For sequential
+ * reads, the next @ra->window compression blocks following the already read
+ * ahead data are decompressed into the vm page cache asynchronously by a
+ * thread call once the reader has consumed half of the read-ahead data.  The
+ * window starts at NTFS_CB_RA_MIN compression blocks and is doubled up to
+ * NTFS_CB_RA_MAX compression blocks whenever the reader catches up with a
+ * read-ahead still in progress, i.e. whenever the data is consumed faster than
+ * it is read ahead.  A non-sequential read resets the window.
+ *
+ * Locking: Caller must hold @ni->lock on the inode.
+ */
+void ntfs_compressed_ra(ntfs_inode *ni, const s64 ofs, const s64 count)
+{
+	s64 end, start, data_size, ra_end;
+	ntfs_cb_ra *ra;
+	ntfs_cb_ra_job *job;
+	int cb_size = ni->compression_block_size;
+
+	ra = ni->cb_ra;
+	if (!ra) {
+		ra = IOMallocType(ntfs_cb_ra);
+		if (!ra)
+			return;
+		lck_spin_init(&ra->lock, ntfs_lock_grp, ntfs_lock_attr);
+		ra->call = thread_call_allocate_with_options(ntfs_cb_ra_worker,
+				NULL, THREAD_CALL_PRIORITY_LOW,
+				THREAD_CALL_OPTIONS_ONCE);
+		if (!ra->call) {
+			lck_spin_destroy(&ra->lock, ntfs_lock_grp);
+			IOFreeType(ra, ntfs_cb_ra);
+			return;
+		}
+		ra->window = NTFS_CB_RA_MIN;
+		if (!OSCompareAndSwapPtr(NULL, ra, (void* volatile*)&ni->cb_ra))
+			ntfs_cb_ra_free(ra);
+		ra = ni->cb_ra;
+	}
+	end = ofs + count;
+	lck_spin_lock(&ra->lock);
+	if (ofs != ra->next_ofs) {
+		/* Random access, start over. */
+		ra->next_ofs = end;
+		ra->window = NTFS_CB_RA_MIN;
+		ra->ra_start = ra->ra_end = 0;
+		lck_spin_unlock(&ra->lock);
+		return;
+	}
+	ra->next_ofs = end;
+	if (ra->in_flight) {
+		/*
+		 * The reader caught up with the read-ahead, read ahead more
+		 * next time.
+		 */
+		if (end > ra->ra_start && ra->window < NTFS_CB_RA_MAX)
+			ra->window <<= 1;
+		lck_spin_unlock(&ra->lock);
+		return;
+	}
+	/* Wait until half of the read-ahead data has been consumed. */
+	if (end + (s64)ra->window * cb_size / 2 < ra->ra_end) {
+		lck_spin_unlock(&ra->lock);
+		return;
+	}
+	start = (end + cb_size - 1) & ~(s64)(cb_size - 1);
+	if (start < ra->ra_end)
+		start = ra->ra_end;
+	ra_end = start + (s64)ra->window * cb_size;
+	lck_spin_lock(&ni->size_lock);
+	data_size = ni->data_size;
+	lck_spin_unlock(&ni->size_lock);
+	data_size = (data_size + PAGE_MASK) & ~PAGE_MASK_64;
+	if (ra_end > data_size)
+		ra_end = data_size;
+	if (start >= ra_end) {
+		lck_spin_unlock(&ra->lock);
+		return;
+	}
+	ra->ra_start = start;
+	ra->ra_end = ra_end;
+	ra->in_flight = TRUE;
+	lck_spin_unlock(&ra->lock);
+	job = IOMallocType(ntfs_cb_ra_job);
+	if (!job)
+		goto err;
+	job->vn = ni->vn;
+	job->ofs = start;
+	job->count = ra_end - start;
+	/* Keep the vnode around until the read-ahead is done. */
+	if (vnode_ref(ni->vn)) {
+		IOFreeType(job, ntfs_cb_ra_job);
+		goto err;
+	}
+	ntfs_debug("Reading ahead mft_no 0x%llx, offset 0x%llx, count 0x%x.",
+			(unsigned long long)ni->mft_no,
+			(unsigned long long)start, job->count);
+	lck_spin_lock(&ra->lock);
+	ra->job = job;
+	lck_spin_unlock(&ra->lock);
+	(void)thread_call_enter1(ra->call, job);
+	return;
+err:
+	lck_spin_lock(&ra->lock);
+	ra->in_flight = FALSE;
+	ra->ra_end = ra->ra_start;
+	lck_spin_unlock(&ra->lock);
+}
+
+/**
+ * ntfs_cb_ra_cancel - cancel a read-ahead of a compressed attribute
+ * @ni:		ntfs inode of the compressed attribute
+ * @wait:	if true wait for a running read-ahead to finish
+ *
+ * Cancel the asynchronous read-ahead of @ni if it is still queued, dropping the
+ * usecount reference it holds on the vnode.  If the read-ahead is already
+ * running and @wait is true, wait for it to finish.
+ *
+ * This is called at unmount time with @wait true so that a pending read-ahead
+ * does not keep the vnode in use and thus make the unmount fail with EBUSY.
+ *
+ * It is also called on reclaim with @wait false.  We must not wait then as a
+ * running read-ahead is blocked in vnode_getwithref() until the reclaim is
+ * done after which it fails and the read-ahead touches neither the inode nor
+ * its read-ahead state so they can be freed.
+ *
+ * Locking: Caller must hold an iocount reference on the vnode of @ni (or be
+ *	    reclaiming it) and must not hold @ni->lock.
+ */
+void ntfs_cb_ra_cancel(ntfs_inode *ni, const BOOL wait)
+{
+	ntfs_cb_ra *ra = ni->cb_ra;
+	ntfs_cb_ra_job *job;
+	boolean_t cancelled;
+
+	if (!ra)
+		return;
+	if (wait)
+		cancelled = thread_call_cancel_wait(ra->call);
+	else
+		cancelled = thread_call_cancel(ra->call);
+	if (!cancelled)
+		return;
+	/* The job never ran thus we own it now. */
+	lck_spin_lock(&ra->lock);
+	job = ra->job;
+	ra->job = NULL;
+	ra->in_flight = FALSE;
+	ra->ra_end = ra->ra_start;
+	lck_spin_unlock(&ra->lock);
+	ntfs_debug("Cancelled read-ahead of mft_no 0x%llx.",
+			(unsigned long long)ni->mft_no);
+	vnode_rele(job->vn);
+	IOFreeType(job, ntfs_cb_ra_job);
+}
+
+/**
+ * ntfs_cb_ra_free - free the read-ahead state of a compressed attribute
+ * @ra:		read-ahead state to free
+ *
+ * The caller must have cancelled any read-ahead using ntfs_cb_ra_cancel().
+ */
+void ntfs_cb_ra_free(ntfs_cb_ra *ra)
+{
+	(void)thread_call_free(ra->call);
+	lck_spin_destroy(&ra->lock, ntfs_lock_grp);
+	IOFreeType(ra, ntfs_cb_ra);
+}
+
+/**
+ * ntfs_is_zero - check if a buffer is all zeroes
+ */
+static inline BOOL ntfs_is_zero(const u8 *buf, const int size)
+{
+	const u64 *p, *end;
+
+	end = (const u64*)(buf + size);
+	for (p = (const u64*)buf; p < end; p++) {
+		if (*p)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * ntfs_raw_inode_sync_sizes - update the sizes of a raw inode
+ * @ni:		non-raw ntfs inode to which the raw inode belongs
+ * @raw_ni:	raw compressed ntfs inode to update
+ *
+ * The sizes of the raw inode @raw_ni are all equal to the allocated size of
+ * @ni so the entirety of the compressed data can be accessed (see
+ * ntfs_inode_attr_read()).  They are only set when the raw inode is read in
+ * thus update them here after the allocation of @ni has been extended.
+ *
+ * Locking: - Caller must hold @ni->lock on the inode.
+ *	    - Caller must hold @raw_ni->lock on the raw inode for writing.
+ */
+void ntfs_raw_inode_sync_sizes(ntfs_inode *ni, ntfs_inode *raw_ni)
+{
+	s64 size, compressed_size;
+	BOOL changed;
+
+	lck_spin_lock(&ni->size_lock);
+	size = ni->allocated_size;
+	compressed_size = ni->compressed_size;
+	lck_spin_unlock(&ni->size_lock);
+	lck_spin_lock(&raw_ni->size_lock);
+	changed = (raw_ni->allocated_size != size);
+	raw_ni->initialized_size = raw_ni->data_size = raw_ni->allocated_size =
+			size;
+	raw_ni->compressed_size = compressed_size;
+	lck_spin_unlock(&raw_ni->size_lock);
+	if (changed) {
+		ntfs_debug("Raw inode of mft_no 0x%llx now has size 0x%llx.",
+				(unsigned long long)ni->mft_no,
+				(unsigned long long)size);
+		if (!ubc_setsize(raw_ni->vn, size))
+			ntfs_error(ni->vol->mp, "Failed to set size in UBC.");
+	}
+}
+
+/**
+ * ntfs_raw_inode_rl_drop - discard the runlist of a raw inode
+ * @raw_ni:	raw compressed ntfs inode whose runlist to discard
+ *
+ * The raw inode has its own copy of the runlist of the compressed attribute
+ * which is mapped on demand.  Discard it after the runlist of the attribute
+ * has been changed by ntfs_attr_cb_resize() so that it is mapped again from
+ * the updated mapping pairs array.
+ *
+ * Locking: Caller must hold @raw_ni->lock on the raw inode for writing.
+ */
+static void ntfs_raw_inode_rl_drop(ntfs_inode *raw_ni)
+{
+	lck_rw_lock_exclusive(&raw_ni->rl.lock);
+	/* Invalidate any cached translations before freeing the runlist. */
+	raw_ni->rl.gen++;
+	__sync_synchronize();
+	if (raw_ni->rl.alloc_count)
+		IODeleteData(raw_ni->rl.rl, ntfs_rl_element,
+				raw_ni->rl.alloc_count);
+	raw_ni->rl.rl = NULL;
+	raw_ni->rl.alloc_count = raw_ni->rl.elements = raw_ni->rl.hint = 0;
+	if (raw_ni->rl_extents)
+		raw_ni->rl_extents->nr = 0;
+	lck_rw_unlock_exclusive(&raw_ni->rl.lock);
+}
+
+/**
+ * ntfs_cb_write - write the data of a compression block to disk
+ * @ni:		non-raw ntfs inode to which the compression block belongs
+ * @vcn:	first vcn of the compression block
+ * @src:	data to write
+ * @nr_clusters:	number of real clusters at the start of the compression
+ *			block to write @src to
+ *
+ * Write the @nr_clusters clusters of data in @src to the first @nr_clusters
+ * clusters of the compression block starting at @vcn which must be real
+ * clusters.
+ *
+ * The runs of the compression block are copied into a small runlist starting
+ * at vcn zero so that ntfs_rl_write() can be used to do the i/o.
+ *
+ * Return 0 on success and errno on error.
+ */
+static errno_t ntfs_cb_write(ntfs_inode *ni, const VCN vcn, u8 *src,
+		const s64 nr_clusters)
+{
+	VCN end_vcn;
+	ntfs_volume *vol = ni->vol;
+	ntfs_rl_element *rl;
+	ntfs_rl_element cb_rl[NTFS_MAX_CB_CLUSTERS + 1];
+	ntfs_runlist runlist;
+	unsigned i;
+
+	end_vcn = vcn + nr_clusters;
+	lck_rw_lock_shared(&ni->rl.lock);
+	rl = ntfs_rl_find_vcn_nolock(ntfs_rl_lookup_nolock(&ni->rl, vcn),
+			vcn);
+	for (i = 0; rl && rl->length && rl->vcn < end_vcn &&
+			i < NTFS_MAX_CB_CLUSTERS; rl++, i++) {
+		if (rl->lcn < 0)
+			break;
+		cb_rl[i].vcn = 0;
+		if (rl->vcn > vcn)
+			cb_rl[i].vcn = rl->vcn - vcn;
+		cb_rl[i].lcn = rl->lcn + (vcn + cb_rl[i].vcn - rl->vcn);
+		cb_rl[i].length = rl[1].vcn - vcn - cb_rl[i].vcn;
+		if (rl[1].vcn > end_vcn)
+			cb_rl[i].length = nr_clusters - cb_rl[i].vcn;
+	}
+	lck_rw_unlock_shared(&ni->rl.lock);
+	if (!i || cb_rl[i - 1].vcn + cb_rl[i - 1].length != nr_clusters) {
+		ntfs_error(vol->mp, "Compression block at vcn 0x%llx of mft_no "
+				"0x%llx is not allocated as expected.",
+				(unsigned long long)vcn,
+				(unsigned long long)ni->mft_no);
+		return EIO;
+	}
+	cb_rl[i].vcn = nr_clusters;
+	cb_rl[i].lcn = LCN_ENOENT;
+	cb_rl[i].length = 0;
+	runlist.rl = cb_rl;
+	runlist.elements = i + 1;
+	runlist.alloc_count = NTFS_MAX_CB_CLUSTERS + 1;
+	runlist.hint = 0;
+	runlist.gen = 0;
+	return ntfs_rl_write(vol, src, nr_clusters << vol->cluster_size_shift,
+			&runlist, 0, 0);
+}
+
+/**
+ * ntfs_cb_unreserve - release clusters reserved for compression blocks
+ * @ni:		ntfs inode of the compressed attribute
+ * @nr:		number of clusters to release
+ *
+ * Release @nr clusters of the clusters reserved for the dirty compression
+ * blocks of the compressed attribute @ni by ntfs_write_compressed_reserve().
+ * If fewer clusters are reserved, e.g. because the compression block was
+ * dirtied through a writable mapping, only those are released.
+ *
+ * Locking: The volume lcn bitmap must be unlocked as it is taken for writing.
+ */
+void ntfs_cb_unreserve(ntfs_inode *ni, s64 nr)
+{
+	ntfs_volume *vol = ni->vol;
+
+	lck_rw_lock_exclusive(&vol->lcnbmp_lock);
+	if (nr > ni->cb_reserved)
+		nr = ni->cb_reserved;
+	ni->cb_reserved -= nr;
+	vol->nr_reserved_clusters -= nr;
+	if (vol->nr_reserved_clusters < 0)
+		vol->nr_reserved_clusters = 0;
+	lck_rw_unlock_exclusive(&vol->lcnbmp_lock);
+}
+
+/**
+ * ntfs_write_compressed_reserve - reserve clusters for a compressed write
+ * @ni:		non-raw ntfs inode of the compressed attribute
+ * @ofs:	byte offset at which the write starts
+ * @end:	byte offset at which the write ends
+ *
+ * Reserve enough free clusters on the volume for every compression block
+ * overlapping the byte range @ofs to @end of the compressed attribute
+ * described by the ntfs inode @ni to be written uncompressed.  A compression
+ * block is already fully allocated if its last cluster is real, as the real
+ * clusters of a compression block are always at its start, and needs no
+ * reservation.  Otherwise a full compression block worth of clusters is
+ * reserved.
+ *
+ * Nothing is allocated here.  The compression blocks are compressed and
+ * reallocated to the number of clusters they need when the dirty pages are
+ * written out by ntfs_write_compressed() which then releases the reservation.
+ * The point of the reservation is that a full volume fails the write()
+ * synchronously rather than the pageout at which time the data could only be
+ * discarded.
+ *
+ * The reservation of @ni never exceeds the number of clusters of @ni which are
+ * not real thus writing repeatedly to the same compression blocks before they
+ * are written out cannot leak reserved clusters.  Any remaining reservation is
+ * released when the inode is freed.
+ *
+ * Note the reservation is only honoured by other compressed writes, not by the
+ * cluster allocator itself.
+ *
+ * Return 0 on success and errno on error.  The following error codes are
+ * defined:
+ *	ENOSPC	- Not enough free clusters on the volume.
+ *	ENOMEM	- Not enough memory to map the runlist.
+ *	EIO	- The runlist is corrupt or an i/o error occured.
+ *
+ * Locking: - Caller must hold @ni->lock on the inode.
+ *	    - The runlist of @ni must be unlocked.
+ *	    - The volume lcn bitmap must be unlocked.
+ */
+errno_t ntfs_write_compressed_reserve(ntfs_inode *ni, const s64 ofs,
+		const s64 end)
+{
+	VCN vcn;
+	LCN lcn;
+	s64 cb_ofs, alloc_size, nr_needed, nr_max, nr_new;
+	ntfs_volume *vol = ni->vol;
+	int cb_size, cb_clusters;
+	errno_t err;
+
+	ntfs_debug("Entering for compressed file inode 0x%llx, offset 0x%llx, "
+			"end 0x%llx.", (unsigned long long)ni->mft_no,
+			(unsigned long long)ofs, (unsigned long long)end);
+	cb_size = ni->compression_block_size;
+	cb_clusters = ni->compression_block_clusters;
+	lck_spin_lock(&ni->size_lock);
+	alloc_size = ni->allocated_size;
+	nr_max = (alloc_size - ni->compressed_size) >> vol->cluster_size_shift;
+	lck_spin_unlock(&ni->size_lock);
+	nr_needed = 0;
+	cb_ofs = ofs & ~(s64)(cb_size - 1);
+	for (; cb_ofs < end && cb_ofs < alloc_size; cb_ofs += cb_size) {
+		vcn = cb_ofs >> vol->cluster_size_shift;
+		lck_rw_lock_shared(&ni->rl.lock);
+		lcn = ntfs_attr_vcn_to_lcn_nolock(ni, vcn + cb_clusters - 1,
+				FALSE, NULL);
+		lck_rw_unlock_shared(&ni->rl.lock);
+		if (lcn >= 0)
+			continue;
+		if (lcn != LCN_HOLE) {
+			ntfs_error(vol->mp, "Failed to map compression block "
+					"at offset 0x%llx (error %lld).",
+					(unsigned long long)cb_ofs,
+					(long long)lcn);
+			return (lcn == LCN_ENOMEM) ? ENOMEM : EIO;
+		}
+		nr_needed += cb_clusters;
+	}
+	if (!nr_needed) {
+		ntfs_debug("Done (nothing to reserve).");
+		return 0;
+	}
+	err = 0;
+	lck_rw_lock_exclusive(&vol->lcnbmp_lock);
+	nr_new = ni->cb_reserved + nr_needed;
+	if (nr_new > nr_max)
+		nr_new = nr_max;
+	nr_needed = nr_new - ni->cb_reserved;
+	if (nr_needed > 0) {
+		if (vol->nr_free_clusters - vol->nr_reserved_clusters <
+				nr_needed)
+			err = ENOSPC;
+		else {
+			ni->cb_reserved = nr_new;
+			vol->nr_reserved_clusters += nr_needed;
+		}
+	}
+	lck_rw_unlock_exclusive(&vol->lcnbmp_lock);
+	if (!err)
+		ntfs_debug("Done (reserved 0x%llx clusters).",
+				(unsigned long long)nr_needed);
+	return err;
+}
+
+/**
+ * ntfs_write_compressed - compress data and write it to a compressed attribute
+ * @ni:		non-raw ntfs inode to which the raw inode belongs
+ * @raw_ni:	raw compressed ntfs inode to write through
+ * @ofs:	byte offset into uncompressed data stream to write to
+ * @count:	number of bytes to write from the source buffer
+ * @src:	source buffer containing the uncompressed data
+ * @ioflags:	flags further describing the write (see ntfs_vnop_pageout())
+ *
+ * Compress the @count bytes of data in the source buffer @src and write them
+ * at offset @ofs into the compressed attribute described by the ntfs inode
+ * @ni.  @ofs and @count must be multiples of the system page size.
+ *
+ * This works one compression block at a time.  A compression block which is
+ * only partially covered by the data is read in and decompressed using
+ * ntfs_read_compressed() first unless the part that is not covered is outside
+ * the initialized size in which case it is zeroed instead.  Data outside the
+ * initialized size is always written as zeroes.
+ *
+ * Each compression block is then compressed using the LZNT1 algorithm and
+ * written using the smallest possible number of clusters:
+ *	- A compression block which is all zeroes is made sparse.
+ *	- A compression block which compresses such that at least one cluster is
+ *	  saved is written compressed.
+ *	- Otherwise the compression block is written uncompressed.
+ * The compression block is reallocated to the required number of real clusters
+ * using ntfs_attr_cb_resize().  If that fails, e.g. because the volume is full
+ * or the mapping pairs array does not fit in its mft record, the compression
+ * block is written into its existing clusters if it fits, padding compressed
+ * data with zeroes.  This is valid as the decompressor stops at the first zero
+ * sub-block header.  write() reserved the clusters for the compression blocks
+ * it dirtied using ntfs_write_compressed_reserve() thus the reallocation does
+ * not fail for lack of free clusters unless other allocations used them up or
+ * the pages were dirtied through a writable mapping.  The reservation of each
+ * written compression block which was not fully allocated is released using
+ * ntfs_cb_unreserve().
+ *
+ * The raw inode @raw_ni is updated so that the new compressed data is seen
+ * when reading through it, i.e. its runlist is discarded if the runlist of
+ * @ni changed and its cached pages of the written compression blocks are
+ * invalidated.  The written compression blocks are also invalidated in the
+ * cache of decompressed compression blocks.
+ *
+ * Return 0 on success and errno on error.
+ *
+ * Locking: - Caller must hold @ni->lock on the inode.
+ *	    - Caller must hold @raw_ni->lock on the raw inode for writing.
+ */
+errno_t ntfs_write_compressed(ntfs_inode *ni, ntfs_inode *raw_ni, s64 ofs,
+		const int count, u8 *src, int ioflags)
+{
+	VCN vcn;
+	LCN lcn;
+	s64 end, cb_ofs, cb_end, init_size, nr_real, nr_needed, start, stop;
+	ntfs_volume *vol = ni->vol;
+	ntfs_lznt1_ctx *ctx;
+	u8 *ubuf, *cbuf, *buf;
+	int cb_size, cb_clusters, len;
+	errno_t err;
+	BOOL rl_changed;
+
+	ntfs_debug("Entering for compressed file inode 0x%llx, offset 0x%llx, "
+			"count 0x%x, ioflags 0x%x.",
+			(unsigned long long)ni->mft_no,
+			(unsigned long long)ofs, count, ioflags);
+	if (!NInoAttr(raw_ni) || raw_ni->type != AT_DATA ||
+			!NInoCompressed(raw_ni) || !NInoNonResident(raw_ni) ||
+			!NInoRaw(raw_ni) || NInoEncrypted(raw_ni))
+		panic("%s(): Called for incorrect inode type.\n", __FUNCTION__);
+	if (ofs & PAGE_MASK || count & PAGE_MASK)
+		panic("%s(): Called with offset 0x%llx and count 0x%x at "
+				"least one of which is not a multiple of the "
+				"system page size 0x%x.\n", __FUNCTION__,
+				(unsigned long long)ofs, count, PAGE_SIZE);
+	cb_size = ni->compression_block_size;
+	cb_clusters = ni->compression_block_clusters;
+	if (cb_clusters > NTFS_MAX_CB_CLUSTERS)
+		panic("%s(): cb_clusters > NTFS_MAX_CB_CLUSTERS\n",
+				__FUNCTION__);
+	ntfs_raw_inode_sync_sizes(ni, raw_ni);
+	lck_spin_lock(&ni->size_lock);
+	init_size = ni->initialized_size;
+	lck_spin_unlock(&ni->size_lock);
+	ubuf = IOMallocData(cb_size);
+	cbuf = IOMallocData(cb_size);
+	ctx = IOMallocType(ntfs_lznt1_ctx);
+	if (!ubuf || !cbuf || !ctx) {
+		ntfs_error(vol->mp, "Not enough memory to allocate temporary "
+				"buffers.");
+		err = ENOMEM;
+		goto free;
+	}
+	rl_changed = FALSE;
+	err = 0;
+	end = ofs + count;
+	start = cb_ofs = ofs & ~(s64)(cb_size - 1);
+	for (; cb_ofs < end; cb_ofs += cb_size) {
+		s64 head, tail;
+
+		cb_end = cb_ofs + cb_size;
+		head = cb_ofs;
+		if (head < ofs)
+			head = ofs;
+		tail = cb_end;
+		if (tail > end)
+			tail = end;
+		/*
+		 * Get the parts of the compression block not covered by the
+		 * source data.  If the compression block is partially covered
+		 * the compression block is larger than a page thus we can use
+		 * ntfs_read_compressed() on it.
+		 */
+		if ((head > cb_ofs || tail < cb_end) && cb_ofs < init_size) {
+			err = ntfs_read_compressed(ni, raw_ni, cb_ofs, cb_size,
+					ubuf, NULL, ioflags);
+			if (err) {
+				ntfs_error(vol->mp, "Failed to read "
+						"compression block at offset "
+						"0x%llx (error %d).",
+						(unsigned long long)cb_ofs,
+						err);
+				break;
+			}
+		} else if (head > cb_ofs || tail < cb_end)
+			bzero(ubuf, cb_size);
+		memcpy(ubuf + (head - cb_ofs), src + (head - ofs), tail - head);
+		if (init_size < cb_end) {
+			len = 0;
+			if (init_size > cb_ofs)
+				len = init_size - cb_ofs;
+			bzero(ubuf + len, cb_size - len);
+		}
+		/* Determine the number of real clusters needed. */
+		len = 0;
+		if (ntfs_is_zero(ubuf, cb_size))
+			nr_needed = 0;
+		else {
+			/* Compression must save at least one cluster. */
+			len = ntfs_compress(ctx, ubuf, cb_size, cbuf,
+					cb_size - vol->cluster_size);
+			nr_needed = cb_clusters;
+			if (len)
+				nr_needed = (len + vol->cluster_size_mask) >>
+						vol->cluster_size_shift;
+		}
+		vcn = cb_ofs >> vol->cluster_size_shift;
+		/*
+		 * Only a compression block which is not fully allocated had
+		 * clusters reserved for it by ntfs_write_compressed_reserve().
+		 */
+		lck_rw_lock_shared(&ni->rl.lock);
+		lcn = ntfs_attr_vcn_to_lcn_nolock(ni, vcn + cb_clusters - 1,
+				FALSE, NULL);
+		lck_rw_unlock_shared(&ni->rl.lock);
+		err = ntfs_attr_cb_resize(ni, vcn, nr_needed, &nr_real);
+		if (nr_real != nr_needed) {
+			/*
+			 * The reallocation failed.  Use the existing clusters
+			 * if the data fits into them.
+			 */
+			if (nr_real < nr_needed) {
+				ntfs_error(vol->mp, "Failed to allocate "
+						"clusters for compression "
+						"block at offset 0x%llx "
+						"(error %d).",
+						(unsigned long long)cb_ofs,
+						err);
+				break;
+			}
+			ntfs_debug("Failed to reallocate compression block "
+					"(error %d), writing it into its "
+					"existing 0x%llx clusters.", err,
+					(unsigned long long)nr_real);
+		} else {
+			if (err)
+				ntfs_warning(vol->mp, "Failed to update "
+						"compressed size (error %d).",
+						err);
+			rl_changed = TRUE;
+		}
+		err = 0;
+		if (lcn < 0)
+			ntfs_cb_unreserve(ni, cb_clusters);
+		if (!nr_real)
+			continue;
+		if (nr_real == cb_clusters)
+			buf = ubuf;
+		else {
+			/* Pad the compressed data with zeroes. */
+			buf = cbuf;
+			bzero(cbuf + len, (nr_real << vol->cluster_size_shift) -
+					len);
+		}
+		err = ntfs_cb_write(ni, vcn, buf, nr_real);
+		if (err) {
+			ntfs_error(vol->mp, "Failed to write compression block "
+					"at offset 0x%llx (error %d).",
+					(unsigned long long)cb_ofs, err);
+			break;
+		}
+	}
+	/*
+	 * Make the raw inode see the new data.  The runlist is only discarded
+	 * if it may have changed.
+	 */
+	if (rl_changed)
+		ntfs_raw_inode_rl_drop(raw_ni);
+	stop = cb_ofs;
+	if (stop > start)
+		(void)ubc_msync(raw_ni->vn, start, stop, NULL, UBC_INVALIDATE);
+	ntfs_cb_cache_invalidate(ni, start, end);
+free:
+	if (ctx)
+		IOFreeType(ctx, ntfs_lznt1_ctx);
+	if (cbuf)
+		IOFreeData(cbuf, cb_size);
+	if (ubuf)
+		IOFreeData(ubuf, cb_size);
+	if (!err)
+		ntfs_debug("Done.");
+	else
+		ntfs_error(vol->mp, "Failed (error %d).", err);
+	return err;
+}
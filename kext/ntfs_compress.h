@@ -41,13 +41,80 @@
 
 #include <sys/errno.h>
 
+#include <libkern/OSTypes.h>
+
+#include <kern/thread_call.h>
+
 #include <mach/memory_object_types.h>
 
+#include "al_lock.h"
 #include "ntfs_inode.h"
 #include "ntfs_types.h"
 
+/**
+ * ntfs_cb_ra - read-ahead state of a compressed attribute
+ * @lock:	protects the other fields
+ * @next_ofs:	offset at which the next read is expected if access is
+ *		sequential
+ * @ra_start:	start of the most recent read-ahead
+ * @ra_end:	end of the data that has been or is being read ahead
+ * @window:	number of compression blocks to read ahead
+ * @in_flight:	true whilst an asynchronous read-ahead is in progress
+ * @call:	thread call running the asynchronous read-ahead
+ * @job:	the queued read-ahead job, only valid whilst @call is pending
+ */
+typedef struct _ntfs_cb_ra {
+	al_lck_spin_t lock;
+	thread_call_t call;
+	struct _ntfs_cb_ra_job *job;
+	s64 next_ofs;
+	s64 ra_start;
+	s64 ra_end;
+	unsigned window;
+	BOOL in_flight;
+} ntfs_cb_ra;
+
+/*
+ * Statistics about the cache of decompressed compression blocks, exported via
+ * sysctl as vfs.generic.ntfs.cb_cache_*.
+ */
+typedef struct {
+	SInt64 hits;		/* Number of lookups found in the cache. */
+	SInt64 misses;		/* Number of lookups not found in the cache. */
+	SInt64 inserts;		/* Number of compression blocks cached. */
+	SInt64 evictions;	/* Number of them evicted to make room. */
+	SInt64 invalidations;	/* Number of them invalidated. */
+} ntfs_cb_cache_stats;
+
+__attribute__((visibility("hidden"))) extern ntfs_cb_cache_stats ntfs_cb_cstats;
+
+__private_extern__ void ntfs_cb_cache_init(void);
+__private_extern__ void ntfs_cb_cache_deinit(void);
+__private_extern__ void ntfs_cb_cache_invalidate(ntfs_inode *ni,
+		const s64 start, const s64 end);
+
 __private_extern__ errno_t ntfs_read_compressed(ntfs_inode *ni,
 		ntfs_inode *raw_ni, s64 ofs, const int start_count,
 		u8 *dst_start, upl_page_info_t *pl, int ioflags);
 
+__private_extern__ errno_t ntfs_decompress_pool_init(void);
+__private_extern__ void ntfs_decompress_pool_deinit(void);
+
+__private_extern__ void ntfs_compressed_ra(ntfs_inode *ni, const s64 ofs,
+		const s64 count);
+__private_extern__ void ntfs_cb_ra_cancel(ntfs_inode *ni, const BOOL wait);
+__private_extern__ void ntfs_cb_ra_free(ntfs_cb_ra *ra);
+
+__private_extern__ void ntfs_raw_inode_sync_sizes(ntfs_inode *ni,
+		ntfs_inode *raw_ni);
+
+__private_extern__ void ntfs_cb_unreserve(ntfs_inode *ni, s64 nr);
+
+__private_extern__ errno_t ntfs_write_compressed_reserve(ntfs_inode *ni,
+		const s64 ofs, const s64 end);
+
+__private_extern__ errno_t ntfs_write_compressed(ntfs_inode *ni,
+		ntfs_inode *raw_ni, s64 ofs, const int count, u8 *src,
+		int ioflags);
+
 #endif /* !_OSX_NTFS_COMPRESS_H */
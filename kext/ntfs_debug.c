@@ -53,8 +53,10 @@
 #include "al_lock.h"
 
 #include "ntfs.h"
+#include "ntfs_compress.h"
 #include "ntfs_debug.h"
 #include "ntfs_runlist.h"
+#include "ntfs_vnops.h"
 
 #ifdef DEBUG
 #include <kern/sched_prim.h>
@@ -62,19 +64,85 @@
 /* If 0, do not output debug messages.  If not zero, output debug messages. */
 int ntfs_debug_messages;
 
+#endif /* DEBUG */
+
+SYSCTL_DECL(_vfs_generic);
+SYSCTL_DECL(_vfs_generic_ntfs);
+SYSCTL_NODE(_vfs_generic, OID_AUTO, ntfs, CTLFLAG_RW, 0, "NTFS File System");
+
+#ifdef DEBUG
 /*
  * Define a sysctl "vfs.generic.ntfs.debug_messages" so debug messsages can be
  * enabled and disabled at runtime.
  */
-SYSCTL_DECL(_vfs_generic);
-SYSCTL_DECL(_vfs_generic_ntfs);
-SYSCTL_NODE(_vfs_generic, OID_AUTO, ntfs, CTLFLAG_RW, 0, "NTFS File System");
 SYSCTL_INT(_vfs_generic_ntfs, OID_AUTO, debug_messages, CTLFLAG_RW,
 		&ntfs_debug_messages, 0,
 		"Set to non-zero to enable debug messages.");
-
 #endif /* DEBUG */
 
+/*
+ * Define read-only sysctls "vfs.generic.ntfs.rl_packed_*" exporting the packed
+ * runlist statistics (see ntfs_rl_packed_stats in ntfs_runlist.h).
+ */
+SYSCTL_QUAD(_vfs_generic_ntfs, OID_AUTO, rl_packed_runlists, CTLFLAG_RD,
+		&ntfs_rl_pstats.runlists, "Number of packed runlists.");
+SYSCTL_QUAD(_vfs_generic_ntfs, OID_AUTO, rl_packed_elements, CTLFLAG_RD,
+		&ntfs_rl_pstats.elements,
+		"Number of runlist elements in packed runlists.");
+SYSCTL_QUAD(_vfs_generic_ntfs, OID_AUTO, rl_packed_bytes, CTLFLAG_RD,
+		&ntfs_rl_pstats.bytes, "Bytes used by packed runlists.");
+SYSCTL_QUAD(_vfs_generic_ntfs, OID_AUTO, rl_packed_lookups, CTLFLAG_RD,
+		&ntfs_rl_pstats.lookups,
+		"Number of lookups in packed runlists.");
+SYSCTL_QUAD(_vfs_generic_ntfs, OID_AUTO, rl_packed_unpacks, CTLFLAG_RD,
+		&ntfs_rl_pstats.unpacks,
+		"Number of packed runlists expanded again.");
+
+/*
+ * Define read-only sysctls "vfs.generic.ntfs.cb_cache_*" exporting the
+ * statistics of the cache of decompressed compression blocks (see
+ * ntfs_cb_cache_stats in ntfs_compress.h).
+ */
+SYSCTL_QUAD(_vfs_generic_ntfs, OID_AUTO, cb_cache_hits, CTLFLAG_RD,
+		&ntfs_cb_cstats.hits,
+		"Number of compression blocks found in the cache.");
+SYSCTL_QUAD(_vfs_generic_ntfs, OID_AUTO, cb_cache_misses, CTLFLAG_RD,
+		&ntfs_cb_cstats.misses,
+		"Number of compression blocks not found in the cache.");
+SYSCTL_QUAD(_vfs_generic_ntfs, OID_AUTO, cb_cache_inserts, CTLFLAG_RD,
+		&ntfs_cb_cstats.inserts,
+		"Number of compression blocks inserted into the cache.");
+SYSCTL_QUAD(_vfs_generic_ntfs, OID_AUTO, cb_cache_evictions, CTLFLAG_RD,
+		&ntfs_cb_cstats.evictions,
+		"Number of compression blocks evicted from the cache.");
+SYSCTL_QUAD(_vfs_generic_ntfs, OID_AUTO, cb_cache_invalidations, CTLFLAG_RD,
+		&ntfs_cb_cstats.invalidations,
+		"Number of compression blocks invalidated in the cache.");
+
+/*
+ * Define sysctls "vfs.generic.ntfs.direct_{read,write}_min" to tune the size
+ * above which reads and writes bypass the vm page cache and read-only sysctls
+ * "vfs.generic.ntfs.direct_*" exporting the statistics of such i/o (see
+ * ntfs_direct_io_stats in ntfs_vnops.h).
+ */
+SYSCTL_INT(_vfs_generic_ntfs, OID_AUTO, direct_read_min, CTLFLAG_RW,
+		&ntfs_direct_read_min, 0,
+		"Minimum size in bytes of reads to bypass the page cache (0 to "
+		"disable).");
+SYSCTL_QUAD(_vfs_generic_ntfs, OID_AUTO, direct_reads, CTLFLAG_RD,
+		&ntfs_dio_stats.reads, "Number of direct reads.");
+SYSCTL_QUAD(_vfs_generic_ntfs, OID_AUTO, direct_read_bytes, CTLFLAG_RD,
+		&ntfs_dio_stats.read_bytes, "Bytes requested by direct reads.");
+SYSCTL_INT(_vfs_generic_ntfs, OID_AUTO, direct_write_min, CTLFLAG_RW,
+		&ntfs_direct_write_min, 0,
+		"Minimum size in bytes of page aligned writes to bypass the "
+		"page cache (0 to disable).");
+SYSCTL_QUAD(_vfs_generic_ntfs, OID_AUTO, direct_writes, CTLFLAG_RD,
+		&ntfs_dio_stats.writes, "Number of direct writes.");
+SYSCTL_QUAD(_vfs_generic_ntfs, OID_AUTO, direct_write_bytes, CTLFLAG_RD,
+		&ntfs_dio_stats.write_bytes,
+		"Bytes requested by direct writes.");
+
 /*
  * A static buffer to hold the error string being displayed and a spinlock
  * to protect concurrent accesses to it as well as initialisation and
@@ -87,8 +155,7 @@ static al_lck_spin_t ntfs_err_buf_lock;
 /**
  * ntfs_debug_init - initialize debugging for ntfs
  *
- * Initialize the error buffer lock and if compiled with DEBUG, register our
- * sysctl.
+ * Initialize the error buffer lock and register our sysctls.
  *
  * Note we cannot use ntfs_debug(), ntfs_warning(), and ntfs_error() before
  * this function has been called.
@@ -96,29 +163,60 @@ static al_lck_spin_t ntfs_err_buf_lock;
 void ntfs_debug_init(void)
 {
 	lck_spin_init(&ntfs_err_buf_lock, ntfs_lock_grp, ntfs_lock_attr);
-#ifdef DEBUG
-	/* Register our sysctl. */
+	/* Register our sysctls. */
 	sysctl_register_oid(&sysctl__vfs_generic_ntfs);
+#ifdef DEBUG
 	sysctl_register_oid(&sysctl__vfs_generic_ntfs_debug_messages);
 #endif
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_rl_packed_runlists);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_rl_packed_elements);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_rl_packed_bytes);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_rl_packed_lookups);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_rl_packed_unpacks);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_cb_cache_hits);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_cb_cache_misses);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_cb_cache_inserts);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_cb_cache_evictions);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_cb_cache_invalidations);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_direct_read_min);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_direct_reads);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_direct_read_bytes);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_direct_write_min);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_direct_writes);
+	sysctl_register_oid(&sysctl__vfs_generic_ntfs_direct_write_bytes);
 }
 
 /**
  * ntfs_debug_deinit - deinitialize debugging for ntfs
  *
- * Deinit the error buffer lock and if compiled with DEBUG, unregister our
- * sysctl.
+ * Deinit the error buffer lock and unregister our sysctls.
  *
  * Note we cannot use ntfs_debug(), ntfs_warning(), and ntfs_error() once this
  * function has been called.
  */
 void ntfs_debug_deinit(void)
 {
+	/* Unregister our sysctls. */
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_direct_write_bytes);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_direct_writes);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_direct_write_min);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_direct_read_bytes);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_direct_reads);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_direct_read_min);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_cb_cache_invalidations);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_cb_cache_evictions);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_cb_cache_inserts);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_cb_cache_misses);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_cb_cache_hits);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_rl_packed_unpacks);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_rl_packed_lookups);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_rl_packed_bytes);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_rl_packed_elements);
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_rl_packed_runlists);
 #ifdef DEBUG
-	/* Unregister our sysctl. */
 	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs_debug_messages);
-	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs);
 #endif
+	sysctl_unregister_oid(&sysctl__vfs_generic_ntfs);
 	lck_spin_destroy(&ntfs_err_buf_lock, ntfs_lock_grp);
 }
 
@@ -808,6 +808,11 @@ static inline int ntfs_do_dirent(ntfs_volume *vol, INDEX_ENTRY *ie,
  * if not found either allocate a new directory hint or recycle an the oldest
  * directory hint in the list and set it up ready to use.
  *
+ * The returned hint is detached from the list of hints so that the caller has
+ * exclusive use of it even though it only holds @ni->lock for reading.  When
+ * done with it, the caller must either give it back with ntfs_dirhint_insert()
+ * or free it with ntfs_dirhint_put().
+ *
  * Return the directory hint or NULL if allocating a new hint failed and no
  * hints are present in the list so a hint could not be recycled either.
  *
@@ -815,12 +820,11 @@ static inline int ntfs_do_dirent(ntfs_volume *vol, INDEX_ENTRY *ie,
  * will have a filename attached to it, i.e. ->fn_size and thus also ->fn will
  * be non-zero and non-NULL, respectively.
  *
- * Locking: Caller must hold @ni->lock for writing.
+ * Locking: Caller must hold @ni->lock.
  */
 static ntfs_dirhint *ntfs_dirhint_get(ntfs_inode *ni, unsigned ofs)
 {
 	ntfs_dirhint *dh;
-	BOOL need_init, need_remove;
 	struct timeval tv;
 
 	microuptime(&tv);
@@ -831,77 +835,119 @@ static ntfs_dirhint *ntfs_dirhint_get(ntfs_inode *ni, unsigned ofs)
 	 * always the oldest.
 	 */
 	dh = NULL;
+	lck_spin_lock(&ni->dirhint_lock);
 	if (ofs & ~NTFS_DIR_POS_MASK) {
 		TAILQ_FOREACH(dh, &ni->dirhint_list, link) {
 			if (dh->ofs == ofs)
 				break;
 		}
 	}
-	/* Assume we found a directory hint in which case it is initialized. */
-	need_init = FALSE;
-	need_remove = TRUE;
-	if (!dh) {
-		/* No directory hint matched. */
-		need_init = TRUE;
-		if (ni->nr_dirhints < NTFS_MAX_DIRHINTS) {
-			/*
-			 * Allocate a new directory hint.  If the allocation
-			 * fails try to recycle an existing directory hint.
-			 */
-			dh = IOMallocType(ntfs_dirhint);
-			if (dh) {
-				ni->nr_dirhints++;
-				need_remove = FALSE;
-			}
-		}
-		if (!dh) {
-			/* Recycle the last, i.e. oldest, directory hint. */
-			dh = TAILQ_LAST(&ni->dirhint_list, ntfs_dirhint_head);
-			if (dh && dh->fn_size)
-				IOFreeData(dh->fn, dh->fn_size);
-		}
-	}
-	/*
-	 * If we managed to get a hint, move it to (or place it at if we
-	 * allocated it above) the head of the list of dircetory hints of the
-	 * index inode.
-	 */
 	if (dh) {
-		if (need_remove)
-			TAILQ_REMOVE(&ni->dirhint_list, dh, link);
-		TAILQ_INSERT_HEAD(&ni->dirhint_list, dh, link);
+		/* A directory hint matched thus it is initialized already. */
+		TAILQ_REMOVE(&ni->dirhint_list, dh, link);
+		lck_spin_unlock(&ni->dirhint_lock);
+		goto done;
+	}
+	/* No directory hint matched. */
+	if (ni->nr_dirhints < NTFS_MAX_DIRHINTS) {
 		/*
-		 * Set up the hint if it is a new hint or we recycled an old
-		 * hint.
+		 * Allocate a new directory hint.  We cannot allocate memory
+		 * with the spin lock held so account for the hint first and
+		 * undo that if the allocation fails in which case we try to
+		 * recycle an existing directory hint.
 		 */
-		if (need_init) {
-			dh->ofs = ofs;
-			dh->fn_size = 0;
-		}
-		dh->time = tv.tv_sec;
+		ni->nr_dirhints++;
+		lck_spin_unlock(&ni->dirhint_lock);
+		dh = IOMallocType(ntfs_dirhint);
+		if (dh)
+			goto init;
+		lck_spin_lock(&ni->dirhint_lock);
+		ni->nr_dirhints--;
 	}
+	/*
+	 * Recycle the last, i.e. oldest, directory hint.  There may not be
+	 * one if all hints are in use by concurrent callers.
+	 */
+	dh = TAILQ_LAST(&ni->dirhint_list, ntfs_dirhint_head);
+	if (dh)
+		TAILQ_REMOVE(&ni->dirhint_list, dh, link);
+	lck_spin_unlock(&ni->dirhint_lock);
+	if (!dh)
+		return NULL;
+	if (dh->fn_size)
+		IOFreeData(dh->fn, dh->fn_size);
+init:
+	/* Set up the hint as it is a new hint or we recycled an old hint. */
+	dh->ofs = ofs;
+	dh->fn_size = 0;
+done:
+	dh->time = tv.tv_sec;
 	return dh;
 }
 
+/**
+ * ntfs_dirhint_insert - give a directory hint back to its index inode
+ * @ni:		ntfs index inode to which the directory hint belongs
+ * @dh:		directory hint obtained with ntfs_dirhint_get()
+ *
+ * Attach the directory hint @dh to the head of the list of directory hints of
+ * the ntfs directory index inode @ni, i.e. make it the newest hint.
+ *
+ * Locking: Caller must hold @ni->lock.
+ */
+static void ntfs_dirhint_insert(ntfs_inode *ni, ntfs_dirhint *dh)
+{
+	lck_spin_lock(&ni->dirhint_lock);
+	TAILQ_INSERT_HEAD(&ni->dirhint_list, dh, link);
+	lck_spin_unlock(&ni->dirhint_lock);
+}
+
 /**
  * ntfs_dirhint_put - put a directory hint
  * @ni:		ntfs index inode to which the directory hint belongs
- * @dh:		directory hint to free
+ * @dh:		detached directory hint to free
  *
- * Detach the directory hint @dh from the ntfs directory index inode @ni and
- * free it and all its resources.
+ * Free the directory hint @dh which has been detached from the ntfs directory
+ * index inode @ni and all its resources.
  *
- * Locking: Caller must hold @ni->lock for writing.
+ * Locking: Caller must hold @ni->lock.
  */
 static void ntfs_dirhint_put(ntfs_inode *ni, ntfs_dirhint *dh)
 {
-	TAILQ_REMOVE(&ni->dirhint_list, dh, link);
+	lck_spin_lock(&ni->dirhint_lock);
 	ni->nr_dirhints--;
+	lck_spin_unlock(&ni->dirhint_lock);
 	if (dh->fn_size)
 		IOFreeData(dh->fn, dh->fn_size);
 	IOFreeType(dh, ntfs_dirhint);
 }
 
+/**
+ * ntfs_dirhint_tag_new - assign a new directory hint tag
+ * @ni:		ntfs index inode for which to assign a new tag
+ *
+ * Return the next directory hint tag for the ntfs directory index inode @ni
+ * already shifted into place for or-ing into a directory offset.
+ *
+ * Note we have to avoid the offset becomming (unsigned)-1 because we use that
+ * to denote end of directory.
+ *
+ * Locking: Caller must hold @ni->lock.
+ */
+static unsigned ntfs_dirhint_tag_new(ntfs_inode *ni)
+{
+	unsigned tag;
+
+	lck_spin_lock(&ni->dirhint_lock);
+	tag = (unsigned)(++ni->dirhint_tag) << NTFS_DIR_TAG_SHIFT;
+	if (!tag || (tag | NTFS_DIR_POS_MASK) == (unsigned)-1) {
+		ni->dirhint_tag = 1;
+		tag = (unsigned)1 << NTFS_DIR_TAG_SHIFT;
+	}
+	lck_spin_unlock(&ni->dirhint_lock);
+	return tag;
+}
+
 /**
  * ntfs_dirhints_put - put all directory hints
  * @ni:		ntfs index inode whose directory hints to release
@@ -915,15 +961,26 @@ static void ntfs_dirhint_put(ntfs_inode *ni, ntfs_dirhint *dh)
  * Note we iterate from the oldest to the newest so we can stop when we reach
  * the first valid hint if @stale_only is true.
  *
+ * Hints currently detached by ntfs_readdir() are not released.  They are
+ * given back to @ni once ntfs_readdir() is done with them and will be released
+ * by a later call or in ntfs_inode_free() at the latest.
+ *
  * Locking: Caller must hold @ni->lock for writing.
  */
 void ntfs_dirhints_put(ntfs_inode *ni, BOOL stale_only)
 {
+	struct ntfs_dirhint_head head;
 	ntfs_dirhint *dh, *tdh;
 	struct timeval tv;
 
 	if (stale_only)
 		microuptime(&tv);
+	/*
+	 * Move the hints to be released to a private list so they can be
+	 * freed without holding the spin lock.
+	 */
+	TAILQ_INIT(&head);
+	lck_spin_lock(&ni->dirhint_lock);
 	TAILQ_FOREACH_REVERSE_SAFE(dh, &ni->dirhint_list, ntfs_dirhint_head,
 			link, tdh) {
 		if (stale_only) {
@@ -931,8 +988,12 @@ void ntfs_dirhints_put(ntfs_inode *ni, BOOL stale_only)
 			if (tv.tv_sec - dh->time < NTFS_DIRHINT_TTL)
 				break;
 		}
-		ntfs_dirhint_put(ni, dh);
+		TAILQ_REMOVE(&ni->dirhint_list, dh, link);
+		TAILQ_INSERT_TAIL(&head, dh, link);
 	}
+	lck_spin_unlock(&ni->dirhint_lock);
+	TAILQ_FOREACH_SAFE(dh, &head, link, tdh)
+		ntfs_dirhint_put(ni, dh);
 }
 
 /**
@@ -1232,8 +1293,12 @@ do_next:
 		ia_ni = NULL;
 		goto err;
 	}
-	/* We need the lock exclusive because of the directory hints code. */
-	lck_rw_lock_exclusive(&ia_ni->lock);
+	/*
+	 * We only read the index so we only need the lock shared.  The
+	 * directory hints have their own lock and a hint in use is detached
+	 * from the inode thus concurrent readers do not get in each others way.
+	 */
+	lck_rw_lock_shared(&ia_ni->lock);
 	ictx = ntfs_index_ctx_get(ia_ni);
 	if (!ictx) {
 		ntfs_error(vol->mp, "Not enough memory to allocate index "
@@ -1333,6 +1398,13 @@ do_next:
 	ictx->is_match = 1;
 	goto do_dirent;
 lookup_by_position:
+	/*
+	 * If this is the start of the enumeration of the directory, read ahead
+	 * the first part of the index allocation so the index blocks are not
+	 * read in one at a time as we walk the B+tree.
+	 */
+	if (ofs == 2)
+		ntfs_index_readahead(ia_ni);
 	/*
 	 * Start a search at the beginning of the B+tree and look for the entry
 	 * number @ofs - 2.
@@ -1403,11 +1475,7 @@ err:
 	 */
 	if (!eof && ofs & ~(off_t)NTFS_DIR_POS_MASK) {
 		ofs = NTFS_DIR_POS_MASK;
-		tag = (unsigned)(++ia_ni->dirhint_tag) << NTFS_DIR_TAG_SHIFT;
-		if (!tag || (tag | NTFS_DIR_POS_MASK) == (unsigned)-1) {
-			ia_ni->dirhint_tag = 1;
-			tag = (unsigned)1 << NTFS_DIR_TAG_SHIFT;
-		}
+		tag = ntfs_dirhint_tag_new(ia_ni);
 	}
 	/*
 	 * If we have a directory hint, update it with the current search state
@@ -1449,28 +1517,21 @@ err:
 			dh->fn_size = size;
 		}
 		memcpy(dh->fn, &ictx->entry->key.filename, size);
+		/* If the current tag is zero, we need to assign a new tag. */
+		if (!tag)
+			tag = ntfs_dirhint_tag_new(ia_ni);
 		/*
-		 * If the current tag is zero, we need to assign a new tag.
-		 *
-		 * Note we have to avoid @ofs becomming (unsigned)-1 because we
-		 * use that to denote end of directory.
+		 * Finally set the directory hint to the current offset and
+		 * give it back to the index inode.
 		 */
-		if (!tag) {
-			tag = (unsigned)(++ia_ni->dirhint_tag) <<
-					NTFS_DIR_TAG_SHIFT;
-			if (!tag || (tag | NTFS_DIR_POS_MASK) == (unsigned)-1) {
-				ia_ni->dirhint_tag = 1;
-				tag = (unsigned)1 << NTFS_DIR_TAG_SHIFT;
-			}
-		}
-		/* Finally set the directory hint to the current offset. */
 		dh->ofs = ofs | tag;
+		ntfs_dirhint_insert(ia_ni, dh);
 	}
 dh_done:
 	if (ictx)
 		ntfs_index_ctx_put(ictx);
 	if (ia_ni) {
-		lck_rw_unlock_exclusive(&ia_ni->lock);
+		lck_rw_unlock_shared(&ia_ni->lock);
 		(void)vnode_put(ia_ni->vn);
 	}
 	ntfs_debug("%s (returned 0x%x entries, %s, now at offset 0x%llx).",
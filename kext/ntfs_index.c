@@ -751,6 +751,7 @@ have_page:
 		.down = ictx->down,
 		.idx_ni = idx_ni,
 		.base_ni = ictx->base_ni,
+		.collate = ictx->collate,
 		.index = &ia->index,
 		.bytes_free = le32_to_cpu(ia->index.allocated_size) -
 				le32_to_cpu(ia->index.index_length),
@@ -884,8 +885,8 @@ found:
 		 * Not a perfect match, need to do full blown collation so we
 		 * know which way in the B+tree we have to go.
 		 */
-		rc = ntfs_collate(idx_ni->vol, idx_ni->collation_rule, key,
-				key_len, &ie->key, le16_to_cpu(ie->key_length));
+		rc = ictx->collate(idx_ni->vol, key, key_len, &ie->key,
+				le16_to_cpu(ie->key_length));
 		/*
 		 * If @key collates before the key of the current entry, need
 		 * to search on the left.
@@ -1049,6 +1050,162 @@ err:
 	return err;
 }
 
+/**
+ * ntfs_index_ra_vcns_get - gather the child nodes of an index node to read ahead
+ * @ictx:	index context describing the index node being walked
+ * @vcns:	destination array of at least NTFS_INDEX_RA_NODES VCNs
+ *
+ * If the current entry @ictx->entry_nr is a multiple of NTFS_INDEX_RA_NODES,
+ * gather the VCNs of the child nodes of the up to NTFS_INDEX_RA_NODES index
+ * entries following the current entry into @vcns, sorted in ascending order.
+ * These are the index nodes a sequential walk of the B+tree is going to
+ * descend into next.
+ *
+ * This is done before descending into the child node of the current entry as
+ * the entries array of @ictx is no longer accessible afterwards whilst the
+ * read-ahead itself is done afterwards by ntfs_index_ra_vcns_read() as the
+ * mft record may be mapped whilst @ictx is locked.
+ *
+ * Return the number of VCNs placed in @vcns.
+ *
+ * Locking: - Caller must hold @ictx->idx_ni->lock on the index inode.
+ *	    - The index context @ictx must be locked.
+ */
+static unsigned ntfs_index_ra_vcns_get(ntfs_index_context *ictx, VCN *vcns)
+{
+	INDEX_ENTRY *ie;
+	VCN vcn;
+	unsigned i, j, end, nr;
+
+	if (ictx->entry_nr % NTFS_INDEX_RA_NODES ||
+			vnode_isnoreadahead(ictx->idx_ni->vn))
+		return 0;
+	end = ictx->entry_nr + NTFS_INDEX_RA_NODES;
+	if (end > ictx->nr_entries - 1)
+		end = ictx->nr_entries - 1;
+	nr = 0;
+	for (i = ictx->entry_nr + 1; i <= end; i++) {
+		ie = ictx->entries[i];
+		if (!(ie->flags & INDEX_ENTRY_NODE))
+			continue;
+		vcn = sle64_to_cpup((sle64*)((u8*)ie +
+				le16_to_cpu(ie->length) - sizeof(VCN)));
+		if (vcn < 0)
+			continue;
+		/* Insert the VCN keeping the array sorted. */
+		for (j = nr; j > 0 && vcns[j - 1] > vcn; j--)
+			vcns[j] = vcns[j - 1];
+		vcns[j] = vcn;
+		nr++;
+	}
+	return nr;
+}
+
+/**
+ * ntfs_index_ra_vcns_read - read ahead gathered child nodes
+ * @idx_ni:	index inode to which the child nodes belong
+ * @vcns:	sorted array of VCNs of the index blocks to read ahead
+ * @nr:		number of VCNs in @vcns
+ *
+ * Start read-ahead of the index blocks with the VCNs @vcns gathered by
+ * ntfs_index_ra_vcns_get().  Index blocks which are adjacent or share a page
+ * are coalesced into a single read-ahead request which the cluster layer then
+ * splits up along the physically contiguous extents of the runlist.
+ *
+ * Locking: - Caller must hold @idx_ni->lock on the index inode.
+ *	    - The mft record of the index inode must not be mapped.
+ */
+static void ntfs_index_ra_vcns_read(ntfs_inode *idx_ni, const VCN *vcns,
+		const unsigned nr)
+{
+	s64 ofs, end, next;
+	unsigned i;
+
+	for (i = 0; i < nr;) {
+		ofs = vcns[i] << idx_ni->vcn_size_shift;
+		end = ofs + idx_ni->block_size;
+		while (++i < nr) {
+			next = vcns[i] << idx_ni->vcn_size_shift;
+			if (next > ((end + PAGE_MASK_64) & ~PAGE_MASK_64))
+				break;
+			if (next + idx_ni->block_size > end)
+				end = next + idx_ni->block_size;
+		}
+		ntfs_page_readahead(idx_ni, ofs, end - ofs);
+	}
+}
+
+/**
+ * ntfs_index_readahead - read ahead the start of the index allocation
+ * @idx_ni:	index inode whose index allocation to read ahead
+ *
+ * Start read-ahead of the index blocks which are marked in use in the index
+ * bitmap and are in the first NTFS_INDEX_RA_SIZE bytes of the index allocation
+ * attribute of the index inode @idx_ni.  Each run of consecutive in use index
+ * blocks is read ahead with a single request.
+ *
+ * This is called at the start of a sequential enumeration of the index, e.g.
+ * by ntfs_readdir(), so that the index blocks are read in large requests
+ * rather than one index block at a time as the B+tree is walked.
+ *
+ * Locking: - Caller must hold @idx_ni->lock on the index inode.
+ *	    - Caller must hold an iocount reference on the index inode.
+ *	    - No index contexts of the index may be locked.
+ */
+void ntfs_index_readahead(ntfs_inode *idx_ni)
+{
+	s64 bit, end_bit, run;
+	ntfs_inode *bmp_ni;
+	upl_t upl;
+	upl_page_info_array_t pl;
+	u8 *bmp;
+	errno_t err;
+
+	if (!NInoIndexAllocPresent(idx_ni) || vnode_isnoreadahead(idx_ni->vn))
+		return;
+	err = ntfs_attr_inode_get(NInoAttr(idx_ni) ? idx_ni->base_ni : idx_ni,
+			AT_BITMAP, idx_ni->name, idx_ni->name_len, FALSE,
+			LCK_RW_TYPE_SHARED, &bmp_ni);
+	if (err) {
+		ntfs_debug("Failed to get index bitmap inode (error %d).",
+				err);
+		return;
+	}
+	lck_spin_lock(&bmp_ni->size_lock);
+	end_bit = bmp_ni->initialized_size << 3;
+	lck_spin_unlock(&bmp_ni->size_lock);
+	if (end_bit > NTFS_INDEX_RA_SIZE >> idx_ni->block_size_shift)
+		end_bit = NTFS_INDEX_RA_SIZE >> idx_ni->block_size_shift;
+	if (end_bit > PAGE_SIZE * 8)
+		end_bit = PAGE_SIZE * 8;
+	if (end_bit <= 0)
+		goto put;
+	err = ntfs_page_map(bmp_ni, 0, &upl, &pl, &bmp, FALSE);
+	if (err) {
+		ntfs_debug("Failed to read index bitmap (error %d).", err);
+		goto put;
+	}
+	for (bit = 0; bit < end_bit;) {
+		/* Skip the index blocks which are not in use. */
+		if (!(bmp[bit >> 3] & (1 << (bit & 7)))) {
+			bit++;
+			continue;
+		}
+		/* Find the end of the run of in use index blocks. */
+		for (run = bit + 1; run < end_bit; run++) {
+			if (!(bmp[run >> 3] & (1 << (run & 7))))
+				break;
+		}
+		ntfs_page_readahead(idx_ni, bit << idx_ni->block_size_shift,
+				(run - bit) << idx_ni->block_size_shift);
+		bit = run;
+	}
+	ntfs_page_unmap(bmp_ni, upl, pl, FALSE);
+put:
+	lck_rw_unlock_shared(&bmp_ni->lock);
+	(void)vnode_put(bmp_ni->vn);
+}
+
 /**
  * ntfs_index_lookup_by_position - find an entry by its position in the B+tree
  * @pos:	[IN] position of index entry to find in the B+tree
@@ -1121,10 +1278,18 @@ errno_t ntfs_index_lookup_by_position(const s64 pos, const int key_len,
 		 * is found.
 		 */
 		while (ictx->entry->flags & INDEX_ENTRY_NODE) {
-			/* Child node present, descend into it. */
+			VCN ra_vcns[NTFS_INDEX_RA_NODES];
+			unsigned ra_nr;
+
+			/*
+			 * Child node present, descend into it and read ahead
+			 * the child nodes we are going to descend into next.
+			 */
+			ra_nr = ntfs_index_ra_vcns_get(ictx, ra_vcns);
 			err = ntfs_index_descend_into_child_node(&ictx);
 			if (err)
 				goto err;
+			ntfs_index_ra_vcns_read(ictx->idx_ni, ra_vcns, ra_nr);
 			/* Start at the first index entry in the index node. */
 			ictx->entry = ictx->entries[0];
 			ictx->entry_nr = 0;
@@ -1357,10 +1522,18 @@ errno_t ntfs_index_lookup_next(ntfs_index_context **index_ctx)
 	 * found.
 	 */
 	while (ictx->entry->flags & INDEX_ENTRY_NODE) {
-		/* Child node present, descend into it. */
+		VCN ra_vcns[NTFS_INDEX_RA_NODES];
+		unsigned ra_nr;
+
+		/*
+		 * Child node present, descend into it and read ahead the child
+		 * nodes we are going to descend into next.
+		 */
+		ra_nr = ntfs_index_ra_vcns_get(ictx, ra_vcns);
 		err = ntfs_index_descend_into_child_node(&ictx);
 		if (err)
 			goto err;
+		ntfs_index_ra_vcns_read(ictx->idx_ni, ra_vcns, ra_nr);
 		/* Start at the first index entry in the index node. */
 		ictx->entry = ictx->entries[0];
 		ictx->entry_nr = 0;
@@ -4830,10 +5003,10 @@ static errno_t ntfs_index_entry_replace(ntfs_index_context *ictx,
  */
 static errno_t ntfs_index_block_free(ntfs_index_context *ictx)
 {
-	s64 target_pos, bmp_pos, alloc_size;
+	s64 target_pos, bmp_pos, map_ofs, alloc_size;
 	ntfs_inode *bmp_ni, *idx_ni = ictx->idx_ni;
 	ntfs_volume *vol = idx_ni->vol;
-	unsigned page_ofs;
+	unsigned map_size;
 	errno_t err;
 
 	ntfs_debug("Entering.");
@@ -4894,7 +5067,17 @@ out:
 		upl_page_info_array_t pl;
 		u8 *bmp_start, *bmp;
 
-		err = ntfs_page_map(bmp_ni, bmp_pos & ~PAGE_MASK_64, &upl,
+		/*
+		 * Map the range of pages ending with the page containing
+		 * @bmp_pos so the backwards scan reads the bitmap in with as
+		 * few i/os as possible.
+		 */
+		map_ofs = (bmp_pos & ~PAGE_MASK_64) -
+				(NTFS_PAGE_MAP_RANGE_MAX - PAGE_SIZE);
+		if (map_ofs < 0)
+			map_ofs = 0;
+		map_size = (unsigned)(bmp_pos - map_ofs) + 1;
+		err = ntfs_page_map_range(bmp_ni, map_ofs, &map_size, &upl,
 				&pl, &bmp_start, FALSE);
 		if (err) {
 			ntfs_debug("Failed to read index bitmap (error %d).",
@@ -4902,9 +5085,8 @@ out:
 			idx_ni->last_set_bit = -1;
 			goto out;
 		}
-		page_ofs = (unsigned)bmp_pos & PAGE_MASK;
-		bmp = bmp_start + page_ofs;
-		/* Scan backwards through the page. */
+		bmp = bmp_start + (bmp_pos - map_ofs);
+		/* Scan backwards through the page range. */
 		do {
 			unsigned bit, byte = *bmp;
 			/* If this byte is zero skip it. */
@@ -4931,19 +5113,20 @@ out:
 			}
 			if (byte & 0x02)
 				bit++;
-			ntfs_page_unmap(bmp_ni, upl, pl, FALSE);
+			ntfs_page_unmap_range(bmp_ni, upl, pl, map_size,
+					FALSE);
 			/*
 			 * @bit now contains the last set bit in the byte thus
 			 * we can determine the last set bit in the bitmap.
 			 */
-			idx_ni->last_set_bit = (((bmp_pos & ~PAGE_MASK_64) +
-					(bmp - bmp_start)) << 3) + bit;
+			idx_ni->last_set_bit = ((map_ofs + (bmp - bmp_start)) <<
+					3) + bit;
 			if (target_pos < idx_ni->last_set_bit)
 				goto done;
 			goto was_last_set_bit;
 		} while (--bmp >= bmp_start);
-		ntfs_page_unmap(bmp_ni, upl, pl, FALSE);
-	} while ((bmp_pos -= page_ofs + 1) >= 0);
+		ntfs_page_unmap_range(bmp_ni, upl, pl, map_size, FALSE);
+	} while ((bmp_pos = map_ofs - 1) >= 0);
 	/*
 	 * We scanned the entire bitmap and it was all zero.  We do not do
 	 * anything because truncation of indexes that become empty is done
@@ -49,6 +49,7 @@
 typedef struct _ntfs_index_context ntfs_index_context;
 
 #include "ntfs_attr.h"
+#include "ntfs_collate.h"
 #include "ntfs_inode.h"
 #include "ntfs_layout.h"
 #include "ntfs_types.h"
@@ -80,6 +81,16 @@ IOMallocTypeImpl(kalloc_type_view_t kt_view);
 })
 
 
+/*
+ * When walking the B+tree in order, the child nodes of the next
+ * NTFS_INDEX_RA_NODES index entries of an index node are read ahead every
+ * NTFS_INDEX_RA_NODES entries.  And at the start of an enumeration the in use
+ * index blocks in the first NTFS_INDEX_RA_SIZE bytes of the index allocation
+ * are read ahead.
+ */
+#define NTFS_INDEX_RA_NODES	16
+#define NTFS_INDEX_RA_SIZE	(512 * 1024)
+
 /**
  * @up:		pointer to index context located directly above in the tree
  * @down:	pointer to index context located directly below in the tree
@@ -149,6 +160,8 @@ struct _ntfs_index_context {
 	ntfs_inode *idx_ni;		/* Index inode. */
 	ntfs_inode *base_ni;		/* Base inode of the index inode
 					   @idx_ni. */
+	ntfs_collate_func_t collate;	/* Collation function for the
+					   collation rule of @idx_ni. */
 	union {
 		/* Use @ie if @is_match is 1 and @follow_ie if it is 0. */
 		INDEX_ENTRY *entry;		/* Index entry matched by
@@ -302,6 +315,7 @@ static inline void ntfs_index_ctx_init(ntfs_index_context *ictx,
 		.down = ictx,
 		.idx_ni = idx_ni,
 		.base_ni = NInoAttr(idx_ni) ? idx_ni->base_ni : idx_ni,
+		.collate = ntfs_collate_func_get(idx_ni->collation_rule),
 	};
 }
 
@@ -404,6 +418,8 @@ __private_extern__ errno_t ntfs_index_lookup_by_position(const s64 pos,
 __private_extern__ errno_t ntfs_index_lookup_next(
 		ntfs_index_context **index_ctx);
 
+__private_extern__ void ntfs_index_readahead(ntfs_inode *idx_ni);
+
 __private_extern__ void ntfs_index_entry_mark_dirty(ntfs_index_context *ictx);
 
 __private_extern__ errno_t ntfs_index_move_root_to_allocation_block(
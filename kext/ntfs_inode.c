@@ -63,6 +63,7 @@
 
 #include "ntfs.h"
 #include "ntfs_attr.h"
+#include "ntfs_compress.h"
 #include "ntfs_debug.h"
 #include "ntfs_dir.h"
 #include "ntfs_hash.h"
@@ -163,6 +164,11 @@ static inline void __ntfs_inode_init(ntfs_volume *vol, ntfs_inode *ni)
 		.tv_nsec = 0,
 	};
 	ntfs_rl_init(&ni->rl);
+	ni->rl_packed = NULL;
+	ni->rl_extents = NULL;
+	ni->rl_cache = NULL;
+	ni->cb_ra = NULL;
+	ni->cb_reserved = 0;
 	lck_mtx_init(&ni->buf_lock, ntfs_lock_grp, ntfs_lock_attr);
 	ni->mft_ni = NULL;
 	ni->m_buf = NULL;
@@ -176,6 +182,7 @@ static inline void __ntfs_inode_init(ntfs_volume *vol, ntfs_inode *ni)
 	ni->vcn_size = 0;
 	ni->collation_rule = 0;
 	ni->vcn_size_shift = 0;
+	lck_spin_init(&ni->dirhint_lock, ntfs_lock_grp, ntfs_lock_attr);
 	ni->nr_dirhints = 0;
 	ni->dirhint_tag = 0;
 	TAILQ_INIT(&ni->dirhint_list);
@@ -3203,6 +3210,20 @@ static inline void ntfs_inode_free(ntfs_inode *ni)
 	}
 	if (ni->rl.alloc_count)
 		IODeleteData(ni->rl.rl, ntfs_rl_element, ni->rl.alloc_count);
+	if (ni->rl_packed)
+		ntfs_rl_packed_free(ni->rl_packed);
+	if (ni->rl_extents)
+		IOFreeType(ni->rl_extents, ntfs_rl_extents);
+	if (ni->rl_cache)
+		IOFreeType(ni->rl_cache, ntfs_rl_cache);
+	if (ni->cb_ra) {
+		ntfs_cb_ra_cancel(ni, FALSE);
+		ntfs_cb_ra_free(ni->cb_ra);
+	}
+	if (ni->cb_reserved)
+		ntfs_cb_unreserve(ni, ni->cb_reserved);
+	if (NInoCompressed(ni) && !NInoRaw(ni))
+		ntfs_cb_cache_invalidate(ni, 0, NTFS_MAX_ATTRIBUTE_SIZE);
 	if (ni->attr_list_alloc)
 		IOFreeData(ni->attr_list, ni->attr_list_alloc);
 	if (ni->attr_list_rl.alloc_count)
@@ -3228,6 +3249,7 @@ static inline void ntfs_inode_free(ntfs_inode *ni)
 	/* Destroy all the locks before finally discarding the ntfs inode. */
 	lck_rw_destroy(&ni->lock, ntfs_lock_grp);
 	lck_spin_destroy(&ni->size_lock, ntfs_lock_grp);
+	lck_spin_destroy(&ni->dirhint_lock, ntfs_lock_grp);
 	ntfs_rl_deinit(&ni->rl);
 	ntfs_rl_deinit(&ni->attr_list_rl);
 	lck_mtx_destroy(&ni->extent_lock, ntfs_lock_grp);
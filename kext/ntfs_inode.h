@@ -60,6 +60,7 @@
 typedef struct _ntfs_inode ntfs_inode;
 typedef struct _ntfs_attr ntfs_attr;
 struct _ntfs_dirhint;
+struct _ntfs_cb_ra;
 
 /* Structures associated with ntfs inode caching. */
 typedef LIST_HEAD(, _ntfs_inode) ntfs_inode_list_head;
@@ -104,6 +105,9 @@ struct _ntfs_inode {
 				   record. */
 	u8 block_size_shift; 	/* Log2 of the above. */
     al_lck_spin_t size_lock;	/* Lock serializing access to inode sizes. */
+	al_lck_spin_t dirhint_lock; /* Lock protecting the directory hints, i.e.
+				   @nr_dirhints, @dirhint_tag, and
+				   @dirhint_list, of an index inode. */
 	s64 allocated_size;	/* Copy from the attribute record. */
 	s64 data_size;		/* Copy from the attribute record. */
 	s64 initialized_size;	/* Copy from the attribute record. */
@@ -156,6 +160,23 @@ struct _ntfs_inode {
 				   no $I30 index allocation attribute
 				   (small directory).  In the latter case
 				   rl.elements is always zero. */
+	ntfs_rl_packed *rl_packed; /* If not NULL and rl.elements is 0, a
+				   packed copy of the runlist which is used
+				   for lookups until the runlist is mapped
+				   again.  Protected by rl.lock. */
+	ntfs_rl_extents *rl_extents; /* If not NULL, the attribute extents
+				   mapped into rl in least recently used
+				   order.  Protected by rl.lock. */
+	ntfs_rl_cache *rl_cache; /* If not NULL, recently used vcn to lcn
+				   translations of rl.  Allocated on first
+				   use and accessed without locking. */
+	struct _ntfs_cb_ra *cb_ra; /* If not NULL, the read-ahead state of a
+				   compressed attribute.  Allocated on first
+				   read (see ntfs_compressed_ra()). */
+	s64 cb_reserved;	/* Number of clusters reserved for the dirty
+				   compression blocks of a compressed
+				   attribute (see ntfs_cb_reserve()).
+				   Protected by vol->lcnbmp_lock. */
 	ntfs_runlist url;	/* This runlist represents all uninitialized
 				   regions such as holes or parts of holes that
 				   have been instantiated but have not yet been
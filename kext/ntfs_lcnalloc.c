@@ -351,9 +351,11 @@ errno_t ntfs_cluster_alloc(ntfs_volume *vol, const VCN start_vcn,
 			 */
 			if (rlpos + 2 > rlcount) {
 				ntfs_rl_element *rl2;
+				unsigned rlcount2;
 
 				ntfs_debug("Reallocating memory.");
-				rl2 = IONewData(ntfs_rl_element, rlcount + NTFS_ALLOC_BLOCK / sizeof (ntfs_rl_element));
+				rlcount2 = ntfs_rl_alloc_count(rlcount, rlpos + 2);
+				rl2 = IONewData(ntfs_rl_element, rlcount2);
 				if (!rl2) {
 					err = ENOMEM;
 					ntfs_error(vol->mp, "Failed to allocate memory.");
@@ -368,7 +370,7 @@ errno_t ntfs_cluster_alloc(ntfs_volume *vol, const VCN start_vcn,
 					IODeleteData(rl, ntfs_rl_element, rlcount);
 				}
 				rl = rl2;
-				rlcount += NTFS_ALLOC_BLOCK / sizeof (ntfs_rl_element);
+				rlcount = rlcount2;
 				ntfs_debug("Reallocated memory, rlcount %u.", rlcount);
 			}
 			/* Allocate the bitmap bit. */
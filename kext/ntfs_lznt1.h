@@ -0,0 +1,425 @@
+/*
+ * ntfs_lznt1.h - LZNT1 compression and decompression of sub-blocks for the
+ *		  NTFS kernel driver.
+ *
+ * Copyright (c) 2006-2008 Anton Altaparmakov.  All Rights Reserved.
+ * Portions Copyright (c) 2006-2008 Apple Inc.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 3. Neither the name of Apple Inc. ("Apple") nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ALTERNATIVELY, provided that this notice and licensing terms are retained in
+ * full, this file may be redistributed and/or modified under the terms of the
+ * GNU General Public License (GPL) Version 2, in which case the provisions of
+ * that version of the GPL will apply to you instead of the license terms
+ * above.  You can obtain a copy of the GPL Version 2 at
+ * http://developer.apple.com/opensource/licenses/gpl-2.txt.
+ */
+
+#ifndef _OSX_NTFS_LZNT1_H
+#define _OSX_NTFS_LZNT1_H
+
+#include <string.h>
+#ifndef KERNEL
+#include <strings.h>
+#endif
+
+#include "ntfs_endian.h"
+#include "ntfs_types.h"
+
+/*
+ * The LZNT1 code does not depend on anything but the data it is given thus it
+ * is kept in this header so that it can be built outside the kernel, too, e.g.
+ * by the benchmark in util/ntfs_lznt1_bench.c.
+ */
+
+/**
+ * LZNT1 related constants.
+ */
+enum {
+	/* Compression sub-block (sb) constants. */
+	NTFS_SB_SIZE_MASK	= 0x0fff,
+	NTFS_SB_SIZE		= 0x1000,
+	NTFS_SB_IS_COMPRESSED	= 0x8000,
+	NTFS_SB_SIGNATURE	= 0x3000,
+
+	/* LZNT1 compressor match finder constants. */
+	NTFS_LZNT1_HASH_BITS	= 12,
+	NTFS_LZNT1_HASH_SIZE	= 1 << NTFS_LZNT1_HASH_BITS,
+	NTFS_LZNT1_MAX_CHAIN	= 16,
+
+	/* Token types and access mask. */
+	NTFS_SYMBOL_TOKEN	= 0,
+	NTFS_PHRASE_TOKEN	= 1,
+	NTFS_TOKEN_MASK		= 1,
+};
+
+/**
+ * ntfs_lznt1_split - split of a phrase token into back pointer and length
+ *
+ * The widths of the back pointer and the length in a phrase token depend on
+ * the current position in the decompressed sub-block (see the description of
+ * the decompression algorithm above ntfs_decompress() in ntfs_compress.c).  There are only nine different splits,
+ * indexed by log2 of the current position, and entry @i applies up to and
+ * including position @end of the sub-block at which point entry @i + 1
+ * applies, i.e. the position minus one reaches 0x10 << @i.
+ */
+static const struct {
+	u16 end;	/* Last position at which this split applies. */
+	u16 l_mask;	/* Mask with which to AND a pt to obtain l. */
+	u8 p_shift;	/* Bits by which to right shift a pt to obtain p. */
+} ntfs_lznt1_split[] = {
+	{ 0x0010, 0xfff, 12 },
+	{ 0x0020, 0x7ff, 11 },
+	{ 0x0040, 0x3ff, 10 },
+	{ 0x0080, 0x1ff,  9 },
+	{ 0x0100, 0x0ff,  8 },
+	{ 0x0200, 0x07f,  7 },
+	{ 0x0400, 0x03f,  6 },
+	{ 0x0800, 0x01f,  5 },
+	{ 0x1000, 0x00f,  4 },
+};
+
+/**
+ * ntfs_copy_8 - copy eight bytes which may be unaligned
+ */
+static inline void ntfs_copy_8(u8 *dst, const u8 *src)
+{
+	u64 v;
+
+	memcpy(&v, src, sizeof(v));
+	memcpy(dst, &v, sizeof(v));
+}
+
+/**
+ * ntfs_decompress_sb - decompress the tokens of a compressed sub-block
+ * @cb:		first tag of the sub-block in the compression block
+ * @cb_sb_end:	end of the sub-block in the compression block
+ * @dst:	start of the sub-block in the destination buffer
+ *
+ * Decompress the token groups from @cb up to @cb_sb_end into the destination
+ * sub-block starting at @dst which is NTFS_SB_SIZE bytes long.
+ *
+ * The decoder works on a tag at a time.  A tag of all symbol tokens, which is
+ * the common case for data that does not compress well, is copied in one go.
+ * The split of a phrase token is taken from ntfs_lznt1_split[] and only
+ * changes when the position in the sub-block crosses the end of the current
+ * split.
+ *
+ * A phrase token whose back pointer is at least eight is copied eight bytes
+ * at a time, even if it overlaps the data it is copied to, rounding up the
+ * length when the sub-block has room for it.  This is safe because the bytes
+ * copied past the end of the phrase are overwritten by the following tokens
+ * or by the zeroing of the remainder of the sub-block.  A phrase token with a
+ * shorter back pointer that overlaps repeats the last p bytes of the data,
+ * thus we fill a run of a single byte and otherwise copy the growing already
+ * expanded data onto itself, doubling the amount copied with each step.
+ *
+ * Return the end of the decompressed data in the destination sub-block or
+ * NULL if the compressed data is corrupt.
+ */
+static inline u8 *ntfs_decompress_sb(const u8 *cb, const u8 *const cb_sb_end,
+		u8 *const dst_sb_start)
+{
+	u8 *const dst_sb_end = dst_sb_start + NTFS_SB_SIZE;
+	u8 *dst = dst_sb_start;
+	u8 *split_end;
+	unsigned split, token, tag, pt, length, back;
+	unsigned l_mask, p_shift;
+
+	split = 0;
+	split_end = dst_sb_start + ntfs_lznt1_split[0].end;
+	l_mask = ntfs_lznt1_split[0].l_mask;
+	p_shift = ntfs_lznt1_split[0].p_shift;
+	while (cb < cb_sb_end) {
+		/* Get the next tag and advance to first token. */
+		tag = *cb++;
+		/*
+		 * If all eight tokens are symbol tokens and they are all
+		 * present, copy them in one go.
+		 */
+		if (!tag && cb + 8 <= cb_sb_end && dst + 8 <= dst_sb_end) {
+			ntfs_copy_8(dst, cb);
+			cb += 8;
+			dst += 8;
+			continue;
+		}
+		/* Parse the eight tokens described by the tag. */
+		for (token = 0; token < 8 && cb < cb_sb_end; token++,
+				tag >>= 1) {
+			if ((tag & NTFS_TOKEN_MASK) == NTFS_SYMBOL_TOKEN) {
+				if (dst >= dst_sb_end)
+					return NULL;
+				*dst++ = *cb++;
+				continue;
+			}
+			/*
+			 * We have a phrase token.  Make sure it is not the
+			 * first token in the sub-block as this is illegal and
+			 * that it is complete.
+			 */
+			if (dst == dst_sb_start || cb + 2 > cb_sb_end)
+				return NULL;
+			/* Switch to the split for the current position. */
+			while (dst > split_end) {
+				split++;
+				split_end = dst_sb_start +
+						ntfs_lznt1_split[split].end;
+				l_mask = ntfs_lznt1_split[split].l_mask;
+				p_shift = ntfs_lznt1_split[split].p_shift;
+			}
+			pt = le16_to_cpup((le16*)cb);
+			cb += 2;
+			back = (pt >> p_shift) + 1;
+			length = (pt & l_mask) + 3;
+			if (back > (unsigned)(dst - dst_sb_start) ||
+					dst + length > dst_sb_end)
+				return NULL;
+			if (back >= 8 && ((length + 7) & ~7) <=
+					(unsigned)(dst_sb_end - dst)) {
+				const u8 *src = dst - back;
+				u8 *end = dst + length;
+
+				/*
+				 * Each eight bytes copied are already final
+				 * even if the phrase overlaps.
+				 */
+				do {
+					ntfs_copy_8(dst, src);
+					dst += 8;
+					src += 8;
+				} while (dst < end);
+				dst = end;
+			} else if (back >= length) {
+				memcpy(dst, dst - back, length);
+				dst += length;
+			} else if (back == 1) {
+				/* A run of the same byte. */
+				memset(dst, dst[-1], length);
+				dst += length;
+			} else {
+				const u8 *src = dst - back;
+				u8 *end = dst + length;
+				unsigned chunk;
+
+				/*
+				 * Expand the pattern of the last @back bytes
+				 * by doubling the copied data with each step.
+				 */
+				while ((chunk = dst - src) < (unsigned)(end -
+						dst)) {
+					memcpy(dst, src, chunk);
+					dst += chunk;
+				}
+				memcpy(dst, src, end - dst);
+				dst = end;
+			}
+		}
+	}
+	return dst;
+}
+
+/**
+ * ntfs_lznt1_ctx - match finder state of the LZNT1 compressor
+ * @head:	for each hash of three bytes, the most recent position in the
+ *		current sub-block plus one at which they occur or zero
+ * @prev:	for each position in the current sub-block, the previous
+ *		position plus one with the same hash or zero
+ *
+ * The positions with the same hash form a chain from @head through @prev
+ * which is ordered from the most recent to the oldest position.
+ */
+typedef struct {
+	u16 head[NTFS_LZNT1_HASH_SIZE];
+	u16 prev[NTFS_SB_SIZE];
+} ntfs_lznt1_ctx;
+
+/**
+ * ntfs_lznt1_hash - hash the three bytes at a position for the match finder
+ */
+static inline unsigned ntfs_lznt1_hash(const u8 *p)
+{
+	return (((u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16)) *
+			2654435761U) >> (32 - NTFS_LZNT1_HASH_BITS);
+}
+
+/**
+ * ntfs_compress_sb - compress a sub-block
+ * @ctx:	match finder state
+ * @src:	sub-block of NTFS_SB_SIZE bytes to compress
+ * @dst:	destination buffer in which to return the compressed sub-block
+ * @dst_end:	end of the destination buffer
+ *
+ * Compress the sub-block @src into @dst, i.e. write the sub-block header
+ * followed by the token groups describing the sub-block (see the description
+ * of the decompression algorithm above ntfs_decompress() in ntfs_compress.c).
+ *
+ * Matches are found using hash chains of the positions at which each three
+ * byte sequence occurs in the sub-block.  The chains are searched from the
+ * most recent position backwards, at most NTFS_LZNT1_MAX_CHAIN positions deep,
+ * and the longest match is taken greedily.  The maximum back pointer and
+ * length of a phrase token depend on the current position in the sub-block
+ * exactly as they do when decompressing.
+ *
+ * If the compressed sub-block would not be smaller than the sub-block itself,
+ * the sub-block is stored uncompressed instead.
+ *
+ * Return the number of bytes written to @dst including the header or zero if
+ * the sub-block does not fit into @dst.
+ */
+static inline int ntfs_compress_sb(ntfs_lznt1_ctx *ctx, const u8 *src, u8 *dst,
+		const u8 *dst_end)
+{
+	const u8 *limit;
+	u8 *d, *tag_p;
+	unsigned pos, token, tag, lg, max_len, best_len, best_back, len;
+	unsigned cand, depth, h;
+
+	/* The stored form is the upper bound on the size of the sub-block. */
+	limit = dst + 2 + NTFS_SB_SIZE;
+	if (limit > dst_end)
+		limit = dst_end;
+	bzero(ctx->head, sizeof(ctx->head));
+	d = dst + 2;
+	pos = 0;
+	lg = 0;
+	while (pos < NTFS_SB_SIZE) {
+		/* We need space for the tag and at least one token. */
+		if (d + 3 > limit)
+			goto store;
+		tag_p = d++;
+		tag = 0;
+		for (token = 0; token < 8 && pos < NTFS_SB_SIZE; token++) {
+			if (d + 2 > limit)
+				goto store;
+			best_len = best_back = 0;
+			if (pos + 3 <= NTFS_SB_SIZE) {
+				h = ntfs_lznt1_hash(src + pos);
+				cand = ctx->head[h];
+				/*
+				 * Determine the maximum length of a phrase
+				 * token at this position.  There is no need to
+				 * check the back pointer as it can always
+				 * reach the start of the sub-block.  A phrase
+				 * token cannot be the first token.
+				 */
+				max_len = 0;
+				if (pos) {
+					while ((pos - 1) >> lg >= 0x10)
+						lg++;
+					max_len = (0xfff >> lg) + 3;
+					if (max_len > NTFS_SB_SIZE - pos)
+						max_len = NTFS_SB_SIZE - pos;
+				} else
+					cand = 0;
+				for (depth = NTFS_LZNT1_MAX_CHAIN; cand &&
+						depth; depth--) {
+					const u8 *m = src + cand - 1;
+
+					if (m[best_len] == src[pos + best_len]) {
+						for (len = 0; len < max_len &&
+								m[len] ==
+								src[pos + len];
+								len++)
+							;
+						if (len > best_len) {
+							best_len = len;
+							best_back = src + pos - m;
+							if (len == max_len)
+								break;
+						}
+					}
+					cand = ctx->prev[cand - 1];
+				}
+				ctx->prev[pos] = ctx->head[h];
+				ctx->head[h] = pos + 1;
+			}
+			if (best_len < 3) {
+				/* Emit a symbol token. */
+				*d++ = src[pos++];
+				continue;
+			}
+			/* Emit a phrase token. */
+			*(le16*)d = cpu_to_le16(((best_back - 1) <<
+					(12 - lg)) | (best_len - 3));
+			d += 2;
+			tag |= 1 << token;
+			/* Add the positions covered by the match to the chains. */
+			for (len = 1; len < best_len; len++) {
+				if (pos + len + 3 > NTFS_SB_SIZE)
+					break;
+				h = ntfs_lznt1_hash(src + pos + len);
+				ctx->prev[pos + len] = ctx->head[h];
+				ctx->head[h] = pos + len + 1;
+			}
+			pos += best_len;
+		}
+		*tag_p = tag;
+	}
+	len = d - dst;
+	if (len < 2 + NTFS_SB_SIZE) {
+		*(le16*)dst = cpu_to_le16(NTFS_SB_SIGNATURE |
+				NTFS_SB_IS_COMPRESSED | (len - 3));
+		return len;
+	}
+store:
+	if (dst + 2 + NTFS_SB_SIZE > dst_end)
+		return 0;
+	*(le16*)dst = cpu_to_le16(NTFS_SB_SIGNATURE | (NTFS_SB_SIZE + 2 - 3));
+	memcpy(dst + 2, src, NTFS_SB_SIZE);
+	return 2 + NTFS_SB_SIZE;
+}
+
+/**
+ * ntfs_compress - compress a compression block
+ * @ctx:	match finder state
+ * @src:	compression block of @cb_size bytes to compress
+ * @cb_size:	size of the compression block in bytes
+ * @dst:	destination buffer in which to return the compressed data
+ * @dst_size:	size of the destination buffer in bytes
+ *
+ * Compress the compression block @src one sub-block at a time into @dst using
+ * ntfs_compress_sb().
+ *
+ * Return the number of bytes of compressed data written to @dst or zero if the
+ * compressed data does not fit into @dst_size bytes, in which case the caller
+ * should store the compression block uncompressed.
+ */
+static inline int ntfs_compress(ntfs_lznt1_ctx *ctx, const u8 *src,
+		const int cb_size, u8 *dst, const int dst_size)
+{
+	u8 *d, *dst_end;
+	int ofs, len;
+
+	d = dst;
+	dst_end = dst + dst_size;
+	for (ofs = 0; ofs < cb_size; ofs += NTFS_SB_SIZE) {
+		len = ntfs_compress_sb(ctx, src + ofs, d, dst_end);
+		if (!len)
+			return 0;
+		d += len;
+	}
+	return d - dst;
+}
+
+#endif /* !_OSX_NTFS_LZNT1_H */
@@ -443,6 +443,198 @@ err:
 	return err;
 }
 
+/**
+ * ntfs_page_map_range - map a range of pages of a vnode into memory
+ * @ni:		ntfs inode of which to map a range of pages
+ * @ofs:	byte offset into @ni at which to start mapping
+ * @size:	pointer to the number of bytes to map
+ * @upl:	destination page list for the page range
+ * @pl:		destination array of pages containing the page range
+ * @kaddr:	destination pointer for the address of the mapped range
+ * @rw:		if true we intend to modify the pages and if false we do not
+ *
+ * Map the pages covering *@size bytes starting at byte offset @ofs into the
+ * ntfs inode @ni into memory and return the page list in @upl, the array of
+ * pages in @pl and the address of the virtually contiguous mapping of the
+ * page range in @kaddr.
+ *
+ * The range is capped at NTFS_PAGE_MAP_RANGE_MAX bytes and at the end of the
+ * attribute rounded up to a multiple of PAGE_SIZE.  On success, *@size is set
+ * to the number of bytes actually mapped which is always a non-zero multiple
+ * of PAGE_SIZE.  As with ntfs_page_map(), any bytes in the final page which
+ * are outside the end of the attribute are zero.
+ *
+ * All pages are returned uptodate.  Unlike mapping the pages one at a time
+ * with ntfs_page_map(), the whole range is described by a single page list
+ * and each run of consecutive pages which are not valid is brought uptodate
+ * with a single call to ntfs_pagein() thus the cluster layer can read the
+ * run with as few i/os as the runlist allows.
+ *
+ * The caller must set @rw to true if the pages are going to be modified and
+ * to false otherwise.  The page range must be released again with
+ * ntfs_page_unmap_range().
+ *
+ * Note: @ofs must be page aligned.
+ *
+ * Locking: - Caller must hold an iocount reference on the vnode of @ni.
+ *	    - Caller must hold @ni->lock for reading or writing.
+ *
+ * Return 0 on success and errno on error in which case *@upl is set to NULL.
+ */
+errno_t ntfs_page_map_range(ntfs_inode *ni, s64 ofs, unsigned *size,
+		upl_t *upl, upl_page_info_array_t *pl, u8 **kaddr,
+		const BOOL rw)
+{
+	s64 data_size;
+	kern_return_t kerr;
+	unsigned map_size, nr_pages, start, i;
+	errno_t err;
+
+	ntfs_debug("Entering for inode 0x%llx, offset 0x%llx, size 0x%x, rw "
+			"is %s.", (unsigned long long)ni->mft_no,
+			(unsigned long long)ofs, *size, rw ? "true" : "false");
+	if (ofs & PAGE_MASK)
+		panic("%s() called with non page aligned offset (0x%llx).",
+				__FUNCTION__, (unsigned long long)ofs);
+	lck_spin_lock(&ni->size_lock);
+	data_size = ubc_getsize(ni->vn);
+	if (data_size > ni->data_size)
+		data_size = ni->data_size;
+	lck_spin_unlock(&ni->size_lock);
+	if (ofs >= data_size || !*size) {
+		ntfs_error(ni->vol->mp, "Range at offset 0x%llx and size 0x%x "
+				"is empty or outside the end of the attribute "
+				"(0x%llx).", (unsigned long long)ofs, *size,
+				(unsigned long long)data_size);
+		err = EINVAL;
+		goto err;
+	}
+	map_size = *size;
+	if (map_size > NTFS_PAGE_MAP_RANGE_MAX)
+		map_size = NTFS_PAGE_MAP_RANGE_MAX;
+	if (map_size > data_size - ofs)
+		map_size = data_size - ofs;
+	map_size = (map_size + PAGE_MASK) & ~PAGE_MASK;
+	nr_pages = map_size >> PAGE_SHIFT;
+	/* Create a single page list for the whole range. */
+	kerr = ubc_create_upl(ni->vn, ofs, map_size, upl, pl, UPL_SET_LITE |
+			(rw ? UPL_WILL_MODIFY : 0));
+	if (kerr != KERN_SUCCESS)
+		panic("%s(): Failed to get page range (error %d).\n",
+				__FUNCTION__, (int)kerr);
+	/*
+	 * Read in each run of pages which are not valid with a single pagein
+	 * thus making them valid.
+	 *
+	 * We set UPL_NESTED_PAGEOUT to let ntfs_pagein() know that we already
+	 * have the inode locked (@ni->lock is held by the caller).
+	 */
+	for (i = 0; i < nr_pages; i++) {
+		if (upl_valid_page(*pl, i))
+			continue;
+		start = i;
+		while (i + 1 < nr_pages && !upl_valid_page(*pl, i + 1))
+			i++;
+		ntfs_debug("Reading pages 0x%x to 0x%x as they were not "
+				"valid.", start, i);
+		err = ntfs_pagein(ni, ofs + ((s64)start << PAGE_SHIFT),
+				(i + 1 - start) << PAGE_SHIFT, *upl,
+				start << PAGE_SHIFT, UPL_IOSYNC |
+				UPL_NOCOMMIT | UPL_NESTED_PAGEOUT);
+		if (err) {
+			ntfs_error(ni->vol->mp, "Failed to read page range "
+					"(error %d).", err);
+			goto pagein_err;
+		}
+	}
+	/* Map the page range into the kernel's address space. */
+	kerr = ubc_upl_map(*upl, (vm_offset_t*)kaddr);
+	if (kerr == KERN_SUCCESS) {
+		*size = map_size;
+		ntfs_debug("Done (mapped 0x%x bytes).", map_size);
+		return 0;
+	}
+	ntfs_error(ni->vol->mp, "Failed to map page range (error %d).",
+			(int)kerr);
+	err = EIO;
+pagein_err:
+	/*
+	 * Release each page as ntfs_page_map_ext() would, i.e. dump it if it
+	 * is not valid or if caching is disabled and it is not dirty.
+	 */
+	for (i = 0; i < nr_pages; i++) {
+		int abort_flags;
+
+		abort_flags = UPL_ABORT_FREE_ON_EMPTY;
+		if (!upl_valid_page(*pl, i) || (vnode_isnocache(ni->vn) &&
+				!upl_dirty_page(*pl, i)))
+			abort_flags |= UPL_ABORT_DUMP_PAGES;
+		ubc_upl_abort_range(*upl, i << PAGE_SHIFT, PAGE_SIZE,
+				abort_flags);
+	}
+err:
+	*upl = NULL;
+	return err;
+}
+
+/**
+ * ntfs_page_readahead - start asynchronous read-ahead of a range of a vnode
+ * @ni:		ntfs inode whose data to read ahead
+ * @ofs:	byte offset into @ni at which to start the read-ahead
+ * @size:	number of bytes to read ahead
+ *
+ * Start asynchronous reads for all the pages in the byte range @ofs to
+ * @ofs + @size of the ntfs inode @ni which are not already in memory.  Pages
+ * which are already in memory, including any that are currently mapped by the
+ * caller, are left alone.
+ *
+ * The cluster layer maps the range to disk via ntfs_vnop_blockmap() thus it
+ * issues one i/o for each physically contiguous extent of the runlist.  For
+ * mst protected attributes ntfs_cluster_iodone() removes the fixups as each
+ * i/o completes just like for a normal pagein.
+ *
+ * Read-ahead is only a hint thus nothing is done for resident, compressed, or
+ * encrypted attributes and if read-ahead is disabled on the vnode, and errors
+ * are ignored.
+ *
+ * Locking: - Caller must hold an iocount reference on the vnode of @ni.
+ *	    - Caller must hold @ni->lock for reading or writing.
+ *	    - Caller must not hold @ni->rl.lock nor have the mft record of the
+ *	      base inode of @ni mapped as ntfs_vnop_blockmap() may need to map
+ *	      the runlist.
+ */
+void ntfs_page_readahead(ntfs_inode *ni, s64 ofs, s64 size)
+{
+	s64 end;
+	int (*callback)(buf_t, void *);
+
+	if (!NInoNonResident(ni) || (ni->type != AT_INDEX_ALLOCATION &&
+			(NInoCompressed(ni) || NInoEncrypted(ni))) ||
+			vnode_isnoreadahead(ni->vn))
+		return;
+	lck_spin_lock(&ni->size_lock);
+	end = ubc_getsize(ni->vn);
+	if (end > ni->data_size)
+		end = ni->data_size;
+	lck_spin_unlock(&ni->size_lock);
+	size += ofs & PAGE_MASK_64;
+	ofs &= ~PAGE_MASK_64;
+	if (ofs >= end || size <= 0)
+		return;
+	if (size > end - ofs)
+		size = end - ofs;
+	if (size > INT_MAX)
+		size = INT_MAX & ~PAGE_MASK;
+	ntfs_debug("Reading ahead inode 0x%llx, offset 0x%llx, size 0x%llx.",
+			(unsigned long long)ni->mft_no,
+			(unsigned long long)ofs, (unsigned long long)size);
+	callback = NULL;
+	if (NInoMstProtected(ni))
+		callback = ntfs_cluster_iodone;
+	(void)advisory_read_ext(ni->vn, end, ofs, (int)size, callback, NULL,
+			0);
+}
+
 /**
  * ntfs_page_unmap - unmap a page belonging to a vnode from memory
  * @ni:		ntfs inode to which the page belongs
@@ -510,6 +702,86 @@ void ntfs_page_unmap(ntfs_inode *ni, upl_t upl, upl_page_info_array_t pl,
 	}
 }
 
+/**
+ * ntfs_page_unmap_range - unmap a range of pages belonging to a vnode
+ * @ni:		ntfs inode to which the page range belongs
+ * @upl:	page list of the page range
+ * @pl:		array of pages containing the page range
+ * @size:	size in bytes of the page range as returned by the mapping
+ * @mark_dirty:	mark all pages in the range dirty
+ *
+ * Unmap the page range mapped with ntfs_page_map_range() belonging to the
+ * ntfs inode @ni from memory releasing it back to the vm.
+ *
+ * Each page is released as ntfs_page_unmap() would, i.e. it is committed
+ * preserving its dirty state unless it is clean, not being marked dirty, and
+ * caching is disabled on the vnode in which case it is dumped.  Consecutive
+ * pages which are released the same way are committed or dumped together.
+ *
+ * If @mark_dirty is TRUE, tell the vm to mark every page in the range dirty
+ * when releasing it.
+ *
+ * Locking: Caller must hold an iocount reference on the vnode of @ni.
+ */
+void ntfs_page_unmap_range(ntfs_inode *ni, upl_t upl,
+		upl_page_info_array_t pl, unsigned size, const BOOL mark_dirty)
+{
+	kern_return_t kerr;
+	unsigned nr_pages, start, i;
+	int flags, next_flags;
+	BOOL nocache;
+
+	ntfs_debug("Entering for inode 0x%llx, size 0x%x%s.",
+			(unsigned long long)ni->mft_no, size,
+			mark_dirty ? ", marking it dirty" : "");
+	/* Unmap the page range from the kernel's address space. */
+	kerr = ubc_upl_unmap(upl);
+	if (kerr != KERN_SUCCESS)
+		ntfs_warning(ni->vol->mp, "ubc_upl_unmap() failed (error %d).",
+				(int)kerr);
+	nocache = vnode_isnocache(ni->vn);
+	nr_pages = size >> PAGE_SHIFT;
+	/*
+	 * Determine the commit flags for each page exactly as in
+	 * ntfs_page_unmap() using zero to mean that the page is to be dumped
+	 * and release each run of pages with the same flags in one go.
+	 */
+	flags = 0;
+	for (start = i = 0; i <= nr_pages; i++) {
+		next_flags = -1;
+		if (i < nr_pages) {
+			BOOL was_valid, was_dirty;
+
+			was_valid = upl_valid_page(pl, i);
+			was_dirty = (was_valid && upl_dirty_page(pl, i));
+			next_flags = 0;
+			if (was_dirty || mark_dirty || !nocache) {
+				next_flags = UPL_COMMIT_FREE_ON_EMPTY |
+						UPL_COMMIT_INACTIVATE;
+				if (!was_valid && !mark_dirty)
+					next_flags |= UPL_COMMIT_CLEAR_DIRTY;
+				else if (was_dirty || mark_dirty)
+					next_flags |= UPL_COMMIT_SET_DIRTY;
+			}
+			if (!i || next_flags == flags) {
+				flags = next_flags;
+				continue;
+			}
+		}
+		if (flags)
+			ubc_upl_commit_range(upl, start << PAGE_SHIFT,
+					(i - start) << PAGE_SHIFT, flags);
+		else
+			ubc_upl_abort_range(upl, start << PAGE_SHIFT,
+					(i - start) << PAGE_SHIFT,
+					UPL_ABORT_DUMP_PAGES |
+					UPL_ABORT_FREE_ON_EMPTY);
+		start = i;
+		flags = next_flags;
+	}
+	ntfs_debug("Done.");
+}
+
 /**
  * ntfs_page_dump - discard a page belonging to a vnode from memory
  * @ni:		ntfs inode to which the page belongs
@@ -47,6 +47,14 @@
 __private_extern__ int ntfs_pagein(ntfs_inode *ni, s64 attr_ofs, unsigned size,
 		upl_t upl, upl_offset_t upl_ofs, int flags);
 
+/*
+ * The maximum number of bytes mapped by a single call to
+ * ntfs_page_map_range().  This bounds the size of the page list and of the
+ * kernel mapping whilst still allowing a bulk scan to be read with one i/o
+ * per physically contiguous extent.
+ */
+#define NTFS_PAGE_MAP_RANGE_MAX	(256 * 1024)
+
 __private_extern__ errno_t ntfs_page_map_ext(ntfs_inode *ni, s64 ofs,
 		upl_t *upl, upl_page_info_array_t *pl, u8 **kaddr,
 		const BOOL uptodate, const BOOL rw);
@@ -110,9 +118,18 @@ static inline errno_t ntfs_page_grab(ntfs_inode *ni, s64 ofs, upl_t *upl,
 	return ntfs_page_map_ext(ni, ofs, upl, pl, kaddr, FALSE, rw);
 }
 
+__private_extern__ errno_t ntfs_page_map_range(ntfs_inode *ni, s64 ofs,
+		unsigned *size, upl_t *upl, upl_page_info_array_t *pl,
+		u8 **kaddr, const BOOL rw);
+
+__private_extern__ void ntfs_page_readahead(ntfs_inode *ni, s64 ofs, s64 size);
+
 __private_extern__ void ntfs_page_unmap(ntfs_inode *ni, upl_t upl,
 		upl_page_info_array_t pl, const BOOL mark_dirty);
 
+__private_extern__ void ntfs_page_unmap_range(ntfs_inode *ni, upl_t upl,
+		upl_page_info_array_t pl, unsigned size, const BOOL mark_dirty);
+
 __private_extern__ void ntfs_page_dump(ntfs_inode *ni, upl_t upl,
 		upl_page_info_array_t pl);
 
@@ -41,6 +41,8 @@
 
 #include <string.h>
 
+#include <libkern/OSAtomic.h>
+
 #include <kern/debug.h>
 //#include <kern/locks.h>
 #include "al_lock.h"
@@ -76,13 +78,39 @@ static inline void ntfs_rl_copy(ntfs_rl_element *dst, ntfs_rl_element *src,
 		memcpy(dst, src, size * sizeof(ntfs_rl_element));
 }
 
+/**
+ * ntfs_rl_alloc_count - get the number of runlist elements to allocate
+ * @alloc_count:	number of runlist elements currently allocated
+ * @elements:		number of runlist elements that need to fit
+ *
+ * Return the number of runlist elements to allocate when growing an array of
+ * runlist elements of which @alloc_count are allocated at present so that it
+ * can hold @elements elements.
+ *
+ * The array grows by at least half its current size so that building up a
+ * runlist one element at a time does not copy the whole runlist for every few
+ * added elements.  The size is rounded up to a multiple of NTFS_ALLOC_BLOCK
+ * bytes.
+ */
+unsigned ntfs_rl_alloc_count(const unsigned alloc_count,
+		const unsigned elements)
+{
+	unsigned count = alloc_count + (alloc_count >> 1);
+
+	if (count < elements)
+		count = elements;
+	return ((count * sizeof(ntfs_rl_element) + NTFS_ALLOC_BLOCK - 1) &
+			~(NTFS_ALLOC_BLOCK - 1)) / sizeof(ntfs_rl_element);
+}
+
 /**
  * ntfs_rl_inc - append runlist elements to an existing runlist
  * @runlist:	runlist for which to increment the number of runlist elements
  * @delta:	number of elements to add to the runlist
  *
  * Increment the number of elements in the array of runlist elements of the
- * runlist @runlist by @delta.  Reallocate the array buffer if needed.
+ * runlist @runlist by @delta.  Reallocate the array buffer if needed, growing
+ * it geometrically (see ntfs_rl_alloc_count()).
  *
  * Return 0 on success and ENOMEM if not enough memory to reallocate the
  * runlist, in which case the runlist @runlist is left unmodified.
@@ -94,9 +122,8 @@ static errno_t ntfs_rl_inc(ntfs_runlist *runlist, unsigned delta)
 {
 	unsigned new_elements = runlist->elements + delta;
 	unsigned count = runlist->alloc_count;
-	unsigned new_size = (new_elements * sizeof(ntfs_rl_element) + NTFS_ALLOC_BLOCK - 1) & ~(NTFS_ALLOC_BLOCK - 1);
-	unsigned new_count = new_size / sizeof (ntfs_rl_element);
-	if (new_count > count) {
+	if (new_elements > count) {
+		unsigned new_count = ntfs_rl_alloc_count(count, new_elements);
 		ntfs_rl_element* new_rl = IONewData(ntfs_rl_element, new_count);
 		if (!new_rl)
 			return ENOMEM;
@@ -151,10 +178,9 @@ static errno_t ntfs_rl_ins(ntfs_runlist *runlist, unsigned pos, unsigned ins_cou
 		panic("%s(): pos > runlist->elements\n", __FUNCTION__);
 	unsigned new_elements = runlist->elements + ins_count;
 	unsigned count = runlist->alloc_count;
-	unsigned new_size = (new_elements * sizeof(ntfs_rl_element) + NTFS_ALLOC_BLOCK - 1) & ~(NTFS_ALLOC_BLOCK - 1);
-	unsigned new_count = new_size / sizeof (ntfs_rl_element);
+	unsigned new_count;
 	/* If no memory reallocation needed, it is a simple memmove(). */
-	if (new_count <= count) {
+	if (new_elements <= count) {
 		if (ins_count) {
 			new_rl += pos;
 			ntfs_rl_move(new_rl + ins_count, new_rl, runlist->elements - pos);
@@ -168,6 +194,7 @@ static errno_t ntfs_rl_ins(ntfs_runlist *runlist, unsigned pos, unsigned ins_cou
 	 * of the newly allocated array of runlist elements unless @pos is zero
 	 * in which case a single memcpy() is sufficient.
 	 */
+	new_count = ntfs_rl_alloc_count(count, new_elements);
 	new_rl = IONewData(ntfs_rl_element, new_count);
 	if (!new_rl)
 		return ENOMEM;
@@ -832,6 +859,41 @@ done:
 	return 0;
 }
 
+/**
+ * ntfs_mapping_pairs_get_value - read a signed value from a mapping pair
+ * @src:	first byte of the value
+ * @n:		number of bytes in the value
+ * @end:	first byte past the end of the buffer containing @src
+ *
+ * Read the @n byte, little endian, signed value at @src and sign extend it to
+ * 64 bits.  The caller must have checked that the @n bytes at @src are inside
+ * the buffer.
+ *
+ * When there are at least eight bytes left before @end, which is the case for
+ * all but the last few pairs of a mapping pairs array, the value is fetched
+ * with a single unaligned load and the unwanted high bytes are shifted out.
+ * Otherwise, and for the corrupt case of @n > 8, we fall back to assembling
+ * the value a byte at a time.
+ *
+ * Return the sign extended value.
+ */
+static inline s64 ntfs_mapping_pairs_get_value(const u8 *src, unsigned n,
+		const u8 *end)
+{
+	s64 v;
+
+	if (n <= 8 && end - src >= 8) {
+		le64 l;
+		const unsigned shift = 64 - (n << 3);
+
+		memcpy(&l, src, sizeof(l));
+		return (s64)(le64_to_cpu(l) << shift) >> shift;
+	}
+	for (v = (s8)src[--n]; n; n--)
+		v = (v << 8) + src[n - 1];
+	return v;
+}
+
 /**
  * ntfs_mapping_pairs_decompress - convert mapping pairs array to runlist
  * @vol:	ntfs volume on which the attribute resides
@@ -874,7 +936,8 @@ errno_t ntfs_mapping_pairs_decompress(ntfs_volume *vol, const ATTR_RECORD *a,
 	unsigned rlcount;	/* Size of runlist buffer. */
 	unsigned rlpos;		/* Current runlist position in units of
 				   ntfs_rl_elements. */
-	unsigned b;		/* Current byte offset in buf. */
+	unsigned b;		/* Size of the length in bytes. */
+	u8 hdr;			/* Header byte of the current pair. */
 	errno_t err = EIO;
 
 	/* Make sure @a exists and is non-resident. */
@@ -915,7 +978,9 @@ errno_t ntfs_mapping_pairs_decompress(ntfs_volume *vol, const ATTR_RECORD *a,
 		 * not-mapped and terminator elements.
 		 */
 		if (rlpos + 3 > rlcount) {
-			ntfs_rl_element *rl2 = IONewData(ntfs_rl_element, rlcount + NTFS_ALLOC_BLOCK / sizeof (ntfs_rl_element));
+			unsigned rlcount2 = ntfs_rl_alloc_count(rlcount,
+					rlpos + 3);
+			ntfs_rl_element *rl2 = IONewData(ntfs_rl_element, rlcount2);
 			if (!rl2) {
 				err = ENOMEM;
 				goto err;
@@ -923,7 +988,7 @@ errno_t ntfs_mapping_pairs_decompress(ntfs_volume *vol, const ATTR_RECORD *a,
 			memcpy(rl2, rl, rlcount * sizeof (ntfs_rl_element));
 			IODeleteData(rl, ntfs_rl_element, rlcount);
 			rl = rl2;
-			rlcount += NTFS_ALLOC_BLOCK / sizeof (ntfs_rl_element);
+			rlcount = rlcount2;
 		}
 		/* Enter the current vcn into the current runlist element. */
 		rl[rlpos].vcn = vcn;
@@ -933,12 +998,13 @@ errno_t ntfs_mapping_pairs_decompress(ntfs_volume *vol, const ATTR_RECORD *a,
 		 * values.  A negative run length does not make any sense, but
 		 * hey, I did not design NTFS...
 		 */
-		b = *buf & 0xf;
+		hdr = *buf;
+		b = hdr & 0xf;
 		if (b) {
 			if (buf + b >= a_end)
 				goto io_err;
-			for (deltaxcn = (s8)buf[b--]; b; b--)
-				deltaxcn = (deltaxcn << 8) + buf[b];
+			deltaxcn = ntfs_mapping_pairs_get_value(buf + 1, b,
+					a_end);
 		} else { /* The length entry is compulsory. */
 			ntfs_error(vol->mp, "Missing length entry in mapping "
 					"pairs array.");
@@ -965,16 +1031,14 @@ errno_t ntfs_mapping_pairs_decompress(ntfs_volume *vol, const ATTR_RECORD *a,
 		 * sparse clusters on NTFS 3.0+, in which case we set the lcn
 		 * to LCN_HOLE.
 		 */
-		if (!(*buf & 0xf0))
+		if (!(hdr & 0xf0))
 			rl[rlpos].lcn = LCN_HOLE;
 		else {
 			/* Get the lcn change which really can be negative. */
-			u8 b2 = *buf & 0xf;
-			b = b2 + ((*buf >> 4) & 0xf);
-			if (buf + b >= a_end)
+			if (buf + b + (hdr >> 4) >= a_end)
 				goto io_err;
-			for (deltaxcn = (s8)buf[b--]; b > b2; b--)
-				deltaxcn = (deltaxcn << 8) + buf[b];
+			deltaxcn = ntfs_mapping_pairs_get_value(buf + 1 + b,
+					hdr >> 4, a_end);
 			/* Change the current lcn to its new value. */
 			lcn += deltaxcn;
 #ifdef DEBUG
@@ -1004,7 +1068,7 @@ errno_t ntfs_mapping_pairs_decompress(ntfs_volume *vol, const ATTR_RECORD *a,
 		/* Get to the next runlist element. */
 		rlpos++;
 		/* Increment the buffer position to the next mapping pair. */
-		buf += (*buf & 0xf) + ((*buf >> 4) & 0xf) + 1;
+		buf += b + (hdr >> 4) + 1;
 	}
 	if (buf >= a_end)
 		goto io_err;
@@ -1083,6 +1147,72 @@ io_err:
 	goto err;
 }
 
+/**
+ * ntfs_mapping_pairs_find - find the mapping pair starting at a vcn
+ * @a:		non-resident attribute record whose mapping pairs array to search
+ * @vcn:	vcn at which the mapping pair to find starts
+ * @ofs:	destination in which to return the byte offset of the pair
+ * @prev_lcn:	destination in which to return the lcn before the pair
+ *
+ * Walk the mapping pairs array of the attribute record @a and find the
+ * mapping pair describing the run starting at @vcn.  On success, return in
+ * *@ofs the byte offset of the pair from the start of the mapping pairs array
+ * and in *@prev_lcn the lcn the lcn delta of that pair is relative to.  If
+ * @vcn is the first vcn past the end of the array, the offset of the
+ * terminator byte is returned.
+ *
+ * Together with ntfs_get_size_for_mapping_pairs_ext() and
+ * ntfs_mapping_pairs_build_ext() this allows rewriting just the tail of a
+ * mapping pairs array rather than the whole array.  Only the header and
+ * values of the pairs are read so this is much cheaper than decompressing
+ * the array.
+ *
+ * Return 0 on success and errno on error.  The following error codes are
+ * defined:
+ *	ENOENT	- No mapping pair starts at @vcn.
+ *	EIO	- The mapping pairs array is corrupt.
+ */
+errno_t ntfs_mapping_pairs_find(const ATTR_RECORD *a, const VCN vcn,
+		unsigned *ofs, LCN *prev_lcn)
+{
+	const u8 *mp, *buf, *a_end;
+	VCN cur_vcn;
+	LCN lcn;
+	s64 length;
+	unsigned b, b2;
+
+	if (!a->non_resident)
+		return EIO;
+	mp = (const u8*)a + le16_to_cpu(a->mapping_pairs_offset);
+	a_end = (const u8*)a + le32_to_cpu(a->length);
+	if (mp < (const u8*)a || mp >= a_end)
+		return EIO;
+	cur_vcn = sle64_to_cpu(a->lowest_vcn);
+	lcn = 0;
+	for (buf = mp; cur_vcn < vcn; buf += b + b2 + 1) {
+		if (buf >= a_end)
+			return EIO;
+		if (!*buf)
+			return ENOENT;
+		b = *buf & 0xf;
+		b2 = *buf >> 4;
+		if (!b || buf + b + b2 >= a_end)
+			return EIO;
+		length = ntfs_mapping_pairs_get_value(buf + 1, b, a_end);
+		if (length < 0)
+			return EIO;
+		cur_vcn += length;
+		if (b2)
+			lcn += ntfs_mapping_pairs_get_value(buf + 1 + b, b2,
+					a_end);
+	}
+	if (cur_vcn != vcn || buf >= a_end)
+		return ENOENT;
+	*ofs = buf - mp;
+	*prev_lcn = lcn;
+	return 0;
+}
+
 /**
  * ntfs_rl_vcn_to_lcn - convert a vcn into a lcn given a runlist
  * @rl:		runlist to use for conversion
@@ -1109,8 +1239,9 @@ io_err:
  *	    - This function does not touch the lock.
  *	    - The runlist is not modified.
  *
- * TODO: If we pass in the number of runlist elements we could attempt to
- * optimise the for loop into a quasi binary search.
+ * Note this searches @rl linearly thus callers that have the ntfs_runlist
+ * should pass in the runlist element returned by ntfs_rl_lookup_nolock() in
+ * which case the search terminates immediately.
  */
 LCN ntfs_rl_vcn_to_lcn(const ntfs_rl_element *rl, const VCN vcn, s64 *clusters)
 {
@@ -1187,6 +1318,68 @@ ntfs_rl_element *ntfs_rl_find_vcn_nolock(ntfs_rl_element *rl, const VCN vcn)
 	return NULL;
 }
 
+/**
+ * ntfs_rl_lookup_nolock - find the runlist element containing a vcn
+ * @runlist:	runlist to search
+ * @vcn:	vcn to find
+ *
+ * Find the runlist element of the runlist @runlist which contains the virtual
+ * cluster number @vcn.  If @vcn is beyond the end of the runlist return the
+ * terminator element and if @vcn is before the start of the runlist return the
+ * first element.
+ *
+ * The returned element is thus a starting point from which ntfs_rl_vcn_to_lcn()
+ * and ntfs_rl_find_vcn_nolock() find @vcn immediately and it is only NULL if
+ * the runlist is empty.
+ *
+ * The element found by the last lookup and the element following it are
+ * checked first so that sequential access does not need to search.  Otherwise
+ * the runlist is binary searched.
+ *
+ * Locking: The runlist must be locked (for reading or writing) on entry.  Only
+ *	    @runlist->hint is modified.
+ */
+ntfs_rl_element *ntfs_rl_lookup_nolock(ntfs_runlist *runlist, const VCN vcn)
+{
+	ntfs_rl_element *rl;
+	unsigned lo, hi, mid;
+
+	if (vcn < 0)
+		panic("%s(): vcn < 0\n", __FUNCTION__);
+	if (!runlist->elements)
+		return NULL;
+	rl = runlist->rl;
+	hi = runlist->elements - 1;
+	if (vcn < rl[0].vcn)
+		return rl;
+	if (vcn >= rl[hi].vcn)
+		return &rl[hi];
+	/* Try the element found by the last lookup and the one after it. */
+	mid = runlist->hint;
+	if (mid < hi && vcn >= rl[mid].vcn) {
+		if (vcn < rl[mid + 1].vcn)
+			return &rl[mid];
+		if (++mid < hi && vcn < rl[mid + 1].vcn)
+			goto done;
+	}
+	/*
+	 * Binary search for the last element starting at or before @vcn.  We
+	 * know that rl[lo].vcn <= @vcn < rl[hi].vcn.
+	 */
+	lo = 0;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (rl[mid].vcn <= vcn)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	mid = lo;
+done:
+	runlist->hint = mid;
+	return &rl[mid];
+}
+
 /**
  * ntfs_get_nr_significant_bytes - get number of bytes needed to store a number
  * @n:		number for which to get the number of bytes for
@@ -1202,34 +1395,34 @@ ntfs_rl_element *ntfs_rl_find_vcn_nolock(ntfs_rl_element *rl, const VCN vcn)
  */
 static inline int ntfs_get_nr_significant_bytes(const s64 n)
 {
-	s64 l = n;
-	int i;
-	s8 j;
+	/*
+	 * Fold negative numbers onto their one's complement so that the
+	 * number of significant bits is given by the position of the highest
+	 * set bit plus one for the sign.  OR in 1 so that zero and -1, which
+	 * need a single byte, do not hit the undefined clz(0).
+	 */
+	const u64 l = (u64)(n ^ (n >> 63)) | 1;
 
-	i = 0;
-	do {
-		l >>= 8;
-		i++;
-	} while (l != 0 && l != -1);
-	j = (s8)(n >> (8 * (i - 1))) & 0xff;
-	/* If the sign bit is wrong, we need an extra byte. */
-	if ((n < 0 && j >= 0) || (n > 0 && j < 0))
-		i++;
-	return i;
+	return (64 - __builtin_clzll(l) + 8) >> 3;
 }
 
 /**
- * ntfs_get_size_for_mapping_pairs - get bytes needed for mapping pairs array
+ * ntfs_get_size_for_mapping_pairs_ext - get bytes needed for mapping pairs
  * @vol:	ntfs volume (needed for the ntfs version)
  * @rl:		locked runlist to determine the size of the mapping pairs of
  * @first_vcn:	first vcn which to include in the mapping pairs array
  * @last_vcn:	last vcn which to include in the mapping pairs array
+ * @prev_lcn:	lcn the first lcn delta is relative to
  * @mp_size:	destination pointer in which to return the size
  *
  * Walk the locked runlist @rl and calculate the size in bytes of the mapping
  * pairs array corresponding to the runlist @rl, starting at vcn @first_vcn and
  * finishing with vcn @last_vcn and return the size in *@mp_size.
  *
+ * @prev_lcn is the lcn in effect before the first mapping pair, i.e. zero for
+ * the start of a mapping pairs array, or the value returned by
+ * ntfs_mapping_pairs_find() when sizing the tail of an existing array.
+ *
  * A @last_vcn of -1 means end of runlist and in that case the size of the
  * mapping pairs array corresponding to the runlist starting at vcn @first_vcn
  * and finishing at the end of the runlist is determined.
@@ -1248,11 +1441,10 @@ static inline int ntfs_get_nr_significant_bytes(const s64 n)
  * Locking: @rl must be locked on entry (either for reading or writing), it
  *	    remains locked throughout, and is left locked upon return.
  */
-errno_t ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
+errno_t ntfs_get_size_for_mapping_pairs_ext(const ntfs_volume *vol,
 		const ntfs_rl_element *rl, const VCN first_vcn,
-		const VCN last_vcn, unsigned *mp_size)
+		const VCN last_vcn, LCN prev_lcn, unsigned *mp_size)
 {
-	LCN prev_lcn;
 	int rls;
 	BOOL the_end = FALSE;
 
@@ -1276,7 +1468,6 @@ errno_t ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		rl++;
 	if ((!rl->length && first_vcn > rl->vcn) || first_vcn < rl->vcn)
 		return EINVAL;
-	prev_lcn = 0;
 	/* Always need the termining zero byte. */
 	rls = 1;
 	/* Do the first partial run if present. */
@@ -1307,11 +1498,13 @@ errno_t ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		 * an lcn of -1 and not a delta_lcn of -1 (unless both are -1).
 		 */
 		if (rl->lcn >= 0 || vol->major_ver < 3) {
-			prev_lcn = rl->lcn;
-			if (rl->lcn >= 0)
-				prev_lcn += delta;
+			LCN lcn = rl->lcn;
+
+			if (lcn >= 0)
+				lcn += delta;
 			/* Change in lcn. */
-			rls += ntfs_get_nr_significant_bytes(prev_lcn);
+			rls += ntfs_get_nr_significant_bytes(lcn - prev_lcn);
+			prev_lcn = lcn;
 		}
 		/* Go to next runlist element. */
 		rl++;
@@ -1358,6 +1551,28 @@ err:
 	return rls;
 }
 
+/**
+ * ntfs_get_size_for_mapping_pairs - get bytes needed for mapping pairs array
+ * @vol:	ntfs volume (needed for the ntfs version)
+ * @rl:		locked runlist to determine the size of the mapping pairs of
+ * @first_vcn:	first vcn which to include in the mapping pairs array
+ * @last_vcn:	last vcn which to include in the mapping pairs array
+ * @mp_size:	destination pointer in which to return the size
+ *
+ * Same as ntfs_get_size_for_mapping_pairs_ext() for a mapping pairs array
+ * starting at @first_vcn, i.e. with a starting lcn of zero.
+ *
+ * Locking: @rl must be locked on entry (either for reading or writing), it
+ *	    remains locked throughout, and is left locked upon return.
+ */
+errno_t ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
+		const ntfs_rl_element *rl, const VCN first_vcn,
+		const VCN last_vcn, unsigned *mp_size)
+{
+	return ntfs_get_size_for_mapping_pairs_ext(vol, rl, first_vcn,
+			last_vcn, 0, mp_size);
+}
+
 /**
  * ntfs_write_significant_bytes - write the significant bytes of a number
  * @dst:	destination buffer to write to
@@ -1379,50 +1594,49 @@ err:
 static inline int ntfs_write_significant_bytes(s8 *dst, const s8 *dst_max,
 		const s64 n)
 {
-	s64 l = n;
+	const int len = ntfs_get_nr_significant_bytes(n);
+	s64 l;
 	int i;
-	s8 j;
 
-	i = 0;
-	do {
-		if (dst > dst_max)
-			goto err;
-		*dst++ = (s8)l & 0xff;
-		l >>= 8;
-		i++;
-	} while (l != 0 && l != -1);
-	j = (s8)(n >> (8 * (i - 1))) & 0xff;
-	/* If the sign bit is wrong, we need an extra byte. */
-	if (n < 0 && j >= 0) {
-		if (dst > dst_max)
-			goto err;
-		i++;
-		*dst = (s8)-1;
-	} else if (n > 0 && j < 0) {
-		if (dst > dst_max)
-			goto err;
-		i++;
-		*dst = (s8)0;
+	if (dst + len - 1 > dst_max)
+		return -ENOSPC;
+	/*
+	 * If there is room, store all eight bytes in one go.  The bytes past
+	 * @len are sign extension and are overwritten by whatever the caller
+	 * writes next or are left in the unused tail of the buffer.
+	 */
+	if (dst + 7 <= dst_max) {
+		const le64 v = cpu_to_le64((u64)n);
+
+		memcpy(dst, &v, sizeof(v));
+		return len;
 	}
-	return i;
-err:
-	return -ENOSPC;
+	for (l = n, i = 0; i < len; i++, l >>= 8)
+		dst[i] = (s8)l;
+	return len;
 }
 
 /**
- * ntfs_mapping_pairs_build - build the mapping pairs array from a runlist
+ * ntfs_mapping_pairs_build_ext - build the mapping pairs array from a runlist
  * @vol:	ntfs volume (needed for the ntfs version)
  * @dst:	destination buffer to which to write the mapping pairs array
  * @dst_len:	size of destination buffer @dst in bytes
  * @rl:		locked runlist for which to build the mapping pairs array
  * @first_vcn:	first vcn which to include in the mapping pairs array
  * @last_vcn:	last vcn which to include in the mapping pairs array
+ * @prev_lcn:	lcn the first lcn delta is relative to
  * @stop_vcn:	first vcn outside destination buffer on success or ENOSPC
  *
  * Create the mapping pairs array from the locked runlist @rl, starting at vcn
  * @first_vcn and finishing with vcn @last_vcn and save the array in @dst.
  * @dst_len is the size of @dst in bytes and it should be at least equal to the
- * value obtained by calling ntfs_get_size_for_mapping_pairs().
+ * value obtained by calling ntfs_get_size_for_mapping_pairs_ext() with the
+ * same @prev_lcn.
+ *
+ * @prev_lcn is the lcn in effect before the first mapping pair.  It is zero
+ * when building a complete mapping pairs array.  To rewrite only the tail of
+ * an existing array, pass the offset and lcn returned by
+ * ntfs_mapping_pairs_find() as @dst and @prev_lcn respectively.
  *
  * A @last_vcn of -1 means end of runlist and in that case the mapping pairs
  * array corresponding to the runlist starting at vcn @first_vcn and finishing
@@ -1447,11 +1661,11 @@ err:
  * Locking: @rl must be locked on entry (either for reading or writing), it
  *	    remains locked throughout, and is left locked upon return.
  */
-errno_t ntfs_mapping_pairs_build(const ntfs_volume *vol, s8 *dst,
+errno_t ntfs_mapping_pairs_build_ext(const ntfs_volume *vol, s8 *dst,
 		const unsigned dst_len, const ntfs_rl_element *rl,
-		const VCN first_vcn, const VCN last_vcn, VCN *const stop_vcn)
+		const VCN first_vcn, const VCN last_vcn, LCN prev_lcn,
+		VCN *const stop_vcn)
 {
-	LCN prev_lcn;
 	s8 *dst_max, *dst_next;
 	errno_t err = ENOSPC;
 	BOOL the_end = FALSE;
@@ -1487,7 +1701,6 @@ errno_t ntfs_mapping_pairs_build(const ntfs_volume *vol, s8 *dst,
 	 * ntfs_write_significant_bytes().
 	 */
 	dst_max = dst + dst_len - 1;
-	prev_lcn = 0;
 	/* Do the first partial run if present. */
 	if (first_vcn > rl->vcn) {
 		s64 delta, length = rl->length;
@@ -1521,14 +1734,16 @@ errno_t ntfs_mapping_pairs_build(const ntfs_volume *vol, s8 *dst,
 		 * change until someone tells us otherwise... (AIA)
 		 */
 		if (rl->lcn >= 0 || vol->major_ver < 3) {
-			prev_lcn = rl->lcn;
-			if (rl->lcn >= 0)
-				prev_lcn += delta;
+			LCN lcn = rl->lcn;
+
+			if (lcn >= 0)
+				lcn += delta;
 			/* Write change in lcn. */
 			lcn_len = ntfs_write_significant_bytes(dst + 1 +
-					len_len, dst_max, prev_lcn);
+					len_len, dst_max, lcn - prev_lcn);
 			if (lcn_len < 0)
 				goto size_err;
+			prev_lcn = lcn;
 		} else
 			lcn_len = 0;
 		dst_next = dst + len_len + lcn_len + 1;
@@ -1605,6 +1820,30 @@ err:
 	return err;
 }
 
+/**
+ * ntfs_mapping_pairs_build - build the mapping pairs array from a runlist
+ * @vol:	ntfs volume (needed for the ntfs version)
+ * @dst:	destination buffer to which to write the mapping pairs array
+ * @dst_len:	size of destination buffer @dst in bytes
+ * @rl:		locked runlist for which to build the mapping pairs array
+ * @first_vcn:	first vcn which to include in the mapping pairs array
+ * @last_vcn:	last vcn which to include in the mapping pairs array
+ * @stop_vcn:	first vcn outside destination buffer on success or ENOSPC
+ *
+ * Same as ntfs_mapping_pairs_build_ext() for a mapping pairs array starting
+ * at @first_vcn, i.e. with a starting lcn of zero.
+ *
+ * Locking: @rl must be locked on entry (either for reading or writing), it
+ *	    remains locked throughout, and is left locked upon return.
+ */
+errno_t ntfs_mapping_pairs_build(const ntfs_volume *vol, s8 *dst,
+		const unsigned dst_len, const ntfs_rl_element *rl,
+		const VCN first_vcn, const VCN last_vcn, VCN *const stop_vcn)
+{
+	return ntfs_mapping_pairs_build_ext(vol, dst, dst_len, rl, first_vcn,
+			last_vcn, 0, stop_vcn);
+}
+
 /**
  * ntfs_rl_shrink - remove runlist elements from the end of an existing runlist
  * @runlist:		runlist to shrink
@@ -1632,7 +1871,12 @@ static void ntfs_rl_shrink(ntfs_runlist *runlist, unsigned new_elements)
 		panic("%s(): !count || !runlist->rl\n", __FUNCTION__);
 	unsigned new_size = (new_elements * sizeof(ntfs_rl_element) + NTFS_ALLOC_BLOCK - 1) & ~(NTFS_ALLOC_BLOCK - 1);
 	unsigned new_count = new_size / sizeof (ntfs_rl_element);
-	if (new_count < count) {
+	/*
+	 * As the array is grown geometrically, only shrink it once less than
+	 * half of it is in use so that a runlist which is being truncated and
+	 * extended repeatedly does not get reallocated every time.
+	 */
+	if (new_count <= count / 2) {
 		ntfs_rl_element *new_rl = IONewData(ntfs_rl_element, new_count);
 		if (new_rl) {
 			ntfs_rl_copy(new_rl, runlist->rl, new_elements);
@@ -1643,8 +1887,8 @@ static void ntfs_rl_shrink(ntfs_runlist *runlist, unsigned new_elements)
 			ntfs_debug("Failed to shrink runlist buffer.  This "
 					"just wastes a bit of memory "
 					"temporarily so we ignore it.");
-	} else if (new_count != count)
-		panic("%s(): new_count != count\n", __FUNCTION__);
+	} else if (new_count > count)
+		panic("%s(): new_count > count\n", __FUNCTION__);
 	runlist->elements = new_elements;
 }
 
@@ -1690,6 +1934,9 @@ errno_t ntfs_rl_truncate_nolock(const ntfs_volume *vol,
 	if (new_length < 0)
 		panic("%s(): new_length < 0\n", __FUNCTION__);
 	ntfs_debug_runlist_dump(runlist);
+	/* Invalidate any cached translations of the runs we remove. */
+	runlist->gen++;
+	__sync_synchronize();
 	if (!new_length) {
 		ntfs_debug("Freeing runlist.");
 		if (rl) {
@@ -1869,6 +2116,9 @@ errno_t ntfs_rl_punch_nolock(const ntfs_volume *vol, ntfs_runlist *runlist,
 		return 0;
 	if (!rl->length)
 		return ENOENT;
+	/* Invalidate any cached translations of the runs we punch out. */
+	runlist->gen++;
+	__sync_synchronize();
 	/* If @start is in a hole simply extend the hole. */
 	if (rl->lcn == LCN_HOLE) {
 		/*
@@ -2138,9 +2388,16 @@ errno_t ntfs_rl_read(ntfs_volume *vol, ntfs_runlist *runlist, u8 *dst,
 				"is missing.");
 		return EIO;
 	}
-	/* Read all clusters specified by the runlist one run at a time. */
+	/*
+	 * Read all clusters specified by the runlist, treating runs which are
+	 * physically adjacent on disk as a single extent.  Within an extent we
+	 * fire off asynchronous read-ahead of the following blocks each time
+	 * we reach the end of the previous read-ahead window so that the whole
+	 * extent is in flight at once rather than being read one block at a
+	 * time.
+	 */
 	while (rl->length) {
-		daddr64_t block, max_block;
+		daddr64_t block, max_block, ra_block;
 
 		ntfs_debug("Reading vcn 0x%llx, lcn 0x%llx, length 0x%llx.",
 				(unsigned long long)rl->vcn,
@@ -2152,19 +2409,43 @@ errno_t ntfs_rl_read(ntfs_volume *vol, ntfs_runlist *runlist, u8 *dst,
 					"or sparse.  Cannot read data.");
 			return EIO;
 		}
-		/* Read the run from device in chunks of block_size bytes. */
+		/* Read the extent from device in chunks of block_size bytes. */
 		block = rl->lcn << cluster_to_block_shift;
 		max_block = block + (rl->length << cluster_to_block_shift);
+		while (rl[1].length && rl[1].lcn == rl->lcn + rl->length) {
+			rl++;
+			max_block += rl->length << cluster_to_block_shift;
+		}
 		ntfs_debug("max_block 0x%llx.", (unsigned long long)max_block);
+		ra_block = block + 1;
 		do {
+			daddr64_t ra_blocks[NTFS_RL_IO_RA_BLOCKS];
+			int ra_sizes[NTFS_RL_IO_RA_BLOCKS];
+			int nr_ra = 0;
 			u8 *src;
 
-			ntfs_debug("Reading block 0x%llx.",
-					(unsigned long long)block);
-			err = buf_meta_bread(dev_vn, block, block_size, NOCRED,
+			if (block + 1 >= ra_block) {
+				s64 left;
+
+				/* Only read ahead what we are going to use. */
+				left = ((dst_end - dst) + block_size - 1) >>
+						vol->sector_size_shift;
+				ra_block = block + 1;
+				while (nr_ra < NTFS_RL_IO_RA_BLOCKS &&
+						ra_block < max_block &&
+						nr_ra + 1 < left) {
+					ra_sizes[nr_ra] = block_size;
+					ra_blocks[nr_ra++] = ra_block++;
+				}
+			}
+			ntfs_debug("Reading block 0x%llx, read-ahead %d "
+					"blocks.", (unsigned long long)block,
+					nr_ra);
+			err = buf_meta_breadn(dev_vn, block, block_size,
+					ra_blocks, ra_sizes, nr_ra, NOCRED,
 					&buf);
 			if (err) {
-				ntfs_error(vol->mp, "buf_meta_bread() failed "
+				ntfs_error(vol->mp, "buf_meta_breadn() failed "
 						"(error %d).  Cannot read "
 						"data.", (int)err);
 				goto err;
@@ -2205,6 +2486,62 @@ err:
 	return err;
 }
 
+/**
+ * ntfs_rl_write_io - state shared between ntfs_rl_write() and its i/o
+ * @lock:	protects @pending and @err
+ * @pending:	number of buffer writes in flight
+ * @err:	first error returned by a buffer write
+ */
+typedef struct {
+	al_lck_mtx_t lock;
+	unsigned pending;
+	errno_t err;
+} ntfs_rl_write_io;
+
+/**
+ * ntfs_rl_write_done - i/o completion callback for ntfs_rl_write()
+ * @buf:	buffer whose write has completed
+ * @arg:	the ntfs_rl_write_io describing the write in progress
+ *
+ * Record the error status of the completed write of @buf, release @buf, and
+ * wake up ntfs_rl_write() if this was the last write in flight or if it is
+ * waiting for the number of writes in flight to drop.
+ */
+static void ntfs_rl_write_done(buf_t buf, void *arg)
+{
+	ntfs_rl_write_io *io = arg;
+	errno_t err;
+
+	err = buf_error(buf);
+	buf_brelse(buf);
+	lck_mtx_lock(&io->lock);
+	if (err && !io->err)
+		io->err = err;
+	io->pending--;
+	wakeup(io);
+	lck_mtx_unlock(&io->lock);
+}
+
+/**
+ * ntfs_rl_write_wait - wait for writes issued by ntfs_rl_write() to complete
+ * @io:		the ntfs_rl_write_io describing the write in progress
+ * @max:	maximum number of writes which may remain in flight
+ *
+ * Sleep until at most @max of the buffer writes issued for @io are still in
+ * flight and return the first error any of the completed writes returned.
+ */
+static errno_t ntfs_rl_write_wait(ntfs_rl_write_io *io, const unsigned max)
+{
+	errno_t err;
+
+	lck_mtx_lock(&io->lock);
+	while (io->pending > max)
+		(void)msleep(io, &io->lock, PRIBIO, __FUNCTION__, 0);
+	err = io->err;
+	lck_mtx_unlock(&io->lock);
+	return err;
+}
+
 /**
  * ntfs_rl_write - write data to disk as described by an runlist
  * @vol:	ntfs volume to which to write
@@ -2224,6 +2561,12 @@ err:
  * adjusted accordingly and it will be rounded up to the next device block
  * boundary and anything outside @size will be written as zeroes.
  *
+ * Runs which are physically adjacent on disk are written as a single extent
+ * and the buffer writes are issued asynchronously, with up to
+ * NTFS_RL_IO_MAX_PENDING of them in flight at a time, rather than waiting for
+ * each buffer write to complete before issuing the next one.  We wait for all
+ * of them to complete before returning.
+ *
  * Return 0 on success and errno on error.
  *
  * Note: Sparse runlists are not supported by this function.
@@ -2238,8 +2581,9 @@ errno_t ntfs_rl_write(ntfs_volume *vol, u8 *src, const s64 size,
 	VCN vcn;
 	u8 *src_end, *src_stop;
 	ntfs_rl_element *rl;
+	ntfs_rl_write_io io;
 	errno_t err;
-	unsigned block_size, block_shift, cluster_shift, shift, delta, vcn_ofs;
+	unsigned block_size, block_shift, cluster_shift, delta, vcn_ofs;
 
 	ntfs_debug("Entering for size 0x%llx, ofs 0x%llx.",
 			(unsigned long long)size, (unsigned long long)ofs);
@@ -2259,7 +2603,6 @@ errno_t ntfs_rl_write(ntfs_volume *vol, u8 *src, const s64 size,
 	block_size = vol->sector_size;
 	block_shift = vol->sector_size_shift;
 	cluster_shift = vol->cluster_size_shift;
-	shift = cluster_shift - block_shift;
 	/*
 	 * Align the start offset to contain a whole buffer.  This makes things
 	 * simpler.
@@ -2267,27 +2610,34 @@ errno_t ntfs_rl_write(ntfs_volume *vol, u8 *src, const s64 size,
 	delta = ofs & vol->sector_size_mask;
 	ofs -= delta;
 	src += ofs;
-	rl = runlist->rl;
 	/* Skip to the start offset @ofs in the runlist. */
 	vcn = ofs >> cluster_shift;
 	vcn_ofs = ofs & vol->cluster_size_mask;
-	rl = ntfs_rl_find_vcn_nolock(rl, vcn);
+	rl = ntfs_rl_find_vcn_nolock(ntfs_rl_lookup_nolock(runlist, vcn), vcn);
 	if (!rl || !rl->length)
 		panic("%s(): !rl || !rl->length\n", __FUNCTION__);
-	/* Write the clusters specified by the runlist one at a time. */
+	lck_mtx_init(&io.lock, ntfs_lock_grp, ntfs_lock_attr);
+	io.pending = 0;
+	io.err = 0;
+	/* Write the clusters specified by the runlist one extent at a time. */
 	do {
-		LCN lcn;
 		daddr64_t block, end_block;
 
-		lcn = ntfs_rl_vcn_to_lcn(rl, vcn, NULL);
-		if (lcn < 0)
-			panic("%s(): lcn < 0\n", __FUNCTION__);
+		if (rl->lcn < 0)
+			panic("%s(): rl->lcn < 0\n", __FUNCTION__);
 		ntfs_debug("Writing vcn 0x%llx, start offset 0x%x, lcn "
 				"0x%llx.", (unsigned long long)vcn, vcn_ofs,
-				(unsigned long long)lcn);
+				(unsigned long long)(rl->lcn + vcn - rl->vcn));
 		/* Write to the device in chunks of sectors. */
-		block = ((lcn << cluster_shift) + vcn_ofs) >> block_shift;
-		end_block = (lcn + 1) << shift;
+		block = (((rl->lcn + vcn - rl->vcn) << cluster_shift) +
+				vcn_ofs) >> block_shift;
+		end_block = (rl->lcn + rl->length) << (cluster_shift -
+				block_shift);
+		while (rl[1].length && rl[1].lcn == rl->lcn + rl->length) {
+			rl++;
+			end_block += rl->length << (cluster_shift -
+					block_shift);
+		}
 		ntfs_debug("end_block 0x%llx.", (unsigned long long)end_block);
 		do {
 			buf_t buf;
@@ -2295,6 +2645,18 @@ errno_t ntfs_rl_write(ntfs_volume *vol, u8 *src, const s64 size,
 
 			ntfs_debug("Writing block 0x%llx.",
 					(unsigned long long)block);
+			/*
+			 * Do not let too many writes pile up, both so that we
+			 * do not tie up too many buffers and so that we notice
+			 * errors early.
+			 */
+			err = ntfs_rl_write_wait(&io,
+					NTFS_RL_IO_MAX_PENDING - 1);
+			if (err) {
+				ntfs_error(vol->mp, "buf_bawrite() failed "
+						"(error %d).", err);
+				goto err;
+			}
 			/* Obtain the buffer, possibly not uptodate. */
 			buf = buf_getblk(dev_vn, block, block_size, 0, 0,
 					BLK_META);
@@ -2317,35 +2679,48 @@ errno_t ntfs_rl_write(ntfs_volume *vol, u8 *src, const s64 size,
 				block_size = delta;
 			}
 			/*
-			 * Copy the modified data into the buffer and write it
-			 * synchronously.
+			 * Copy the modified data into the buffer and start
+			 * writing it.  ntfs_rl_write_done() releases it when
+			 * the write has completed.
 			 */
 			memcpy(dst, src, block_size);
 			err = buf_unmap(buf);
 			if (err)
 				ntfs_error(vol->mp, "buf_unmap() failed "
 						"(error %d).", err);
-			err = buf_bwrite(buf);
-			if (err) {
-				ntfs_error(vol->mp, "buf_bwrite() failed "
-						"(error %d).", err);
-				goto err;
-			}
+			lck_mtx_lock(&io.lock);
+			io.pending++;
+			lck_mtx_unlock(&io.lock);
+			/*
+			 * Errors are reported to ntfs_rl_write_done() and
+			 * picked up by ntfs_rl_write_wait().
+			 */
+			buf_setcallback(buf, ntfs_rl_write_done, &io);
+			(void)buf_bawrite(buf);
 			src += block_size;
 			if (src >= src_stop)
 				goto done;
 		} while (++block < end_block);
-		if (++vcn >= rl[1].vcn) {
-			rl++;
-			if (!rl->length)
-				break;
-		}
+		rl++;
+		if (!rl->length)
+			break;
+		vcn = rl->vcn;
 		vcn_ofs = 0;
 	} while (1);
 done:
+	/* Wait for all the writes to complete. */
+	err = ntfs_rl_write_wait(&io, 0);
+	lck_mtx_destroy(&io.lock, ntfs_lock_grp);
+	if (err) {
+		ntfs_error(vol->mp, "buf_bawrite() failed (error %d).", err);
+		goto io_err;
+	}
 	ntfs_debug("Done.");
 	return 0;
 err:
+	(void)ntfs_rl_write_wait(&io, 0);
+	lck_mtx_destroy(&io.lock, ntfs_lock_grp);
+io_err:
 	ntfs_error(vol->mp, "Failed to update attribute list attribute on "
 			"disk due to i/o error on buffer write.  Leaving "
 			"inconsistent metadata.  Run chkdsk.");
@@ -2476,14 +2851,13 @@ s64 ntfs_rl_get_nr_real_clusters(ntfs_runlist *runlist, const VCN start_vcn,
 		end_vcn = start_vcn + cnt;
 	rl = runlist->rl;
 	if (start_vcn > 0)
-		rl = ntfs_rl_find_vcn_nolock(rl, start_vcn);
+		rl = ntfs_rl_find_vcn_nolock(ntfs_rl_lookup_nolock(runlist,
+				start_vcn), start_vcn);
 	if (!rl || !rl->length)
 		goto done;
 	if (rl->lcn >= 0) {
-		s64 delta;
-		
-		delta = start_vcn - rl->vcn;
-		nr_real_clusters = rl[1].vcn - delta;
+		/* Only count the part of the run starting at @start_vcn. */
+		nr_real_clusters = rl[1].vcn - start_vcn;
 		if (nr_real_clusters > cnt) {
 			nr_real_clusters = cnt;
 			goto done;
@@ -2508,3 +2882,650 @@ done:
 	ntfs_debug("Done (nr_real_clusters 0x%llx).", nr_real_clusters);
 	return nr_real_clusters;
 }
+
+ntfs_rl_packed_stats ntfs_rl_pstats;
+
+/**
+ * ntfs_rl_packed_put - encode an unsigned LEB128 varint
+ */
+static inline u8 *ntfs_rl_packed_put(u8 *dst, u64 val)
+{
+	while (val >= 0x80) {
+		*dst++ = (u8)val | 0x80;
+		val >>= 7;
+	}
+	*dst++ = (u8)val;
+	return dst;
+}
+
+/**
+ * ntfs_rl_packed_get - decode an unsigned LEB128 varint
+ */
+static inline const u8 *ntfs_rl_packed_get(const u8 *src, u64 *val)
+{
+	u64 v = 0;
+	unsigned shift = 0;
+
+	while (*src & 0x80) {
+		v |= (u64)(*src++ & 0x7f) << shift;
+		shift += 7;
+	}
+	*val = v | ((u64)*src++ << shift);
+	return src;
+}
+
+/**
+ * ntfs_rl_packed_run_put - encode a runlist element into a packed runlist
+ * @dst:	destination buffer of at least 20 bytes
+ * @rl:		runlist element to encode
+ * @prev_lcn:	previous real lcn, updated if @rl has a real lcn
+ *
+ * Return the number of bytes written to @dst or 0 if @rl cannot be encoded.
+ */
+static unsigned ntfs_rl_packed_run_put(u8 *dst, const ntfs_rl_element *rl,
+		LCN *prev_lcn)
+{
+	u8 *p;
+	u64 val;
+
+	if (rl->length < 0)
+		return 0;
+	if (rl->lcn >= 0) {
+		const s64 delta = rl->lcn - *prev_lcn;
+
+		/* The zig-zag encoded delta needs to fit in 62 bits. */
+		if (delta >= (1LL << 60) || delta < -(1LL << 60))
+			return 0;
+		val = ((u64)delta << 1) ^ (u64)(delta >> 63);
+		val <<= 2;
+		*prev_lcn = rl->lcn;
+	} else if (rl->lcn >= LCN_ENOENT)
+		val = -rl->lcn;
+	else
+		return 0;
+	p = ntfs_rl_packed_put(dst, rl->length);
+	p = ntfs_rl_packed_put(p, val);
+	return p - dst;
+}
+
+/**
+ * ntfs_rl_packed_run_get - decode a runlist element from a packed runlist
+ * @src:	encoded run to decode
+ * @length:	destination for the run length
+ * @lcn:	destination for the lcn of the run
+ * @prev_lcn:	previous real lcn, updated if the run has a real lcn
+ *
+ * Return a pointer to the next encoded run.
+ */
+static inline const u8 *ntfs_rl_packed_run_get(const u8 *src, s64 *length,
+		LCN *lcn, LCN *prev_lcn)
+{
+	u64 val;
+
+	src = ntfs_rl_packed_get(src, &val);
+	*length = val;
+	src = ntfs_rl_packed_get(src, &val);
+	if (!(val & 3)) {
+		val >>= 2;
+		*prev_lcn += (s64)(val >> 1) ^ -(s64)(val & 1);
+		*lcn = *prev_lcn;
+	} else
+		*lcn = -(LCN)val;
+	return src;
+}
+
+/**
+ * ntfs_rl_pack - make a packed copy of a runlist
+ * @runlist:	runlist to pack
+ * @packed:	destination for the packed runlist
+ *
+ * Encode the runlist @runlist into a newly allocated packed runlist (see the
+ * description of ntfs_rl_packed in ntfs_runlist.h) and return it in *@packed.
+ * The runlist @runlist itself is not modified.
+ *
+ * Return 0 on success and errno on error.  The possible error return codes are:
+ *	EINVAL	- The runlist is empty, not terminated, or contains elements
+ *		  which cannot be packed.
+ *	ENOMEM	- Not enough memory to allocate the packed runlist.
+ *
+ * Locking: The runlist must be locked (for reading or writing) on entry.
+ */
+errno_t ntfs_rl_pack(const ntfs_runlist *runlist, ntfs_rl_packed **packed)
+{
+	const ntfs_rl_element *rl = runlist->rl;
+	ntfs_rl_packed *p;
+	u8 *dst, buf[20];
+	LCN prev_lcn;
+	unsigned i, len, size, nr_blocks;
+
+	if (!runlist->elements || rl[runlist->elements - 1].length)
+		return EINVAL;
+	/* Determine the size of the encoded runs and validate the runlist. */
+	size = 0;
+	prev_lcn = 0;
+	for (i = 0; i < runlist->elements; i++) {
+		if (i + 1 < runlist->elements && (!rl[i].length ||
+				rl[i].vcn + rl[i].length != rl[i + 1].vcn))
+			return EINVAL;
+		len = ntfs_rl_packed_run_put(buf, &rl[i], &prev_lcn);
+		if (!len)
+			return EINVAL;
+		size += len;
+	}
+	nr_blocks = (runlist->elements + NTFS_RL_PACKED_BLOCK_RUNS - 1) /
+			NTFS_RL_PACKED_BLOCK_RUNS;
+	len = sizeof(ntfs_rl_packed) + nr_blocks *
+			sizeof(ntfs_rl_packed_block) + size;
+	p = IOMallocData(len);
+	if (!p)
+		return ENOMEM;
+	p->elements = runlist->elements;
+	p->nr_blocks = nr_blocks;
+	p->size = len;
+	p->blocks = (ntfs_rl_packed_block*)(p + 1);
+	p->data = (u8*)(p->blocks + nr_blocks);
+	dst = p->data;
+	prev_lcn = 0;
+	for (i = 0; i < runlist->elements; i++) {
+		if (!(i % NTFS_RL_PACKED_BLOCK_RUNS)) {
+			ntfs_rl_packed_block *b;
+
+			b = &p->blocks[i / NTFS_RL_PACKED_BLOCK_RUNS];
+			b->vcn = rl[i].vcn;
+			b->lcn = prev_lcn;
+			b->ofs = dst - p->data;
+		}
+		dst += ntfs_rl_packed_run_put(dst, &rl[i], &prev_lcn);
+	}
+	OSIncrementAtomic64(&ntfs_rl_pstats.runlists);
+	OSAddAtomic64(p->elements, &ntfs_rl_pstats.elements);
+	OSAddAtomic64(p->size, &ntfs_rl_pstats.bytes);
+	ntfs_debug("Packed %u runlist elements (%lu bytes) into %u bytes.",
+			p->elements, (unsigned long)(p->elements *
+			sizeof(ntfs_rl_element)), p->size);
+	*packed = p;
+	return 0;
+}
+
+/**
+ * ntfs_rl_unpack - expand a packed runlist into a runlist
+ * @packed:	packed runlist to expand
+ * @runlist:	empty runlist to expand @packed into
+ *
+ * Decode the packed runlist @packed into the runlist @runlist, which must not
+ * have any elements.  The packed runlist @packed is not freed.
+ *
+ * Return 0 on success and ENOMEM if not enough memory to allocate the runlist
+ * elements in which case @runlist is left empty.
+ *
+ * Locking: - The caller must have locked the runlist for writing.
+ *	    - The runlist is modified.
+ */
+errno_t ntfs_rl_unpack(const ntfs_rl_packed *packed, ntfs_runlist *runlist)
+{
+	ntfs_rl_element *rl;
+	const u8 *src;
+	VCN vcn;
+	LCN prev_lcn;
+	unsigned i, count;
+
+	if (runlist->elements)
+		panic("%s(): runlist->elements\n", __FUNCTION__);
+	count = ntfs_rl_alloc_count(0, packed->elements);
+	rl = IONewData(ntfs_rl_element, count);
+	if (!rl)
+		return ENOMEM;
+	src = packed->data;
+	vcn = packed->blocks[0].vcn;
+	prev_lcn = 0;
+	for (i = 0; i < packed->elements; i++) {
+		rl[i].vcn = vcn;
+		src = ntfs_rl_packed_run_get(src, &rl[i].length, &rl[i].lcn,
+				&prev_lcn);
+		vcn += rl[i].length;
+	}
+	if (runlist->alloc_count)
+		IODeleteData(runlist->rl, ntfs_rl_element,
+				runlist->alloc_count);
+	runlist->rl = rl;
+	runlist->elements = packed->elements;
+	runlist->alloc_count = count;
+	OSIncrementAtomic64(&ntfs_rl_pstats.unpacks);
+	return 0;
+}
+
+/**
+ * ntfs_rl_packed_free - free a packed runlist
+ * @packed:	packed runlist to free
+ */
+void ntfs_rl_packed_free(ntfs_rl_packed *packed)
+{
+	OSDecrementAtomic64(&ntfs_rl_pstats.runlists);
+	OSAddAtomic64(-(SInt64)packed->elements, &ntfs_rl_pstats.elements);
+	OSAddAtomic64(-(SInt64)packed->size, &ntfs_rl_pstats.bytes);
+	IOFreeData(packed, packed->size);
+}
+
+/**
+ * ntfs_rl_packed_vcn_to_lcn - convert a vcn into a lcn given a packed runlist
+ * @packed:	packed runlist to use for conversion
+ * @vcn:	vcn to convert
+ * @clusters:	optional return pointer for the number of contiguous clusters
+ *
+ * This is the equivalent of ntfs_rl_vcn_to_lcn() for a packed runlist.  The
+ * block containing @vcn is found by binary search and only the runs in that
+ * block up to the one containing @vcn are decoded.
+ *
+ * Locking: The runlist the packed runlist belongs to must be locked (for
+ *	    reading or writing) on entry.
+ */
+LCN ntfs_rl_packed_vcn_to_lcn(const ntfs_rl_packed *packed, const VCN vcn,
+		s64 *clusters)
+{
+	const ntfs_rl_packed_block *b = packed->blocks;
+	const u8 *src;
+	VCN cur_vcn;
+	LCN lcn, prev_lcn;
+	s64 length;
+	unsigned lo, hi, mid, i, nr;
+
+	if (vcn < 0)
+		panic("%s(): vcn < 0\n", __FUNCTION__);
+	OSIncrementAtomic64(&ntfs_rl_pstats.lookups);
+	if (vcn < b[0].vcn)
+		return LCN_ENOENT;
+	/* Find the last block starting at or before @vcn. */
+	lo = 0;
+	hi = packed->nr_blocks;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (b[mid].vcn <= vcn)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	b += lo;
+	nr = packed->elements - lo * NTFS_RL_PACKED_BLOCK_RUNS;
+	if (nr > NTFS_RL_PACKED_BLOCK_RUNS)
+		nr = NTFS_RL_PACKED_BLOCK_RUNS;
+	src = packed->data + b->ofs;
+	cur_vcn = b->vcn;
+	prev_lcn = b->lcn;
+	for (i = 0; i < nr; i++) {
+		src = ntfs_rl_packed_run_get(src, &length, &lcn, &prev_lcn);
+		if (!length) {
+			/* The terminator element. */
+			if (clusters)
+				*clusters = 0;
+			if (lcn < (LCN)0)
+				return lcn;
+			return LCN_ENOENT;
+		}
+		if (vcn < cur_vcn + length) {
+			const s64 ofs = vcn - cur_vcn;
+
+			if (clusters)
+				*clusters = length - ofs;
+			if (lcn >= (LCN)0)
+				return lcn + ofs;
+			return lcn;
+		}
+		cur_vcn += length;
+	}
+	panic("%s(): vcn 0x%llx not found in packed runlist block.\n",
+			__FUNCTION__, (unsigned long long)vcn);
+	return LCN_EIO;
+}
+
+/**
+ * ntfs_rl_extents_touch - mark the mapped attribute extent containing a vcn used
+ * @ext:	mapped attribute extents of a runlist
+ * @vcn:	vcn which has been looked up
+ *
+ * Locking: The runlist must be locked (for reading or writing) on entry.
+ */
+void ntfs_rl_extents_touch(ntfs_rl_extents *ext, const VCN vcn)
+{
+	unsigned i;
+
+	for (i = 0; i < ext->nr; i++) {
+		if (vcn >= ext->extents[i].start_vcn &&
+				vcn < ext->extents[i].end_vcn) {
+			ext->extents[i].stamp = ++ext->clock;
+			break;
+		}
+	}
+}
+
+/**
+ * ntfs_rl_extents_add - add a mapped attribute extent
+ * @ext:	mapped attribute extents of a runlist
+ * @start_vcn:	lowest vcn of the attribute extent
+ * @end_vcn:	highest vcn of the attribute extent + 1
+ *
+ * Add the attribute extent [@start_vcn, @end_vcn) which has just been mapped
+ * into the runlist to @ext as the most recently used one.  If @ext is full the
+ * least recently used attribute extent is forgotten about, i.e. it will remain
+ * mapped.
+ *
+ * Locking: The caller must have locked the runlist for writing.
+ */
+void ntfs_rl_extents_add(ntfs_rl_extents *ext, const VCN start_vcn,
+		const VCN end_vcn)
+{
+	unsigned i, lru;
+
+	for (i = lru = 0; i < ext->nr; i++) {
+		if (ext->extents[i].start_vcn == start_vcn)
+			break;
+		if (ext->extents[i].stamp < ext->extents[lru].stamp)
+			lru = i;
+	}
+	if (i == ext->nr) {
+		if (ext->nr < NTFS_RL_MAX_MAPPED_EXTENTS)
+			ext->nr++;
+		else
+			i = lru;
+	}
+	ext->extents[i].start_vcn = start_vcn;
+	ext->extents[i].end_vcn = end_vcn;
+	ext->extents[i].stamp = ++ext->clock;
+}
+
+/**
+ * ntfs_rl_extents_evict - remove the least recently used mapped attribute extent
+ * @ext:	mapped attribute extents of a runlist
+ * @start_vcn:	destination for the lowest vcn of the removed attribute extent
+ * @end_vcn:	destination for the highest vcn + 1 of the removed extent
+ *
+ * If all NTFS_RL_MAX_MAPPED_EXTENTS entries of @ext are in use, remove the
+ * least recently used attribute extent from @ext, return its vcn range in
+ * *@start_vcn and *@end_vcn and return TRUE.  Otherwise return FALSE.
+ *
+ * Locking: The caller must have locked the runlist for writing.
+ */
+BOOL ntfs_rl_extents_evict(ntfs_rl_extents *ext, VCN *start_vcn,
+		VCN *end_vcn)
+{
+	unsigned i, lru;
+
+	if (ext->nr < NTFS_RL_MAX_MAPPED_EXTENTS)
+		return FALSE;
+	for (i = 1, lru = 0; i < ext->nr; i++) {
+		if (ext->extents[i].stamp < ext->extents[lru].stamp)
+			lru = i;
+	}
+	*start_vcn = ext->extents[lru].start_vcn;
+	*end_vcn = ext->extents[lru].end_vcn;
+	ext->extents[lru] = ext->extents[--ext->nr];
+	return TRUE;
+}
+
+/**
+ * ntfs_rl_unmap_nolock - unmap a region of a runlist
+ * @runlist:	runlist to unmap a region of
+ * @start_vcn:	first vcn of the region to unmap
+ * @end_vcn:	last vcn + 1 of the region to unmap
+ *
+ * Replace the region [@start_vcn, @end_vcn) of the runlist @runlist with a
+ * single LCN_RL_NOT_MAPPED element, splitting the runs crossing @start_vcn and
+ * @end_vcn and merging the new element with adjacent unmapped elements.
+ *
+ * The region needs to be exactly an attribute extent, i.e. [lowest_vcn,
+ * highest_vcn + 1) of an attribute record, so that ntfs_map_runlist_nolock()
+ * can map it again later.
+ *
+ * Return 0 on success and errno on error, in which case @runlist has not been
+ * modified.  The possible error return codes are:
+ *	EINVAL	- The region is out of bounds or not completely mapped.
+ *	ENOMEM	- Not enough memory to allocate the new runlist.
+ *
+ * Locking: - The caller must have locked the runlist for writing.
+ *	    - The runlist is modified and reallocated.
+ */
+errno_t ntfs_rl_unmap_nolock(ntfs_runlist *runlist, const VCN start_vcn,
+		const VCN end_vcn)
+{
+	ntfs_rl_element *rl, *new_rl, *dst;
+	unsigned first, last, i, count, new_elements;
+
+	rl = runlist->rl;
+	if (!runlist->elements || start_vcn >= end_vcn ||
+			start_vcn < rl[0].vcn ||
+			end_vcn > rl[runlist->elements - 1].vcn)
+		return EINVAL;
+	first = ntfs_rl_lookup_nolock(runlist, start_vcn) - rl;
+	last = ntfs_rl_lookup_nolock(runlist, end_vcn - 1) - rl;
+	for (i = first; i <= last; i++) {
+		if (!rl[i].length || rl[i].lcn < LCN_HOLE)
+			return EINVAL;
+	}
+	/*
+	 * The new runlist consists of the elements before @first, the head of
+	 * element @first before @start_vcn, the unmapped element, the tail of
+	 * element @last after @end_vcn, and the elements after @last.
+	 */
+	new_elements = first + 1 + (runlist->elements - last - 1);
+	if (rl[first].vcn < start_vcn)
+		new_elements++;
+	if (rl[last].vcn + rl[last].length > end_vcn)
+		new_elements++;
+	count = ntfs_rl_alloc_count(0, new_elements);
+	new_rl = IONewData(ntfs_rl_element, count);
+	if (!new_rl)
+		return ENOMEM;
+	ntfs_rl_copy(new_rl, rl, first);
+	dst = new_rl + first;
+	if (rl[first].vcn < start_vcn) {
+		*dst = rl[first];
+		dst->length = start_vcn - rl[first].vcn;
+		dst++;
+	}
+	/* Merge with a preceding unmapped element. */
+	if (dst > new_rl && dst[-1].lcn == LCN_RL_NOT_MAPPED) {
+		dst--;
+		dst->length = end_vcn - dst->vcn;
+	} else {
+		dst->vcn = start_vcn;
+		dst->lcn = LCN_RL_NOT_MAPPED;
+		dst->length = end_vcn - start_vcn;
+	}
+	dst++;
+	if (rl[last].vcn + rl[last].length > end_vcn) {
+		const s64 delta = end_vcn - rl[last].vcn;
+
+		dst->vcn = end_vcn;
+		dst->lcn = rl[last].lcn;
+		if (dst->lcn >= 0)
+			dst->lcn += delta;
+		dst->length = rl[last].length - delta;
+		dst++;
+	} else if (rl[last + 1].length &&
+			rl[last + 1].lcn == LCN_RL_NOT_MAPPED) {
+		/* Merge with a following unmapped element. */
+		dst[-1].length += rl[last + 1].length;
+		last++;
+	}
+	ntfs_rl_copy(dst, rl + last + 1, runlist->elements - last - 1);
+	dst += runlist->elements - last - 1;
+	IODeleteData(rl, ntfs_rl_element, runlist->alloc_count);
+	runlist->rl = new_rl;
+	runlist->elements = dst - new_rl;
+	runlist->alloc_count = count;
+	ntfs_debug("Unmapped vcns 0x%llx-0x%llx, runlist now has %u "
+			"elements.", (unsigned long long)start_vcn,
+			(unsigned long long)end_vcn - 1, runlist->elements);
+	return 0;
+}
+
+/**
+ * ntfs_rl_cache_lookup - look up a vcn in a vcn to lcn translation cache
+ * @cache:	translation cache to search
+ * @gen:	current generation of the runlist the cache belongs to
+ * @vcn:	vcn to look up
+ * @clusters:	destination for the number of contiguous clusters
+ *
+ * Look up @vcn in the translation cache @cache, ignoring any entries which
+ * were not created with the runlist generation @gen.
+ *
+ * Return the lcn corresponding to @vcn and in *@clusters the number of
+ * physically contiguous clusters starting at @vcn on success, and
+ * LCN_RL_NOT_MAPPED if @vcn is not in the cache.
+ *
+ * Locking: No locks are needed.
+ */
+LCN ntfs_rl_cache_lookup(ntfs_rl_cache *cache, const u32 gen, const VCN vcn,
+		s64 *clusters)
+{
+	unsigned i;
+
+	for (i = 0; i < NTFS_RL_CACHE_ENTRIES; i++) {
+		VCN e_vcn;
+		LCN e_lcn;
+		s64 e_clusters;
+		u32 e_gen;
+		UInt32 seq;
+
+		seq = cache->entries[i].seq;
+		if (seq & 1)
+			continue;
+		__sync_synchronize();
+		e_gen = cache->entries[i].gen;
+		e_vcn = cache->entries[i].vcn;
+		e_lcn = cache->entries[i].lcn;
+		e_clusters = cache->entries[i].clusters;
+		__sync_synchronize();
+		if (cache->entries[i].seq != seq || e_gen != gen)
+			continue;
+		if (vcn >= e_vcn && vcn < e_vcn + e_clusters) {
+			*clusters = e_vcn + e_clusters - vcn;
+			return e_lcn + (vcn - e_vcn);
+		}
+	}
+	return LCN_RL_NOT_MAPPED;
+}
+
+/**
+ * ntfs_rl_cache_insert - add a translation to a vcn to lcn translation cache
+ * @cache:	translation cache to add to
+ * @gen:	generation of the runlist the translation was looked up in
+ * @vcn:	first vcn of the translation
+ * @lcn:	lcn corresponding to @vcn
+ * @clusters:	number of physically contiguous clusters starting at @vcn
+ *
+ * Add the translation of the @clusters clusters starting at @vcn to the
+ * clusters starting at @lcn to the translation cache @cache, replacing the
+ * oldest entry.  If another thread is updating the same entry at the same
+ * time we simply do not add the translation.
+ *
+ * Locking: The caller must hold the runlist lock (for reading or writing) so
+ *	    that the runlist generation cannot change whilst the translation
+ *	    is looked up and added.
+ */
+void ntfs_rl_cache_insert(ntfs_rl_cache *cache, const u32 gen, const VCN vcn,
+		const LCN lcn, const s64 clusters)
+{
+	unsigned i;
+	UInt32 seq;
+
+	if (lcn < 0 || clusters <= 0)
+		return;
+	i = (UInt32)OSIncrementAtomic((volatile SInt32*)&cache->next) %
+			NTFS_RL_CACHE_ENTRIES;
+	seq = cache->entries[i].seq;
+	if (seq & 1 || !OSCompareAndSwap(seq, seq + 1,
+			&cache->entries[i].seq))
+		return;
+	__sync_synchronize();
+	cache->entries[i].gen = gen;
+	cache->entries[i].vcn = vcn;
+	cache->entries[i].lcn = lcn;
+	cache->entries[i].clusters = clusters;
+	__sync_synchronize();
+	cache->entries[i].seq = seq + 2;
+}
+
+/**
+ * ntfs_rl_stats_add_fragment - account a fragment in runlist statistics
+ * @stats:	runlist statistics to update
+ * @frag:	size of the fragment in clusters
+ *
+ * Update the largest and smallest fragment sizes in @stats with the fragment
+ * of @frag clusters.  A fragment of zero clusters is ignored.
+ */
+static inline void ntfs_rl_stats_add_fragment(ntfs_rl_stats *stats,
+		const s64 frag)
+{
+	if (!frag)
+		return;
+	if ((u64)frag > stats->largest_run)
+		stats->largest_run = frag;
+	if (!stats->smallest_run || (u64)frag < stats->smallest_run)
+		stats->smallest_run = frag;
+}
+
+/**
+ * ntfs_rl_get_stats - gather statistics about a runlist
+ * @runlist:	runlist to gather statistics about
+ * @stats:	destination in which to return the statistics
+ *
+ * Walk the runlist @runlist and fill in the runlist related fields of @stats,
+ * i.e. everything except @stats->cluster_size, @stats->attr_extents, and
+ * @stats->packed which the caller has to fill in.  See the description of
+ * ntfs_rl_stats in ntfs.h for the meaning of the individual fields.
+ *
+ * Adjacent runs of real clusters which are also physically contiguous are
+ * counted as a single fragment so @stats->fragments reflects the on-disk
+ * fragmentation of the attribute rather than the way the runlist happens to
+ * be split into elements.
+ *
+ * Locking: The runlist must be locked on entry (for reading is sufficient).
+ */
+void ntfs_rl_get_stats(const ntfs_runlist *runlist, ntfs_rl_stats *stats)
+{
+	const ntfs_rl_element *rl;
+	LCN next_lcn;
+	s64 frag;
+	BOOL mapped;
+
+	stats->elements = runlist->elements;
+	stats->runs = stats->fragments = stats->holes = 0;
+	stats->mapped_extents = stats->unmapped_extents = 0;
+	stats->unmapped_clusters = 0;
+	stats->largest_run = stats->smallest_run = 0;
+	stats->rl_bytes = (u64)runlist->alloc_count * sizeof(ntfs_rl_element);
+	rl = runlist->rl;
+	if (!rl)
+		return;
+	next_lcn = LCN_HOLE;
+	frag = 0;
+	mapped = FALSE;
+	for (; rl->length; rl++) {
+		if (rl->lcn == LCN_RL_NOT_MAPPED) {
+			if (mapped || !stats->unmapped_extents)
+				stats->unmapped_extents++;
+			stats->unmapped_clusters += rl->length;
+			mapped = FALSE;
+		} else if (!mapped) {
+			stats->mapped_extents++;
+			mapped = TRUE;
+		}
+		if (rl->lcn < 0) {
+			if (rl->lcn == LCN_HOLE)
+				stats->holes++;
+			ntfs_rl_stats_add_fragment(stats, frag);
+			frag = 0;
+			continue;
+		}
+		stats->runs++;
+		if (frag && rl->lcn == next_lcn)
+			frag += rl->length;
+		else {
+			ntfs_rl_stats_add_fragment(stats, frag);
+			stats->fragments++;
+			frag = rl->length;
+		}
+		next_lcn = rl->lcn + rl->length;
+	}
+	ntfs_rl_stats_add_fragment(stats, frag);
+}
@@ -40,6 +40,8 @@
 
 #include <sys/errno.h>
 
+#include <libkern/OSTypes.h>
+
 //#include <kern/locks.h>
 #include "al_lock.h"
 
@@ -69,6 +71,8 @@ typedef struct { /* In memory vcn to lcn mapping structure element. */
  * @rl:		pointer to an array of runlist elements
  * @elements:	number of runlist elements in runlist
  * @alloc:	number of bytes allocated for this runlist in memory
+ * @hint:	index of the runlist element found by the last lookup
+ * @gen:	generation number, incremented whenever runs are removed
  * @lock:	read/write lock for serializing access to @rl
  *
  * This is the runlist structure.  It describes the mapping from file offsets
@@ -100,11 +104,25 @@ typedef struct { /* In memory vcn to lcn mapping structure element. */
  *
  * For other special values of LCNs please see below, where the enum
  * LCN_SPECIAL_VALUES is defined.
+ *
+ * Lookups by ntfs_rl_lookup_nolock() binary search the runlist and remember
+ * the element they found in @hint so that the next lookup, which for
+ * sequential i/o is in the same or in the following element, does not need to
+ * search at all.  @hint is only ever a hint and it is validated on use thus it
+ * is updated without regard for the runlist lock being held shared by multiple
+ * threads and it does not need to be updated when the runlist is modified.
+ *
+ * @gen is incremented by ntfs_rl_truncate_nolock() and ntfs_rl_punch_nolock()
+ * before they remove any runs, i.e. whenever a vcn to lcn translation which
+ * was valid before can become invalid.  It is used to validate the entries of
+ * the lock-free translation cache (see ntfs_rl_cache below).
  */
 typedef struct {
 	ntfs_rl_element *rl;
 	unsigned elements;
 	unsigned alloc_count;
+	unsigned hint;
+	u32 gen;
 	al_lck_rw_t lock;
 } ntfs_runlist;
 
@@ -115,7 +133,8 @@ typedef struct {
 static inline void ntfs_rl_init(ntfs_runlist *rl)
 {
 	rl->rl = NULL;
-	rl->alloc_count = rl->elements = 0;
+	rl->alloc_count = rl->elements = rl->hint = 0;
+	rl->gen = 0;
 	lck_rw_init(&rl->lock, ntfs_lock_grp, ntfs_lock_attr);
 }
 
@@ -146,22 +165,219 @@ typedef enum {
 	LCN_EIO			= -5,
 } LCN_SPECIAL_VALUES;
 
+/**
+ * ntfs_rl_packed - compact read-only copy of a runlist
+ * @elements:	number of runlist elements including the terminator element
+ * @nr_blocks:	number of blocks in @blocks
+ * @size:	size in bytes of the whole allocation including @data
+ * @blocks:	index of the blocks of encoded runs in @data
+ * @data:	the encoded runs
+ *
+ * A runlist of an inode which is not in use can be replaced by a packed copy
+ * which takes a fraction of the memory (see ntfs_attr_pack_runlist()).
+ *
+ * Each run is stored in @data as its length followed by its lcn, each as an
+ * unsigned LEB128 varint.  The two low bits of the lcn value are zero for a
+ * real lcn, which is stored as the zig-zag encoded delta to the previous real
+ * lcn in the bits above them, and give -LCN_HOLE, -LCN_RL_NOT_MAPPED, or
+ * -LCN_ENOENT otherwise.  Like the mapping pairs array on disk, the vcns are
+ * not stored as they follow from the run lengths.
+ *
+ * The runs are grouped into blocks of NTFS_RL_PACKED_BLOCK_RUNS runs and each
+ * block has an entry in @blocks containing its starting vcn, the previous real
+ * lcn, and its offset in @data so a lookup binary searches @blocks and then
+ * decodes at most NTFS_RL_PACKED_BLOCK_RUNS runs.
+ */
+typedef struct {
+	VCN vcn;	/* Starting vcn of the first run in the block. */
+	LCN lcn;	/* Real lcn to which the first real lcn in the block is
+			   relative. */
+	unsigned ofs;	/* Offset in bytes of the block in the encoded runs. */
+} ntfs_rl_packed_block;
+
+typedef struct {
+	unsigned elements;
+	unsigned nr_blocks;
+	unsigned size;
+	ntfs_rl_packed_block *blocks;
+	u8 *data;
+} ntfs_rl_packed;
+
+enum {
+	NTFS_RL_PACKED_BLOCK_RUNS	= 64,
+	/* Runlists with fewer elements are not worth packing. */
+	NTFS_RL_PACK_MIN_ELEMENTS	= 256,
+};
+
+/*
+ * Statistics about the packed runlists, exported via sysctl as
+ * vfs.generic.ntfs.rl_packed_*.
+ */
+typedef struct {
+	SInt64 runlists;	/* Number of packed runlists. */
+	SInt64 elements;	/* Number of runlist elements in them. */
+	SInt64 bytes;		/* Number of bytes used by them. */
+	SInt64 lookups;		/* Number of vcns looked up in them. */
+	SInt64 unpacks;		/* Number of them expanded back. */
+} ntfs_rl_packed_stats;
+
+__attribute__((visibility("hidden"))) extern ntfs_rl_packed_stats ntfs_rl_pstats;
+
+__private_extern__ errno_t ntfs_rl_pack(const ntfs_runlist *runlist,
+		ntfs_rl_packed **packed);
+
+__private_extern__ errno_t ntfs_rl_unpack(const ntfs_rl_packed *packed,
+		ntfs_runlist *runlist);
+
+__private_extern__ void ntfs_rl_packed_free(ntfs_rl_packed *packed);
+
+__private_extern__ LCN ntfs_rl_packed_vcn_to_lcn(const ntfs_rl_packed *packed,
+		const VCN vcn, s64 *clusters);
+
+enum {
+	NTFS_RL_MAX_MAPPED_EXTENTS	= 16,
+	/* Runlists with fewer elements never have extents unmapped. */
+	NTFS_RL_EVICT_MIN_ELEMENTS	= 4096,
+};
+
+/*
+ * ntfs_rl_read() reads ahead up to NTFS_RL_IO_RA_BLOCKS device blocks at a
+ * time and ntfs_rl_write() keeps up to NTFS_RL_IO_MAX_PENDING device block
+ * writes in flight at a time.
+ */
+enum {
+	NTFS_RL_IO_RA_BLOCKS		= 32,
+	NTFS_RL_IO_MAX_PENDING		= 64,
+};
+
+/**
+ * ntfs_rl_extents - least recently used tracking of mapped attribute extents
+ * @nr:		number of entries in use in @extents
+ * @clock:	counter used to stamp the entries in @extents on use
+ * @extents:	the vcn ranges [@start_vcn, @end_vcn) of the attribute extents
+ *		which have been mapped into the runlist
+ *
+ * For large runlists the attribute extents mapped by ntfs_map_runlist_nolock()
+ * are tracked so that once NTFS_RL_MAX_MAPPED_EXTENTS of them are mapped, the
+ * least recently used one can be unmapped again (see ntfs_rl_unmap_nolock())
+ * before mapping another one.
+ *
+ * The stamps are updated on lookups with the runlist lock held for reading
+ * thus concurrent lookups can race when updating them.  This only affects the
+ * accuracy of the least recently used order.
+ */
+typedef struct {
+	unsigned nr;
+	u64 clock;
+	struct {
+		VCN start_vcn;
+		VCN end_vcn;
+		u64 stamp;
+	} extents[NTFS_RL_MAX_MAPPED_EXTENTS];
+} ntfs_rl_extents;
+
+__private_extern__ void ntfs_rl_extents_touch(ntfs_rl_extents *ext,
+		const VCN vcn);
+
+__private_extern__ void ntfs_rl_extents_add(ntfs_rl_extents *ext,
+		const VCN start_vcn, const VCN end_vcn);
+
+__private_extern__ BOOL ntfs_rl_extents_evict(ntfs_rl_extents *ext,
+		VCN *start_vcn, VCN *end_vcn);
+
+__private_extern__ errno_t ntfs_rl_unmap_nolock(ntfs_runlist *runlist,
+		const VCN start_vcn, const VCN end_vcn);
+
+enum {
+	NTFS_RL_CACHE_ENTRIES		= 8,
+};
+
+/**
+ * ntfs_rl_cache - lock-free cache of recent vcn to lcn translations
+ * @next:	index of the next entry to replace (modulo the number of entries)
+ * @entries:	the cached translations
+ *
+ * Each entry translates the @clusters clusters starting at @vcn to the
+ * physically contiguous clusters starting at @lcn and is only valid as long as
+ * the generation @gen of the runlist it was looked up in is unchanged.  Only
+ * real clusters are cached, not holes, as filling a hole does not change the
+ * runlist generation.
+ *
+ * The cache is accessed without holding the runlist lock.  Each entry is
+ * protected by its sequence number @seq which is odd whilst the entry is being
+ * updated.  Readers retry or skip an entry whose sequence number is odd or
+ * changes whilst they are reading it.
+ */
+typedef struct {
+	volatile UInt32 next;
+	struct {
+		volatile UInt32 seq;
+		u32 gen;
+		VCN vcn;
+		LCN lcn;
+		s64 clusters;
+	} entries[NTFS_RL_CACHE_ENTRIES];
+} ntfs_rl_cache;
+
+/**
+ * ntfs_rl_gen - get the generation of a runlist
+ * @runlist:	runlist whose generation to return
+ *
+ * Return the current generation of the runlist @runlist.  This may be called
+ * without the runlist lock held.
+ */
+static inline u32 ntfs_rl_gen(const ntfs_runlist *runlist)
+{
+	return *(volatile const u32*)&runlist->gen;
+}
+
+__private_extern__ LCN ntfs_rl_cache_lookup(ntfs_rl_cache *cache,
+		const u32 gen, const VCN vcn, s64 *clusters);
+
+__private_extern__ void ntfs_rl_cache_insert(ntfs_rl_cache *cache,
+		const u32 gen, const VCN vcn, const LCN lcn,
+		const s64 clusters);
+
+struct ntfs_rl_stats;
+
+__private_extern__ void ntfs_rl_get_stats(const ntfs_runlist *runlist,
+		struct ntfs_rl_stats *stats);
+
+__private_extern__ unsigned ntfs_rl_alloc_count(const unsigned alloc_count,
+		const unsigned elements);
+
 __private_extern__ errno_t ntfs_rl_merge(ntfs_runlist *dst_runlist,
 		ntfs_runlist *src_runlist);
 
 __private_extern__ errno_t ntfs_mapping_pairs_decompress(ntfs_volume *vol,
 		const ATTR_RECORD *a, ntfs_runlist *runlist);
 
+__private_extern__ errno_t ntfs_mapping_pairs_find(const ATTR_RECORD *a,
+		const VCN vcn, unsigned *ofs, LCN *prev_lcn);
+
 __private_extern__ LCN ntfs_rl_vcn_to_lcn(const ntfs_rl_element *rl,
 		const VCN vcn, s64 *clusters);
 
 __private_extern__ ntfs_rl_element *ntfs_rl_find_vcn_nolock(
 		ntfs_rl_element *rl, const VCN vcn);
 
+__private_extern__ ntfs_rl_element *ntfs_rl_lookup_nolock(
+		ntfs_runlist *runlist, const VCN vcn);
+
+__private_extern__ errno_t ntfs_get_size_for_mapping_pairs_ext(
+		const ntfs_volume *vol, const ntfs_rl_element *rl,
+		const VCN first_vcn, const VCN last_vcn, LCN prev_lcn,
+		unsigned *mp_size);
+
 __private_extern__ errno_t ntfs_get_size_for_mapping_pairs(
 		const ntfs_volume *vol, const ntfs_rl_element *rl,
 		const VCN first_vcn, const VCN last_vcn, unsigned *mp_size);
 
+__private_extern__ errno_t ntfs_mapping_pairs_build_ext(
+		const ntfs_volume *vol, s8 *dst, const unsigned dst_len,
+		const ntfs_rl_element *rl, const VCN first_vcn,
+		const VCN last_vcn, LCN prev_lcn, VCN *const stop_vcn);
+
 __private_extern__ errno_t ntfs_mapping_pairs_build(const ntfs_volume *vol,
 		s8 *dst, const unsigned dst_len, const ntfs_rl_element *rl,
 		const VCN first_vcn, const VCN last_vcn, VCN *const stop_vcn);
@@ -72,6 +72,7 @@
 #include "ntfs.h"
 #include "ntfs_attr.h"
 #include "ntfs_attr_list.h"
+#include "ntfs_compress.h"
 #include "ntfs_debug.h"
 #include "ntfs_dir.h"
 #include "ntfs_hash.h"
@@ -3233,17 +3234,19 @@ static inline u32 ntfs_popcount32(u32 v)
  * result in @res.  We do not care about partial buffers as these will be just
  * zero filled and hence not be counted as set bits.
  *
- * If any buffers cannot be read we assume all bits in the erroring buffers are
- * set.  This means we return an overestimate on errors which is better than
- * an underestimate.
+ * The bitmap is mapped in large ranges.  If a range cannot be read it is
+ * mapped again one page at a time and we assume all bits in the erroring pages
+ * are set.  This means we return an overestimate on errors which is better
+ * than an underestimate.
  *
  * Return 0 on success amd errno if an iocount reference could not be obtained
  * on the bitmap vnode.
  */
 static errno_t ntfs_get_nr_set_bits(vnode_t vn, const s64 nr_bits, s64 *res)
 {
-	s64 max_ofs, ofs, nr_set;
+	s64 max_ofs, ofs, pg_ofs, nr_set;
 	ntfs_inode *ni = NTFS_I(vn);
+	unsigned size;
 	errno_t err;
 
 	ntfs_debug("Entering.");
@@ -3255,40 +3258,73 @@ static errno_t ntfs_get_nr_set_bits(vnode_t vn, const s64 nr_bits, s64 *res)
 	/* Convert the number of bits into bytes rounded up. */
 	max_ofs = (nr_bits + 7) >> 3;
 	ntfs_debug("Reading bitmap, max_ofs %lld.", (long long)max_ofs);
-	for (nr_set = ofs = 0; ofs < max_ofs; ofs += PAGE_SIZE) {
+	for (nr_set = ofs = 0; ofs < max_ofs; ofs += size) {
 		upl_t upl;
 		upl_page_info_array_t pl;
 		u32 *p;
-		int i;
+		unsigned i;
 
-		/* Map the page. */
-		err = ntfs_page_map(ni, ofs, &upl, &pl, (u8**)&p, FALSE);
+		/*
+		 * Map as much of the remainder of the bitmap as we can in one
+		 * go so that it is read in with as few i/os as possible.
+		 */
+		size = NTFS_PAGE_MAP_RANGE_MAX;
+		if (size > max_ofs - ofs)
+			size = max_ofs - ofs;
+		err = ntfs_page_map_range(ni, ofs, &size, &upl, &pl, (u8**)&p,
+				FALSE);
 		if (err) {
-			ntfs_debug("Failed to map page from bitmap (offset "
-					"%lld, size %d, error %d).  Skipping "
-					"page.", (long long)ofs, PAGE_SIZE,
-					(int)err);
-			/* Count the whole buffer contents as set bits only if I/O fails, otherwise bail out */
-			if (err != EIO) {
-				lck_rw_unlock_shared(&ni->lock);
-				vnode_put(vn);
-				return err;
+			size = (size + PAGE_MASK) & ~PAGE_MASK;
+			ntfs_debug("Failed to map pages from bitmap (offset "
+					"%lld, size %u, error %d).  Retrying "
+					"one page at a time.", (long long)ofs,
+					size, (int)err);
+			if (err != EIO)
+				goto err;
+			/*
+			 * Map the range one page at a time so that only the
+			 * pages which really cannot be read are counted as
+			 * set bits.
+			 */
+			for (pg_ofs = ofs; pg_ofs < ofs + size &&
+					pg_ofs < max_ofs; pg_ofs += PAGE_SIZE) {
+				err = ntfs_page_map(ni, pg_ofs, &upl, &pl,
+						(u8**)&p, FALSE);
+				if (err) {
+					ntfs_debug("Failed to map page from "
+							"bitmap (offset %lld, "
+							"size %d, error %d).  "
+							"Skipping page.",
+							(long long)pg_ofs,
+							PAGE_SIZE, (int)err);
+					/*
+					 * Count the whole buffer contents as
+					 * set bits only if I/O fails,
+					 * otherwise bail out.
+					 */
+					if (err != EIO)
+						goto err;
+					nr_set += PAGE_SIZE * 8;
+					continue;
+				}
+				for (i = 0; i < (PAGE_SIZE / 4); i++)
+					nr_set += ntfs_popcount32(p[i]);
+				ntfs_page_unmap(ni, upl, pl, FALSE);
 			}
-			nr_set += PAGE_SIZE * 8;
 			continue;
 		}
 		/*
 		 * For each 32-bit word, add the number of set bits.  If this
-		 * is the last block and it is partial we do not really care as
-		 * it just means we do a little extra work but it will not
+		 * is the last range and it is partial we do not really care
+		 * as it just means we do a little extra work but it will not
 		 * affect the result as all out of range bytes are set to zero
-		 * by ntfs_page_map().
+		 * by ntfs_page_map_range().
 		 *
-		 * Use multiples of 4 bytes, thus max size is PAGE_SIZE / 4.
+		 * Use multiples of 4 bytes, thus max size is @size / 4.
 		 */
-	  	for (i = 0; i < (PAGE_SIZE / 4); i++)
+		for (i = 0; i < (size / 4); i++)
 			nr_set += ntfs_popcount32(p[i]);
-		ntfs_page_unmap(ni, upl, pl, FALSE);
+		ntfs_page_unmap_range(ni, upl, pl, size, FALSE);
 	}
 	/*
 	 * Release the iocount reference on the bitmap vnode.  We can ignore
@@ -3300,6 +3336,10 @@ static errno_t ntfs_get_nr_set_bits(vnode_t vn, const s64 nr_bits, s64 *res)
 			(long long)nr_set);
 	*res = nr_set;
 	return 0;
+err:
+	lck_rw_unlock_shared(&ni->lock);
+	(void)vnode_put(vn);
+	return err;
 }
 
 /**
@@ -3495,6 +3535,27 @@ static int ntfs_unmount_callback_recycle(vnode_t vn, void *data __unused)
 	return VNODE_RETURNED;
 }
 
+/**
+ * ntfs_unmount_callback_cb_ra - callback for vnode iterate in ntfs_unmount()
+ * @vn:		vnode the callback is invoked with (has iocount reference)
+ * @data:	for us always NULL and ignored
+ *
+ * This callback is called from vnode_iterate() which is called from
+ * ntfs_unmount() for all in-core, non-dead, non-suspend vnodes belonging to
+ * the mounted volume that still have an ntfs inode attached.
+ *
+ * We cancel or wait for any pending read-ahead of a compressed attribute as
+ * its usecount reference on the vnode would otherwise make vflush() fail.
+ */
+static int ntfs_unmount_callback_cb_ra(vnode_t vn, void *data __unused)
+{
+	ntfs_inode *ni = NTFS_I(vn);
+
+	if (ni)
+		ntfs_cb_ra_cancel(ni, TRUE);
+	return VNODE_RETURNED;
+}
+
 /**
  * ntfs_unmount_inode_detach - detach an inode at umount time
  * @pni:	pointer to the attached ntfs inode to detach
@@ -3657,8 +3718,10 @@ static int ntfs_unmount(mount_t mp, int mnt_flags,
 		goto no_root;
 	/*
 	 * Try to reclaim all non-root and non-system vnodes.  For a non-forced
-	 * unmount, this will fail if there are any open files.
+	 * unmount, this will fail if there are any open files.  First get rid
+	 * of any pending read-ahead as it holds a reference on its vnode.
 	 */
+	(void)vnode_iterate(mp, 0, ntfs_unmount_callback_cb_ra, NULL);
 	err = vflush(mp, NULLVP, vflags|SKIPROOT|SKIPSYSTEM);
 	if (err) {
 		ntfs_warning(mp, "Cannot unmount (vflush() returned error "
@@ -4852,9 +4915,9 @@ static int ntfs_getattr(mount_t mp, struct vfs_attr *fsa,
 				0;
 		/* File system driver capabilities. */
 		ca->capabilities[VOL_CAPABILITIES_INTERFACES] =
-				/* TODO: These are not implemented yet. */
-				// VOL_CAP_INT_SEARCHFS |
+				VOL_CAP_INT_SEARCHFS |
 				VOL_CAP_INT_ATTRLIST |
+				/* TODO: These are not implemented yet. */
 				// VOL_CAP_INT_NFSEXPORT |
 				// VOL_CAP_INT_READDIRATTR |
 				// VOL_CAP_INT_EXCHANGEDATA |
@@ -5641,6 +5704,10 @@ lck_err:
 	err = ntfs_inode_hash_init();
 	if (err)
 		goto hash_err;
+	err = ntfs_decompress_pool_init();
+	if (err)
+		goto pool_err;
+	ntfs_cb_cache_init();
 	vfe = (struct vfs_fsentry) {
 		.vfe_vfsops	= &ntfs_vfsops,
 		.vfe_vopcnt	= 1,	/* For now we just use one set of vnode
@@ -5660,6 +5727,9 @@ lck_err:
 		return KERN_SUCCESS;
 	}
 	ntfs_error(NULL, "vfs_fsadd() failed (error %d).", (int)err);
+	ntfs_cb_cache_deinit();
+	ntfs_decompress_pool_deinit();
+pool_err:
 	ntfs_inode_hash_deinit();
 hash_err:
 	IOFreeData(ntfs_file_sds_entry, 0x60 * 4);
@@ -5705,6 +5775,8 @@ kern_return_t ntfs_module_stop(kmod_info_t *ki __unused, void *data __unused)
 					"%d).\n", err);
 		return KERN_FAILURE;
 	}
+	ntfs_cb_cache_deinit();
+	ntfs_decompress_pool_deinit();
 	ntfs_inode_hash_deinit();
 	IOFreeData(ntfs_file_sds_entry, 0x60 * 4);
 	ntfs_file_sds_entry = NULL;
@@ -38,6 +38,8 @@
 #include <sys/attr.h>
 #include <sys/buf.h>
 #include <sys/errno.h>
+#include <sys/fcntl.h>
+#include <sys/fsctl.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/syslimits.h>
@@ -52,6 +54,8 @@
 
 #include <string.h>
 
+#include <libkern/OSAtomic.h>
+
 #include <mach/kern_return.h>
 #include <mach/memory_object_types.h>
 
@@ -86,6 +90,14 @@
 /* Global ntfs vnode operations. */
 vnop_t **ntfs_vnodeop_p;
 
+/* Reads of at least this size bypass the vm page cache (see ntfs_read()). */
+int ntfs_direct_read_min = 1024 * 1024;
+
+/* Writes of at least this size bypass the vm page cache (see ntfs_write()). */
+int ntfs_direct_write_min = 1024 * 1024;
+
+ntfs_direct_io_stats ntfs_dio_stats;
+
 /**
  * ntfs_cluster_iodone - complete i/o on a memory region
  * @cbp:	cluster head buffer for which i/o is being completed
@@ -2214,12 +2226,6 @@ static int ntfs_vnop_setattr(struct vnop_setattr_args *a)
 		ntfs_debug("Changing size for mft_no 0x%llx to 0x%llx.",
 				(unsigned long long)ni->mft_no,
 				(unsigned long long)va->va_data_size);
-#if 1		// TODO: Remove this when sparse support is done...
-		if (NInoSparse(ni)) {
-			err = ENOTSUP;
-			goto unl_err;
-		}
-#endif
 		/*
 		 * Do not allow calling for $MFT/$DATA as it would destroy the
 		 * volume.
@@ -2474,7 +2480,7 @@ static inline int ntfs_vnop_read_compressed(ntfs_inode *ni, uio_t uio,
 {
 	s64 size;
 	user_ssize_t start_count;
-	off_t ofs;
+	off_t ofs, ra_ofs;
 	vnode_t vn = ni->vn;
 	ntfs_inode *raw_ni;
 	upl_t upl;
@@ -2483,7 +2489,7 @@ static inline int ntfs_vnop_read_compressed(ntfs_inode *ni, uio_t uio,
 	int count, err, align_mask, cur_pg, last_pg;
 	int max_upl_size = ubc_upl_maxbufsize();
 
-	ofs = uio_offset(uio);
+	ra_ofs = ofs = uio_offset(uio);
 	start_count = uio_resid(uio);
 	ntfs_debug("Entering for compressed file inode 0x%llx, offset 0x%llx, "
 			"count 0x%llx, ioflags 0x%x.",
@@ -2542,12 +2548,11 @@ static inline int ntfs_vnop_read_compressed(ntfs_inode *ni, uio_t uio,
 	 * Loop until we have finished the whole request or reached the end of
 	 * the attribute.
 	 *
-	 * FIXME: We do not bother with read-ahead on the uncompressed vnode
-	 * for now except to the extent that we always decompress full
-	 * compression blocks which may be larger than the current i/o request
-	 * so the next i/o request will find the whole compression block
-	 * decompressed in the vm page cache thus small reads will in effect
-	 * experience a certain amount of read-ahead in this way.
+	 * Note we always decompress full compression blocks which may be
+	 * larger than the current i/o request so the next i/o request will
+	 * find the whole compression block decompressed in the vm page cache.
+	 * Sequential reads further cause the following compression blocks to
+	 * be read ahead asynchronously (see ntfs_compressed_ra()).
 	 */
 	do {
 		u8 *kaddr;
@@ -2719,6 +2724,9 @@ static inline int ntfs_vnop_read_compressed(ntfs_inode *ni, uio_t uio,
 		} while (next_pg < last_pg);
 	} while ((start_count = uio_resid(uio)) &&
 			(ofs = uio_offset(uio)) < data_size);
+	/* Read ahead if the access is sequential. */
+	if (!(ioflags & (IO_RAOFF | IO_NOCACHE)))
+		ntfs_compressed_ra(ni, ra_ofs, uio_offset(uio) - ra_ofs);
 	ntfs_debug("Done.");
 err:
 	lck_rw_unlock_shared(&raw_ni->lock);
@@ -2790,6 +2798,16 @@ abort_err:
  * normal and multi sector transfer protected attributes and
  * ntfs_vnop_read_compressed() which deals with compressed attributes.
  *
+ * Large reads of normal attributes into user space buffers, i.e. reads of at
+ * least ntfs_direct_read_min bytes, as well as IO_NOCACHE reads, bypass the vm
+ * page cache.  We set IO_NOCACHE which causes cluster_read_ext() to wire the
+ * user buffer and to read straight from the device into it, using
+ * ntfs_vnop_blockmap() to map the runlist to physical blocks.  Sparse runs and
+ * everything beyond the initialized size are mapped as holes and are zeroed
+ * instead of being read.  Parts of the request which are not suitably aligned
+ * for device i/o, as well as any pages which are already cached, are copied
+ * through the vm page cache instead so cached dirty data is never bypassed.
+ *
  * For resident attributes we read the data from the vm page cache and if it is
  * not there we cause the vm page cache to be populated by reading the buffer
  * at offset 0 in the attribute.
@@ -2815,7 +2833,7 @@ static errno_t ntfs_read(ntfs_inode *ni, uio_t uio, const int ioflags,
 	upl_t upl;
 	upl_page_info_array_t pl;
 	u8 *kaddr;
-	int err, count;
+	int err, count, flags;
 
 	ofs = uio_offset(uio);
 	start_count = uio_resid(uio);
@@ -2888,9 +2906,17 @@ static errno_t ntfs_read(ntfs_inode *ni, uio_t uio, const int ioflags,
 			goto err;
 		}
 		callback = NULL;
+		flags = ioflags;
 		if (NInoMstProtected(ni) || NInoEncrypted(ni))
 			callback = ntfs_cluster_iodone;
-		err = cluster_read_ext(vn, uio, size, ioflags, callback, NULL);
+		else if (uio_isuserspace(uio) && (flags & IO_NOCACHE ||
+				(ntfs_direct_read_min > 0 &&
+				start_count >= ntfs_direct_read_min))) {
+			flags |= IO_NOCACHE;
+			OSIncrementAtomic64(&ntfs_dio_stats.reads);
+			OSAddAtomic64(start_count, &ntfs_dio_stats.read_bytes);
+		}
+		err = cluster_read_ext(vn, uio, size, flags, callback, NULL);
 		if (!err)
 			ntfs_debug("Done (cluster_read_ext()).");
 		else
@@ -3089,6 +3115,195 @@ static int ntfs_vnop_read(struct vnop_read_args *a)
 }
 
 // TODO: Rename to ntfs_inode_write and move to ntfs_inode.[hc]?
+/**
+ * ntfs_vnop_write_compressed - write to a compressed attribute
+ * @ni:		ntfs inode describing the compressed attribute to write to
+ * @uio:	source containing the data to write
+ * @init_size:	initialized size of the compressed attribute
+ * @ioflags:	flags further describing the write request (see ntfs_write())
+ *
+ * This is a helper function for ntfs_write() (see below).  It is called when a
+ * write request for a compressed attribute is received by ntfs_write().
+ *
+ * This function is the counterpart of ntfs_vnop_read_compressed().  It breaks
+ * up large i/os into smaller manageable chunks and for each chunk it creates
+ * and maps a upl covering the pages being written to, brings the partially
+ * written first and last pages up-to-date if they are not valid by calling
+ * ntfs_read_compressed() or by zeroing them if they are outside the
+ * initialized size @init_size, copies the data from @uio into the mapped upl
+ * and commits the pages marking them dirty.
+ *
+ * Before any data is copied, ntfs_write_compressed_reserve() reserves enough
+ * clusters for the compression blocks being written to so that the write fails
+ * synchronously if there is not enough space.
+ *
+ * The data is compressed when the dirty pages are written out, i.e. in
+ * ntfs_vnop_pageout(), which calls ntfs_write_compressed() for the pages.
+ *
+ * Return 0 on success and errno on error.
+ *
+ * Locking: Caller must hold @ni->lock on the inode.
+ */
+static inline int ntfs_vnop_write_compressed(ntfs_inode *ni, uio_t uio,
+		const s64 init_size, int ioflags)
+{
+	off_t ofs, end;
+	vnode_t vn = ni->vn;
+	ntfs_inode *raw_ni;
+	upl_t upl;
+	upl_page_info_t *pl;
+	u8 *kaddr;
+	kern_return_t kerr;
+	int err, count, delta, cur_pg, last_pg, commit_flags;
+	int max_upl_size = ubc_upl_maxbufsize();
+
+	ofs = uio_offset(uio);
+	ntfs_debug("Entering for compressed file inode 0x%llx, offset 0x%llx, "
+			"count 0x%llx, ioflags 0x%x.",
+			(unsigned long long)ni->mft_no,
+			(unsigned long long)ofs,
+			(unsigned long long)uio_resid(uio), ioflags);
+	if (ni->type != AT_DATA || !NInoCompressed(ni) ||
+			!NInoNonResident(ni) || NInoEncrypted(ni) ||
+			NInoRaw(ni))
+		panic("%s(): Called for inappropriate inode.\n", __FUNCTION__);
+	/*
+	 * Get the raw inode so we can read in the pages which are only
+	 * partially written to.  We take the inode lock shared as we only
+	 * read from it.
+	 */
+	err = ntfs_raw_inode_get(ni, LCK_RW_TYPE_SHARED, &raw_ni);
+	if (err) {
+		ntfs_error(ni->vol->mp, "Failed to get raw inode (error %d).",
+				err);
+		return err;
+	}
+	if (!NInoRaw(raw_ni))
+		panic("%s(): Requested raw inode but got non-raw one.\n",
+				__FUNCTION__);
+	if (vnode_isnocache(vn) || vnode_isnocache(raw_ni->vn))
+		ioflags |= IO_NOCACHE;
+	if (vnode_isnoreadahead(vn) || vnode_isnoreadahead(raw_ni->vn))
+		ioflags |= IO_RAOFF;
+	/*
+	 * Reserve the clusters for the compression blocks being written to
+	 * now so that running out of space fails the write rather than the
+	 * pageout.
+	 */
+	err = ntfs_write_compressed_reserve(ni, ofs, ofs + uio_resid(uio));
+	if (err) {
+		ntfs_error(ni->vol->mp, "Failed to reserve clusters for "
+				"compression blocks (error %d).", err);
+		goto err;
+	}
+	while (uio_resid(uio) > 0) {
+		ofs = uio_offset(uio);
+		end = ofs + uio_resid(uio);
+		/*
+		 * Align the i/o to PAGE_SIZE boundaries and truncate it to the
+		 * maximum upl size.
+		 */
+		delta = ofs & PAGE_MASK;
+		ofs -= delta;
+		if (end - ofs > NTFS_MAX_IO_REQUEST_SIZE)
+			end = ofs + NTFS_MAX_IO_REQUEST_SIZE;
+		if (end - ofs > max_upl_size)
+			end = ofs + max_upl_size;
+		count = (end - ofs + PAGE_MASK) & ~PAGE_MASK;
+		kerr = ubc_create_upl(vn, ofs, count, &upl, &pl, UPL_SET_LITE);
+		if (kerr != KERN_SUCCESS)
+			panic("%s(): Failed to get page list (error %d).\n",
+					__FUNCTION__, (int)kerr);
+		kerr = ubc_upl_map(upl, (vm_offset_t*)&kaddr);
+		if (kerr != KERN_SUCCESS) {
+			ntfs_error(ni->vol->mp, "Failed to map page list "
+					"(error %d).", (int)kerr);
+			err = EIO;
+			goto abort_err;
+		}
+		/*
+		 * Bring the first and last pages up-to-date if they are only
+		 * partially written to and are not valid.  All other pages
+		 * are overwritten completely.
+		 */
+		last_pg = (count >> PAGE_SHIFT) - 1;
+		for (cur_pg = 0; cur_pg <= last_pg; cur_pg += last_pg) {
+			off_t pg_ofs = ofs + ((off_t)cur_pg << PAGE_SHIFT);
+
+			if (upl_valid_page(pl, cur_pg) || (pg_ofs >= ofs +
+					delta && pg_ofs + PAGE_SIZE <= end))
+				goto next_pg;
+			if (pg_ofs < init_size) {
+				err = ntfs_read_compressed(ni, raw_ni, pg_ofs,
+						PAGE_SIZE, kaddr + (cur_pg <<
+						PAGE_SHIFT), NULL, ioflags);
+				if (err) {
+					ntfs_error(ni->vol->mp, "Failed to "
+							"decompress data "
+							"(error %d).", err);
+					goto unm_err;
+				}
+			} else
+				bzero(kaddr + (cur_pg << PAGE_SHIFT),
+						PAGE_SIZE);
+next_pg:
+			if (!last_pg)
+				break;
+		}
+		err = uiomove((caddr_t)(kaddr + delta), end - ofs - delta, uio);
+		if (err) {
+			ntfs_error(ni->vol->mp, "uiomove() failed (error %d).",
+					err);
+			goto unm_err;
+		}
+		kerr = ubc_upl_unmap(upl);
+		if (kerr != KERN_SUCCESS) {
+			ntfs_error(ni->vol->mp, "ubc_upl_unmap() failed "
+					"(error %d).", (int)kerr);
+			err = EIO;
+			goto abort_err;
+		}
+		/*
+		 * All the pages are now valid and contain new data, commit
+		 * them marking them dirty so they get compressed and written
+		 * out by ntfs_vnop_pageout().
+		 */
+		commit_flags = UPL_COMMIT_SET_DIRTY | UPL_COMMIT_FREE_ON_EMPTY;
+		if (ioflags & IO_NOCACHE)
+			commit_flags |= UPL_COMMIT_INACTIVATE;
+		ubc_upl_commit_range(upl, 0, count, commit_flags);
+	}
+	ntfs_debug("Done.");
+err:
+	lck_rw_unlock_shared(&raw_ni->lock);
+	(void)vnode_put(raw_ni->vn);
+	return err;
+unm_err:
+	kerr = ubc_upl_unmap(upl);
+	if (kerr != KERN_SUCCESS)
+		ntfs_error(ni->vol->mp, "ubc_upl_unmap() failed (error %d).",
+				(int)kerr);
+abort_err:
+	/*
+	 * For a page that was not valid, we dump it as it does not contain
+	 * valid data.  For a page that was valid, we release it without
+	 * modification.  Note uiomove() may have copied some of the data into
+	 * valid pages which we leave in place as would happen for a partial
+	 * write.
+	 */
+	last_pg = count >> PAGE_SHIFT;
+	for (cur_pg = 0; cur_pg < last_pg; cur_pg++) {
+		int abort_flags;
+
+		abort_flags = UPL_ABORT_FREE_ON_EMPTY;
+		if (!upl_valid_page(pl, cur_pg))
+			abort_flags |= UPL_ABORT_DUMP_PAGES;
+		ubc_upl_abort_range(upl, cur_pg << PAGE_SHIFT, PAGE_SIZE,
+				abort_flags);
+	}
+	goto err;
+}
+
 /**
  * ntfs_write - write a number of bytes from a memory buffer into a file
  * @ni:			ntfs inode to write to
@@ -3118,12 +3333,26 @@ static int ntfs_vnop_read(struct vnop_read_args *a)
  *	IO_DEFWRITE	- Defer write if vfs.defwrite is set.
  *	IO_PASSIVE	- This is background i/o so do not throttle other i/o.
  *
- * For compressed and encrypted attributes we abort for now as we do not
- * support them yet.
+ * For encrypted attributes we abort for now as we do not support them yet.
+ *
+ * For non-resident, compressed attributes we use ntfs_vnop_write_compressed()
+ * which copies the data into the vm page cache and leaves the compression to
+ * ntfs_vnop_pageout().
  *
  * For non-resident attributes we use cluster_write_ext() which deals with
  * normal attributes.
  *
+ * Large, page aligned writes from user space buffers, i.e. writes of at least
+ * ntfs_direct_write_min bytes, as well as IO_NOCACHE writes, bypass the vm
+ * page cache.  The clusters have been allocated and any holes instantiated
+ * above, thus we set IO_NOCACHE which causes cluster_write_ext() to wire the
+ * user buffer and to write straight from it to the device, using
+ * ntfs_vnop_blockmap() to map the runlist to physical blocks.  The vm keeps
+ * any cached pages in the range locked whilst the write is in progress and
+ * discards them afterwards thus the page cache stays coherent.  The
+ * initialized size is updated once the write has completed just as for cached
+ * writes.
+ *
  * Return 0 on success and errno on error.
  *
  * Note it is up to the caller to verify that writing to the inode @ni makes
@@ -3172,16 +3401,6 @@ static errno_t ntfs_write(ntfs_inode *ni, uio_t uio, int ioflags,
 				"attribute (EACCES).");
 		return EACCES;
 	}
-	/* TODO: We do not support writing to compressed files. */
-	if (NInoCompressed(ni)) {
-		ntfs_error(ni->vol->mp, "Writing to compressed files is not "
-				"implemented yet.  Sorry.");
-		return ENOTSUP;
-	}
-#if 1	// TODO: Remove this when sparse support is done...
-	if (NInoSparse(ni))
-		return ENOTSUP;
-#endif
 	base_ni = ni;
 	if (NInoAttr(ni))
 		base_ni = ni->base_ni;
@@ -3288,12 +3507,14 @@ recheck_deleted:
 	 * If this is a sparse attribute and the write overlaps the existing
 	 * allocated size we need to fill any holes overlapping the write.  We
 	 * can skip resident attributes as they cannot have sparse regions.
+	 * We can also skip compressed attributes as their clusters are
+	 * allocated when the data is compressed in ntfs_vnop_pageout().
 	 *
 	 * As allocated size goes in units of clusters we need to round down
 	 * the start offset to the nearest cluster boundary and we need to
 	 * round up the end offset to the next cluster boundary.
 	 */
-	if (NInoSparse(ni) && NInoNonResident(ni) &&
+	if (NInoSparse(ni) && NInoNonResident(ni) && !NInoCompressed(ni) &&
 			(ofs & ~ni->vol->cluster_size_mask) < size) {
 		s64 aligned_end, new_end;
 
@@ -3439,24 +3660,16 @@ recheck_deleted:
 		int (*callback)(buf_t, void *);
 
 		if (NInoCompressed(ni) && !NInoRaw(ni)) {
-#if 0
 			err = ntfs_vnop_write_compressed(ni, uio, size,
 					ioflags);
-			if (!err)
-				ntfs_debug("Done (ntfs_vnop_write_compressed()"
-						").");
-			else
+			if (err) {
 				ntfs_error(ni->vol->mp, "Failed ("
 						"ntfs_vnop_write_compressed(), "
 						"error %d).", err);
-#endif
-			/*
-			 * TODO: At present we should never get here for
-			 * compressed files as this case is aborted at the
-			 * start of the function.
-			 */
-			panic("%s(): NInoCompressed(ni) && !NInoRaw(ni)\n",
-					__FUNCTION__);
+				goto abort;
+			}
+			ntfs_debug("Done (ntfs_vnop_write_compressed()).");
+			goto done;
 		}
 		callback = NULL;
 		if (NInoEncrypted(ni)) {
@@ -3468,6 +3681,18 @@ recheck_deleted:
 			 */
 			panic("%s(): NInoEncrypted(ni)\n", __FUNCTION__);
 		}
+		if (uio_isuserspace(uio)) {
+			if (!(ioflags & IO_NOCACHE) &&
+					ntfs_direct_write_min > 0 &&
+					count >= ntfs_direct_write_min &&
+					!(ofs & PAGE_MASK_64))
+				ioflags |= IO_NOCACHE;
+			if (ioflags & IO_NOCACHE) {
+				OSIncrementAtomic64(&ntfs_dio_stats.writes);
+				OSAddAtomic64(count,
+						&ntfs_dio_stats.write_bytes);
+			}
+		}
 		/* Determine the new file size. */
 		size = ubc_getsize(vn);
 		if (end > size)
@@ -3828,8 +4053,11 @@ skip_truncate:
  *	IO_DEFWRITE	- Defer write if vfs.defwrite is set.
  *	IO_PASSIVE	- This is background i/o so do not throttle other i/o.
  *
- * For compressed and encrypted attributes we abort for now as we do not
- * support them yet.
+ * For encrypted attributes we abort for now as we do not support them yet.
+ *
+ * For non-resident, compressed attributes we use ntfs_vnop_write_compressed()
+ * which copies the data into the vm page cache and leaves the compression to
+ * ntfs_vnop_pageout().
  *
  * For non-resident attributes we use cluster_write_ext() which deals with
  * normal attributes.
@@ -3862,16 +4090,149 @@ static int ntfs_vnop_write(struct vnop_write_args *a)
 }
 
 /**
- * ntfs_vnop_ioctl -
+ * ntfs_vnop_ioctl - device/file specific control operation on an ntfs inode
+ * @a:		arguments to ioctl function
+ *
+ * @a contains:
+ *	vnode_t a_vp;		vnode of the ntfs inode to operate on
+ *	u_long a_command;	ioctl command to perform
+ *	caddr_t a_data;		in/out buffer for the command data
+ *	int a_fflag;		file flags of the open file
+ *	vfs_context_t a_context;
+ *
+ * The following commands are supported:
  *
+ * NTFS_IOC_RL_STATS - Return statistics about the runlist of the ntfs inode
+ *	in @a->a_data which is an ntfs_rl_stats structure (see ntfs.h).  This
+ *	is supported on regular files and on named streams.
+ *
+ * F_PUNCHHOLE - Deallocate the byte range described by the fpunchhole_t
+ *	structure in @a->a_data so that it reads back as zeroes (see
+ *	ntfs_attr_punch_hole()).  The file size does not change.  This is
+ *	supported on regular files and on named streams.  The VFS has already
+ *	checked that the file is open for writing and passes a zero @a_fflag
+ *	thus we do not check it here.
+ *
+ * FSIOC_FIOSEEKHOLE, FSIOC_FIOSEEKDATA - Find the first hole or data region,
+ *	respectively, at or after the byte offset in @a->a_data which is an
+ *	off_t and return its offset in @a->a_data (see
+ *	ntfs_attr_seek_hole_data()).  These implement the SEEK_HOLE and
+ *	SEEK_DATA whences of lseek(2) and are supported on regular files and
+ *	on named streams.
+ *
+ * Return 0 on success and errno on error.  ENOTSUP is returned for unknown
+ * commands.
  */
-static int ntfs_vnop_ioctl(struct vnop_ioctl_args *a __attribute__((unused)))
+static int ntfs_vnop_ioctl(struct vnop_ioctl_args *a)
 {
+	ntfs_inode *base_ni, *ni = NTFS_I(a->a_vp);
 	errno_t err;
 
-	ntfs_debug("Entering.");
-	// TODO:
-	err = ENOTSUP;
+	if (!ni) {
+		ntfs_debug("Entered with NULL ntfs_inode, aborting.");
+		return EINVAL;
+	}
+	ntfs_debug("Entering for mft_no 0x%llx, command 0x%lx.",
+			(unsigned long long)ni->mft_no, a->a_command);
+	switch (a->a_command) {
+	case NTFS_IOC_RL_STATS:
+		if (!S_ISREG(ni->mode) && !(NInoAttr(ni) &&
+				ni->type == AT_DATA)) {
+			err = S_ISDIR(ni->mode) ? EISDIR : EINVAL;
+			break;
+		}
+		base_ni = ni;
+		if (NInoAttr(ni)) {
+			base_ni = ni->base_ni;
+			lck_rw_lock_shared(&base_ni->lock);
+		}
+		lck_rw_lock_shared(&ni->lock);
+		/* Do not allow messing with the inode once it has been deleted. */
+		if (NInoDeleted(ni)) {
+			/* Remove the inode from the name cache. */
+			cache_purge(ni->vn);
+			err = ENOENT;
+		} else
+			err = ntfs_attr_get_rl_stats(ni,
+					(ntfs_rl_stats*)a->a_data);
+		lck_rw_unlock_shared(&ni->lock);
+		if (base_ni != ni)
+			lck_rw_unlock_shared(&base_ni->lock);
+		break;
+	case F_PUNCHHOLE:
+	{
+		fpunchhole_t *args = (fpunchhole_t*)a->a_data;
+
+		if (vnode_issystem(a->a_vp) || NInoMstProtected(ni) ||
+				(!S_ISREG(ni->mode) && !(NInoAttr(ni) &&
+				ni->type == AT_DATA))) {
+			err = S_ISDIR(ni->mode) ? EISDIR : EPERM;
+			break;
+		}
+		if (args->fp_flags || args->fp_offset < 0 ||
+				args->fp_length <= 0 || args->fp_offset >
+				NTFS_MAX_ATTRIBUTE_SIZE - args->fp_length) {
+			err = EINVAL;
+			break;
+		}
+		base_ni = ni;
+		if (NInoAttr(ni)) {
+			base_ni = ni->base_ni;
+			lck_rw_lock_exclusive(&base_ni->lock);
+		}
+		lck_rw_lock_exclusive(&ni->lock);
+		/* Do not allow messing with the inode once it has been deleted. */
+		if (NInoDeleted(ni)) {
+			/* Remove the inode from the name cache. */
+			cache_purge(ni->vn);
+			err = ENOENT;
+		} else {
+			err = ntfs_attr_punch_hole(ni, args->fp_offset,
+					args->fp_offset + args->fp_length);
+			if (!err) {
+				/* As in ntfs_write(). */
+				base_ni->last_mft_change_time =
+						ntfs_utc_current_time();
+				if (ni == base_ni)
+					base_ni->last_data_change_time =
+						base_ni->last_mft_change_time;
+				NInoSetDirtyTimes(base_ni);
+			}
+		}
+		lck_rw_unlock_exclusive(&ni->lock);
+		if (base_ni != ni)
+			lck_rw_unlock_exclusive(&base_ni->lock);
+		break;
+	}
+	case FSIOC_FIOSEEKHOLE:
+	case FSIOC_FIOSEEKDATA:
+		if (!S_ISREG(ni->mode) && !(NInoAttr(ni) &&
+				ni->type == AT_DATA)) {
+			err = S_ISDIR(ni->mode) ? EISDIR : EINVAL;
+			break;
+		}
+		base_ni = ni;
+		if (NInoAttr(ni)) {
+			base_ni = ni->base_ni;
+			lck_rw_lock_shared(&base_ni->lock);
+		}
+		lck_rw_lock_shared(&ni->lock);
+		/* Do not allow messing with the inode once it has been deleted. */
+		if (NInoDeleted(ni)) {
+			/* Remove the inode from the name cache. */
+			cache_purge(ni->vn);
+			err = ENOENT;
+		} else
+			err = ntfs_attr_seek_hole_data(ni, (s64*)a->a_data,
+					a->a_command == FSIOC_FIOSEEKHOLE);
+		lck_rw_unlock_shared(&ni->lock);
+		if (base_ni != ni)
+			lck_rw_unlock_shared(&base_ni->lock);
+		break;
+	default:
+		err = ENOTSUP;
+		break;
+	}
 	ntfs_debug("Done (error %d).", (int)err);
 	return err;
 }
@@ -7312,9 +7673,15 @@ sync:
 		err = 0;
 		if (!NVolReadOnly(vol))
 			err = ntfs_inode_sync(ni, IO_SYNC | IO_CLOSE, FALSE);
-		if (!err)
+		if (!err) {
+			/*
+			 * The inode is now unused thus pack a large runlist
+			 * so it takes less memory whilst the vnode sits in
+			 * the vnode cache.
+			 */
+			ntfs_attr_pack_runlist(ni);
 			ntfs_debug("Done.");
-		else
+		} else
 			ntfs_error(vol->mp, "Failed to sync mft_no 0x%llx, "
 					"type 0x%x, name_len 0x%x (error %d).",
 					(unsigned long long)ni->mft_no,
@@ -7851,6 +8218,22 @@ static int ntfs_vnop_pathconf(struct vnop_pathconf_args *a)
 		 */
 		*a->a_retval = 63;
 		break;
+	case _PC_MIN_HOLE_SIZE:
+		/*
+		 * The minimum size of a hole in a sparse file.  For ntfs, this
+		 * is the cluster size or, for compressed files, the size of a
+		 * compression block as only entirely sparse compression blocks
+		 * are holes.
+		 */
+		if (!vol) {
+			err = EINVAL;
+			break;
+		}
+		*a->a_retval = vol->cluster_size;
+		if (ni && !S_ISDIR(ni->mode) && NInoCompressed(ni) &&
+				ni->compression_block_size)
+			*a->a_retval = ni->compression_block_size;
+		break;
 	default:
 		err = EINVAL;
 	}
@@ -8266,12 +8649,6 @@ static int ntfs_vnop_pageout(struct vnop_pageout_args *a)
 		err = EFBIG;
 		goto err;
 	}
-#if 1	// TODO: Remove this when sparse support is done...
-	if (NInoSparse(ni)) {
-		err = ENOTSUP;
-		goto err;
-	}
-#endif
 	/*
 	 * Protect against changes in initialized_size and thus against
 	 * truncation also but only if the VFS is not calling back into the
@@ -8303,9 +8680,15 @@ static int ntfs_vnop_pageout(struct vnop_pageout_args *a)
 	 * whether the caller is holding the lock for write or not and we
 	 * cannot safely drop/retake the lock in any case...  For now we ignore
 	 * the problem and just emit a warning in this case.
+	 *
+	 * Compressed attributes also need the lock for writing as their
+	 * compression blocks are reallocated when they are written out.  This
+	 * also excludes concurrent readers and writers which hold the raw
+	 * inode lock whilst they have pages of the attribute busy in their
+	 * page lists thus we can safely take the raw inode lock below.
 	 */
 	if (!(flags & UPL_NESTED_PAGEOUT)) {
-		if (NInoSparse(ni))
+		if (NInoSparse(ni) || NInoCompressed(ni))
 			lock_type = LCK_RW_TYPE_EXCLUSIVE;
 		if (!lck_rw_try_lock(&ni->lock, lock_type)) {
 			ntfs_debug("Failed to take ni->lock for %s for mft_no "
@@ -8395,7 +8778,8 @@ retry_pageout:
 	 * the start offset to the nearest cluster boundary and we need to
 	 * round up the end offset to the next cluster boundary.
 	 */
-	if (NInoSparse(ni) && NInoNonResident(ni) && ni->type == AT_DATA) {
+	if (NInoSparse(ni) && NInoNonResident(ni) && !NInoCompressed(ni) &&
+			ni->type == AT_DATA) {
 		s64 aligned_end, new_end;
 
 		aligned_end = (attr_ofs + size + vol->cluster_size_mask) &
@@ -8505,10 +8889,6 @@ compressed:
 			ntfs_error(vol->mp, "ntfs_resident_attr_write() "
 					"failed (error %d).", err);
 	} else if (NInoCompressed(ni)) {
-		ntfs_error(vol->mp, "Writing to compressed files is not "
-				"implemented yet, sorry.");
-		err = ENOTSUP;
-#if 0
 		ntfs_inode *raw_ni;
 		int ioflags;
 
@@ -8533,14 +8913,13 @@ compressed:
 					vnode_isnoreadahead(raw_ni->vn))
 				ioflags |= IO_RAOFF;
 			err = ntfs_write_compressed(ni, raw_ni, attr_ofs, size,
-					kaddr + upl_ofs, NULL, ioflags);
+					kaddr + upl_ofs, ioflags);
 			if (err)
 				ntfs_error(vol->mp, "ntfs_write_compressed() "
 						"failed (error %d).", err);
 			lck_rw_unlock_exclusive(&raw_ni->lock);
 			(void)vnode_put(raw_ni->vn);
 		}
-#endif
 	} else {
 		/*
 		 * The attribute was converted to non-resident under our nose
@@ -8646,18 +9025,670 @@ done:
 	return err;
 }
 
+/*
+ * The private search state of ntfs_vnop_searchfs().  It is stored in the file
+ * system specific part of the search state (@a->a_searchstate) between calls
+ * so that a search can be resumed where it left off.
+ */
+typedef struct {
+	s64 mft_no;		/* Mft record number at which to resume. */
+	unsigned name_idx;	/* Number of filenames in the mft record @mft_no
+				   which have been dealt with already. */
+} ntfs_searchstate;
+
+/*
+ * Number of buffers of $MFT/$DATA to read ahead at a time when scanning the
+ * mft in ntfs_vnop_searchfs().
+ */
+#define NTFS_SEARCHFS_BATCH 64
+
+/*
+ * Size of the buffer in which search results are collected before they are
+ * copied to the caller's buffer.
+ */
+#define NTFS_SEARCHFS_RESULTS_SIZE (16 * NTFS_SEARCHFS_ENTRY_SIZE)
+
+/* The attributes ntfs_vnop_searchfs() knows how to return. */
+#define NTFS_SEARCHFS_RETURN_ATTRS (ATTR_CMN_NAME | ATTR_CMN_DEVID |	\
+		ATTR_CMN_FSID | ATTR_CMN_OBJTYPE | ATTR_CMN_OBJID |	\
+		ATTR_CMN_OBJPERMANENTID | ATTR_CMN_PAROBJID |		\
+		ATTR_CMN_FILEID | ATTR_CMN_PARENTID)
+
+/* Size of the buffer in which a single search result is assembled. */
+#define NTFS_SEARCHFS_ENTRY_SIZE (128 + MAXPATHLEN)
+
+/*
+ * The search context used by ntfs_vnop_searchfs() and its helpers.
+ */
+typedef struct {
+	ntfs_volume *vol;		/* Volume being searched. */
+	ntfschar *uname;		/* Name to search for. */
+	size_t uname_size;		/* Size of @uname buffer in bytes. */
+	unsigned uname_len;		/* Length of @uname in Unicode chars. */
+	u32 options;			/* SRCHFS_* search options. */
+	attrgroup_t returnattrs;	/* ATTR_CMN_* attributes to return. */
+	uio_t uio;			/* Destination for the results. */
+	u32 nummatches;			/* Number of matches returned so far. */
+	u32 maxmatches;			/* Maximum number of matches to
+					   return. */
+	u32 results_len;		/* Number of bytes in @results. */
+	BOOL results_full;		/* True if @results ran out of space. */
+	u8 entry[NTFS_SEARCHFS_ENTRY_SIZE]; /* Buffer for a single result. */
+	u8 results[NTFS_SEARCHFS_RESULTS_SIZE]; /* Results not yet copied to
+					   @uio. */
+	u8 utf8_name[MAXPATHLEN];	/* Buffer for a converted filename. */
+	daddr64_t rablks[NTFS_SEARCHFS_BATCH];	/* Read-ahead block numbers. */
+	int rasizes[NTFS_SEARCHFS_BATCH];	/* Read-ahead block sizes. */
+} ntfs_searchfs_ctx;
+
+/**
+ * ntfs_searchfs_name_match - check if a filename matches the search name
+ * @sctx:	search context
+ * @fn:		filename attribute to check
+ *
+ * Return true if the filename in the filename attribute @fn matches the search
+ * name in the search context @sctx and false otherwise.
+ *
+ * If SRCHFS_MATCHPARTIALNAMES is set the name matches if the search name is
+ * contained anywhere in the filename.  This comparison is always done case
+ * insensitively and expects @sctx->uname to have been upcased already.
+ * Otherwise the names must be identical, case insensitively unless the volume
+ * is mounted case sensitive.
+ */
+static BOOL ntfs_searchfs_name_match(ntfs_searchfs_ctx *sctx,
+		const FILENAME_ATTR *fn)
+{
+	ntfs_volume *vol = sctx->vol;
+	const ntfschar *upcase = vol->upcase;
+	const u32 upcase_len = vol->upcase_len;
+	unsigned i, j, fn_len = fn->filename_length;
+	u16 c;
+
+	if (!(sctx->options & SRCHFS_MATCHPARTIALNAMES))
+		return ntfs_are_names_equal(fn->filename, fn_len, sctx->uname,
+				sctx->uname_len, NVolCaseSensitive(vol),
+				upcase, upcase_len);
+	if (sctx->uname_len > fn_len)
+		return FALSE;
+	for (i = 0; i <= fn_len - sctx->uname_len; i++) {
+		for (j = 0; j < sctx->uname_len; j++) {
+			c = le16_to_cpu(fn->filename[i + j]);
+			if (c < upcase_len)
+				c = le16_to_cpu(upcase[c]);
+			if (c != le16_to_cpu(sctx->uname[j]))
+				break;
+		}
+		if (j == sctx->uname_len)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * ntfs_searchfs_entry_return - return a single search result
+ * @sctx:	search context
+ * @fn:		filename attribute that matched
+ * @mft_no:	mft record number of the base inode to which @fn belongs
+ * @is_dir:	true if the inode @mft_no is a directory
+ *
+ * Pack the attributes @sctx->returnattrs for the filename @fn of the inode
+ * @mft_no in the getattrlist() format and append the result to
+ * @sctx->results.  The results are copied to @sctx->uio by
+ * ntfs_searchfs_results_copy() once the mft buffer and the lock of $MFT have
+ * been released as the copy may fault in pages of a file on this volume.
+ *
+ * Return 0 on success and -1 if there is not enough space left in @sctx->uio
+ * to return the result or if @sctx->results is full, in which case
+ * @sctx->results_full is set.  A filename that cannot be represented in UTF-8
+ * is silently skipped and 0 is returned.
+ */
+static int ntfs_searchfs_entry_return(ntfs_searchfs_ctx *sctx,
+		const FILENAME_ATTR *fn, ino64_t mft_no, BOOL is_dir)
+{
+	ntfs_volume *vol = sctx->vol;
+	attrgroup_t attrs = sctx->returnattrs;
+	attrreference_t *ar = NULL;
+	u8 *p, *utf8_name;
+	size_t utf8_size;
+	ino64_t parent_mft_no;
+	fsobj_id_t objid;
+	u32 len;
+	signed res_size = 0;
+
+	/*
+	 * As elsewhere, return fsRtDirID (2) as the inode number of the root
+	 * directory.
+	 */
+	parent_mft_no = MREF_LE(fn->parent_directory);
+	if (parent_mft_no == FILE_root)
+		parent_mft_no = 2;
+	if (attrs & ATTR_CMN_NAME) {
+		utf8_name = sctx->utf8_name;
+		utf8_size = sizeof(sctx->utf8_name);
+		res_size = ntfs_to_utf8(vol, fn->filename,
+				fn->filename_length << NTFSCHAR_SIZE_SHIFT,
+				&utf8_name, &utf8_size);
+		if (res_size <= 0) {
+			ntfs_warning(vol->mp, "Skipping unrepresentable inode "
+					"0x%llx (error %d).",
+					(unsigned long long)mft_no, -res_size);
+			return 0;
+		}
+	}
+	bzero(sctx->entry, sizeof(sctx->entry));
+	p = sctx->entry + sizeof(u32);
+	if (attrs & ATTR_CMN_NAME) {
+		ar = (attrreference_t*)p;
+		p += sizeof(attrreference_t);
+	}
+	if (attrs & ATTR_CMN_DEVID) {
+		memcpy(p, &vol->dev, sizeof(dev_t));
+		p += sizeof(dev_t);
+	}
+	if (attrs & ATTR_CMN_FSID) {
+		memcpy(p, &vfs_statfs(vol->mp)->f_fsid, sizeof(fsid_t));
+		p += sizeof(fsid_t);
+	}
+	if (attrs & ATTR_CMN_OBJTYPE) {
+		fsobj_type_t type = is_dir ? VDIR : VREG;
+
+		memcpy(p, &type, sizeof(type));
+		p += sizeof(type);
+	}
+	objid.fid_objno = (u32)mft_no;
+	objid.fid_generation = 0;
+	if (attrs & ATTR_CMN_OBJID) {
+		memcpy(p, &objid, sizeof(objid));
+		p += sizeof(objid);
+	}
+	if (attrs & ATTR_CMN_OBJPERMANENTID) {
+		memcpy(p, &objid, sizeof(objid));
+		p += sizeof(objid);
+	}
+	if (attrs & ATTR_CMN_PAROBJID) {
+		objid.fid_objno = (u32)parent_mft_no;
+		memcpy(p, &objid, sizeof(objid));
+		p += sizeof(objid);
+	}
+	if (attrs & ATTR_CMN_FILEID) {
+		u64 fileid = mft_no;
+
+		memcpy(p, &fileid, sizeof(fileid));
+		p += sizeof(fileid);
+	}
+	if (attrs & ATTR_CMN_PARENTID) {
+		u64 parentid = parent_mft_no;
+
+		memcpy(p, &parentid, sizeof(parentid));
+		p += sizeof(parentid);
+	}
+	if (ar) {
+		/* Include the NUL terminator in the name length. */
+		ar->attr_dataoffset = (int32_t)(p - (u8*)ar);
+		ar->attr_length = res_size + 1;
+		memcpy(p, sctx->utf8_name, res_size);
+		p += (res_size + 1 + 3) & ~3;
+	}
+	len = (u32)(p - sctx->entry);
+	memcpy(sctx->entry, &len, sizeof(len));
+	if (uio_resid(sctx->uio) < sctx->results_len + len)
+		return -1;
+	if (sctx->results_len + len > sizeof(sctx->results)) {
+		sctx->results_full = TRUE;
+		return -1;
+	}
+	memcpy(sctx->results + sctx->results_len, sctx->entry, len);
+	sctx->results_len += len;
+	return 0;
+}
+
+/**
+ * ntfs_searchfs_results_copy - copy the collected search results to the caller
+ * @sctx:	search context
+ *
+ * Copy the search results collected in @sctx->results to @sctx->uio and empty
+ * @sctx->results.
+ *
+ * Locking: The caller must not hold any locks or buffers as uiomove() may
+ *	    fault in pages of a file on this volume.
+ *
+ * Return 0 on success and errno on error.
+ */
+static int ntfs_searchfs_results_copy(ntfs_searchfs_ctx *sctx)
+{
+	int err = 0;
+
+	if (sctx->results_len) {
+		err = uiomove((caddr_t)sctx->results, sctx->results_len,
+				sctx->uio);
+		if (err)
+			ntfs_error(sctx->vol->mp, "uiomove() failed (error "
+					"%d).", err);
+		sctx->results_len = 0;
+	}
+	sctx->results_full = FALSE;
+	return err;
+}
+
+/**
+ * ntfs_searchfs_record - search the filenames in an mft record
+ * @sctx:	search context
+ * @m:		mft record to search
+ * @rec_no:	mft record number of @m
+ * @name_idx:	number of filenames in @m to skip on entry, see below
+ *
+ * Check each filename attribute in the mft record @m against the search
+ * criteria in the search context @sctx and return the ones that match.  The
+ * first *@name_idx filenames are skipped as they have been dealt with by a
+ * previous call already.  DOS filenames are never returned (and not counted)
+ * as they are merely short aliases of the Win32 filenames.
+ *
+ * Extent mft records are searched, too, as filename attributes can be moved
+ * out of the base mft record when the inode has many hard links.  They are
+ * returned as belonging to the base inode.
+ *
+ * Return 0 if all filenames in @m have been dealt with, in which case
+ * *@name_idx is reset to zero, or if @sctx->maxmatches has been reached, in
+ * which case *@name_idx is set so that the search can be resumed.  Return -1
+ * if there was not enough space to return a match, again setting *@name_idx
+ * so that the search can be resumed.
+ */
+static int ntfs_searchfs_record(ntfs_searchfs_ctx *sctx, MFT_RECORD *m,
+		s64 rec_no, unsigned *name_idx)
+{
+	ntfs_volume *vol = sctx->vol;
+	ATTR_RECORD *a;
+	FILENAME_ATTR *fn;
+	u8 *m_end;
+	ino64_t mft_no, parent_mft_no;
+	unsigned idx;
+	u32 bytes_in_use;
+	int err;
+	BOOL match, is_dir, is_base;
+
+	/*
+	 * Skip unused and corrupt mft records.  We do not complain about the
+	 * latter as the mft record may be in the process of being modified
+	 * and we will complain when it is mapped properly.
+	 */
+	if (!ntfs_is_mft_record(m->magic) || !(m->flags & MFT_RECORD_IN_USE))
+		goto done;
+	bytes_in_use = le32_to_cpu(m->bytes_in_use);
+	if (bytes_in_use > vol->mft_record_size ||
+			le16_to_cpu(m->attrs_offset) >= bytes_in_use)
+		goto done;
+	is_base = !m->base_mft_record;
+	mft_no = is_base ? (ino64_t)rec_no : MREF_LE(m->base_mft_record);
+	/* Skip the core NTFS system files as ntfs_readdir() does. */
+	if (mft_no < FILE_first_user)
+		goto done;
+	if (sctx->options & SRCHFS_SKIPLINKS && is_base &&
+			le16_to_cpu(m->link_count) > 1) {
+		unsigned nr_names = 0;
+		/*
+		 * The link count includes DOS filenames thus count the
+		 * non-DOS filenames to determine if this is a hard link.
+		 */
+		m_end = (u8*)m + bytes_in_use;
+		for (a = (ATTR_RECORD*)((u8*)m + le16_to_cpu(m->attrs_offset));
+				(u8*)a + sizeof(a->type) <= m_end &&
+				a->type != AT_END;
+				a = (ATTR_RECORD*)((u8*)a +
+				le32_to_cpu(a->length))) {
+			if (!a->length || (u8*)a + le32_to_cpu(a->length) >
+					m_end)
+				break;
+			if (a->type != AT_FILENAME || a->non_resident)
+				continue;
+			fn = (FILENAME_ATTR*)((u8*)a +
+					le16_to_cpu(a->value_offset));
+			if (fn->filename_type != FILENAME_DOS)
+				nr_names++;
+		}
+		if (nr_names > 1)
+			goto done;
+	}
+	idx = 0;
+	m_end = (u8*)m + bytes_in_use;
+	for (a = (ATTR_RECORD*)((u8*)m + le16_to_cpu(m->attrs_offset));
+			(u8*)a + sizeof(a->type) <= m_end &&
+			a->type != AT_END;
+			a = (ATTR_RECORD*)((u8*)a + le32_to_cpu(a->length))) {
+		if (!a->length || (u8*)a + le32_to_cpu(a->length) > m_end)
+			break;
+		if (a->type != AT_FILENAME || a->non_resident)
+			continue;
+		fn = (FILENAME_ATTR*)((u8*)a + le16_to_cpu(a->value_offset));
+		if ((u8*)fn + sizeof(FILENAME_ATTR) > m_end ||
+				(u8*)fn->filename + (fn->filename_length <<
+				NTFSCHAR_SIZE_SHIFT) > m_end)
+			continue;
+		if (fn->filename_type == FILENAME_DOS)
+			continue;
+		if (idx++ < *name_idx)
+			continue;
+		/*
+		 * Skip filenames whose parent is an NTFS system directory
+		 * other than the root directory, i.e. whose parent mft record
+		 * is below FILE_first_user, such as $Extend.  Only direct
+		 * children are skipped.  The subdirectories of $Extend (e.g.
+		 * $RmMetadata) have user mft records so names in them are
+		 * still matched.
+		 */
+		parent_mft_no = MREF_LE(fn->parent_directory);
+		if (parent_mft_no < FILE_first_user &&
+				parent_mft_no != FILE_root)
+			continue;
+		if (is_base)
+			is_dir = (m->flags & MFT_RECORD_IS_DIRECTORY) ? TRUE :
+					FALSE;
+		else
+			is_dir = (fn->file_attributes &
+					FILE_ATTR_DUP_FILENAME_INDEX_PRESENT) ?
+					TRUE : FALSE;
+		if (!(sctx->options & (is_dir ? SRCHFS_MATCHDIRS :
+				SRCHFS_MATCHFILES)))
+			continue;
+		if (sctx->options & SRCHFS_SKIPINVISIBLE &&
+				(fn->file_attributes & FILE_ATTR_HIDDEN ||
+				(fn->filename_length &&
+				fn->filename[0] == const_cpu_to_le16('.'))))
+			continue;
+		match = ntfs_searchfs_name_match(sctx, fn);
+		if (sctx->options & SRCHFS_NEGATEPARAMS)
+			match = !match;
+		if (!match)
+			continue;
+		if (sctx->nummatches >= sctx->maxmatches) {
+			*name_idx = idx - 1;
+			return 0;
+		}
+		err = ntfs_searchfs_entry_return(sctx, fn, mft_no, is_dir);
+		if (err) {
+			*name_idx = idx - 1;
+			return err;
+		}
+		if (++sctx->nummatches >= sctx->maxmatches) {
+			*name_idx = idx;
+			return 0;
+		}
+	}
+done:
+	*name_idx = 0;
+	return 0;
+}
+
 /**
- * ntfs_vnop_searchfs -
+ * ntfs_vnop_searchfs - search a volume for files matching given criteria
+ * @a:		arguments to searchfs function
  *
+ * @a contains:
+ *	vnode_t a_vp;			root vnode of the volume to search
+ *	void *a_searchparams1;		lower bounds of the search criteria
+ *	void *a_searchparams2;		upper bounds of the search criteria
+ *	struct attrlist *a_searchattrs;	attributes to search by
+ *	uint32_t a_maxmatches;		maximum number of matches to return
+ *	struct timeval *a_timelimit;	maximum time to spend searching
+ *	struct attrlist *a_returnattrs;	attributes to return for each match
+ *	uint32_t *a_nummatches;		destination for the number of matches
+ *	uint32_t a_scriptcode;		unused
+ *	uint32_t a_options;		SRCHFS_* search options
+ *	struct uio *a_uio;		destination for the matches
+ *	struct searchstate *a_searchstate; state for resuming a search
+ *	vfs_context_t a_context;
+ *
+ * Search the volume for files and/or directories whose name matches the name
+ * specified in @a->a_searchparams1 and return the attributes @a->a_returnattrs
+ * for each match in @a->a_uio in the getattrlist() format.
+ *
+ * Rather than walking the directory tree, which requires a lookup and random
+ * i/o for each directory, we scan $MFT/$DATA sequentially and decode the
+ * filename attributes in each mft record directly.  The mft records are read
+ * through the buffer cache, as everywhere else, one buffer at a time but with
+ * the buffers of the next NTFS_SEARCHFS_BATCH mft records being read ahead.
+ * Parent directories are not resolved at all, we only return their inode
+ * numbers and leave it to the caller to turn those into paths if needed.
+ *
+ * The matches are collected in a kernel buffer and only copied to @a->a_uio
+ * once the mft buffer and the lock of $MFT have been released.  Otherwise a
+ * destination buffer which is a mapped file on this volume could deadlock.
+ *
+ * Only searching by name (ATTR_CMN_NAME) is supported.  Symbolic links are
+ * returned as regular files as determining whether a file is a symbolic link
+ * would require reading its AFP_AfpInfo named stream.
+ *
+ * Return 0 when the search is complete, EAGAIN if the search has been
+ * interrupted because @a->a_maxmatches or @a->a_timelimit has been reached or
+ * because @a->a_uio is full, in which case it can be resumed by calling again
+ * with the same @a->a_searchstate, and errno on error.
  */
 static int ntfs_vnop_searchfs(struct vnop_searchfs_args *a)
 {
-	errno_t err;
+	struct timeval deadline, now;
+	ntfs_inode *mft_ni;
+	ntfs_volume *vol;
+	ntfs_searchfs_ctx *sctx;
+	ntfs_searchstate *ss;
+	struct attrlist *sa, *ra;
+	attrreference_t *name_ref;
+	buf_t buf;
+	u8 *kaddr;
+	s64 rec_no, nr_recs, blkno, unit_end;
+	unsigned name_idx, recs_per_unit, unit_size, nr_ra, i;
+	signed res;
+	errno_t err, err2;
+	BOOL resumed;
 
+	*a->a_nummatches = 0;
+	if (!NTFS_I(a->a_vp)) {
+		ntfs_debug("Entered with NULL ntfs_inode, aborting.");
+		return EINVAL;
+	}
+	vol = NTFS_I(a->a_vp)->vol;
 	ntfs_debug("Entering.");
-	// TODO:
-	err = err_searchfs(a);
-	ntfs_debug("Done (error %d).", (int)err);
+	if (a->a_options & ~SRCHFS_VALIDOPTIONSMASK ||
+			!(a->a_options & (SRCHFS_MATCHDIRS |
+			SRCHFS_MATCHFILES)))
+		return EINVAL;
+	/* We only support searching by name. */
+	sa = a->a_searchattrs;
+	if (sa->bitmapcount != ATTR_BIT_MAP_COUNT ||
+			sa->commonattr != ATTR_CMN_NAME || sa->volattr ||
+			sa->dirattr || sa->fileattr || sa->forkattr) {
+		ntfs_debug("Unsupported search attributes, returning "
+				"EINVAL.");
+		return EINVAL;
+	}
+	ra = a->a_returnattrs;
+	if (ra->bitmapcount != ATTR_BIT_MAP_COUNT ||
+			ra->commonattr & ~NTFS_SEARCHFS_RETURN_ATTRS ||
+			ra->volattr || ra->dirattr || ra->fileattr ||
+			ra->forkattr) {
+		ntfs_debug("Unsupported return attributes, returning "
+				"EINVAL.");
+		return EINVAL;
+	}
+	/*
+	 * The search parameters begin with their size followed by the
+	 * attribute reference to the name.  The VFS has verified that the name
+	 * lies within the parameters.
+	 */
+	name_ref = (attrreference_t*)((u32*)a->a_searchparams1 + 1);
+	sctx = IOMallocType(ntfs_searchfs_ctx);
+	if (!sctx) {
+		ntfs_error(vol->mp, "Failed to allocate search context.");
+		return ENOMEM;
+	}
+	sctx->vol = vol;
+	sctx->uname = NULL;
+	sctx->options = a->a_options;
+	sctx->returnattrs = ra->commonattr;
+	sctx->uio = a->a_uio;
+	sctx->nummatches = 0;
+	sctx->maxmatches = a->a_maxmatches;
+	sctx->results_len = 0;
+	sctx->results_full = FALSE;
+	res = utf8_to_ntfs(vol, (u8*)name_ref + name_ref->attr_dataoffset,
+			strnlen((char*)name_ref + name_ref->attr_dataoffset,
+			name_ref->attr_length), &sctx->uname,
+			&sctx->uname_size);
+	if (res <= 0) {
+		err = EINVAL;
+		if (res < 0)
+			err = -res;
+		else
+			IOFreeData(sctx->uname, sctx->uname_size);
+		ntfs_debug("Failed to convert search name to NTFS (error "
+				"%d).", (int)err);
+		IOFreeType(sctx, ntfs_searchfs_ctx);
+		return err;
+	}
+	sctx->uname_len = res;
+	if (sctx->options & SRCHFS_MATCHPARTIALNAMES)
+		ntfs_upcase_name(sctx->uname, sctx->uname_len, vol->upcase,
+				vol->upcase_len);
+	ss = (ntfs_searchstate*)a->a_searchstate;
+	if (a->a_options & SRCHFS_START)
+		bzero(ss, sizeof(*ss));
+	rec_no = ss->mft_no;
+	name_idx = ss->name_idx;
+	if (rec_no < 0) {
+		err = EINVAL;
+		goto err;
+	}
+	microuptime(&deadline);
+	timeradd(&deadline, a->a_timelimit, &deadline);
+	mft_ni = vol->mft_ni;
+	if (!mft_ni) {
+		err = EINVAL;
+		goto err;
+	}
+	err = vnode_get(mft_ni->vn);
+	if (err) {
+		ntfs_error(vol->mp, "Failed to get vnode for $MFT.");
+		goto err;
+	}
+	/*
+	 * Mft records are accessed through the buffer cache in units of an mft
+	 * record or a sector, whichever is bigger, see
+	 * ntfs_mft_record_map_ext().
+	 */
+	if (vol->mft_record_size < vol->sector_size) {
+		unit_size = vol->sector_size;
+		recs_per_unit = vol->sector_size >> vol->mft_record_size_shift;
+	} else {
+		unit_size = vol->mft_record_size;
+		recs_per_unit = 1;
+	}
+	resumed = TRUE;
+	for (;;) {
+		/* Beyond the initialized size there are no records in use. */
+		lck_spin_lock(&mft_ni->size_lock);
+		nr_recs = mft_ni->initialized_size >>
+				vol->mft_record_size_shift;
+		lck_spin_unlock(&mft_ni->size_lock);
+		if (rec_no >= nr_recs)
+			break;
+		blkno = rec_no & ~((s64)recs_per_unit - 1);
+		/*
+		 * At the start of each batch, and when starting or resuming,
+		 * read ahead the buffers of the next batch so the mft is read
+		 * in large sequential chunks whilst we process it.
+		 */
+		nr_ra = 0;
+		if (resumed || !(blkno % ((s64)NTFS_SEARCHFS_BATCH *
+				recs_per_unit))) {
+			for (i = 0; i < NTFS_SEARCHFS_BATCH; i++) {
+				s64 ra_blkno = blkno + (s64)(i + 1) *
+						recs_per_unit;
+
+				if (ra_blkno >= nr_recs)
+					break;
+				sctx->rablks[i] = ra_blkno;
+				sctx->rasizes[i] = unit_size;
+			}
+			nr_ra = i;
+		}
+		resumed = FALSE;
+		lck_rw_lock_shared(&mft_ni->lock);
+		err = buf_meta_breadn(mft_ni->vn, blkno, unit_size,
+				sctx->rablks, sctx->rasizes, nr_ra, NOCRED,
+				&buf);
+		if (err) {
+			lck_rw_unlock_shared(&mft_ni->lock);
+			ntfs_error(vol->mp, "Failed to read buffer of mft "
+					"record 0x%llx (error %d).",
+					(unsigned long long)blkno, err);
+			buf_brelse(buf);
+			break;
+		}
+		err = buf_map(buf, (caddr_t*)&kaddr);
+		if (err) {
+			lck_rw_unlock_shared(&mft_ni->lock);
+			ntfs_error(vol->mp, "Failed to map buffer of mft "
+					"record 0x%llx (error %d).",
+					(unsigned long long)blkno, err);
+			buf_brelse(buf);
+			break;
+		}
+		unit_end = blkno + recs_per_unit;
+		if (unit_end > nr_recs)
+			unit_end = nr_recs;
+		for (; rec_no < unit_end; rec_no++) {
+			err = ntfs_searchfs_record(sctx, (MFT_RECORD*)(kaddr +
+					((rec_no - blkno) <<
+					vol->mft_record_size_shift)), rec_no,
+					&name_idx);
+			if (err || sctx->nummatches >= sctx->maxmatches)
+				break;
+		}
+		err2 = buf_unmap(buf);
+		if (err2)
+			ntfs_error(vol->mp, "Failed to unmap buffer of mft "
+					"record 0x%llx (error %d).",
+					(unsigned long long)blkno, err2);
+		buf_brelse(buf);
+		lck_rw_unlock_shared(&mft_ni->lock);
+		/*
+		 * Now that we no longer hold the buffer nor the lock, copy the
+		 * results to the destination buffer.  If we stopped because
+		 * our results buffer was full, carry on where we left off.
+		 */
+		if (err < 0 && sctx->results_full)
+			err = 0;
+		err2 = ntfs_searchfs_results_copy(sctx);
+		if (err2) {
+			err = err2;
+			break;
+		}
+		if (err) {
+			/*
+			 * If we have run out of space in the destination
+			 * buffer before returning anything, the buffer is too
+			 * small for even a single result.
+			 */
+			err = sctx->nummatches ? EAGAIN : ENOBUFS;
+			break;
+		}
+		if (sctx->nummatches >= sctx->maxmatches) {
+			err = EAGAIN;
+			break;
+		}
+		microuptime(&now);
+		if (timercmp(&now, &deadline, >)) {
+			err = EAGAIN;
+			break;
+		}
+	}
+	(void)vnode_put(mft_ni->vn);
+	ss->mft_no = rec_no;
+	ss->name_idx = name_idx;
+	*a->a_nummatches = sctx->nummatches;
+err:
+	IOFreeData(sctx->uname, sctx->uname_size);
+	IOFreeType(sctx, ntfs_searchfs_ctx);
+	ntfs_debug("Done (error %d, %u matches).", (int)err,
+			(unsigned)*a->a_nummatches);
 	return err;
 }
 
@@ -10228,6 +11259,10 @@ static int ntfs_vnop_offtoblk(struct vnop_offtoblk_args *a)
  * file offset @a->a_foffset, this will be zero if @a_foffset is block aligned
  * and non-zero otherwise).
  *
+ * @a->a_run covers as much of the @a->a_size bytes as is physically
+ * contiguous on disk (or is a hole), even when this spans several runlist
+ * elements, so that cluster_io() can issue maximal transfers.
+ *
  * FIXME: At present the OS X kernel completely ignores @a->a_poff and in fact
  * it is always either NULL on entry or the returned value is ignored.  Thus,
  * for now, if @a->a_foffset is not aligned to the physical block size, we
@@ -10287,6 +11322,7 @@ static int ntfs_vnop_blockmap(struct vnop_blockmap_args *a)
 	ntfs_inode *ni = NTFS_I(a->a_vp);
 	ntfs_volume *vol;
 	unsigned vcn_ofs;
+	u32 gen;
 	BOOL is_write = (a->a_flags & VNODE_WRITE);
 
 	if (!ni) {
@@ -10417,13 +11453,24 @@ eof:
 	 */
 	vcn = byte_offset >> vol->cluster_size_shift;
 	vcn_ofs = (u32)byte_offset & vol->cluster_size_mask;
+	/*
+	 * In the steady state the translation is usually in the lock-free
+	 * translation cache of the inode in which case we do not need to touch
+	 * the runlist at all.
+	 */
+	if (ni->rl_cache) {
+		lcn = ntfs_rl_cache_lookup(ni->rl_cache, ntfs_rl_gen(&ni->rl),
+				vcn, &clusters);
+		if (lcn >= 0)
+			goto mapped;
+	}
 	/*
 	 * Convert the vcn to the corresponding lcn and obtain the number of
 	 * contiguous clusters starting at the vcn.
 	 */
 	lck_rw_lock_shared(&ni->rl.lock);
-	lcn = ntfs_attr_vcn_to_lcn_nolock(ni, vcn, FALSE,
-			a->a_run ? &clusters : 0);
+	gen = ntfs_rl_gen(&ni->rl);
+	lcn = ntfs_attr_vcn_to_lcn_nolock(ni, vcn, FALSE, &clusters);
 	if (lcn < LCN_HOLE) {
 		errno_t err;
 
@@ -10454,6 +11501,32 @@ eof:
 		}
 		return err;
 	}
+	/*
+	 * The runlist may describe a physically contiguous region (or a
+	 * single hole) as several consecutive runs, for example when the
+	 * attribute was extended several times and the cluster allocator
+	 * found free clusters just after the previous allocation each time.
+	 * Merge such runs so that cluster_io() can issue a single transfer
+	 * (or zero a single hole) for the whole of the requested range rather
+	 * than splitting the i/o at every runlist element.
+	 */
+	if (a->a_run) {
+		const s64 max_clusters = (vcn_ofs + byte_size +
+				vol->cluster_size_mask) >>
+				vol->cluster_size_shift;
+
+		while (clusters < max_clusters) {
+			LCN next_lcn;
+			s64 next_clusters;
+
+			next_lcn = ntfs_attr_vcn_to_lcn_nolock(ni,
+					vcn + clusters, FALSE, &next_clusters);
+			if (lcn >= 0 ? next_lcn != lcn + clusters :
+					next_lcn != LCN_HOLE)
+				break;
+			clusters += next_clusters;
+		}
+	}
 	if (lcn < 0) {
 		/*
 		 * It is a hole, return it.  If this is a VNODE_WRITE request,
@@ -10503,8 +11576,25 @@ eof:
 				bytes = data_size - byte_offset;
 		}
 		goto done;
-	} else
-		lck_rw_unlock_shared(&ni->rl.lock);
+	}
+	/*
+	 * Remember the translation unless the runlist lock was dropped whilst
+	 * looking it up and runs were removed in the mean time.
+	 */
+	if (ntfs_rl_gen(&ni->rl) == gen) {
+		if (!ni->rl_cache) {
+			ntfs_rl_cache *cache = IOMallocType(ntfs_rl_cache);
+
+			if (cache && !OSCompareAndSwapPtr(NULL, cache,
+					(void* volatile*)&ni->rl_cache))
+				IOFreeType(cache, ntfs_rl_cache);
+		}
+		if (ni->rl_cache)
+			ntfs_rl_cache_insert(ni->rl_cache, gen, vcn, lcn,
+					clusters);
+	}
+	lck_rw_unlock_shared(&ni->rl.lock);
+mapped:
 	/* The vcn was mapped successfully to a physical lcn, return it. */
 	*a->a_bpn = ((lcn << vol->cluster_size_shift) + vcn_ofs) >>
 			vol->sector_size_shift;
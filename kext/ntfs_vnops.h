@@ -42,6 +42,8 @@
 #include <sys/ucred.h>
 #include <sys/vnode.h>
 
+#include <libkern/OSTypes.h>
+
 typedef int vnop_t(void *);
 
 __attribute__((visibility("hidden"))) extern vnop_t **ntfs_vnodeop_p;
@@ -50,4 +52,31 @@ __attribute__((visibility("hidden"))) extern struct vnodeopv_desc ntfs_vnodeopv_
 
 __private_extern__ int ntfs_cluster_iodone(buf_t cbp, void *arg __unused);
 
+/*
+ * Reads of at least this many bytes into user space buffers bypass the vm page
+ * cache (see ntfs_read()).  Zero disables this.  Tunable via sysctl as
+ * vfs.generic.ntfs.direct_read_min.
+ */
+__attribute__((visibility("hidden"))) extern int ntfs_direct_read_min;
+
+/*
+ * Page aligned writes of at least this many bytes from user space buffers
+ * bypass the vm page cache (see ntfs_write()).  Zero disables this.  Tunable
+ * via sysctl as vfs.generic.ntfs.direct_write_min.
+ */
+__attribute__((visibility("hidden"))) extern int ntfs_direct_write_min;
+
+/*
+ * Statistics about i/o bypassing the vm page cache, exported via sysctl as
+ * vfs.generic.ntfs.direct_*.
+ */
+typedef struct {
+	SInt64 reads;		/* Number of direct reads. */
+	SInt64 read_bytes;	/* Number of bytes requested by them. */
+	SInt64 writes;		/* Number of direct writes. */
+	SInt64 write_bytes;	/* Number of bytes requested by them. */
+} ntfs_direct_io_stats;
+
+__attribute__((visibility("hidden"))) extern ntfs_direct_io_stats ntfs_dio_stats;
+
 #endif /* !_OSX_NTFS_VNOPS_H */
@@ -151,6 +151,10 @@ struct _ntfs_volume {
 					   bits in lcn bitmap. */
 	LCN nr_free_clusters;		/* Number of free clusters on volume ==
 					   number of zero bits in lcn bitmap. */
+	LCN nr_reserved_clusters;	/* Number of free clusters reserved for
+					   dirty compression blocks which are
+					   only allocated when written out.
+					   Protected by @lcnbmp_lock. */
 
 	ntfs_inode *vol_ni;		/* The ntfs inode of $Volume. */
 	VOLUME_FLAGS vol_flags;		/* Volume flags. */
@@ -0,0 +1,314 @@
+/*
+ * ntfs_lznt1_bench.c - Benchmark of the LZNT1 compressor of the NTFS kernel
+ *			driver.
+ *
+ * Copyright (c) 2006-2008 Apple Inc. All rights reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code as
+ * defined in and that are subject to the Apple Public Source License Version
+ * 2.0 (the 'License'). You may not use this file except in compliance with the
+ * License.
+ *
+ * Please obtain a copy of the License at http://www.opensource.apple.com/apsl/
+ * and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ * A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT. Please see the
+ * License for the specific language governing rights and limitations under the
+ * License.
+ */
+
+/*
+ * Compress the given files one compression block at a time exactly as
+ * ntfs_write_compressed() does, decompress them again and check that the data
+ * survived, and report the compression ratio and the compression and
+ * decompression throughput.
+ *
+ * The compressor and the sub-block decompressor are the ones of the kernel
+ * driver, i.e. ../kext/ntfs_lznt1.h.  This is not built by the Xcode project.
+ * Build it with:
+ *
+ *	cc -O2 -I../kext -o ntfs_lznt1_bench ntfs_lznt1_bench.c
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ntfs.h"
+#include "ntfs_lznt1.h"
+#include "ntfs_types.h"
+
+/* Number of clusters in a compression block. */
+#define CB_CLUSTERS (1 << NTFS_COMPRESSION_UNIT)
+
+static void usage(const char *progname) __attribute__((noreturn));
+static void usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-c cluster_size] [-n iterations] file ...\n", progname);
+	fprintf(stderr, "       cluster_size is 512, 1024, 2048, or 4096 (default 4096)\n");
+	fprintf(stderr, "       iterations is the number of times each file is compressed and\n");
+	fprintf(stderr, "       decompressed for timing (default 10)\n");
+	exit(1);
+}
+
+/**
+ * now - return the current time in seconds
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * is_zero - check if a buffer is all zeroes
+ */
+static BOOL is_zero(const u8 *buf, const int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++) {
+		if (buf[i])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * decompress - decompress a compression block
+ * @cb:		compressed data of the compression block
+ * @cb_len:	size of the compressed data in bytes
+ * @dst:	destination buffer of @cb_size bytes
+ * @cb_size:	size of the compression block in bytes
+ *
+ * Decompress the compression block @cb into @dst the same way ntfs_decompress()
+ * in ../kext/ntfs_compress.c does it.
+ *
+ * Return 0 on success and -1 if the compressed data is corrupt.
+ */
+static int decompress(u8 *cb, const int cb_len, u8 *dst, const int cb_size)
+{
+	u8 *cb_end, *cb_sb_end, *dst_end;
+	u16 hdr;
+
+	cb_end = cb + cb_len;
+	dst_end = dst + cb_size;
+	while (cb + 2 <= cb_end && dst < dst_end) {
+		hdr = le16_to_cpup((le16*)cb);
+		if (!hdr)
+			break;
+		cb_sb_end = cb + (hdr & NTFS_SB_SIZE_MASK) + 3;
+		if (cb_sb_end > cb_end || dst + NTFS_SB_SIZE > dst_end)
+			return -1;
+		if (!(hdr & NTFS_SB_IS_COMPRESSED)) {
+			if (cb_sb_end - cb - 2 != NTFS_SB_SIZE)
+				return -1;
+			memcpy(dst, cb + 2, NTFS_SB_SIZE);
+		} else {
+			u8 *end = ntfs_decompress_sb(cb + 2, cb_sb_end, dst);
+
+			if (!end)
+				return -1;
+			bzero(end, dst + NTFS_SB_SIZE - end);
+		}
+		cb = cb_sb_end;
+		dst += NTFS_SB_SIZE;
+	}
+	if (dst < dst_end)
+		bzero(dst, dst_end - dst);
+	return 0;
+}
+
+/**
+ * read_file - read a whole file into memory
+ * @path:	path of the file to read
+ * @cb_size:	size of a compression block in bytes
+ * @size:	destination for the size of the file in bytes
+ *
+ * Return a buffer containing the file padded with zeroes to a multiple of
+ * @cb_size bytes or NULL on error.
+ */
+static u8 *read_file(const char *path, const int cb_size, s64 *size)
+{
+	struct stat st;
+	u8 *buf;
+	s64 alloc, ofs;
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	alloc = (st.st_size + cb_size - 1) & ~(s64)(cb_size - 1);
+	buf = calloc(1, alloc ? alloc : 1);
+	if (!buf) {
+		fprintf(stderr, "%s: Not enough memory.\n", path);
+		close(fd);
+		return NULL;
+	}
+	for (ofs = 0; ofs < st.st_size; ofs += len) {
+		len = read(fd, buf + ofs, st.st_size - ofs);
+		if (len <= 0) {
+			fprintf(stderr, "%s: Failed to read file: %s\n", path,
+					len ? strerror(errno) : "short read");
+			free(buf);
+			close(fd);
+			return NULL;
+		}
+	}
+	close(fd);
+	*size = st.st_size;
+	return buf;
+}
+
+/**
+ * bench_file - benchmark the compression of a file
+ * @path:	path of the file to benchmark
+ * @cluster_size:	cluster size in bytes
+ * @iterations:	number of times to compress and decompress the file
+ *
+ * Return 0 on success and -1 on error.
+ */
+static int bench_file(const char *path, const int cluster_size,
+		const int iterations)
+{
+	ntfs_lznt1_ctx *ctx;
+	u8 *src, *cbuf, *ubuf;
+	int *clen;
+	s64 size, nr_cbs, i, nr_clusters, nr_real, nr_compressed;
+	double t, t_comp, t_decomp;
+	int cb_size, it, err;
+
+	cb_size = cluster_size * CB_CLUSTERS;
+	src = read_file(path, cb_size, &size);
+	if (!src)
+		return -1;
+	nr_cbs = (size + cb_size - 1) / cb_size;
+	ctx = malloc(sizeof(*ctx));
+	cbuf = malloc(nr_cbs * cb_size + 1);
+	ubuf = malloc(cb_size);
+	clen = malloc(nr_cbs * sizeof(*clen) + 1);
+	err = -1;
+	if (!ctx || !cbuf || !ubuf || !clen) {
+		fprintf(stderr, "%s: Not enough memory.\n", path);
+		goto out;
+	}
+	/*
+	 * Compress each compression block as ntfs_write_compressed() does,
+	 * i.e. a block which is all zeroes is sparse and a block which does
+	 * not compress by at least one cluster is stored uncompressed.  A
+	 * length of zero means sparse and a length of @cb_size uncompressed.
+	 */
+	t = now();
+	for (it = 0; it < iterations; it++) {
+		for (i = 0; i < nr_cbs; i++) {
+			u8 *cb = src + i * cb_size;
+
+			if (is_zero(cb, cb_size)) {
+				clen[i] = 0;
+				continue;
+			}
+			clen[i] = ntfs_compress(ctx, cb, cb_size,
+					cbuf + i * cb_size,
+					cb_size - cluster_size);
+			if (!clen[i])
+				clen[i] = cb_size;
+		}
+	}
+	t_comp = now() - t;
+	nr_clusters = nr_real = nr_compressed = 0;
+	for (i = 0; i < nr_cbs; i++) {
+		nr_clusters += CB_CLUSTERS;
+		nr_real += (clen[i] + cluster_size - 1) / cluster_size;
+		if (clen[i] && clen[i] != cb_size)
+			nr_compressed++;
+	}
+	/*
+	 * Decompress each compressed block and check the result.  Only the
+	 * compressed blocks count towards the decompression throughput as the
+	 * others are not decompressed.
+	 */
+	t = now();
+	for (it = 0; it < iterations; it++) {
+		for (i = 0; i < nr_cbs; i++) {
+			if (!clen[i] || clen[i] == cb_size)
+				continue;
+			if (decompress(cbuf + i * cb_size, clen[i], ubuf,
+					cb_size) || (!it &&
+					memcmp(ubuf, src + i * cb_size,
+					cb_size))) {
+				fprintf(stderr, "%s: Compression block %lld "
+						"does not decompress to the "
+						"original data.\n", path,
+						(long long)i);
+				goto out;
+			}
+		}
+	}
+	t_decomp = now() - t;
+	printf("%s: %lld bytes, %lld of %lld clusters used (%.1f%%), "
+			"compress %.1f MB/s, decompress %.1f MB/s\n", path,
+			(long long)size, (long long)nr_real,
+			(long long)nr_clusters,
+			nr_clusters ? 100.0 * nr_real / nr_clusters : 0.0,
+			t_comp > 0 ? (double)size * iterations / t_comp /
+			(1024 * 1024) : 0.0,
+			t_decomp > 0 ? (double)nr_compressed * cb_size *
+			iterations / t_decomp / (1024 * 1024) : 0.0);
+	err = 0;
+out:
+	free(clen);
+	free(ubuf);
+	free(cbuf);
+	free(ctx);
+	free(src);
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	int ch, cluster_size, iterations, err;
+
+	cluster_size = 4096;
+	iterations = 10;
+	while ((ch = getopt(argc, argv, "c:n:")) != -1) {
+		switch (ch) {
+		case 'c':
+			cluster_size = atoi(optarg);
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc || iterations < 1 || (cluster_size != 512 &&
+			cluster_size != 1024 && cluster_size != 2048 &&
+			cluster_size != 4096))
+		usage(argv[0]);
+	err = 0;
+	for (; optind < argc; optind++) {
+		if (bench_file(argv[optind], cluster_size, iterations))
+			err = 1;
+	}
+	return err;
+}